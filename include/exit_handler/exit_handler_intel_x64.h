@@ -22,6 +22,7 @@
 #ifndef EXIT_HANDLER_INTEL_X64_H
 #define EXIT_HANDLER_INTEL_X64_H
 
+#include <array>
 #include <memory>
 
 #include <vmcs/vmcs_intel_x64.h>
@@ -31,6 +32,44 @@
 #include <bfjson.h>
 #include <bfvmcallinterface.h>
 
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+/// Memory Manager Statistics
+///
+/// A VMCALL_DATA request (r04) that ignores its input, and replies with the
+/// memory manager's usage statistics formatted as JSON.
+///
+#ifndef VMCALL_DATA_MEMORY_MANAGER_STATS
+#define VMCALL_DATA_MEMORY_MANAGER_STATS 0x100
+#endif
+
+/// Number of Exit Reasons
+///
+/// The size of each vCPU's handler table. Exits with a basic exit reason
+/// that is not less than this cannot be given a handler, and are always
+/// unimplemented. Must be larger than the largest basic exit reason
+/// (currently xrstors, 64).
+///
+#ifndef EXIT_HANDLER_NUM_EXIT_REASONS
+#define EXIT_HANDLER_NUM_EXIT_REASONS 128
+#endif
+
+/// Maintenance Interval
+///
+/// The number of exits dispatched (not counting exits handled by a fast
+/// handler) between calls to the memory manager's maintain(), which
+/// returns memory held by the CPU's caches, and tops up the zeroed page
+/// reserve. Must be a power of 2.
+///
+#ifndef EXIT_HANDLER_MAINTENANCE_INTERVAL
+#define EXIT_HANDLER_MAINTENANCE_INTERVAL 0x1000
+#endif
+
+static_assert((EXIT_HANDLER_MAINTENANCE_INTERVAL & (EXIT_HANDLER_MAINTENANCE_INTERVAL - 1)) == 0,
+              "exit handler maintenance interval must be a power of 2");
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -65,18 +104,37 @@
 /// can subclass this class, and overload the handlers that are needed. The
 /// basics are provided with this class to ease development.
 ///
+/// Exits are dispatched using a table (one per vCPU) indexed by the basic
+/// exit reason. Each entry is a chain of handlers, that are called in turn
+/// until one of them handles the exit, so that handlers can be added and
+/// removed at runtime without subclassing. The handlers that this class
+/// provides are added by the constructor, so a handler that is added later
+/// is called first, and can pass an exit on to them by returning false.
+///
 class EXPORT_EXIT_HANDLER exit_handler_intel_x64
 {
 public:
 
     using ret_type = int64_t;
 
+    /// Handler
+    ///
+    /// Called to handle an exit. data is the pointer given when the handler
+    /// was added. Returns true if the exit was handled, in which case the
+    /// guest is resumed, or false to pass the exit on to the next handler
+    /// in the chain.
+    ///
+    using handler_type = bool (*)(gsl::not_null<exit_handler_intel_x64 *> ehlr, void *data);
+
     /// Default Constructor
     ///
+    /// Adds the handlers this class provides (CPUID, INVD, VMCALL, VMXOFF,
+    /// RDMSR and WRMSR).
+    ///
     /// @expects none
     /// @ensures none
     ///
-    exit_handler_intel_x64() = default;
+    exit_handler_intel_x64();
 
     /// Destructor
     ///
@@ -87,13 +145,88 @@ public:
 
     /// Dispatch
     ///
-    /// Called when a VM exit needs to be handled. This function will decode
-    /// the exit reason, and dispatch the correct handler.
+    /// Called when a VM exit needs to be handled. This function will
+    /// dispatch the correct handler for the exit reason, which the entry
+    /// point has already read from the VMCS. Exits that tell the VMM the
+    /// guest is flushing its TLB (INVLPG, INVPCID and MOV to CR) also
+    /// invalidate the guest TLB. Every EXIT_HANDLER_MAINTENANCE_INTERVAL
+    /// exits, the memory manager's maintain() is called first.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param reason the basic exit reason of the exit
+    ///
+    virtual void dispatch(intel_x64::vmcs::value_type reason);
+
+    /// Dispatch Fast
+    ///
+    /// Called by the exit handler's entry point before dispatch, with the
+    /// same exit reason, so that the exit reason is only read once. If a
+    /// fast handler was set for reason, it is called directly, without
+    /// guarding against exceptions, and without invalidating the guest
+    /// TLB. If it handles the exit, the guest is resumed with vmcs_resume
+    /// (and not the VMCS's resume(), which throws if it fails). Otherwise
+    /// (or if there is no fast handler), false is returned, and the entry
+    /// point calls dispatch, which does not call the fast handler again. If
+    /// the guest cannot be resumed, true is still returned, and the entry
+    /// point halts.
     ///
     /// @expects none
     /// @ensures none
     ///
-    virtual void dispatch();
+    /// @param reason the basic exit reason of the exit
+    /// @return true if the exit was handled, false otherwise
+    ///
+    virtual bool dispatch_fast(intel_x64::vmcs::value_type reason) noexcept;
+
+    /// Add Handler
+    ///
+    /// Adds a handler to the front of reason's chain, so that it is called
+    /// before the handlers that were added before it. The same handler can
+    /// be added more than once with different data.
+    ///
+    /// @expects reason < EXIT_HANDLER_NUM_EXIT_REASONS
+    /// @expects handler != nullptr
+    /// @ensures none
+    ///
+    /// @param reason the basic exit reason to handle
+    /// @param handler the handler to add
+    /// @param data passed to the handler when it is called
+    ///
+    void add_handler(intel_x64::vmcs::value_type reason, handler_type handler, void *data = nullptr);
+
+    /// Remove Handler
+    ///
+    /// Removes the handler (with the same data) that was added last to
+    /// reason's chain. Nothing is done if there is no such handler.
+    ///
+    /// @expects reason < EXIT_HANDLER_NUM_EXIT_REASONS
+    /// @ensures none
+    ///
+    /// @param reason the basic exit reason the handler was added for
+    /// @param handler the handler to remove
+    /// @param data the data the handler was added with
+    ///
+    void remove_handler(intel_x64::vmcs::value_type reason, handler_type handler, void *data = nullptr);
+
+    /// Set Fast Handler
+    ///
+    /// Sets the handler dispatch_fast calls for reason, replacing the fast
+    /// handler that was set before (if any). A fast handler must not throw,
+    /// as an exception that is thrown on the fast path cannot be caught,
+    /// and terminates the VMM. Exits that invalidate the guest TLB (INVLPG, INVPCID
+    /// and control register accesses) cannot have a fast handler.
+    ///
+    /// @expects reason < EXIT_HANDLER_NUM_EXIT_REASONS
+    /// @expects reason does not invalidate the guest TLB
+    /// @ensures none
+    ///
+    /// @param reason the basic exit reason to handle
+    /// @param handler the fast handler, or nullptr to remove it
+    /// @param data passed to the handler when it is called
+    ///
+    void set_fast_handler(intel_x64::vmcs::value_type reason, handler_type handler, void *data = nullptr);
 
     /// Halt
     ///
@@ -136,6 +269,22 @@ protected:
     void advance_rip() noexcept;
     void unimplemented_handler() noexcept;
 
+    /// Guest TLB
+    ///
+    /// Returns the guest TLB that should be used when mapping guest memory
+    /// using the guest's CR3. A translation can only be cached if the VMM
+    /// sees the guest flush its own TLB, so nullptr (no caching) is
+    /// returned unless INVLPG and CR3 load exiting are both enabled, and
+    /// the CR0 / CR4 guest / host masks cause writes to CR0.PG and
+    /// CR4.PGE / PCIDE / PAE to exit.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the guest TLB, or nullptr if it cannot be used
+    ///
+    guest_tlb_x64 *guest_tlb();
+
     virtual void handle_vmcall_versions(vmcall_registers_t &regs);
     virtual void handle_vmcall_registers(vmcall_registers_t &regs);
     virtual void handle_vmcall_data(vmcall_registers_t &regs);
@@ -154,6 +303,9 @@ protected:
         const bfn::unique_map_ptr_x64<char> &imap,
         const bfn::unique_map_ptr_x64<char> &omap);
 
+    virtual void handle_vmcall_data_memory_manager_stats(
+        json &ojson);
+
     void reply_with_string(
         vmcall_registers_t &regs, const std::string &str,
         const bfn::unique_map_ptr_x64<char> &omap);
@@ -171,12 +323,35 @@ public:
     vmcs_intel_x64 *m_vmcs{nullptr};
     state_save_intel_x64 *m_state_save{nullptr};
 
+    guest_tlb_x64 m_guest_tlb;
+
     virtual void set_vmcs(gsl::not_null<vmcs_intel_x64 *> vmcs)
     { m_vmcs = vmcs; }
 
     virtual void set_state_save(gsl::not_null<state_save_intel_x64 *> state_save)
     { m_state_save = state_save; }
 
+private:
+
+    struct handler_entry_type
+    {
+        handler_type handler{nullptr};
+        void *data{nullptr};
+
+        std::unique_ptr<handler_entry_type> next;
+    };
+
+    struct fast_handler_entry_type
+    {
+        handler_type handler{nullptr};
+        void *data{nullptr};
+    };
+
+    std::array<handler_entry_type, EXIT_HANDLER_NUM_EXIT_REASONS> m_handlers{};
+    std::array<fast_handler_entry_type, EXIT_HANDLER_NUM_EXIT_REASONS> m_fast_handlers{};
+
+    uint64_t m_num_exits{0};
+
 private:
 
 #ifdef INCLUDE_LIBCXX_UNITTESTS
@@ -43,6 +43,7 @@
 // -----------------------------------------------------------------------------
 
 extern "C" EXPORT_INTRINSICS void _invlpg(const void *virt) noexcept;
+extern "C" EXPORT_INTRINSICS void _invpcid(uint64_t type, const void *descriptor) noexcept;
 
 // *INDENT-OFF*
 
@@ -52,12 +53,37 @@ namespace tlb
 {
     using pointer = void *;
     using integer_pointer = uintptr_t;
+    using pcid_type = uint64_t;
 
     inline void invlpg(pointer val) noexcept
     { _invlpg(val); }
 
     inline void invlpg(integer_pointer val) noexcept
     { _invlpg(reinterpret_cast<pointer>(val)); }
+
+    inline void invpcid_individual_address(pcid_type pcid, integer_pointer addr) noexcept
+    {
+        uint64_t descriptor[2] = { pcid, addr };
+        _invpcid(0, static_cast<void *>(descriptor));
+    }
+
+    inline void invpcid_single_context(pcid_type pcid) noexcept
+    {
+        uint64_t descriptor[2] = { pcid, 0 };
+        _invpcid(1, static_cast<void *>(descriptor));
+    }
+
+    inline void invpcid_all_contexts_global() noexcept
+    {
+        uint64_t descriptor[2] = { 0, 0 };
+        _invpcid(2, static_cast<void *>(descriptor));
+    }
+
+    inline void invpcid_all_contexts() noexcept
+    {
+        uint64_t descriptor[2] = { 0, 0 };
+        _invpcid(3, static_cast<void *>(descriptor));
+    }
 }
 }
 
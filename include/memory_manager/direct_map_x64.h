@@ -0,0 +1,268 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef DIRECT_MAP_X64_H
+#define DIRECT_MAP_X64_H
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+#include <bfgsl.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_MEMORY_MANAGER
+#ifdef SHARED_MEMORY_MANAGER
+#define EXPORT_MEMORY_MANAGER EXPORT_SYM
+#else
+#define EXPORT_MEMORY_MANAGER IMPORT_SYM
+#endif
+#else
+#define EXPORT_MEMORY_MANAGER
+#endif
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+// The VMM virtual address that physical address 0 is mapped to. Must be 1g
+// aligned, so that 1g aligned physical memory can be mapped using 1g pages.
+
+#ifndef DIRECT_MAP_START
+#define DIRECT_MAP_START 0x0000600000000000ULL
+#endif
+
+// The largest physical address (exclusive) that can be in the direct map.
+
+#ifndef DIRECT_MAP_MAX_PHYS
+#define DIRECT_MAP_MAX_PHYS 0x0000100000000000ULL
+#endif
+
+// The number of physically contiguous ranges the direct map can hold.
+// Ranges that are added back to back are merged, so this only has to be as
+// large as the number of holes in the host's physical memory map.
+
+#ifndef DIRECT_MAP_MAX_RANGES
+#define DIRECT_MAP_MAX_RANGES 64
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+/// Direct Map
+///
+/// Maps the host's physical memory, as reported by the driver, into the VMM
+/// at a fixed offset (virt == start + phys), so that converting between a
+/// physical address and a VMM virtual address in the direct map is simple
+/// arithmetic, and no memory has to be mapped / unmapped to access it. The
+/// direct map is optional. Until memory is added to it, phys_to_direct and
+/// direct_to_phys always return 0, and callers fall back to mapping the
+/// memory themselves.
+///
+/// Memory is mapped read / write and write-back, using 1g / 2m pages where
+/// the memory is aligned, and the memory manager's descriptors are not
+/// updated (see root_page_table_x64::map_range_untracked). For this reason,
+/// only RAM should be added, never MMIO. Physical page 0 is never added, so
+/// that 0 can be used to report an address that is not in the direct map.
+///
+/// Lookups do not take a lock, and can be done while memory is being added.
+/// A lookup checks each range in turn, which is cheap as there is usually a
+/// handful of them.
+///
+class EXPORT_MEMORY_MANAGER direct_map_x64
+{
+public:
+
+    using integer_pointer = uintptr_t;
+    using size_type = size_t;
+
+    /// Constructor
+    ///
+    /// @expects start is 1g aligned
+    /// @ensures none
+    ///
+    /// @param start the virtual address physical address 0 is mapped to
+    ///
+    direct_map_x64(integer_pointer start = DIRECT_MAP_START);
+
+    /// Destructor
+    ///
+    /// The direct map is never unmapped, as it is used until the VMM is
+    /// unloaded.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    ~direct_map_x64() = default;
+
+    /// Add Range
+    ///
+    /// Maps [phys, phys + size) into the direct map.
+    ///
+    /// @expects phys and size are page aligned
+    /// @expects phys + size <= DIRECT_MAP_MAX_PHYS
+    /// @expects the range does not overlap a range already added
+    /// @ensures none
+    ///
+    /// @param phys the physical address of the range to add
+    /// @param size the size of the range in bytes
+    ///
+    void add_range(integer_pointer phys, size_type size);
+
+    /// Physical Address To Direct Map Address
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param phys the physical address to convert
+    /// @return the virtual address phys is mapped to in the direct map, or
+    ///     0 if phys is not in the direct map
+    ///
+    integer_pointer phys_to_direct(integer_pointer phys) const noexcept
+    { return this->contains(phys) ? m_start + phys : 0; }
+
+    /// Direct Map Address To Physical Address
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param virt the virtual address to convert
+    /// @return the physical address virt maps to, or 0 if virt is not in
+    ///     the direct map
+    ///
+    integer_pointer direct_to_phys(integer_pointer virt) const noexcept
+    {
+        if (virt < m_start || virt >= m_start + DIRECT_MAP_MAX_PHYS) {
+            return 0;
+        }
+
+        return this->contains(virt - m_start) ? virt - m_start : 0;
+    }
+
+    /// Start
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the virtual address physical address 0 is mapped to
+    ///
+    integer_pointer start() const noexcept
+    { return m_start; }
+
+    /// Size
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of bytes in the direct map
+    ///
+    size_type size() const noexcept;
+
+    /// Number of Ranges
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of physically contiguous ranges in the direct map
+    ///
+    size_type num_ranges() const noexcept
+    { return m_num.load(); }
+
+private:
+
+    bool contains(integer_pointer phys) const noexcept;
+
+private:
+
+    struct range_type
+    {
+        std::atomic<integer_pointer> phys{0};
+        std::atomic<size_type> size{0};
+    };
+
+    integer_pointer m_start{0};
+
+    std::atomic<size_type> m_num{0};
+    std::array<range_type, DIRECT_MAP_MAX_RANGES> m_ranges;
+
+    std::mutex m_mutex;
+
+public:
+
+    direct_map_x64(direct_map_x64 &&) noexcept = delete;
+    direct_map_x64 &operator=(direct_map_x64 &&) noexcept = delete;
+
+    direct_map_x64(const direct_map_x64 &) = delete;
+    direct_map_x64 &operator=(const direct_map_x64 &) = delete;
+};
+
+/// Direct Map
+///
+/// Returns the VMM's direct map.
+///
+/// @expects none
+/// @ensures ret != nullptr
+///
+EXPORT_MEMORY_MANAGER direct_map_x64 *direct_map() noexcept;
+
+/// Direct Map Macro
+///
+/// The following macro can be used to quickly call the direct map.
+///
+/// @expects none
+/// @ensures ret != nullptr
+///
+#define g_dm direct_map()
+
+/// Physical Address To Direct Map Address
+///
+/// @expects none
+/// @ensures none
+///
+/// @param phys the physical address to convert
+/// @return the virtual address phys is mapped to in the VMM's direct map,
+///     or 0 if phys is not in the direct map
+///
+inline uintptr_t
+phys_to_direct(uintptr_t phys) noexcept
+{ return g_dm->phys_to_direct(phys); }
+
+/// Direct Map Address To Physical Address
+///
+/// @expects none
+/// @ensures none
+///
+/// @param virt the virtual address to convert
+/// @return the physical address virt maps to in the VMM's direct map, or 0
+///     if virt is not in the direct map
+///
+inline uintptr_t
+direct_to_phys(uintptr_t virt) noexcept
+{ return g_dm->direct_to_phys(virt); }
+
+#endif
@@ -0,0 +1,331 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+#include <bfgsl.h>
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+/// Epoch
+///
+/// Epoch based reclamation. Readers that walk a lock-free structure do so
+/// from within a critical section (see epoch::guard). A writer that unlinks
+/// memory from the structure retires it instead of freeing it, and the
+/// memory is only freed once every critical section that could still be
+/// using it has finished.
+///
+/// Each critical section is counted against the parity of the epoch it
+/// started in. The epoch is only advanced when no critical sections from
+/// the epoch before the current one remain, so memory retired in epoch e
+/// can be freed once the epoch reaches e + 2. Entering and leaving a
+/// critical section is a couple of atomic operations, and never takes a
+/// lock. The lock is only used to retire and reclaim memory, which is rare.
+///
+/// Retired memory is kept on a list that is stored in the retired memory
+/// itself: its first word points to the memory that was retired before it,
+/// and its second word holds the epoch it was retired in. Retiring memory
+/// therefore never allocates, and cannot fail.
+///
+class epoch
+{
+public:
+
+    using pointer = void *;
+    using integer_pointer = uintptr_t;
+    using epoch_type = uint64_t;
+    using size_type = std::size_t;
+    using free_type = void (*)(pointer);
+
+    /// Critical Section
+    ///
+    /// Memory retired while a guard exists is not freed until after the
+    /// guard is destroyed.
+    ///
+    class guard
+    {
+    public:
+
+        /// Constructor
+        ///
+        /// Enters a critical section.
+        ///
+        /// @expects none
+        /// @ensures none
+        ///
+        /// @param e the epoch to enter
+        ///
+        guard(epoch &e) noexcept :
+            m_epoch(e),
+            m_value(e.enter())
+        { }
+
+        /// Destructor
+        ///
+        /// Leaves the critical section.
+        ///
+        /// @expects none
+        /// @ensures none
+        ///
+        ~guard()
+        { m_epoch.exit(m_value); }
+
+    private:
+
+        epoch &m_epoch;
+        epoch_type m_value;
+
+    public:
+
+        guard(guard &&) noexcept = delete;
+        guard &operator=(guard &&) noexcept = delete;
+
+        guard(const guard &) = delete;
+        guard &operator=(const guard &) = delete;
+    };
+
+    /// Constructor
+    ///
+    /// Critical sections that are still running might read the two words
+    /// that retire() writes into retired memory. tag is set in both words,
+    /// so that such a reader can tell them apart from its own data. tag
+    /// must fit in the low 12 bits, and must not overlap the bits of a
+    /// retired pointer (e.g. use the low bits of page aligned memory).
+    ///
+    /// @expects func != nullptr
+    /// @expects tag < 0x1000
+    /// @ensures none
+    ///
+    /// @param func the function used to free retired memory
+    /// @param tag the bits that are set in the words retire() writes
+    ///
+    epoch(free_type func, integer_pointer tag = 0) noexcept :
+        m_free(func),
+        m_tag(tag)
+    { }
+
+    /// Destructor
+    ///
+    /// Frees all of the memory that is still retired. There must not be any
+    /// critical sections left when the epoch is destroyed.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    ~epoch()
+    { free_list(m_retired); }
+
+    /// Enter Critical Section
+    ///
+    /// Prefer epoch::guard over calling this directly.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the epoch that must be passed to exit()
+    ///
+    epoch_type
+    enter() noexcept
+    {
+        while (true) {
+            auto e = m_epoch.load();
+            gsl::at(m_active, e & 1).fetch_add(1);
+
+            // If the epoch advanced before this critical section was
+            // counted, it might be counted against the wrong parity, so it
+            // has to be counted again.
+
+            if (m_epoch.load() == e) {
+                return e;
+            }
+
+            gsl::at(m_active, e & 1).fetch_sub(1);
+        }
+    }
+
+    /// Exit Critical Section
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param e the value returned by enter()
+    ///
+    void
+    exit(epoch_type e) noexcept
+    { gsl::at(m_active, e & 1).fetch_sub(1); }
+
+    /// Retire
+    ///
+    /// Frees ptr once every critical section that could be using it has
+    /// finished. ptr must already be unreachable for new critical sections.
+    /// The first two words of ptr are overwritten (see the constructor), so
+    /// ptr must point to at least two words that nothing else writes to.
+    /// This can be called from inside a critical section.
+    ///
+    /// @expects ptr != nullptr
+    /// @ensures none
+    ///
+    /// @param ptr the memory to retire
+    ///
+    void
+    retire(pointer ptr) noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        link(ptr, m_retired, m_epoch.load());
+
+        m_retired = ptr;
+        m_num_retired++;
+    }
+
+    /// Reclaim
+    ///
+    /// Advances the epoch if possible, and frees retired memory that is no
+    /// longer in use. This must be called outside of a critical section.
+    /// This never waits: if the epoch cannot be advanced yet, or another
+    /// CPU is already reclaiming, the memory is freed by a later call.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void
+    reclaim() noexcept
+    {
+        std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+
+        if (!lock.owns_lock() || m_retired == nullptr) {
+            return;
+        }
+
+        auto e = m_epoch.load();
+
+        if (gsl::at(m_active, (e + 1) & 1).load() == 0) {
+            m_epoch.store(++e);
+        }
+
+        // The list is ordered from the newest to the oldest, so once memory
+        // is old enough to be freed, so is everything after it.
+
+        pointer prev = nullptr;
+        pointer ptr = m_retired;
+
+        while (ptr != nullptr && retired_epoch(ptr) + 2 > e) {
+            prev = ptr;
+            ptr = next(ptr);
+        }
+
+        if (prev == nullptr) {
+            m_retired = nullptr;
+        }
+        else {
+            link(prev, nullptr, retired_epoch(prev));
+        }
+
+        free_list(ptr);
+    }
+
+    /// Number Retired
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of retired pointers that have not been freed yet
+    ///
+    size_type
+    num_retired() const noexcept
+    { return m_num_retired.load(); }
+
+private:
+
+    struct link_type
+    {
+        integer_pointer next;
+        integer_pointer epoch;
+    };
+
+    static constexpr const integer_pointer epoch_shift = 12;
+
+    void
+    link(pointer ptr, pointer next, epoch_type e) noexcept
+    {
+        auto &&words = static_cast<link_type *>(ptr);
+
+        __atomic_store_n(&words->next, reinterpret_cast<integer_pointer>(next) | m_tag, __ATOMIC_RELEASE);
+        __atomic_store_n(&words->epoch, (e << epoch_shift) | m_tag, __ATOMIC_RELEASE);
+    }
+
+    pointer
+    next(pointer ptr) const noexcept
+    {
+        auto &&words = static_cast<link_type *>(ptr);
+        return reinterpret_cast<pointer>(__atomic_load_n(&words->next, __ATOMIC_ACQUIRE) & ~m_tag);
+    }
+
+    epoch_type
+    retired_epoch(pointer ptr) const noexcept
+    {
+        auto &&words = static_cast<link_type *>(ptr);
+        return __atomic_load_n(&words->epoch, __ATOMIC_ACQUIRE) >> epoch_shift;
+    }
+
+    void
+    free_list(pointer ptr) noexcept
+    {
+        while (ptr != nullptr) {
+            auto &&next_ptr = next(ptr);
+
+            m_free(ptr);
+            m_num_retired--;
+
+            ptr = next_ptr;
+        }
+    }
+
+private:
+
+    free_type m_free;
+    integer_pointer m_tag;
+
+    std::atomic<epoch_type> m_epoch{0};
+    std::array<std::atomic<size_type>, 2> m_active{};
+
+    std::mutex m_mutex;
+    pointer m_retired{nullptr};
+    std::atomic<size_type> m_num_retired{0};
+
+public:
+
+    epoch(epoch &&) noexcept = delete;
+    epoch &operator=(epoch &&) noexcept = delete;
+
+    epoch(const epoch &) = delete;
+    epoch &operator=(const epoch &) = delete;
+};
+
+#endif
@@ -0,0 +1,214 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef GUEST_TLB_X64_H
+#define GUEST_TLB_X64_H
+
+#include <array>
+#include <cstdint>
+
+#include <bfgsl.h>
+
+#include <memory_manager/page_table_entry_x64.h>
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+// The number of translations kept by each guest TLB. Must be a power of 2.
+
+#ifndef GUEST_TLB_SIZE
+#define GUEST_TLB_SIZE 64
+#endif
+
+static_assert((GUEST_TLB_SIZE & (GUEST_TLB_SIZE - 1)) == 0, "guest tlb size must be a power of 2");
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+/// Guest TLB
+///
+/// Caches the result of walking a guest's page tables, so that translating
+/// the same guest virtual page again (e.g. a vmcall buffer that is used
+/// over and over) does not have to walk the guest's page tables. Each
+/// translation is tagged with the guest CR3 it came from, and is stored in
+/// a direct mapped table indexed by the guest virtual page.
+///
+/// Like a real TLB, a translation can become stale when the guest changes
+/// its page tables, so the owner must call invalidate / flush whenever the
+/// guest would have to flush its own TLB (INVLPG, INVPCID, or a write to
+/// CR0 / CR3 / CR4). This is only possible when those exits are
+/// intercepted, so a guest TLB should not be used otherwise.
+///
+/// A guest TLB belongs to a single vCPU, and is not thread safe.
+///
+class guest_tlb_x64
+{
+public:
+
+    using integer_pointer = uintptr_t;
+    using size_type = size_t;
+
+    /// Translation
+    ///
+    /// The page that a guest virtual address maps to. phys and size
+    /// describe the whole page, which can be a 4k, 2m or 1g page.
+    ///
+    struct entry_type
+    {
+        integer_pointer cr3{0};     ///< Guest CR3 the translation came from
+        integer_pointer virt{0};    ///< Guest virtual address (4k aligned)
+        integer_pointer phys{0};    ///< Physical address of the page
+        size_type size{0};          ///< Size of the page, 0 if not valid
+        uint64_t pati{0};           ///< PAT index of the page
+
+        /// Physical Address
+        ///
+        /// @param addr a guest virtual address in this page
+        /// @return the physical address addr maps to
+        ///
+        integer_pointer phys_addr(integer_pointer addr) const noexcept
+        { return phys | (addr & (size - 1)); }
+    };
+
+    /// Default Constructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    guest_tlb_x64() noexcept = default;
+
+    /// Default Destructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    ~guest_tlb_x64() = default;
+
+    /// Lookup
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param cr3 the guest CR3 to lookup the translation for
+    /// @param virt the guest virtual address to lookup
+    /// @param entry set to the translation if it is found
+    /// @return true if the translation was found, false otherwise
+    ///
+    bool lookup(integer_pointer cr3, integer_pointer virt, entry_type &entry) noexcept
+    {
+        const auto &slot = this->slot(virt);
+
+        if (slot.size != 0 && slot.cr3 == cr3 && slot.virt == (virt & ~(page_size - 1))) {
+            entry = slot;
+            m_hits++;
+
+            return true;
+        }
+
+        m_misses++;
+        return false;
+    }
+
+    /// Insert
+    ///
+    /// Adds a translation, replacing the translation that uses the same
+    /// slot (if any).
+    ///
+    /// @expects entry.size is 4k, 2m or 1g
+    /// @ensures none
+    ///
+    /// @param entry the translation to add
+    ///
+    void insert(const entry_type &entry) noexcept
+    {
+        auto &&slot = this->slot(entry.virt);
+
+        slot = entry;
+        slot.virt &= ~(page_size - 1);
+        slot.phys &= ~(entry.size - 1);
+    }
+
+    /// Invalidate
+    ///
+    /// Removes every translation (for any CR3) for the page containing
+    /// virt, the same as INVLPG. For a large page, this also removes the
+    /// translations cached for the rest of the large page.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param virt the guest virtual address to invalidate
+    ///
+    void invalidate(integer_pointer virt) noexcept
+    {
+        for (auto &&slot : m_entries) {
+            if (slot.size != 0 && (slot.virt & ~(slot.size - 1)) == (virt & ~(slot.size - 1))) {
+                slot.size = 0;
+            }
+        }
+    }
+
+    /// Flush
+    ///
+    /// Removes every translation.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void flush() noexcept
+    {
+        for (auto &&slot : m_entries) {
+            slot.size = 0;
+        }
+    }
+
+    /// Hits
+    ///
+    /// @return the number of lookups that found a translation
+    ///
+    size_type hits() const noexcept
+    { return m_hits; }
+
+    /// Misses
+    ///
+    /// @return the number of lookups that did not find a translation
+    ///
+    size_type misses() const noexcept
+    { return m_misses; }
+
+private:
+
+    static constexpr const auto page_size = x64::page_table::pt::size_bytes;
+
+    entry_type &slot(integer_pointer virt) noexcept
+    { return gsl::at(m_entries, (virt >> x64::page_table::pt::from) & (GUEST_TLB_SIZE - 1)); }
+
+private:
+
+    std::array<entry_type, GUEST_TLB_SIZE> m_entries{};
+
+    size_type m_hits{0};
+    size_type m_misses{0};
+};
+
+#endif
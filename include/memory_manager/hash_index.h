@@ -0,0 +1,399 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include <atomic>
+#include <new>
+#include <memory>
+#include <limits>
+#include <cstdint>
+
+#include <bfgsl.h>
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+#ifndef HASH_INDEX_MIN_SLOTS
+#define HASH_INDEX_MIN_SLOTS 256
+#endif
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+///
+/// *INDENT-OFF*
+///
+
+/// Hash Index
+///
+/// Maps a 64bit key (e.g. a page number) to a 64bit value, where a value of
+/// 0 means "not present". Unlike radix_tree, which needs a whole node for
+/// every 512 neighbouring keys, the cost of an entry does not depend on how
+/// its key is spread out: every entry takes one 16 byte slot of an open
+/// addressed (linear probing) table that is never more than half full, so
+/// keys that are far apart (like the physical addresses of pages that the
+/// driver allocated one at a time) stay cheap.
+///
+/// get() is lock free and can run at the same time as set() and erase().
+/// Writers must be serialized by the caller, and bump a sequence count
+/// around every change, so a reader that raced with a change (which might
+/// have moved the entry it was looking for) simply looks again. When the
+/// table grows, the old table is kept (a lock free reader might still be
+/// probing it) until the index is destroyed. As the table doubles each
+/// time, the old tables never add up to more than the current one.
+///
+class hash_index
+{
+public:
+
+    using key_type = uint64_t;
+    using value_type = uint64_t;
+    using size_type = std::size_t;
+
+    /// Default Constructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    hash_index() noexcept = default;
+
+    /// Destructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    ~hash_index() = default;
+
+    /// Get
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param key the key to lookup
+    /// @return the value stored for key, or 0 if key is not present
+    ///
+    value_type
+    get(key_type key) const noexcept
+    {
+        if (key == empty_key) {
+            return 0;
+        }
+
+        while (true) {
+            auto seq = m_seq.load(std::memory_order_acquire);
+
+            if ((seq & 1) != 0) {
+                continue;
+            }
+
+            auto val = 0ULL;
+            auto table = m_table.load(std::memory_order_acquire);
+
+            if (table != nullptr) {
+                auto slot = find(table, key);
+                val = slot->val.load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (m_seq.load(std::memory_order_relaxed) == seq) {
+                return val;
+            }
+        }
+    }
+
+    /// Set
+    ///
+    /// Stores val for key, growing the table if it is needed. Calls to
+    /// set(), reserve() and erase() must be serialized by the caller.
+    ///
+    /// @expects key != ~0
+    /// @expects val != 0
+    /// @ensures get(key) == val
+    ///
+    /// @param key the key to store
+    /// @param val the value to store
+    ///
+    void
+    set(key_type key, value_type val)
+    {
+        expects(key != empty_key);
+        expects(val != 0);
+
+        this->reserve(1);
+
+        auto table = m_table.load(std::memory_order_relaxed);
+        auto slot = find(table, key);
+
+        begin_write();
+
+        if (slot->key.load(std::memory_order_relaxed) == empty_key) {
+            slot->key.store(key, std::memory_order_relaxed);
+            m_size.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        slot->val.store(val, std::memory_order_relaxed);
+
+        end_write();
+    }
+
+    /// Reserve
+    ///
+    /// Grows the table so that num more keys can be set() without it
+    /// having to grow, so that those calls cannot fail. This lets a caller
+    /// that sets many keys allocate everything up front, so that it does
+    /// not have to undo a partial update. Calls to reserve() must be
+    /// serialized with calls to set() and erase() by the caller.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param num the number of keys to make room for
+    ///
+    void
+    reserve(size_type num)
+    {
+        auto max = std::numeric_limits<size_type>::max() / (2 * sizeof(slot_type));
+        auto size = m_size.load(std::memory_order_relaxed);
+
+        if (num > max - size) {
+            throw std::bad_alloc();
+        }
+
+        auto needed = (size + num) * 2;
+        auto table = m_table.load(std::memory_order_relaxed);
+
+        if (table != nullptr && needed <= table->mask + 1) {
+            return;
+        }
+
+        size = HASH_INDEX_MIN_SLOTS;
+        while (size < needed) {
+            size <<= 1;
+        }
+
+        auto next = std::make_unique<table_type>(size);
+
+        if (table != nullptr) {
+            for (auto i = 0ULL; i <= table->mask; i++) {
+                auto &slot = table->slots[i];
+                auto key = slot.key.load(std::memory_order_relaxed);
+
+                if (key != empty_key) {
+                    auto dest = find(next.get(), key);
+
+                    dest->key.store(key, std::memory_order_relaxed);
+                    dest->val.store(slot.val.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                }
+            }
+
+            next->prev = std::move(m_owner);
+        }
+
+        m_bytes.fetch_add(size * sizeof(slot_type), std::memory_order_relaxed);
+        m_owner = std::move(next);
+        m_table.store(m_owner.get(), std::memory_order_release);
+    }
+
+    /// Erase
+    ///
+    /// Removes key from the index. The entries that follow it are moved
+    /// back, so erased keys do not leave anything behind that a lookup
+    /// has to step over. Calls to set(), reserve() and erase() must be
+    /// serialized by the caller.
+    ///
+    /// @expects none
+    /// @ensures get(key) == 0
+    ///
+    /// @param key the key to remove
+    /// @return the value that was stored for key, or 0 if key was not
+    ///     present
+    ///
+    value_type
+    erase(key_type key) noexcept
+    {
+        auto table = m_table.load(std::memory_order_relaxed);
+
+        if (key == empty_key || table == nullptr) {
+            return 0;
+        }
+
+        auto hole = find(table, key);
+        auto val = hole->val.load(std::memory_order_relaxed);
+
+        if (hole->key.load(std::memory_order_relaxed) == empty_key) {
+            return 0;
+        }
+
+        begin_write();
+
+        auto i = static_cast<size_type>(hole - table->slots.get());
+        auto j = i;
+
+        while (true) {
+            j = (j + 1) & table->mask;
+
+            auto &next = table->slots[j];
+            auto next_key = next.key.load(std::memory_order_relaxed);
+
+            if (next_key == empty_key) {
+                break;
+            }
+
+            auto home = hash(next_key) & table->mask;
+
+            if (((j - home) & table->mask) >= ((j - i) & table->mask)) {
+                table->slots[i].key.store(next_key, std::memory_order_relaxed);
+                table->slots[i].val.store(next.val.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                i = j;
+            }
+        }
+
+        table->slots[i].key.store(empty_key, std::memory_order_relaxed);
+        table->slots[i].val.store(0, std::memory_order_relaxed);
+        m_size.fetch_sub(1, std::memory_order_relaxed);
+
+        end_write();
+        return val;
+    }
+
+    /// Size
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of keys in the index
+    ///
+    size_type
+    size() const noexcept
+    { return m_size.load(std::memory_order_relaxed); }
+
+    /// Bytes
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of bytes held by the index's tables, including
+    ///     the old tables that are kept until the index is destroyed
+    ///
+    size_type
+    bytes() const noexcept
+    { return m_bytes.load(std::memory_order_relaxed); }
+
+private:
+
+    static constexpr const key_type empty_key = ~0ULL;
+
+    struct slot_type
+    {
+        slot_type() noexcept
+        {
+            key.store(empty_key, std::memory_order_relaxed);
+            val.store(0, std::memory_order_relaxed);
+        }
+
+        std::atomic<key_type> key;
+        std::atomic<value_type> val;
+    };
+
+    struct table_type
+    {
+        table_type(size_type size) :
+            slots(std::make_unique<slot_type[]>(size)),
+            mask(size - 1)
+        { }
+
+        std::unique_ptr<slot_type[]> slots;
+        size_type mask;
+
+        std::unique_ptr<table_type> prev;
+    };
+
+    static key_type
+    hash(key_type key) noexcept
+    {
+        key *= 0x9E3779B97F4A7C15ULL;
+        return key ^ (key >> 32);
+    }
+
+    // Returns the slot holding key, or the empty slot that ends its probe
+    // sequence if key is not present. As the table is never more than half
+    // full there is always such a slot, but a reader racing with a writer
+    // might not see it, so it also gives up after a full lap.
+
+    static slot_type *
+    find(const table_type *table, key_type key) noexcept
+    {
+        auto i = hash(key) & table->mask;
+
+        for (auto n = 0ULL; n <= table->mask; n++) {
+            auto slot = &table->slots[i];
+            auto slot_key = slot->key.load(std::memory_order_relaxed);
+
+            if (slot_key == key || slot_key == empty_key) {
+                return slot;
+            }
+
+            i = (i + 1) & table->mask;
+        }
+
+        return &table->slots[i];
+    }
+
+    void
+    begin_write() noexcept
+    {
+        m_seq.store(m_seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void
+    end_write() noexcept
+    { m_seq.store(m_seq.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+private:
+
+    std::atomic<table_type *> m_table{nullptr};
+    std::atomic<uint64_t> m_seq{0};
+
+    std::unique_ptr<table_type> m_owner;
+
+    std::atomic<size_type> m_size{0};
+    std::atomic<size_type> m_bytes{0};
+
+public:
+
+    hash_index(hash_index &&) noexcept = delete;
+    hash_index &operator=(hash_index &&) noexcept = delete;
+
+    hash_index(const hash_index &) = delete;
+    hash_index &operator=(const hash_index &) = delete;
+};
+
+///
+/// *INDENT-ON*
+///
+
+#endif
@@ -0,0 +1,342 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef KMAP_X64_H
+#define KMAP_X64_H
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+
+#include <bfgsl.h>
+
+#include <memory_manager/mem_attr_x64.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_MEMORY_MANAGER
+#ifdef SHARED_MEMORY_MANAGER
+#define EXPORT_MEMORY_MANAGER EXPORT_SYM
+#else
+#define EXPORT_MEMORY_MANAGER IMPORT_SYM
+#endif
+#else
+#define EXPORT_MEMORY_MANAGER
+#endif
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+// The number of single page maps each CPU can hold at the same time. A guest
+// page walk holds one per level, so this must be at least 4. Must not be
+// larger than 64.
+
+#ifndef KMAP_SLOTS
+#define KMAP_SLOTS 8
+#endif
+
+// The number of CPUs with mapping slots. kmap_cpu() throws on a CPU whose id
+// is larger.
+
+#ifndef KMAP_MAX_CPUS
+#define KMAP_MAX_CPUS 64
+#endif
+
+static_assert(KMAP_SLOTS >= 4 && KMAP_SLOTS <= 64, "KMAP_SLOTS must be between 4 and 64");
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+/// Temporary Mapping Slots
+///
+/// A small window of virtual pages that belongs to a single CPU, and is used
+/// to map a physical page for a short time (e.g. while reading a guest's
+/// page tables). The window is allocated, and its page table entries are
+/// added to the root page tables, the first time the CPU uses it. From then
+/// on, mapping a page only rewrites the slot's entry and invalidates the
+/// slot's TLB entry, so unlike make_unique_map_x64, no memory is allocated,
+/// no lock is taken and the page tables are not walked.
+///
+/// When a slot is not in use, its entry maps a zeroed page instead of being
+/// cleared, so that the page tables holding the window are never empty and
+/// are never removed. Note that unmap does not invalidate the TLB, so the
+/// last page mapped by a slot can still be reachable using the slot's
+/// address until the slot is used again. For the same reason, the memory
+/// manager's descriptors for the window always describe the zeroed page.
+///
+/// The slots belong to the CPU that owns them, and a page must be unmapped
+/// on the CPU that mapped it. A slot should not be shared with another CPU,
+/// as only the local TLB is invalidated.
+///
+class EXPORT_MEMORY_MANAGER kmap_x64
+{
+public:
+
+    using integer_pointer = uintptr_t;
+    using size_type = size_t;
+    using attr_type = x64::memory_attr::attr_type;
+
+    /// Default Constructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    kmap_x64() noexcept = default;
+
+    /// Default Destructor
+    ///
+    /// The window is never given back, as the slots are used until the VMM
+    /// is unloaded.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    ~kmap_x64() = default;
+
+    /// Map
+    ///
+    /// Maps a physical page into a free slot.
+    ///
+    /// @expects phys != 0
+    /// @expects phys is page aligned
+    /// @ensures ret != 0
+    ///
+    /// @param phys the physical address of the page to map
+    /// @param attr describes how to map the page
+    /// @return the virtual address of the slot the page is mapped to
+    ///
+    integer_pointer map(integer_pointer phys, attr_type attr = x64::memory_attr::rw_wb);
+
+    /// Unmap
+    ///
+    /// Returns a slot previously returned by map, so that it can be used
+    /// again. Addresses that are not a slot in this window are ignored.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param virt the virtual address of the slot to unmap
+    ///
+    void unmap(integer_pointer virt) noexcept;
+
+    /// Window
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the virtual address of the first slot, or 0 if this CPU has
+    ///     not mapped anything yet
+    ///
+    integer_pointer window() const noexcept
+    { return m_virt; }
+
+    /// Number of Mapped Slots
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of slots that are currently in use
+    ///
+    size_type num_mapped() const noexcept
+    { return static_cast<size_type>(__builtin_popcountll(m_used)); }
+
+private:
+
+    void setup();
+
+private:
+
+    integer_pointer m_virt{0};
+    integer_pointer m_idle{0};
+
+    uint64_t m_used{0};
+    std::array<integer_pointer *, KMAP_SLOTS> m_ptes{};
+
+public:
+
+    kmap_x64(kmap_x64 &&) noexcept = delete;
+    kmap_x64 &operator=(kmap_x64 &&) noexcept = delete;
+
+    kmap_x64(const kmap_x64 &) = delete;
+    kmap_x64 &operator=(const kmap_x64 &) = delete;
+};
+
+/// CPU Mapping Slots
+///
+/// Returns the mapping slots of the CPU that is calling this function.
+///
+/// @expects thread_context_cpuid() < KMAP_MAX_CPUS
+/// @ensures ret != nullptr
+///
+EXPORT_MEMORY_MANAGER kmap_x64 *kmap_cpu();
+
+namespace bfn
+{
+
+/// Unique Temporary Map
+///
+/// Owns a single page mapped using the calling CPU's mapping slots (see
+/// kmap_x64), and unmaps it when destroyed. This should be used instead of
+/// make_unique_map_x64 for a single page that is only needed for a short
+/// time by the CPU that mapped it, and should be created using
+/// make_unique_kmap_x64:
+///
+/// @b Example: @n
+/// @code
+/// auto &&pml4 = bfn::make_unique_kmap_x64<uintptr_t>(cr3);
+/// std::cout << pml4.get()[0] << '\n';
+/// @endcode
+///
+template <class T>
+class unique_kmap_ptr_x64
+{
+public:
+
+    using pointer = T*;
+    using integer_pointer = uintptr_t;
+    using element_type = T;
+
+    /// Default Map
+    ///
+    /// This constructor can be used to create a default map that maps to
+    /// nothing
+    ///
+    unique_kmap_ptr_x64() = default;
+
+    /// Map Single Page
+    ///
+    /// @expects kmap != nullptr
+    /// @expects phys != 0
+    /// @expects phys & (x64::page_size - 1) == 0
+    /// @ensures get() != nullptr
+    ///
+    /// @param kmap the mapping slots to map the page with
+    /// @param phys the physical address to map
+    /// @param attr defines how to map the memory
+    ///
+    unique_kmap_ptr_x64(gsl::not_null<kmap_x64 *> kmap, integer_pointer phys,
+                        x64::memory_attr::attr_type attr) :
+        m_kmap(kmap),
+        m_virt(kmap->map(phys, attr))
+    { }
+
+    /// Destructor
+    ///
+    /// Unmaps the page.
+    ///
+    ~unique_kmap_ptr_x64()
+    { reset(); }
+
+    /// Move Constructor
+    ///
+    unique_kmap_ptr_x64(unique_kmap_ptr_x64 &&other) noexcept
+    { swap(other); }
+
+    /// Move Operator
+    ///
+    unique_kmap_ptr_x64 &operator=(unique_kmap_ptr_x64 &&other) noexcept
+    { reset(); swap(other); return *this; }
+
+    /// Get
+    ///
+    /// @return the virtual address of the map
+    ///
+    pointer get() const noexcept
+    { return reinterpret_cast<pointer>(m_virt); }
+
+    /// Dereference
+    ///
+    typename std::add_lvalue_reference<T>::type operator*() const
+    { return *get(); }
+
+    /// Dereference
+    ///
+    pointer operator->() const noexcept
+    { return get(); }
+
+    /// Valid
+    ///
+    /// @return true if this maps a page, false otherwise
+    ///
+    explicit operator bool() const noexcept
+    { return m_virt != 0; }
+
+    /// Reset
+    ///
+    /// Unmaps the page, if any.
+    ///
+    void reset() noexcept
+    {
+        if (m_kmap != nullptr) {
+            m_kmap->unmap(m_virt);
+        }
+
+        m_kmap = nullptr;
+        m_virt = 0;
+    }
+
+    /// Swap
+    ///
+    /// @param other the unique_kmap_ptr_x64 to swap with
+    ///
+    void swap(unique_kmap_ptr_x64 &other) noexcept
+    {
+        std::swap(m_kmap, other.m_kmap);
+        std::swap(m_virt, other.m_virt);
+    }
+
+private:
+
+    kmap_x64 *m_kmap{nullptr};
+    integer_pointer m_virt{0};
+
+public:
+
+    unique_kmap_ptr_x64(const unique_kmap_ptr_x64 &) = delete;
+    unique_kmap_ptr_x64 &operator=(const unique_kmap_ptr_x64 &) = delete;
+};
+
+/// Make Unique Temporary Map
+///
+/// Maps a single physical page using the calling CPU's mapping slots.
+///
+/// @expects phys != 0
+/// @expects phys & (x64::page_size - 1) == 0
+/// @ensures ret.get() != nullptr
+///
+/// @param phys the physical address to map
+/// @param attr defines how to map the memory. Defaults to map_read_write
+/// @return resulting unique_kmap_ptr_x64
+///
+template<class T>
+auto make_unique_kmap_x64(uintptr_t phys, x64::memory_attr::attr_type attr = x64::memory_attr::rw_wb)
+{ return unique_kmap_ptr_x64<T>(kmap_cpu(), phys, attr); }
+
+}
+
+#endif
@@ -33,7 +33,11 @@
 #include <bfupperlower.h>
 
 #include <memory_manager/pat_x64.h>
+#include <memory_manager/kmap_x64.h>
+#include <memory_manager/guest_tlb_x64.h>
+#include <memory_manager/direct_map_x64.h>
 #include <memory_manager/mem_attr_x64.h>
+#include <memory_manager/tlb_batch_x64.h>
 #include <memory_manager/memory_manager_x64.h>
 #include <memory_manager/root_page_table_x64.h>
 
@@ -68,7 +72,8 @@ class unique_map_ptr_x64;
 /// Make Unique Map (Single Page)
 ///
 /// This function can be used to map a single virtual memory page to
-/// a single physical memory page.
+/// a single physical memory page. If the page is in the direct map, and
+/// attr is rw_wb, the direct map is used instead, and nothing is mapped.
 ///
 /// @b Example: @n
 /// @code
@@ -87,6 +92,14 @@ template<class T>
 auto make_unique_map_x64(typename unique_map_ptr_x64<T>::pointer phys,
                          x64::memory_attr::attr_type attr = x64::memory_attr::rw_wb)
 {
+    if (attr == x64::memory_attr::rw_wb) {
+        if (auto &&dmap = phys_to_direct(reinterpret_cast<uintptr_t>(phys))) {
+            if (lower(dmap) == 0) {
+                return unique_map_ptr_x64<T>(dmap, x64::page_size);
+            }
+        }
+    }
+
     auto &&vmap = g_mm->alloc_map(x64::page_size);
 
     try {
@@ -104,7 +117,8 @@ auto make_unique_map_x64(typename unique_map_ptr_x64<T>::pointer phys,
 /// Make Unique Map (Single Page)
 ///
 /// This function can be used to map a single virtual memory page to
-/// a single physical memory page.
+/// a single physical memory page. If the page is in the direct map, and
+/// attr is rw_wb, the direct map is used instead, and nothing is mapped.
 ///
 /// @b Example: @n
 /// @code
@@ -123,6 +137,14 @@ template<class T>
 auto make_unique_map_x64(typename unique_map_ptr_x64<T>::integer_pointer phys,
                          x64::memory_attr::attr_type attr = x64::memory_attr::rw_wb)
 {
+    if (attr == x64::memory_attr::rw_wb) {
+        if (auto &&dmap = phys_to_direct(phys)) {
+            if (lower(dmap) == 0) {
+                return unique_map_ptr_x64<T>(dmap, x64::page_size);
+            }
+        }
+    }
+
     auto &&vmap = g_mm->alloc_map(x64::page_size);
 
     try {
@@ -228,13 +250,17 @@ auto make_unique_map_x64(const
 ///     physical memory mappings
 /// @param size the number of bytes to map
 /// @param pat the pat msr associated with the provided cr3
+/// @param tlb the guest TLB associated with cr3, or nullptr. Providing a
+///     guest TLB skips the guest page table walk for pages that were
+///     translated before (e.g. a buffer that is mapped on every exit)
 /// @return resulting unique_map_ptr_x64
 ///
 template<class T>
 auto make_unique_map_x64(typename unique_map_ptr_x64<T>::integer_pointer virt,
                          typename unique_map_ptr_x64<T>::integer_pointer cr3,
                          typename unique_map_ptr_x64<T>::size_type size,
-                         x64::msrs::value_type pat)
+                         x64::msrs::value_type pat,
+                         guest_tlb_x64 *tlb = nullptr)
 {
     auto &&vmap = g_mm->alloc_map(size + lower(virt));
 
@@ -242,6 +268,7 @@ auto make_unique_map_x64(typename unique_map_ptr_x64<T>::integer_pointer virt,
 
     (void) cr3;
     (void) pat;
+    (void) tlb;
 
     expects(virt != 0xDEADBEEF);
     return unique_map_ptr_x64<T> {reinterpret_cast<typename unique_map_ptr_x64<T>::integer_pointer>(vmap), size};
@@ -251,7 +278,7 @@ auto make_unique_map_x64(typename unique_map_ptr_x64<T>::integer_pointer virt,
     try {
         return unique_map_ptr_x64<T>(reinterpret_cast<typename unique_map_ptr_x64<T>::integer_pointer>
                                      (vmap),
-                                     virt, cr3, size, pat);
+                                     virt, cr3, size, pat, tlb);
     }
     catch (...) {
         g_mm->free_map(vmap);
@@ -266,8 +293,10 @@ auto make_unique_map_x64(typename unique_map_ptr_x64<T>::integer_pointer virt,
 /// Converts a virtual address to a physical address given the
 /// CR3 to locate the physical address from. Note that this function
 /// has to map / unmap the page table tree as it traverses the tree
-/// to locate the physical address. As a result, this is an expensive
-/// operation and should not be used in time sensitive operations.
+/// to locate the physical address. Page tables in the direct map are read
+/// directly, and the rest are mapped using the calling CPU's mapping slots
+/// (see kmap_x64), which costs a single invlpg. This is still not free, and
+/// should be avoided in time sensitive operations.
 ///
 /// @note the provided virtual address should be present prior to running
 ///     this function.
@@ -282,8 +311,11 @@ auto make_unique_map_x64(typename unique_map_ptr_x64<T>::integer_pointer virt,
 ///     could be incorrect, or an exception could be thrown.
 /// @return returns the physical address mapped to the provided virtual address
 ///     located in the provided CR3
+/// @param tlb the guest TLB associated with cr3, or nullptr. If provided,
+///     the page tables are only walked if the translation is not in the
+///     guest TLB
 ///
-uintptr_t virt_to_phys_with_cr3(uintptr_t virt, uintptr_t cr3);
+uintptr_t virt_to_phys_with_cr3(uintptr_t virt, uintptr_t cr3, guest_tlb_x64 *tlb = nullptr);
 
 /// Map Physically Contiguous / Non-Contiguous Range With CR3
 ///
@@ -319,10 +351,11 @@ uintptr_t virt_to_phys_with_cr3(uintptr_t virt, uintptr_t cr3);
 ///     physical memory mappings
 /// @param size the number of bytes to map
 /// @param pat the pat msr associated with the provided cr3
+/// @param tlb the guest TLB associated with cr3, or nullptr
 ///
 EXPORT_MEMORY_MANAGER
 void map_with_cr3(uintptr_t vmap, uintptr_t virt, uintptr_t cr3, size_t size,
-                  x64::msrs::value_type pat);
+                  x64::msrs::value_type pat, guest_tlb_x64 *tlb = nullptr);
 
 /// Unique Map
 ///
@@ -499,15 +532,10 @@ public:
         m_virt |= upper(vmap);
 
         auto &&voff = 0UL;
-        auto &&poff = 0UL;
 
         for (const auto &p : list) {
-            auto &&phys = upper(p.first);
-            auto &&size = p.second;
-
-            for (poff = 0; poff < size; poff += x64::page_size, voff += x64::page_size) {
-                g_pt->map_4k(vmap + voff, phys + poff, attr);
-            }
+            g_pt->map_range(vmap + voff, upper(p.first), p.second, attr);
+            voff += p.second;
         }
 
         flush();
@@ -547,13 +575,15 @@ public:
     ///     physical memory mappings
     /// @param size the number of bytes to map
     /// @param pat the pat msr associated with the provided cr3
+    /// @param tlb the guest TLB associated with cr3, or nullptr
     ///
     unique_map_ptr_x64(
         integer_pointer vmap,
         integer_pointer virt,
         integer_pointer cr3,
         size_type size,
-        x64::msrs::value_type pat) :
+        x64::msrs::value_type pat,
+        guest_tlb_x64 *tlb = nullptr) :
 
         m_virt(0),
         m_size(size),
@@ -566,7 +596,7 @@ public:
 
         m_unaligned_size += lower(virt);
 
-        map_with_cr3(vmap, virt, cr3, m_unaligned_size, pat);
+        map_with_cr3(vmap, virt, cr3, m_unaligned_size, pat, tlb);
 
         flush();
     }
@@ -830,18 +860,21 @@ public:
     ///
     /// Flushes the TLB entries associated with the virtual address ranges
     /// this unique_map_ptr_x64 holds. This is done automatically when
-    /// mapping memory, but might be needed if this map is shared with
-    /// another core whose TLB has not been properly flushed.
+    /// mapping memory, as another CPU might still cache a translation for
+    /// the range's previous mapping, but might be needed if this map is
+    /// shared with another core whose TLB has not been properly flushed.
+    /// A large map is flushed by reloading CR3.
     ///
     /// @expects none
     /// @ensures none
     ///
     void flush() noexcept
     {
-        auto &&vmap = upper(m_virt);
-        for (auto vadr = vmap; vadr < vmap + m_unaligned_size; vadr += x64::page_size) {
-            x64::tlb::invlpg(reinterpret_cast<pointer>(vadr));
+        if (auto &&batch = tlb_batch_cpu()) {
+            return batch->invalidate(upper(m_virt), m_unaligned_size);
         }
+
+        invlpg(upper(m_virt), m_unaligned_size);
     }
 
     /// Cache Flush
@@ -863,14 +896,34 @@ public:
 
 private:
 
+    void invlpg(integer_pointer vmap, size_type size) noexcept
+    {
+        for (auto vadr = vmap; vadr < vmap + size; vadr += x64::page_size) {
+            x64::tlb::invlpg(reinterpret_cast<pointer>(vadr));
+        }
+    }
+
+    // The virtual memory is given back to the memory manager once its TLB
+    // entries are invalidated, which the calling CPU's TLB batch defers
+    // until it is flushed, so that the maps released by a vmcall share a
+    // single flush.
+
     void cleanup(integer_pointer virt, size_type size) noexcept
     {
         if (virt != 0 && size != 0) {
             auto &&vmap = upper(virt);
-            for (auto vadr = vmap; vadr < vmap + size; vadr += x64::page_size) {
-                g_pt->unmap(vadr);
+
+            if (direct_to_phys(vmap) != 0) {
+                return;
             }
 
+            g_pt->unmap_range(vmap, size);
+
+            if (auto &&batch = tlb_batch_cpu()) {
+                return batch->release(vmap, size);
+            }
+
+            invlpg(vmap, size);
             g_mm->free_map(reinterpret_cast<pointer>(vmap));
         }
     }
@@ -931,57 +984,125 @@ template <class T>
 bool operator!=(std::nullptr_t dontcare, const unique_map_ptr_x64<T> &y) noexcept
 { (void) dontcare; return y; }
 
-inline uintptr_t virt_to_phys_with_cr3(uintptr_t virt, uintptr_t cr3)
+/// Read Page Table Entry
+///
+/// Returns a copy of an entry in a page table that is not owned by the VMM
+/// (e.g. a guest's page tables). The page table is read through the direct
+/// map if it is in the direct map, and is mapped using the calling CPU's
+/// mapping slots otherwise.
+///
+/// @expects phys != 0
+/// @expects phys & (x64::page_size - 1) == 0
+/// @expects index < x64::page_table::num_entries
+/// @ensures none
+///
+/// @param phys the physical address of the page table
+/// @param index the index of the entry to read
+/// @return the entry
+///
+inline uintptr_t read_page_table_entry(uintptr_t phys, uintptr_t index)
+{
+    expects(index < x64::page_table::num_entries);
+
+    if (auto &&dmap = phys_to_direct(phys)) {
+        return reinterpret_cast<uintptr_t *>(dmap)[index];
+    }
+
+    auto &&map = bfn::make_unique_kmap_x64<uintptr_t>(phys);
+    return map.get()[index];
+}
+
+/// Walk With CR3
+///
+/// Walks the page tables located by cr3 to find the page that virt maps
+/// to. If a guest TLB is provided, it is checked first, and the result of
+/// the walk is added to it.
+///
+/// @expects virt != 0
+/// @expects cr3 != 0
+/// @expects cr3 & (x64::page_size - 1) == 0
+/// @ensures ret.size != 0
+///
+/// @param virt virtual address to lookup
+/// @param cr3 the CR3 to lookup virt from
+/// @param tlb the guest TLB associated with cr3, or nullptr
+/// @return the page virt maps to
+///
+inline guest_tlb_x64::entry_type
+walk_with_cr3(uintptr_t virt, uintptr_t cr3, guest_tlb_x64 *tlb = nullptr)
 {
-    uintptr_t from;
+    guest_tlb_x64::entry_type entry;
 
     expects(cr3 != 0);
     expects(lower(cr3) == 0);
     expects(virt != 0);
 
-    from = x64::page_table::pml4::from;
-    auto &&pml4_idx = x64::page_table::index(virt, from);
-    auto &&pml4_map = bfn::make_unique_map_x64<uintptr_t>(cr3);
-    auto &&pml4_pte = page_table_entry_x64{&pml4_map.get()[pml4_idx]};
+    if (tlb != nullptr && tlb->lookup(cr3, virt, entry)) {
+        return entry;
+    }
 
-    expects(pml4_pte.present());
-    expects(pml4_pte.phys_addr() != 0);
+    entry.cr3 = cr3;
+    entry.virt = upper(virt);
 
-    from = x64::page_table::pdpt::from;
-    auto &&pdpt_idx = x64::page_table::index(virt, from);
-    auto &&pdpt_map = bfn::make_unique_map_x64<uintptr_t>(pml4_pte.phys_addr());
-    auto &&pdpt_pte = page_table_entry_x64{&pdpt_map.get()[pdpt_idx]};
+    while (true) {
+        auto &&pml4_idx = x64::page_table::index(virt, x64::page_table::pml4::from);
+        auto &&pml4_entry = read_page_table_entry(cr3, pml4_idx);
+        auto &&pml4_pte = page_table_entry_x64{&pml4_entry};
 
-    expects(pdpt_pte.present());
-    expects(pdpt_pte.phys_addr() != 0);
+        expects(pml4_pte.present());
+        expects(pml4_pte.phys_addr() != 0);
 
-    if (pdpt_pte.ps()) {
-        return upper(pdpt_pte.phys_addr(), from) | lower(virt, from);
-    }
+        auto &&pdpt_idx = x64::page_table::index(virt, x64::page_table::pdpt::from);
+        auto &&pdpt_entry = read_page_table_entry(pml4_pte.phys_addr(), pdpt_idx);
+        auto &&pdpt_pte = page_table_entry_x64{&pdpt_entry};
 
-    from = x64::page_table::pd::from;
-    auto &&pd_idx = x64::page_table::index(virt, from);
-    auto &&pd_map = bfn::make_unique_map_x64<uintptr_t>(pdpt_pte.phys_addr());
-    auto &&pd_pte = page_table_entry_x64{&pd_map.get()[pd_idx]};
+        expects(pdpt_pte.present());
+        expects(pdpt_pte.phys_addr() != 0);
 
-    expects(pd_pte.present());
-    expects(pd_pte.phys_addr() != 0);
+        if (pdpt_pte.ps()) {
+            entry.size = x64::page_table::pdpt::size_bytes;
+            entry.phys = upper(pdpt_pte.phys_addr(), x64::page_table::pdpt::from);
+            entry.pati = pdpt_pte.pat_index_large();
+            break;
+        }
 
-    if (pd_pte.ps()) {
-        return upper(pd_pte.phys_addr(), from) | lower(virt, from);
-    }
+        auto &&pd_idx = x64::page_table::index(virt, x64::page_table::pd::from);
+        auto &&pd_entry = read_page_table_entry(pdpt_pte.phys_addr(), pd_idx);
+        auto &&pd_pte = page_table_entry_x64{&pd_entry};
+
+        expects(pd_pte.present());
+        expects(pd_pte.phys_addr() != 0);
 
-    from = x64::page_table::pt::from;
-    auto &&pt_idx = x64::page_table::index(virt, from);
-    auto &&pt_map = bfn::make_unique_map_x64<uintptr_t>(pd_pte.phys_addr());
-    auto &&pt_pte = page_table_entry_x64{&pt_map.get()[pt_idx]};
+        if (pd_pte.ps()) {
+            entry.size = x64::page_table::pd::size_bytes;
+            entry.phys = upper(pd_pte.phys_addr(), x64::page_table::pd::from);
+            entry.pati = pd_pte.pat_index_large();
+            break;
+        }
 
-    expects(pt_pte.present());
-    expects(pt_pte.phys_addr() != 0);
+        auto &&pt_idx = x64::page_table::index(virt, x64::page_table::pt::from);
+        auto &&pt_entry = read_page_table_entry(pd_pte.phys_addr(), pt_idx);
+        auto &&pt_pte = page_table_entry_x64{&pt_entry};
 
-    return upper(pt_pte.phys_addr(), from) | lower(virt, from);
+        expects(pt_pte.present());
+        expects(pt_pte.phys_addr() != 0);
+
+        entry.size = x64::page_table::pt::size_bytes;
+        entry.phys = upper(pt_pte.phys_addr(), x64::page_table::pt::from);
+        entry.pati = pt_pte.pat_index_4k();
+        break;
+    }
+
+    if (tlb != nullptr) {
+        tlb->insert(entry);
+    }
+
+    return entry;
 }
 
+inline uintptr_t virt_to_phys_with_cr3(uintptr_t virt, uintptr_t cr3, guest_tlb_x64 *tlb)
+{ return walk_with_cr3(virt, cr3, tlb).phys_addr(virt); }
+
 }
 
 #endif
@@ -24,10 +24,13 @@
 
 #include <mutex>
 #include <array>
+#include <atomic>
 
 #include <bfgsl.h>
 #include <bfconstants.h>
 
+#include <memory_manager/mem_pool_stats.h>
+
 // -----------------------------------------------------------------------------
 // Testing Switch
 // -----------------------------------------------------------------------------
@@ -73,6 +76,13 @@ constexpr const auto mem_pool_free_index = 0xFFFFFFFFFFFFFFFFUL;
 /// done using custom new / delete operators at the class level if needed
 /// until we can provide a more complicated algorithm.
 ///
+/// Only alloc() takes the lock, as it is the only function that needs to
+/// search the pool. Each entry in the allocation table is atomic, so free()
+/// and size(), which only ever touch a single entry, do not need the lock and
+/// do not contend with allocations on other CPUs. A search racing with a free
+/// simply sees the entry as either allocated or free, and in both cases
+/// makes a valid decision.
+///
 /// @param total_size total size in bytes of the memory pool
 /// @param block_shift block size in bit shifts (i.e. 8 bytes == 3 bits)
 ///
@@ -139,27 +149,104 @@ public:
     ///
     integer_pointer
     alloc(size_type size)
+    {
+        // [[ensures ret: ret != 0]]
+        return alloc_aligned(size, 1ULL << block_shift);
+    }
+
+    /// Allocate Aligned Memory
+    ///
+    /// Same as alloc, except the resulting address is a multiple of
+    /// alignment. Note that alignments smaller than the block size are
+    /// always satisfied, and that the pool's starting address must be
+    /// aligned to the block size.
+    ///
+    /// @expects size > 0
+    /// @expects size <= total_size
+    /// @expects alignment is a power of 2
+    /// @ensures ret != nullptr
+    ///
+    /// @param size the number of bytes to allocate
+    /// @param alignment the required alignment of the allocation in bytes
+    /// @return the starting address of the allocated memory
+    ///
+    integer_pointer
+    alloc_aligned(size_type size, size_type alignment)
     {
         // [[ensures ret: ret != 0]]
         expects(size > 0);
         expects(size <= total_size);
+        expects(alignment != 0 && (alignment & (alignment - 1)) == 0);
 
         std::lock_guard<std::mutex> lock(m_mutex);
 
         integer_pointer start = 0;
         integer_pointer total = total_blocks(size);
+        integer_pointer align = alignment > (1ULL << block_shift) ? alignment >> block_shift : 1;
 
-        if ((start = next_search(m_next, total)) != mem_pool_used_index)
+        if ((start = next_search(m_next, total, align)) != mem_pool_used_index)
         {
             m_next = start + total;
-            gsl::at(m_allocated, start) = total;
+            gsl::at(m_allocated, start).store(total, std::memory_order_release);
 
+            m_counters.alloc(size, total << block_shift);
             return m_addr + (start << block_shift);
         }
 
+        m_counters.failure(size);
         throw std::bad_alloc();
     }
 
+    /// Allocate Memory (Batch)
+    ///
+    /// Allocates up to n allocations of size bytes each, taking the lock
+    /// once for the entire batch instead of once per allocation. Unlike
+    /// alloc, running out of memory is not an error. The batch simply stops
+    /// at the first allocation that cannot be made.
+    ///
+    /// @expects size > 0
+    /// @expects size <= total_size
+    /// @expects out != nullptr
+    /// @ensures ret <= n
+    ///
+    /// @param size the number of bytes of each allocation
+    /// @param out where the starting address of each allocation is stored
+    /// @param n the number of allocations to make
+    /// @return the number of allocations that were made
+    ///
+    size_type
+    alloc_n(size_type size, integer_pointer *out, size_type n)
+    {
+        expects(size > 0);
+        expects(size <= total_size);
+        expects(out != nullptr);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        size_type num = 0;
+        integer_pointer start = 0;
+        integer_pointer total = total_blocks(size);
+
+        for (auto &addr : gsl::make_span(out, static_cast<std::ptrdiff_t>(n)))
+        {
+            if ((start = next_search(m_next, total, 1)) == mem_pool_used_index)
+            {
+                m_counters.failure(size);
+                break;
+            }
+
+            m_next = start + total;
+            gsl::at(m_allocated, start).store(total, std::memory_order_release);
+
+            m_counters.alloc(size, total << block_shift);
+            addr = m_addr + (start << block_shift);
+
+            num++;
+        }
+
+        return num;
+    }
+
     /// Free Memory
     ///
     /// Free's previously allocated memory.
@@ -182,10 +269,98 @@ public:
             return;
         }
 
+        auto total = gsl::at(m_allocated, start).exchange(mem_pool_free_index, std::memory_order_acq_rel);
+
+        if (total != mem_pool_free_index) {
+            m_counters.free(total << block_shift);
+        }
+    }
+
+    /// Free Memory (Batch)
+    ///
+    /// Free's n previously allocated addresses. free() does not take the
+    /// lock, so neither does this, and a batch costs the same as freeing
+    /// each address on its own. It is provided so that mem_pool_cache can
+    /// drain its magazines the same way whichever heap pool it sits in
+    /// front of.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addrs the addresses to free
+    /// @param n the number of addresses to free
+    ///
+    void
+    free_n(const integer_pointer *addrs, size_type n) noexcept
+    {
+        if (addrs == nullptr) {
+            return;
+        }
+
+        for (const auto &addr : gsl::make_span(addrs, static_cast<std::ptrdiff_t>(n))) {
+            free(addr);
+        }
+    }
+
+    /// Resize Memory
+    ///
+    /// Attempts to change the size of previously allocated memory without
+    /// moving it. Shrinking always succeeds, and growing succeeds if the
+    /// blocks that directly follow the allocation are free.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr the address of the allocation to resize
+    /// @param size the new size of the allocation in bytes
+    /// @return true if the allocation was resized, false otherwise, in which
+    ///     case the allocation is left unchanged
+    ///
+    bool
+    resize(integer_pointer addr, size_type size) noexcept
+    {
+        if (!contains(addr) || size == 0 || size > total_size) {
+            return false;
+        }
+
+        integer_pointer start = (addr - m_addr) >> block_shift;
+        integer_pointer total = total_blocks(size);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto old_total = gsl::at(m_allocated, start).load(std::memory_order_acquire);
+        if (old_total == mem_pool_free_index) {
+            return false;
+        }
+
+        if (total > old_total)
         {
-            std::lock_guard<std::mutex> lock(m_mutex);
-            gsl::at(m_allocated, start) = mem_pool_free_index;
+            if (start + total > m_size) {
+                return false;
+            }
+
+            for (auto index = start + old_total; index < start + total; index++) {
+                if (gsl::at(m_allocated, index).load(std::memory_order_acquire) != mem_pool_free_index) {
+                    return false;
+                }
+            }
+        }
+
+        // Blocks inside of an allocation are marked as free, so storing the
+        // new total is all that is needed to shrink, or to grow into the
+        // free blocks that follow.
+
+        gsl::at(m_allocated, start).store(total, std::memory_order_release);
+        m_counters.resize(old_total << block_shift, total << block_shift);
+
+        // The next search must not start in the middle of an allocation, as
+        // it would see the blocks inside of the allocation as free.
+
+        if (m_next > start && m_next < start + total) {
+            m_next = start + total;
         }
+
+        return true;
     }
 
     /// Contains Address
@@ -216,13 +391,11 @@ public:
     size_type
     size(integer_pointer addr) const noexcept
     {
-        std::lock_guard<std::mutex> lock(m_mutex);
-
         if (!contains(addr)) {
             return 0;
         }
 
-        auto size = gsl::at(m_allocated, (addr - m_addr) >> block_shift);
+        auto size = gsl::at(m_allocated, (addr - m_addr) >> block_shift).load(std::memory_order_acquire);
 
         if (size == mem_pool_free_index) {
             return 0;
@@ -245,14 +418,62 @@ public:
         std::lock_guard<std::mutex> lock(m_mutex);
 
         m_next = 0;
-        memset(m_allocated.data(), 0xFF, sizeof(m_allocated));
+
+        for (auto &entry : m_allocated) {
+            entry.store(mem_pool_free_index, std::memory_order_relaxed);
+        }
+
+        m_counters.clear();
+    }
+
+    /// Statistics
+    ///
+    /// Returns a snapshot of this pool's usage counters. Note that finding
+    /// the largest free extent requires walking the allocation table, so
+    /// this should not be called on a hot path.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return usage statistics for this pool
+    ///
+    mem_pool_stats
+    stats() const noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        integer_pointer index = 0;
+        integer_pointer count = 0;
+        integer_pointer largest = 0;
+
+        while (index < m_size)
+        {
+            auto blocks = gsl::at(m_allocated, index).load(std::memory_order_acquire);
+
+            if (blocks == mem_pool_free_index)
+            {
+                count++;
+                index++;
+
+                largest = count > largest ? count : largest;
+            }
+            else
+            {
+                count = 0;
+                index += blocks;
+            }
+        }
+
+        return m_counters.stats(total_size, largest << block_shift);
     }
 
 private:
 
     integer_pointer
-    next_search(integer_pointer initial, integer_pointer total) const
+    next_search(integer_pointer initial, integer_pointer total, integer_pointer align) const
     {
+        auto base = m_addr >> block_shift;
+
         integer_pointer check = 0;
         integer_pointer count = 0;
         integer_pointer start = 0;
@@ -266,20 +487,27 @@ private:
                 index = 0;
             }
 
-            if (gsl::at(m_allocated, index) == mem_pool_free_index)
+            auto blocks = gsl::at(m_allocated, index).load(std::memory_order_acquire);
+
+            if (blocks == mem_pool_free_index)
             {
-                if (count == 0) {
-                    start = index;
+                // A run of free blocks can only start on a block that meets
+                // the requested alignment.
+
+                if (count != 0 || ((base + index) & (align - 1)) == 0)
+                {
+                    if (count == 0) {
+                        start = index;
+                    }
+
+                    count++;
                 }
 
-                count++;
                 index++;
                 check++;
             }
             else
             {
-                auto blocks = gsl::at(m_allocated, index);
-
                 count = 0;
                 index += blocks;
                 check += blocks;
@@ -314,7 +542,9 @@ private:
     integer_pointer m_size{0};
 
     mutable std::mutex m_mutex;
-    std::array<integer_pointer, (total_size >> block_shift)> m_allocated;
+    std::array<std::atomic<integer_pointer>, (total_size >> block_shift)> m_allocated;
+
+    mem_pool_counters m_counters;
 
 public:
 
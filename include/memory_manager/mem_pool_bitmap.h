@@ -0,0 +1,649 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef MEM_POOL_BITMAP_H
+#define MEM_POOL_BITMAP_H
+
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include <bfgsl.h>
+#include <bfconstants.h>
+
+#include <memory_manager/mem_pool.h>
+#include <memory_manager/mem_pool_stats.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+/// Count Trailing Zeros
+///
+/// Returns the index of the least significant set bit. The result is
+/// undefined if val == 0, so callers must check for this first.
+///
+/// @param val the value to scan
+/// @return the index of the first set bit in val
+///
+inline uint64_t
+mem_pool_ctz(uint64_t val) noexcept
+{
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward64(&index, val);
+    return index;
+#else
+    return static_cast<uint64_t>(__builtin_ctzll(val));
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+///
+/// *INDENT-OFF*
+///
+
+/// Memory Pool (Bitmap)
+///
+/// Provides the same alloc / free / size / contains contract as mem_pool,
+/// but instead of walking the allocation table one block at a time, the
+/// free blocks are tracked in a bitmap (one bit per block, set == free),
+/// and a second, smaller summary bitmap records which words of the first
+/// bitmap still contain at least one free block. Allocations use
+/// find-first-set on the summary to skip fully used words, and then on the
+/// words themselves to locate runs of free blocks, so the cost of a search
+/// is bounded by the number of bitmap words rather than the number of
+/// blocks in the pool. Allocations are first fit.
+///
+/// The allocation size of each block run is stored at its first block so
+/// that free() and size() remain O(1).
+///
+/// Like mem_pool, only the search takes the lock. The bitmaps and the
+/// allocation sizes are atomic, and free() only ever sets bits, so it does
+/// not need the lock. A search racing with a free simply does not see the
+/// blocks that are being freed yet.
+///
+/// @param total_size total size in bytes of the memory pool
+/// @param block_shift block size in bit shifts (i.e. 8 bytes == 3 bits)
+///
+template<size_t total_size, size_t block_shift>
+class mem_pool_bitmap
+{
+    static_assert(total_size > 0, "total size must be larger than 0");
+    static_assert(total_size % (1 << block_shift) == 0, "total size must be a multiple of block size");
+    static_assert((MAX_PAGE_SHIFT >= block_shift) &&(block_shift > 0), "block shift must be larger than 0");
+    static_assert((total_size >> block_shift) < 0xFFFFFFFFULL, "too many blocks");
+
+public:
+
+    using size_type = size_t;
+    using shift_type = size_t;
+    using integer_pointer = uintptr_t;
+    using word_type = uint64_t;
+    using blocks_type = uint32_t;
+
+    /// Constructor
+    ///
+    /// Creates a memory pool with the starting virtual address of addr.
+    ///
+    /// @expects addr != 0
+    /// @ensures none
+    ///
+    /// @param addr the starting address of the memory pool
+    mem_pool_bitmap(integer_pointer addr) noexcept_testing :
+        m_addr(addr)
+    {
+        if (addr == 0) {
+            static_construction_error();
+        }
+
+        clear();
+    }
+
+    /// Default Destructor
+    ///
+    ~mem_pool_bitmap() = default;
+
+    /// Allocate Memory
+    ///
+    /// Allocates memory from the memory pool whose size is greater than or
+    /// equal to size. See mem_pool::alloc for alignment guarantees.
+    ///
+    /// @expects size > 0
+    /// @expects size <= total_size
+    /// @ensures ret != nullptr
+    ///
+    /// @param size the number of bytes to allocate
+    /// @return the starting address of the allocated memory
+    ///
+    integer_pointer
+    alloc(size_type size)
+    {
+        // [[ensures ret: ret != 0]]
+        return alloc_aligned(size, 1ULL << block_shift);
+    }
+
+    /// Allocate Aligned Memory
+    ///
+    /// Same as alloc, except the resulting address is a multiple of
+    /// alignment. Note that alignments smaller than the block size are
+    /// always satisfied, and that the pool's starting address must be
+    /// aligned to the block size.
+    ///
+    /// @expects size > 0
+    /// @expects size <= total_size
+    /// @expects alignment is a power of 2
+    /// @ensures ret != nullptr
+    ///
+    /// @param size the number of bytes to allocate
+    /// @param alignment the required alignment of the allocation in bytes
+    /// @return the starting address of the allocated memory
+    ///
+    integer_pointer
+    alloc_aligned(size_type size, size_type alignment)
+    {
+        // [[ensures ret: ret != 0]]
+        expects(size > 0);
+        expects(size <= total_size);
+        expects(alignment != 0 && (alignment & (alignment - 1)) == 0);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto total = total_blocks(size);
+        auto start = search(total, alignment > (1ULL << block_shift) ? alignment >> block_shift : 1);
+
+        if (start != mem_pool_used_index)
+        {
+            mark_used(start, total);
+            gsl::at(m_allocated, start).store(static_cast<blocks_type>(total), std::memory_order_release);
+
+            m_counters.alloc(size, total << block_shift);
+            return m_addr + (start << block_shift);
+        }
+
+        m_counters.failure(size);
+        throw std::bad_alloc();
+    }
+
+    /// Allocate Memory (Batch)
+    ///
+    /// Same as mem_pool::alloc_n. The lock is taken once for the entire
+    /// batch, and the batch stops at the first allocation that cannot be
+    /// made.
+    ///
+    /// @expects size > 0
+    /// @expects size <= total_size
+    /// @expects out != nullptr
+    /// @ensures ret <= n
+    ///
+    /// @param size the number of bytes of each allocation
+    /// @param out where the starting address of each allocation is stored
+    /// @param n the number of allocations to make
+    /// @return the number of allocations that were made
+    ///
+    size_type
+    alloc_n(size_type size, integer_pointer *out, size_type n)
+    {
+        expects(size > 0);
+        expects(size <= total_size);
+        expects(out != nullptr);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        size_type num = 0;
+        auto total = total_blocks(size);
+
+        for (auto &addr : gsl::make_span(out, static_cast<std::ptrdiff_t>(n)))
+        {
+            auto start = search(total, 1);
+
+            if (start == mem_pool_used_index)
+            {
+                m_counters.failure(size);
+                break;
+            }
+
+            mark_used(start, total);
+            gsl::at(m_allocated, start).store(static_cast<blocks_type>(total), std::memory_order_release);
+
+            m_counters.alloc(size, total << block_shift);
+            addr = m_addr + (start << block_shift);
+
+            num++;
+        }
+
+        return num;
+    }
+
+    /// Free Memory
+    ///
+    /// Free's previously allocated memory. Addresses that do not point to
+    /// the start of an allocation are ignored.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr the address to free
+    ///
+    void
+    free(integer_pointer addr) noexcept
+    {
+        if (!contains(addr)) {
+            return;
+        }
+
+        integer_pointer start = (addr - m_addr) >> block_shift;
+
+        auto total = gsl::at(m_allocated, start).exchange(0, std::memory_order_acq_rel);
+        if (total == 0) {
+            return;
+        }
+
+        mark_free(start, total);
+
+        m_counters.free(static_cast<size_type>(total) << block_shift);
+    }
+
+    /// Free Memory (Batch)
+    ///
+    /// Same as mem_pool::free_n. Like free(), this does not take the lock.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addrs the addresses to free
+    /// @param n the number of addresses to free
+    ///
+    void
+    free_n(const integer_pointer *addrs, size_type n) noexcept
+    {
+        if (addrs == nullptr) {
+            return;
+        }
+
+        for (const auto &addr : gsl::make_span(addrs, static_cast<std::ptrdiff_t>(n))) {
+            free(addr);
+        }
+    }
+
+    /// Resize Memory
+    ///
+    /// Attempts to change the size of previously allocated memory without
+    /// moving it. Shrinking always succeeds, and growing succeeds if the
+    /// blocks that directly follow the allocation are free.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr the address of the allocation to resize
+    /// @param size the new size of the allocation in bytes
+    /// @return true if the allocation was resized, false otherwise, in which
+    ///     case the allocation is left unchanged
+    ///
+    bool
+    resize(integer_pointer addr, size_type size) noexcept
+    {
+        if (!contains(addr) || size == 0 || size > total_size) {
+            return false;
+        }
+
+        integer_pointer start = (addr - m_addr) >> block_shift;
+        integer_pointer total = total_blocks(size);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        integer_pointer old_total = gsl::at(m_allocated, start).load(std::memory_order_acquire);
+        if (old_total == 0) {
+            return false;
+        }
+
+        if (total > old_total) {
+
+            if (start + total > num_blocks || !is_free(start + old_total, total - old_total)) {
+                return false;
+            }
+
+            mark_used(start + old_total, total - old_total);
+        }
+
+        if (total < old_total) {
+            mark_free(start + total, old_total - total);
+        }
+
+        gsl::at(m_allocated, start).store(static_cast<blocks_type>(total), std::memory_order_release);
+        m_counters.resize(old_total << block_shift, total << block_shift);
+
+        return true;
+    }
+
+    /// Contains Address
+    ///
+    /// Returns true if this memory pool contains this address, returns
+    /// false otherwise.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr to lookup
+    ///
+    bool
+    contains(integer_pointer addr) const noexcept
+    { return (addr >= m_addr && addr < m_addr + total_size); }
+
+    /// Allocation Size
+    ///
+    /// Locates and returns the size of previously allocated memory from
+    /// this pool. Returns 0 given invalid inputs.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr to lookup
+    ///
+    size_type
+    size(integer_pointer addr) const noexcept
+    {
+        if (!contains(addr)) {
+            return 0;
+        }
+
+        auto total = gsl::at(m_allocated, (addr - m_addr) >> block_shift).load(std::memory_order_acquire);
+        return static_cast<size_type>(total) << block_shift;
+    }
+
+    /// Clear Memory Pool
+    ///
+    /// This is a very dangerous function, and will effectively run free() on
+    /// all memory previously allocated.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void
+    clear() noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto &entry : m_allocated) {
+            entry.store(0, std::memory_order_relaxed);
+        }
+
+        for (auto &word : m_free) {
+            word.store(~0ULL, std::memory_order_relaxed);
+        }
+
+        for (auto &word : m_summary) {
+            word.store(0, std::memory_order_relaxed);
+        }
+
+        // Blocks past the end of the pool share the last word of the
+        // bitmap, and must never be handed out, so they are marked as used
+        // up front.
+
+        if (auto tail = num_blocks % word_bits) {
+            m_free.back().store((1ULL << tail) - 1, std::memory_order_relaxed);
+        }
+
+        for (auto i = 0ULL; i < num_words; i++) {
+            gsl::at(m_summary, i / word_bits).fetch_or(1ULL << (i % word_bits), std::memory_order_relaxed);
+        }
+
+        m_counters.clear();
+    }
+
+    /// Statistics
+    ///
+    /// Returns a snapshot of this pool's usage counters. Note that finding
+    /// the largest free extent requires walking the bitmap, so this should
+    /// not be called on a hot path.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return usage statistics for this pool
+    ///
+    mem_pool_stats
+    stats() const noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        integer_pointer count = 0;
+        integer_pointer largest = 0;
+
+        for (const auto &entry : m_free) {
+            auto word = entry.load(std::memory_order_relaxed);
+
+            if (word == ~0ULL) {
+                count += word_bits;
+            }
+            else {
+                for (auto bit = 0ULL; bit < word_bits; bit++) {
+                    if ((word & (1ULL << bit)) != 0) {
+                        count++;
+                        largest = count > largest ? count : largest;
+                    }
+                    else {
+                        count = 0;
+                    }
+                }
+            }
+
+            largest = count > largest ? count : largest;
+        }
+
+        return m_counters.stats(total_size, largest << block_shift);
+    }
+
+private:
+
+    integer_pointer
+    search(integer_pointer total, integer_pointer align) const noexcept
+    {
+        integer_pointer run_start = 0;
+        integer_pointer run_total = 0;
+        integer_pointer prev_word = mem_pool_used_index;
+
+        for (auto s = 0ULL; s < num_summary_words; s++) {
+            auto summary = gsl::at(m_summary, s).load(std::memory_order_acquire);
+
+            while (summary != 0) {
+                auto w = (s * word_bits) + mem_pool_ctz(summary);
+                summary &= summary - 1;
+
+                // A run can only span words if the words are adjacent.
+                // Fully used words are never visited (their summary bit is
+                // clear), so skipping one breaks the current run.
+
+                if (w != prev_word + 1) {
+                    run_total = 0;
+                }
+
+                prev_word = w;
+
+                auto word = gsl::at(m_free, w).load(std::memory_order_acquire);
+                auto pos = 0ULL;
+
+                while (pos < word_bits) {
+                    auto rem = word >> pos;
+
+                    if (rem == 0) {
+                        run_total = 0;
+                        break;
+                    }
+
+                    if (auto used = mem_pool_ctz(rem)) {
+                        run_total = 0;
+                        pos += used;
+                        rem >>= used;
+                    }
+
+                    auto ones = (~rem == 0) ? (word_bits - pos) : mem_pool_ctz(~rem);
+
+                    if (run_total == 0) {
+                        run_start = (w * word_bits) + pos;
+                    }
+
+                    run_total += ones;
+                    pos += ones;
+
+                    auto first = align_up(run_start, align);
+
+                    if (run_start + run_total >= first + total) {
+                        return first;
+                    }
+
+                    if (pos < word_bits) {
+                        run_total = 0;
+                    }
+                }
+            }
+        }
+
+        return mem_pool_used_index;
+    }
+
+    void
+    mark_used(integer_pointer start, integer_pointer total) noexcept
+    {
+        for_each_word(start, total, [&](auto w, auto mask) {
+            auto &&word = gsl::at(m_free, w);
+            auto &&summary = gsl::at(m_summary, w / word_bits);
+
+            if ((word.fetch_and(~mask) & ~mask) != 0) {
+                return;
+            }
+
+            // A free() can set bits in the word between the word being
+            // used up and its summary bit being cleared, in which case the
+            // summary bit has to be put back, or the freed blocks would
+            // never be found again.
+
+            summary.fetch_and(~(1ULL << (w % word_bits)));
+
+            if (word.load() != 0) {
+                summary.fetch_or(1ULL << (w % word_bits));
+            }
+        });
+    }
+
+    void
+    mark_free(integer_pointer start, integer_pointer total) noexcept
+    {
+        for_each_word(start, total, [&](auto w, auto mask) {
+            gsl::at(m_free, w).fetch_or(mask);
+            gsl::at(m_summary, w / word_bits).fetch_or(1ULL << (w % word_bits));
+        });
+    }
+
+    bool
+    is_free(integer_pointer start, integer_pointer total) const noexcept
+    {
+        auto free = true;
+
+        for_each_word(start, total, [&](auto w, auto mask) {
+            if ((gsl::at(m_free, w).load(std::memory_order_acquire) & mask) != mask) {
+                free = false;
+            }
+        });
+
+        return free;
+    }
+
+    template<typename F>
+    void
+    for_each_word(integer_pointer start, integer_pointer total, F func) const noexcept
+    {
+        auto end = start + total;
+
+        while (start < end) {
+            auto w = start / word_bits;
+            auto bit = start % word_bits;
+            auto num = word_bits - bit;
+
+            if (num > end - start) {
+                num = end - start;
+            }
+
+            auto mask = (num == word_bits) ? ~0ULL : (((1ULL << num) - 1) << bit);
+            func(w, mask);
+
+            start += num;
+        }
+    }
+
+    integer_pointer
+    align_up(integer_pointer block, integer_pointer align) const noexcept
+    {
+        auto base = m_addr >> block_shift;
+        return ((base + block + align - 1) & ~(align - 1)) - base;
+    }
+
+    integer_pointer
+    total_blocks(size_type size) const noexcept
+    {
+        integer_pointer total = size >> block_shift;
+
+        if ((size & ((1 << block_shift) - 1)) != 0) {
+            total++;
+        }
+
+        return total;
+    }
+
+private:
+
+    static constexpr const auto word_bits = 64ULL;
+    static constexpr const auto num_blocks = total_size >> block_shift;
+    static constexpr const auto num_words = (num_blocks + word_bits - 1) / word_bits;
+    static constexpr const auto num_summary_words = (num_words + word_bits - 1) / word_bits;
+
+    integer_pointer m_addr{0};
+
+    mutable std::mutex m_mutex;
+
+    std::array<std::atomic<word_type>, num_words> m_free;
+    std::array<std::atomic<word_type>, num_summary_words> m_summary;
+    std::array<std::atomic<blocks_type>, num_blocks> m_allocated;
+
+    mem_pool_counters m_counters;
+
+public:
+
+    mem_pool_bitmap(mem_pool_bitmap &&) noexcept = delete;
+    mem_pool_bitmap &operator=(mem_pool_bitmap &&) noexcept = delete;
+
+    mem_pool_bitmap(const mem_pool_bitmap &) = delete;
+    mem_pool_bitmap &operator=(const mem_pool_bitmap &) = delete;
+};
+
+///
+/// *INDENT-ON*
+///
+
+#endif
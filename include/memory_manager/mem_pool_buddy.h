@@ -0,0 +1,541 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef MEM_POOL_BUDDY_H
+#define MEM_POOL_BUDDY_H
+
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include <bfgsl.h>
+#include <bfconstants.h>
+
+#include <memory_manager/mem_pool.h>
+#include <memory_manager/mem_pool_stats.h>
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+constexpr const auto mem_pool_buddy_null = 0xFFFFFFFFU;
+constexpr const auto mem_pool_buddy_free = 0x80U;
+constexpr const auto mem_pool_buddy_used = 0x40U;
+constexpr const auto mem_pool_buddy_pending = 0x20U;
+constexpr const auto mem_pool_buddy_order_mask = 0x1FU;
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+///
+/// *INDENT-OFF*
+///
+
+/// Memory Pool (Buddy)
+///
+/// Provides the same alloc / free / size / contains contract as mem_pool,
+/// using a binary buddy allocator. Every allocation is rounded up to a
+/// power-of-two number of blocks (its order), and is naturally aligned to
+/// its own size (i.e. with 4k blocks, an 8k allocation is 8k aligned, and a
+/// 2M allocation is 2M aligned), which is what is needed for the memory to
+/// later be mapped using large pages.
+///
+/// Free blocks are kept on one free list per order. An allocation takes the
+/// first block from the smallest non-empty list that fits, splitting it in
+/// half until it reaches the requested order, and a free merges the block
+/// with its buddy for as long as the buddy is also free, so both are
+/// O(log n).
+///
+/// Merging has to update the free lists, which needs the lock, so free()
+/// does not merge. Instead, it marks the block as pending and pushes it onto
+/// a lock free list, and the next function that takes the lock (i.e. the
+/// next alloc) merges all of the pending blocks first. As a result, free()
+/// and size() never take the lock.
+///
+/// Alignment is computed using the absolute address of each block, and not
+/// its offset into the pool, so the pool does not need to be aligned to its
+/// largest order. If it is not, the unaligned head and tail of the pool are
+/// simply handed out as smaller orders.
+///
+/// @param total_size total size in bytes of the memory pool
+/// @param block_shift block size in bit shifts (i.e. 4k == 12 bits)
+///
+template<size_t total_size, size_t block_shift>
+class mem_pool_buddy
+{
+    static_assert(total_size > 0, "total size must be larger than 0");
+    static_assert(total_size % (1 << block_shift) == 0, "total size must be a multiple of block size");
+    static_assert((MAX_PAGE_SHIFT >= block_shift) &&(block_shift > 0), "block shift must be larger than 0");
+    static_assert((total_size >> block_shift) < mem_pool_buddy_null, "too many blocks");
+
+public:
+
+    using size_type = size_t;
+    using shift_type = size_t;
+    using integer_pointer = uintptr_t;
+    using index_type = uint32_t;
+    using order_type = uint8_t;
+
+    /// Constructor
+    ///
+    /// Creates a memory pool with the starting virtual address of addr.
+    ///
+    /// @expects addr != 0
+    /// @expects addr is block aligned
+    /// @ensures none
+    ///
+    /// @param addr the starting address of the memory pool
+    mem_pool_buddy(integer_pointer addr) noexcept_testing :
+        m_addr(addr)
+    {
+        if (addr == 0 || (addr & (block_size - 1)) != 0) {
+            static_construction_error();
+        }
+
+        clear();
+    }
+
+    /// Default Destructor
+    ///
+    ~mem_pool_buddy() = default;
+
+    /// Allocate Memory
+    ///
+    /// Allocates memory from the memory pool whose size is greater than or
+    /// equal to size. The size of the allocation is rounded up to the next
+    /// power-of-two number of blocks, and the returned address is aligned
+    /// to this size.
+    ///
+    /// @expects size > 0
+    /// @expects size <= total_size
+    /// @ensures ret != nullptr
+    ///
+    /// @param size the number of bytes to allocate
+    /// @return the starting address of the allocated memory
+    ///
+    integer_pointer
+    alloc(size_type size)
+    {
+        // [[ensures ret: ret != 0]]
+        expects(size > 0);
+        expects(size <= total_size);
+
+        auto order = order_of(size);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        merge_pending();
+
+        for (auto i = order; i <= max_order; i++) {
+
+            auto index = gsl::at(m_heads, i);
+            if (index == mem_pool_buddy_null) {
+                continue;
+            }
+
+            remove(index, i);
+
+            while (i > order) {
+                i--;
+                insert(index + (1U << i), i);
+            }
+
+            gsl::at(m_state, index).store(static_cast<order_type>(mem_pool_buddy_used | order), std::memory_order_release);
+
+            m_counters.alloc(size, block_size << order);
+            return m_addr + (static_cast<integer_pointer>(index) << block_shift);
+        }
+
+        m_counters.failure(size);
+        throw std::bad_alloc();
+    }
+
+    /// Free Memory
+    ///
+    /// Free's previously allocated memory. Addresses that do not point to
+    /// the start of an allocation are ignored.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr the address to free
+    ///
+    void
+    free(integer_pointer addr) noexcept
+    {
+        if (!contains(addr)) {
+            return;
+        }
+
+        auto index = static_cast<index_type>((addr - m_addr) >> block_shift);
+        auto &&entry = gsl::at(m_state, index);
+        auto state = entry.load(std::memory_order_acquire);
+
+        // Only one free of the same allocation can succeed in marking it
+        // as pending, so freeing twice is still harmless.
+
+        do {
+            if ((state & mem_pool_buddy_used) == 0) {
+                return;
+            }
+        }
+        while (!entry.compare_exchange_weak(
+                   state, static_cast<order_type>(mem_pool_buddy_pending | (state & mem_pool_buddy_order_mask)),
+                   std::memory_order_acq_rel, std::memory_order_acquire));
+
+        m_counters.free(block_size << (state & mem_pool_buddy_order_mask));
+
+        // The block is not on any free list, so its link is free to use
+        // for the pending list until it is merged.
+
+        auto head = m_pending.load(std::memory_order_relaxed);
+
+        do {
+            gsl::at(m_next, index) = head;
+        }
+        while (!m_pending.compare_exchange_weak(head, index, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    /// Resize Memory
+    ///
+    /// Attempts to change the size of previously allocated memory without
+    /// moving it. Shrinking always succeeds, and returns the upper halves of
+    /// the allocation to the free lists. Growing succeeds if the allocation
+    /// is the lower half of each larger block it needs to grow into, and the
+    /// upper halves of these blocks are free.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr the address of the allocation to resize
+    /// @param size the new size of the allocation in bytes
+    /// @return true if the allocation was resized, false otherwise, in which
+    ///     case the allocation is left unchanged
+    ///
+    bool
+    resize(integer_pointer addr, size_type size) noexcept
+    {
+        if (!contains(addr) || size == 0 || size > total_size) {
+            return false;
+        }
+
+        auto index = static_cast<index_type>((addr - m_addr) >> block_shift);
+        auto order = order_of(size);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        merge_pending();
+
+        auto state = gsl::at(m_state, index).load(std::memory_order_acquire);
+        if ((state & mem_pool_buddy_used) == 0) {
+            return false;
+        }
+
+        auto old_order = static_cast<order_type>(state & mem_pool_buddy_order_mask);
+
+        if (order > old_order) {
+
+            if (order > max_order) {
+                return false;
+            }
+
+            for (auto i = old_order; i < order; i++) {
+                auto buddy = buddy_of(index, i);
+
+                if (buddy == mem_pool_buddy_null || buddy < index ||
+                    gsl::at(m_state, buddy).load(std::memory_order_relaxed) != (mem_pool_buddy_free | i)) {
+                    return false;
+                }
+            }
+
+            for (auto i = old_order; i < order; i++) {
+                remove(buddy_of(index, i), i);
+            }
+        }
+
+        for (auto i = order; i < old_order; i++) {
+            insert(index + (1U << i), i);
+        }
+
+        gsl::at(m_state, index).store(static_cast<order_type>(mem_pool_buddy_used | order), std::memory_order_release);
+        m_counters.resize(block_size << old_order, block_size << order);
+
+        return true;
+    }
+
+    /// Contains Address
+    ///
+    /// Returns true if this memory pool contains this address, returns
+    /// false otherwise.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr to lookup
+    ///
+    bool
+    contains(integer_pointer addr) const noexcept
+    { return (addr >= m_addr && addr < m_addr + total_size); }
+
+    /// Allocation Size
+    ///
+    /// Locates and returns the size of previously allocated memory from
+    /// this pool. Returns 0 given invalid inputs. Note that this is the
+    /// rounded up size of the allocation.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr to lookup
+    ///
+    size_type
+    size(integer_pointer addr) const noexcept
+    {
+        if (!contains(addr)) {
+            return 0;
+        }
+
+        auto state = gsl::at(m_state, (addr - m_addr) >> block_shift).load(std::memory_order_acquire);
+        if ((state & mem_pool_buddy_used) == 0) {
+            return 0;
+        }
+
+        return block_size << (state & mem_pool_buddy_order_mask);
+    }
+
+    /// Clear Memory Pool
+    ///
+    /// This is a very dangerous function, and will effectively run free() on
+    /// all memory previously allocated.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void
+    clear() noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto &entry : m_state) {
+            entry.store(0, std::memory_order_relaxed);
+        }
+
+        m_heads.fill(mem_pool_buddy_null);
+        m_pending.store(mem_pool_buddy_null, std::memory_order_relaxed);
+
+        // Seed the free lists with the largest naturally aligned blocks
+        // that fit, walking from the start of the pool to the end.
+
+        auto index = 0ULL;
+        while (index < num_blocks) {
+
+            auto order = max_order;
+            while (((base_index() + index) & ((1ULL << order) - 1)) != 0 ||
+                   index + (1ULL << order) > num_blocks) {
+                order--;
+            }
+
+            insert(static_cast<index_type>(index), static_cast<order_type>(order));
+            index += 1ULL << order;
+        }
+
+        m_counters.clear();
+    }
+
+    /// Statistics
+    ///
+    /// Returns a snapshot of this pool's usage counters. The largest free
+    /// extent is the largest order with a free block, which is the largest
+    /// allocation that can currently succeed. Pending frees are merged
+    /// first.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return usage statistics for this pool
+    ///
+    mem_pool_stats
+    stats() const noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        merge_pending();
+
+        size_type largest = 0;
+
+        for (auto order = 0ULL; order <= max_order; order++) {
+            if (gsl::at(m_heads, order) != mem_pool_buddy_null) {
+                largest = block_size << order;
+            }
+        }
+
+        return m_counters.stats(total_size, largest);
+    }
+
+private:
+
+    static constexpr const auto block_size = 1ULL << block_shift;
+    static constexpr const auto num_blocks = total_size >> block_shift;
+
+    static constexpr size_type
+    log2(size_type val) noexcept
+    { return val <= 1 ? 0 : 1 + log2(val >> 1); }
+
+    static constexpr const auto max_order = log2(num_blocks);
+
+    integer_pointer
+    base_index() const noexcept
+    { return m_addr >> block_shift; }
+
+    order_type
+    order_of(size_type size) const noexcept
+    {
+        auto total = (size + block_size - 1) >> block_shift;
+        auto order = 0ULL;
+
+        while ((1ULL << order) < total) {
+            order++;
+        }
+
+        return static_cast<order_type>(order);
+    }
+
+    index_type
+    buddy_of(index_type index, order_type order) const noexcept
+    {
+        auto abs = (base_index() + index) ^ (1ULL << order);
+
+        if (abs < base_index()) {
+            return mem_pool_buddy_null;
+        }
+
+        auto buddy = abs - base_index();
+        if (buddy + (1ULL << order) > num_blocks) {
+            return mem_pool_buddy_null;
+        }
+
+        return static_cast<index_type>(buddy);
+    }
+
+    void
+    merge_pending() const noexcept
+    {
+        auto index = m_pending.exchange(mem_pool_buddy_null, std::memory_order_acquire);
+
+        while (index != mem_pool_buddy_null) {
+            auto next = gsl::at(m_next, index);
+            auto state = gsl::at(m_state, index).load(std::memory_order_relaxed);
+
+            merge(index, static_cast<order_type>(state & mem_pool_buddy_order_mask));
+            index = next;
+        }
+    }
+
+    void
+    merge(index_type index, order_type order) const noexcept
+    {
+        while (order < max_order) {
+
+            auto buddy = buddy_of(index, order);
+            if (buddy == mem_pool_buddy_null) {
+                break;
+            }
+
+            if (gsl::at(m_state, buddy).load(std::memory_order_relaxed) != (mem_pool_buddy_free | order)) {
+                break;
+            }
+
+            remove(buddy, order);
+
+            index = buddy < index ? buddy : index;
+            order++;
+        }
+
+        insert(index, order);
+    }
+
+    void
+    insert(index_type index, order_type order) const noexcept
+    {
+        auto head = gsl::at(m_heads, order);
+
+        gsl::at(m_prev, index) = mem_pool_buddy_null;
+        gsl::at(m_next, index) = head;
+
+        if (head != mem_pool_buddy_null) {
+            gsl::at(m_prev, head) = index;
+        }
+
+        gsl::at(m_heads, order) = index;
+        gsl::at(m_state, index).store(static_cast<order_type>(mem_pool_buddy_free | order), std::memory_order_relaxed);
+    }
+
+    void
+    remove(index_type index, order_type order) const noexcept
+    {
+        auto prev = gsl::at(m_prev, index);
+        auto next = gsl::at(m_next, index);
+
+        if (prev != mem_pool_buddy_null) {
+            gsl::at(m_next, prev) = next;
+        }
+        else {
+            gsl::at(m_heads, order) = next;
+        }
+
+        if (next != mem_pool_buddy_null) {
+            gsl::at(m_prev, next) = prev;
+        }
+
+        gsl::at(m_state, index).store(0, std::memory_order_relaxed);
+    }
+
+private:
+
+    integer_pointer m_addr{0};
+
+    mutable std::mutex m_mutex;
+
+    // Merging pending frees changes how the free blocks are indexed, but
+    // not which blocks are free, so stats() is allowed to do it.
+
+    mutable std::atomic<index_type> m_pending{mem_pool_buddy_null};
+
+    mutable std::array<index_type, max_order + 1> m_heads;
+    mutable std::array<std::atomic<order_type>, num_blocks> m_state;
+    mutable std::array<index_type, num_blocks> m_next;
+    mutable std::array<index_type, num_blocks> m_prev;
+
+    mem_pool_counters m_counters;
+
+public:
+
+    mem_pool_buddy(mem_pool_buddy &&) noexcept = delete;
+    mem_pool_buddy &operator=(mem_pool_buddy &&) noexcept = delete;
+
+    mem_pool_buddy(const mem_pool_buddy &) = delete;
+    mem_pool_buddy &operator=(const mem_pool_buddy &) = delete;
+};
+
+///
+/// *INDENT-ON*
+///
+
+#endif
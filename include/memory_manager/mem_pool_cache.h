@@ -0,0 +1,430 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef MEM_POOL_CACHE_H
+#define MEM_POOL_CACHE_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include <bfgsl.h>
+#include <bfconstants.h>
+
+#include <intrinsics/x86/common/x64.h>
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+#ifndef MEM_POOL_CACHE_MAX_CPUS
+#define MEM_POOL_CACHE_MAX_CPUS 64
+#endif
+
+constexpr const auto mem_pool_cache_min_size = 16ULL;
+constexpr const auto mem_pool_cache_max_size = 2048ULL;
+constexpr const auto mem_pool_cache_magazine_size = 32ULL;
+constexpr const auto mem_pool_cache_batch_size = 16ULL;
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+///
+/// *INDENT-OFF*
+///
+
+/// Memory Pool Cache
+///
+/// Sits in front of a memory pool and serves small allocations from per-CPU
+/// magazines, one per power-of-two size class between
+/// mem_pool_cache_min_size and mem_pool_cache_max_size. Classes smaller than
+/// the pool's block size are rounded up to the block size, as that is the
+/// smallest amount of memory the pool can hand out.
+///
+/// A CPU only ever touches its own magazines, so the alloc / free fast paths
+/// do not need a lock or an atomic operation. Magazines are refilled from,
+/// and drained to the memory pool in batches using the pool's alloc_n and
+/// free_n, so a refill takes the pool's lock once per batch instead of once
+/// per object (the pool's free does not take the lock at all).
+///
+/// Each object remembers which CPU's magazine it belongs to. When an object
+/// is freed on a different CPU, it is pushed onto the owning CPU's lock-free
+/// remote free list instead, and the owner collects these objects the next
+/// time one of its magazines runs dry, or when it is flushed. Entries are
+/// only ever removed by taking the entire list, so the list does not suffer
+/// from ABA. This also lets any CPU return every remote list to the memory
+/// pool (see reclaim), which alloc does before giving up, so memory freed to
+/// a CPU that has gone idle is not lost.
+///
+/// Note that this class expects the caller to provide the current CPU's id,
+/// and it expects that a CPU cannot be preempted in the middle of an alloc or
+/// free (which is true in the VMM as exit handlers do not get interrupted).
+///
+/// @param pool_type the memory pool to cache allocations from, which must
+///     provide alloc_n and free_n (i.e. mem_pool or mem_pool_bitmap)
+/// @param total_size total size in bytes of the memory pool
+/// @param block_shift block size of the memory pool in bit shifts
+/// @param max_cpus the number of CPUs with a cache. Allocations from a
+///     CPU whose id is larger are not cached.
+///
+template<class pool_type, size_t total_size, size_t block_shift, size_t max_cpus = MEM_POOL_CACHE_MAX_CPUS>
+class mem_pool_cache
+{
+    static_assert(max_cpus > 0, "max cpus must be larger than 0");
+    static_assert(max_cpus < 0xFFF, "max cpus must be smaller than 0xFFF");
+
+public:
+
+    using size_type = size_t;
+    using integer_pointer = uintptr_t;
+    using cpuid_type = uint64_t;
+    using tag_type = uint16_t;
+
+    /// Constructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param pool the memory pool to cache allocations from
+    /// @param addr the starting address of the memory pool
+    ///
+    mem_pool_cache(pool_type &pool, integer_pointer addr) noexcept :
+        m_pool(pool),
+        m_addr(addr)
+    {
+        m_tags.fill(0);
+    }
+
+    /// Default Destructor
+    ///
+    ~mem_pool_cache() = default;
+
+    /// Cacheable
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param size the number of bytes to allocate
+    /// @return true if allocations of size are served by this cache
+    ///
+    static constexpr bool
+    cacheable(size_type size) noexcept
+    { return size > 0 && size <= mem_pool_cache_max_size; }
+
+    /// Allocate Memory
+    ///
+    /// Allocates memory from the provided CPU's magazine for the size class
+    /// that fits size, refilling the magazine if needed.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param size the number of bytes to allocate
+    /// @param cpuid the id of the CPU that is allocating
+    /// @return the allocated address, or 0 if the allocation cannot be
+    ///     served by the cache, in which case the caller should fall back to
+    ///     the memory pool
+    ///
+    integer_pointer
+    alloc(size_type size, cpuid_type cpuid) noexcept
+    {
+        if (!cacheable(size) || cpuid >= max_cpus) {
+            return 0;
+        }
+
+        auto cls = size_class(size);
+        auto &cache = gsl::at(m_caches, cpuid);
+        auto &mag = gsl::at(cache.mags, cls);
+
+        if (mag.count == 0) {
+            collect(cache);
+        }
+
+        if (mag.count == 0) {
+            refill(mag, cpuid, cls);
+        }
+
+        if (mag.count == 0) {
+            reclaim();
+            refill(mag, cpuid, cls);
+        }
+
+        if (mag.count == 0) {
+            return 0;
+        }
+
+        return gsl::at(mag.objs, --mag.count);
+    }
+
+    /// Free Memory
+    ///
+    /// Returns memory previously allocated using alloc to its owner's
+    /// magazine.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr the address to free
+    /// @param cpuid the id of the CPU that is freeing
+    /// @return true if addr was allocated by this cache and has been freed,
+    ///     false if addr should be freed by the memory pool instead
+    ///
+    bool
+    free(integer_pointer addr, cpuid_type cpuid) noexcept
+    {
+        if (!m_pool.contains(addr)) {
+            return false;
+        }
+
+        auto tag = gsl::at(m_tags, block_index(addr));
+
+        if (tag == 0) {
+            return false;
+        }
+
+        auto owner = tag_owner(tag);
+
+        if (owner != cpuid) {
+            push_remote(gsl::at(m_caches, owner), addr);
+            return true;
+        }
+
+        auto &mag = gsl::at(gsl::at(m_caches, owner).mags, tag_class(tag));
+
+        if (mag.count == mem_pool_cache_magazine_size) {
+            drain(mag, mem_pool_cache_magazine_size / 2);
+        }
+
+        gsl::at(mag.objs, mag.count++) = addr;
+        return true;
+    }
+
+    /// Owns
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr the address to lookup
+    /// @return true if addr was allocated by this cache, false otherwise
+    ///
+    bool
+    owns(integer_pointer addr) const noexcept
+    { return m_pool.contains(addr) && gsl::at(m_tags, block_index(addr)) != 0; }
+
+    /// Flush
+    ///
+    /// Returns all of the memory cached by the provided CPU to the memory
+    /// pool. This should only be called by the CPU that owns the cache.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param cpuid the id of the CPU to flush
+    ///
+    void
+    flush(cpuid_type cpuid) noexcept
+    {
+        if (cpuid >= max_cpus) {
+            return;
+        }
+
+        auto &cache = gsl::at(m_caches, cpuid);
+        collect(cache);
+
+        for (auto &mag : cache.mags) {
+            drain(mag, mag.count);
+        }
+    }
+
+    /// Reclaim
+    ///
+    /// Returns the memory that was freed remotely to any CPU, and that its
+    /// owner has not collected yet, to the memory pool. Unlike flush, this
+    /// can be called by any CPU.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void
+    reclaim() noexcept
+    {
+        for (auto &cache : m_caches) {
+            if (cache.remote.load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+
+            auto addr = cache.remote.exchange(0, std::memory_order_acquire);
+
+            while (addr != 0) {
+                auto next = *reinterpret_cast<integer_pointer *>(addr);
+
+                gsl::at(m_tags, block_index(addr)) = 0;
+                m_pool.free(addr);
+
+                addr = next;
+            }
+        }
+    }
+
+    /// Class Size
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param size the number of bytes to allocate
+    /// @return the number of bytes actually allocated for size by this
+    ///     cache, or 0 if size is not cacheable
+    ///
+    static constexpr size_type
+    class_size(size_type size) noexcept
+    { return cacheable(size) ? size_of_class(size_class(size)) : 0; }
+
+private:
+
+    struct magazine_type
+    {
+        size_type count{0};
+        std::array<integer_pointer, mem_pool_cache_magazine_size> objs;
+    };
+
+    static constexpr const auto block_size = 1ULL << block_shift;
+    static constexpr const auto min_size = block_size > mem_pool_cache_min_size ? block_size : mem_pool_cache_min_size;
+    static constexpr const auto num_blocks = total_size >> block_shift;
+
+    static constexpr size_type
+    size_of_class(size_type cls) noexcept
+    { return min_size << cls; }
+
+    static constexpr size_type
+    size_class(size_type size, size_type cls = 0) noexcept
+    { return size <= size_of_class(cls) ? cls : size_class(size, cls + 1); }
+
+    static constexpr const auto num_classes = size_class(mem_pool_cache_max_size) + 1;
+
+    struct cache_type
+    {
+        alignas(x64::cache_line_size) std::array<magazine_type, num_classes> mags;
+        alignas(x64::cache_line_size) std::atomic<integer_pointer> remote{0};
+    };
+
+    static constexpr tag_type
+    make_tag(cpuid_type cpuid, size_type cls) noexcept
+    { return static_cast<tag_type>(((cpuid + 1) << 4) | cls); }
+
+    static constexpr cpuid_type
+    tag_owner(tag_type tag) noexcept
+    { return static_cast<cpuid_type>(tag >> 4) - 1; }
+
+    static constexpr size_type
+    tag_class(tag_type tag) noexcept
+    { return static_cast<size_type>(tag & 0xF); }
+
+    integer_pointer
+    block_index(integer_pointer addr) const noexcept
+    { return (addr - m_addr) >> block_shift; }
+
+    void
+    refill(magazine_type &mag, cpuid_type cpuid, size_type cls) noexcept
+    {
+        if (mag.count >= mem_pool_cache_batch_size) {
+            return;
+        }
+
+        auto first = mag.count;
+        mag.count += m_pool.alloc_n(size_of_class(cls), &gsl::at(mag.objs, first), mem_pool_cache_batch_size - first);
+
+        for (auto i = first; i < mag.count; i++) {
+            gsl::at(m_tags, block_index(gsl::at(mag.objs, i))) = make_tag(cpuid, cls);
+        }
+    }
+
+    void
+    drain(magazine_type &mag, size_type num) noexcept
+    {
+        num = num < mag.count ? num : mag.count;
+
+        if (num == 0) {
+            return;
+        }
+
+        mag.count -= num;
+
+        for (auto i = mag.count; i < mag.count + num; i++) {
+            gsl::at(m_tags, block_index(gsl::at(mag.objs, i))) = 0;
+        }
+
+        m_pool.free_n(&gsl::at(mag.objs, mag.count), num);
+    }
+
+    void
+    push_remote(cache_type &cache, integer_pointer addr) noexcept
+    {
+        auto head = cache.remote.load(std::memory_order_relaxed);
+
+        do {
+            *reinterpret_cast<integer_pointer *>(addr) = head;
+        }
+        while (!cache.remote.compare_exchange_weak(head, addr, std::memory_order_release,
+                                                    std::memory_order_relaxed));
+    }
+
+    void
+    collect(cache_type &cache) noexcept
+    {
+        auto addr = cache.remote.exchange(0, std::memory_order_acquire);
+
+        while (addr != 0) {
+            auto next = *reinterpret_cast<integer_pointer *>(addr);
+            auto cls = tag_class(gsl::at(m_tags, block_index(addr)));
+            auto &mag = gsl::at(cache.mags, cls);
+
+            if (mag.count == mem_pool_cache_magazine_size) {
+                drain(mag, mem_pool_cache_magazine_size / 2);
+            }
+
+            gsl::at(mag.objs, mag.count++) = addr;
+            addr = next;
+        }
+    }
+
+private:
+
+    pool_type &m_pool;
+    integer_pointer m_addr;
+
+    std::array<cache_type, max_cpus> m_caches;
+    std::array<tag_type, num_blocks> m_tags;
+
+public:
+
+    mem_pool_cache(mem_pool_cache &&) noexcept = delete;
+    mem_pool_cache &operator=(mem_pool_cache &&) noexcept = delete;
+
+    mem_pool_cache(const mem_pool_cache &) = delete;
+    mem_pool_cache &operator=(const mem_pool_cache &) = delete;
+};
+
+///
+/// *INDENT-ON*
+///
+
+#endif
@@ -0,0 +1,315 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef MEM_POOL_STATS_H
+#define MEM_POOL_STATS_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include <bfgsl.h>
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+constexpr const auto mem_pool_histogram_buckets = 32ULL;
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+///
+/// *INDENT-OFF*
+///
+
+/// Memory Pool Histogram
+///
+/// Counts requests by size. Bucket i counts the requests whose size is
+/// larger than 1 << (i - 1) and smaller than or equal to 1 << i, with the
+/// last bucket also counting everything larger.
+///
+class mem_pool_histogram
+{
+public:
+
+    using size_type = size_t;
+    using count_type = uint64_t;
+    using histogram_type = std::array<count_type, mem_pool_histogram_buckets>;
+
+    /// Default Constructor
+    ///
+    mem_pool_histogram() noexcept
+    { clear(); }
+
+    /// Add
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param size the size of the request to count
+    ///
+    void
+    add(size_type size) noexcept
+    {
+        auto bucket = 0ULL;
+
+        while (bucket < mem_pool_histogram_buckets - 1 && (1ULL << bucket) < size) {
+            bucket++;
+        }
+
+        gsl::at(m_buckets, bucket).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// Get
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return a snapshot of the histogram
+    ///
+    histogram_type
+    get() const noexcept
+    {
+        histogram_type buckets{};
+
+        for (auto i = 0ULL; i < mem_pool_histogram_buckets; i++) {
+            gsl::at(buckets, i) = gsl::at(m_buckets, i).load(std::memory_order_relaxed);
+        }
+
+        return buckets;
+    }
+
+    /// Clear
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void
+    clear() noexcept
+    {
+        for (auto &bucket : m_buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+
+    std::array<std::atomic<count_type>, mem_pool_histogram_buckets> m_buckets;
+};
+
+/// Memory Pool Statistics
+///
+/// A snapshot of a memory pool's counters. All sizes are in bytes. Note
+/// that the counters are updated without a lock, so a snapshot taken while
+/// other CPUs are allocating might not be perfectly consistent.
+///
+struct mem_pool_stats
+{
+    using size_type = size_t;
+    using count_type = uint64_t;
+
+    size_type total_size{0};            ///< Size of the pool
+    size_type used{0};                  ///< Bytes currently allocated
+    size_type peak{0};                  ///< Largest value used has reached
+    size_type largest_free{0};          ///< Largest allocation that can succeed
+
+    count_type allocs{0};               ///< Number of successful allocations
+    count_type frees{0};                ///< Number of frees
+    count_type failures{0};             ///< Number of allocations that failed
+
+    mem_pool_histogram::histogram_type histogram{};
+
+    /// Fragmentation Index
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the percentage of free memory that cannot be handed out in
+    ///     a single allocation. 0 means all of the free memory is
+    ///     contiguous, and it approaches 100 as free memory is scattered
+    ///     into smaller pieces.
+    ///
+    count_type
+    fragmentation() const noexcept
+    {
+        auto free = total_size - used;
+
+        if (free == 0 || largest_free >= free) {
+            return 0;
+        }
+
+        return 100 - ((largest_free * 100) / free);
+    }
+};
+
+/// Memory Pool Counters
+///
+/// The counters that back mem_pool_stats. Each memory pool owns one of
+/// these, and updates it as memory is allocated and freed.
+///
+class mem_pool_counters
+{
+public:
+
+    using size_type = mem_pool_stats::size_type;
+    using count_type = mem_pool_stats::count_type;
+
+    /// Default Constructor
+    ///
+    mem_pool_counters() noexcept
+    { clear(); }
+
+    /// Allocation
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param request the number of bytes that were requested
+    /// @param actual the number of bytes that were allocated
+    ///
+    void
+    alloc(size_type request, size_type actual) noexcept
+    {
+        grow(actual);
+
+        m_allocs.fetch_add(1, std::memory_order_relaxed);
+        m_histogram.add(request);
+    }
+
+    /// Resize
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param old_actual the number of bytes that were allocated
+    /// @param new_actual the number of bytes that are now allocated
+    ///
+    void
+    resize(size_type old_actual, size_type new_actual) noexcept
+    {
+        if (new_actual > old_actual) {
+            grow(new_actual - old_actual);
+        }
+        else {
+            m_used.fetch_sub(old_actual - new_actual, std::memory_order_relaxed);
+        }
+    }
+
+    /// Failed Allocation
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param request the number of bytes that were requested
+    ///
+    void
+    failure(size_type request) noexcept
+    {
+        m_failures.fetch_add(1, std::memory_order_relaxed);
+        m_histogram.add(request);
+    }
+
+    /// Free
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param actual the number of bytes that were freed
+    ///
+    void
+    free(size_type actual) noexcept
+    {
+        m_used.fetch_sub(actual, std::memory_order_relaxed);
+        m_frees.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// Clear
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void
+    clear() noexcept
+    {
+        m_used.store(0, std::memory_order_relaxed);
+        m_peak.store(0, std::memory_order_relaxed);
+        m_allocs.store(0, std::memory_order_relaxed);
+        m_frees.store(0, std::memory_order_relaxed);
+        m_failures.store(0, std::memory_order_relaxed);
+        m_histogram.clear();
+    }
+
+    /// Statistics
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param total_size the size of the memory pool
+    /// @param largest_free the largest allocation that can succeed
+    /// @return a snapshot of the counters
+    ///
+    mem_pool_stats
+    stats(size_type total_size, size_type largest_free) const noexcept
+    {
+        mem_pool_stats stats;
+
+        stats.total_size = total_size;
+        stats.used = m_used.load(std::memory_order_relaxed);
+        stats.peak = m_peak.load(std::memory_order_relaxed);
+        stats.largest_free = largest_free;
+        stats.allocs = m_allocs.load(std::memory_order_relaxed);
+        stats.frees = m_frees.load(std::memory_order_relaxed);
+        stats.failures = m_failures.load(std::memory_order_relaxed);
+        stats.histogram = m_histogram.get();
+
+        return stats;
+    }
+
+private:
+
+    void
+    grow(size_type actual) noexcept
+    {
+        auto used = m_used.fetch_add(actual, std::memory_order_relaxed) + actual;
+        auto peak = m_peak.load(std::memory_order_relaxed);
+
+        while (used > peak && !m_peak.compare_exchange_weak(peak, used, std::memory_order_relaxed))
+        { }
+    }
+
+private:
+
+    std::atomic<size_type> m_used;
+    std::atomic<size_type> m_peak;
+    std::atomic<count_type> m_allocs;
+    std::atomic<count_type> m_frees;
+    std::atomic<count_type> m_failures;
+
+    mem_pool_histogram m_histogram;
+};
+
+///
+/// *INDENT-ON*
+///
+
+#endif
@@ -0,0 +1,111 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef MEM_TRACE_H
+#define MEM_TRACE_H
+
+#include <cstdint>
+
+#include <bfgsl.h>
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+// The number of events kept by each CPU's trace ring. Must be a power of 2.
+
+#ifndef MEM_TRACE_SIZE
+#define MEM_TRACE_SIZE 0x400
+#endif
+
+// The number of CPUs with a trace ring. Events from a CPU whose id is larger
+// are dropped.
+
+#ifndef MEM_TRACE_MAX_CPUS
+#define MEM_TRACE_MAX_CPUS 64
+#endif
+
+#define GET_MEM_TRACE_SUCCESS 0
+#define GET_MEM_TRACE_FAILURE -1
+
+constexpr const uint32_t mem_trace_op_alloc = 1;
+constexpr const uint32_t mem_trace_op_free = 2;
+constexpr const uint32_t mem_trace_op_alloc_map = 3;
+constexpr const uint32_t mem_trace_op_free_map = 4;
+
+constexpr const uint32_t mem_trace_pool_heap = 1;
+constexpr const uint32_t mem_trace_pool_cache = 2;
+constexpr const uint32_t mem_trace_pool_page = 3;
+constexpr const uint32_t mem_trace_pool_segment = 4;
+constexpr const uint32_t mem_trace_pool_map = 5;
+
+static_assert((MEM_TRACE_SIZE & (MEM_TRACE_SIZE - 1)) == 0, "trace size must be a power of 2");
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+/// Memory Trace Event
+///
+/// Describes a single alloc / free made through the memory manager. For
+/// frees, size is the size of the allocation that was released.
+///
+struct mem_trace_event
+{
+    uint64_t tsc;           ///< Time stamp counter when the event occurred
+    uint64_t cpuid;         ///< CPU that made the request
+    uint64_t addr;          ///< Address that was allocated / freed
+    uint64_t size;          ///< Size in bytes of the allocation
+    uint64_t caller;        ///< Return address of the malloc / new call, or of the memory manager call
+    uint32_t op;            ///< One of the mem_trace_op values
+    uint32_t pool;          ///< One of the mem_trace_pool values
+};
+
+/// Memory Trace Ring
+///
+/// Each CPU records its events in its own ring, so recording an event does
+/// not need a lock. epos is the total number of events that have been
+/// recorded, so the ring holds the last MEM_TRACE_SIZE of them, starting at
+/// epos - MEM_TRACE_SIZE (or 0). Like the debug ring, a reader that reads
+/// the ring while the CPU is recording could see a partially written event.
+///
+struct mem_trace_ring
+{
+    uint64_t epos;
+    mem_trace_event events[MEM_TRACE_SIZE];
+};
+
+/// Record Memory Trace Event
+///
+/// @expects none
+/// @ensures none
+///
+/// @param ring the ring to record the event in
+/// @param event the event to record
+///
+inline void
+mem_trace_record(mem_trace_ring &ring, const mem_trace_event &event) noexcept
+{
+    gsl::at(ring.events, ring.epos & (MEM_TRACE_SIZE - 1)) = event;
+    ring.epos++;
+}
+
+#endif
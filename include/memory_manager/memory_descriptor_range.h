@@ -0,0 +1,126 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef MEMORY_DESCRIPTOR_RANGE_H
+#define MEMORY_DESCRIPTOR_RANGE_H
+
+#include <vector>
+#include <cstdint>
+
+#include <bfgsl.h>
+#include <bfmemory.h>
+
+#include <intrinsics/x86/common/x64.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+/// Memory Descriptor Range
+///
+/// Describes a range of pages that are contiguous in both virtual and
+/// physical memory, and that share the same attributes. A VMM image is
+/// mostly physically contiguous, so describing it using ranges instead of a
+/// memory_descriptor per page takes far less memory, and allows consumers to
+/// map the range using large pages when its alignment allows.
+///
+struct memory_descriptor_range
+{
+    uint64_t phys;          ///< Physical address of the first page
+    uint64_t virt;          ///< Virtual address of the first page
+    uint64_t pages;         ///< Number of 4k pages in the range
+    uint64_t type;          ///< Attributes of every page in the range
+};
+
+using memory_descriptor_range_list = std::vector<memory_descriptor_range>;
+
+/// Add Page To Range List
+///
+/// Adds a page to the end of a range list. If the page directly follows the
+/// last range in the list (in both virtual and physical memory) and has the
+/// same attributes, the last range is extended, otherwise a new range is
+/// added.
+///
+/// @expects none
+/// @ensures none
+///
+/// @param list the range list to add the page to
+/// @param phys physical address of the page
+/// @param virt virtual address of the page
+/// @param type attributes of the page
+///
+inline void
+add_page_to_range_list(memory_descriptor_range_list &list, uint64_t phys, uint64_t virt, uint64_t type)
+{
+    if (!list.empty()) {
+        auto &last = list.back();
+        auto size = last.pages << x64::page_shift;
+
+        if (last.type == type && last.virt + size == virt && last.phys + size == phys) {
+            last.pages++;
+            return;
+        }
+    }
+
+    list.push_back({phys, virt, 1, type});
+}
+
+/// Add Page To Range Buffer
+///
+/// Same as add_page_to_range_list, except the ranges are stored in a fixed
+/// size buffer, of which the first num ranges are in use. A range whose
+/// type is 0 describes pages that are not present, so only the virtual
+/// addresses of its pages have to be contiguous.
+///
+/// @expects none
+/// @ensures none
+///
+/// @param buffer the buffer to add the page to
+/// @param num the number of ranges in use, updated if a range is added
+/// @param phys physical address of the page
+/// @param virt virtual address of the page
+/// @param type attributes of the page
+/// @return true if the page was added, false if a new range was needed and
+///     the buffer is full
+///
+inline bool
+add_page_to_range_buffer(gsl::span<memory_descriptor_range> buffer, std::ptrdiff_t &num,
+                         uint64_t phys, uint64_t virt, uint64_t type)
+{
+    if (num != 0) {
+        auto &last = buffer.at(num - 1);
+        auto size = last.pages << x64::page_shift;
+
+        if (last.type == type && last.virt + size == virt && (type == 0 || last.phys + size == phys)) {
+            last.pages++;
+            return true;
+        }
+    }
+
+    if (num == buffer.size()) {
+        return false;
+    }
+
+    buffer.at(num++) = {phys, virt, 1, type};
+    return true;
+}
+
+#endif
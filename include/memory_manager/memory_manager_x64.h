@@ -22,7 +22,8 @@
 #ifndef MEMORY_MANAGER_X64_H
 #define MEMORY_MANAGER_X64_H
 
-#include <map>
+#include <array>
+#include <atomic>
 #include <vector>
 
 #include <bfmemory.h>
@@ -30,6 +31,15 @@
 
 #include <intrinsics/x86/common_x64.h>
 #include <memory_manager/mem_pool.h>
+#include <memory_manager/mem_pool_bitmap.h>
+#include <memory_manager/mem_pool_buddy.h>
+#include <memory_manager/mem_pool_cache.h>
+#include <memory_manager/mem_pool_stats.h>
+#include <memory_manager/mem_trace.h>
+#include <memory_manager/hash_index.h>
+#include <memory_manager/page_table_arena.h>
+#include <memory_manager/radix_tree.h>
+#include <memory_manager/memory_descriptor_range.h>
 
 // -----------------------------------------------------------------------------
 // Exports
@@ -47,6 +57,120 @@
 #define EXPORT_MEMORY_MANAGER
 #endif
 
+// -----------------------------------------------------------------------------
+// Pool Selection
+// -----------------------------------------------------------------------------
+
+// The heap defaults to the bitmap pool, as it services a large number of
+// small allocations and the next fit pool has to walk its allocation table
+// one block at a time. Defining MEM_POOL_NEXT_FIT_HEAP selects the original
+// next fit pool instead.
+
+#ifdef MEM_POOL_NEXT_FIT_HEAP
+template<size_t total_size, size_t block_shift>
+using heap_pool_type = mem_pool<total_size, block_shift>;
+#else
+template<size_t total_size, size_t block_shift>
+using heap_pool_type = mem_pool_bitmap<total_size, block_shift>;
+#endif
+
+// The page pool defaults to the buddy pool, which returns allocations that
+// are naturally aligned to their size so that they can be mapped using large
+// pages, and coalesces memory as it is freed. Defining
+// MEM_POOL_NEXT_FIT_PAGE selects the original next fit pool instead.
+
+#ifdef MEM_POOL_NEXT_FIT_PAGE
+template<size_t total_size, size_t block_shift>
+using page_pool_type = mem_pool<total_size, block_shift>;
+#else
+template<size_t total_size, size_t block_shift>
+using page_pool_type = mem_pool_buddy<total_size, block_shift>;
+#endif
+
+// Small heap allocations are served from per-CPU caches that sit in front
+// of the heap pool.
+
+template<size_t total_size, size_t block_shift>
+using heap_cache_type = mem_pool_cache<heap_pool_type<total_size, block_shift>, total_size, block_shift>;
+
+// -----------------------------------------------------------------------------
+// Zeroed Page Reserve
+// -----------------------------------------------------------------------------
+
+// The memory manager keeps a reserve of pages that have already been zeroed,
+// so that zeroed allocations (e.g. calloc and new page tables) do not have to
+// memset on the allocating path. MAX_ZEROED_PAGES is the most pages the
+// reserve can hold. The number of pages it is refilled to can be lowered at
+// runtime using set_zeroed_pages_target().
+
+#ifndef MAX_ZEROED_PAGES
+#define MAX_ZEROED_PAGES 64
+#endif
+
+// The most pages maintain() zeroes per call, once the reserve has fallen
+// below half of its target.
+
+#ifndef ZEROED_PAGES_REFILL_BATCH
+#define ZEROED_PAGES_REFILL_BATCH 8
+#endif
+
+// -----------------------------------------------------------------------------
+// Page Table Arena
+// -----------------------------------------------------------------------------
+
+// Page tables are allocated from a dedicated arena of MAX_PAGE_TABLE_POOL
+// bytes, so that they do not compete with (or fragment) the page pool. Once
+// the arena is full, page tables are allocated from the page pool instead.
+
+#ifndef MAX_PAGE_TABLE_POOL
+#define MAX_PAGE_TABLE_POOL (0x100000)
+#endif
+
+// -----------------------------------------------------------------------------
+// Pool Segments
+// -----------------------------------------------------------------------------
+
+// The heap and page pools are sized at compile time. To avoid having to size
+// them for the worst case, the driver can donate additional memory to the
+// VMM at runtime, which is added as one or more pool segments. Each segment
+// is a page pool of MAX_POOL_SEGMENT_SIZE bytes whose bookkeeping is stored
+// in the first pages of the donated memory, so each segment consumes
+// pool_segment_footprint bytes of the donation. Allocations that the heap and
+// page pools cannot satisfy are served by the segments, which are tried in
+// the order they were added. Donated memory is never returned.
+//
+// Segments are page pools, so a heap sized request that falls back to a
+// segment still consumes a whole page (i.e. a 64 byte allocation costs 4k).
+// Segments are meant to keep the VMM running once the heap is exhausted,
+// and the heap should still be sized for the expected workload.
+
+#ifndef MAX_POOL_SEGMENTS
+#define MAX_POOL_SEGMENTS 16
+#endif
+
+#ifndef MAX_POOL_SEGMENT_SIZE
+#define MAX_POOL_SEGMENT_SIZE (0x1000000)
+#endif
+
+using pool_segment_type = page_pool_type<MAX_POOL_SEGMENT_SIZE, x64::page_shift>;
+
+constexpr const auto pool_segment_header_size =
+    (sizeof(pool_segment_type) + x64::page_size - 1) & ~(x64::page_size - 1);
+constexpr const auto pool_segment_footprint =
+    pool_segment_header_size + MAX_POOL_SEGMENT_SIZE;
+
+// -----------------------------------------------------------------------------
+// Translation Index
+// -----------------------------------------------------------------------------
+
+// Memory descriptors are indexed by page number. Virtual addresses are
+// canonical, so only bits 12-47 are needed to tell two of them apart (bit
+// 47 is sign extended when the address is rebuilt). Physical addresses are
+// limited to the architectural limit of 52 bits.
+
+constexpr const auto memory_manager_virt_key_bits = 36ULL;
+constexpr const auto memory_manager_phys_key_bits = 40ULL;
+
 // -----------------------------------------------------------------------------
 // Definitions
 // -----------------------------------------------------------------------------
@@ -59,14 +183,19 @@
 /// To support alloc / free, the memory manager is given both heap memory
 /// and a page pool. If a alloc is requested whose size is a multiple of
 /// MAX_PAGE_SIZE, the page pool is used. All other requests come from the
-/// heap.
+/// heap, with small requests being served by a per-CPU cache in front of the
+/// heap first.
 ///
 /// To support virt / phys mappings, the memory manager has an add_mdl
 /// function that is called by the driver entry. Each time the driver entry
 /// allocates memory for an ELF module, it must call add_mdl with a list of
 /// page mappings that tells the VMM how to convert from virt to phys and back.
 /// The memory manager uses this information to provide the VMM with the needed
-/// conversions.
+/// conversions. These are indexed by page number, so a conversion does not
+/// take a lock; only add_md / remove_md are serialized. The virt index is a
+/// radix tree, as the VMM's virtual addresses are packed together, while
+/// the phys index is a hash table, as the physical pages that back them
+/// are usually scattered (see hash_index.h).
 ///
 /// Mapping / unmapping of virtual to physical memory is handled by providing
 /// two capabilities. First, the memory manager provides a means to alloc and
@@ -76,6 +205,11 @@
 /// tables. This operation should not be done manually, but instead should
 /// be done using unique_map_ptr_x64.
 ///
+/// Allocations can be traced by defining MEMORY_MANAGER_TRACE, in which case
+/// each alloc / free is recorded in a per-CPU ring that the driver can get
+/// with the BF_REQUEST_GET_MEM_TRACE request, which calls get_mem_trace (see
+/// mem_trace.h). When it is not defined, the trace compiles away completely.
+///
 /// Finally, this module also provides the libc functions that are needed by
 /// libc++ for new / delete. For this reason, this module is required to get
 /// libc++ working, which is needed by, pretty much the rest of the VMM
@@ -97,7 +231,51 @@ public:
     using integer_pointer = uintptr_t;
     using size_type = std::size_t;
     using attr_type = decltype(memory_descriptor::type);
-    using memory_descriptor_list = std::vector<memory_descriptor>;
+    using memory_descriptor_list = memory_descriptor_range_list;
+
+    /// Memory Manager Statistics
+    ///
+    /// Usage statistics for each of the memory manager's pools, as well as
+    /// counters for the memory manager's own alloc / free APIs. Note that
+    /// memory held by the per-CPU heap caches is reported as used by the
+    /// heap pool. The pool segments are reported as a single total, as a
+    /// copy of each segment's statistics would make this too large to
+    /// return on the VMM's stack (see segment_stats()).
+    ///
+    struct stats_type
+    {
+        mem_pool_stats heap;                ///< Heap pool statistics
+        mem_pool_stats page;                ///< Page pool statistics
+        mem_pool_stats mem_map;             ///< Map pool statistics
+        mem_pool_stats page_table;          ///< Page table arena statistics
+        mem_pool_stats segments;            ///< Sum of the pool segments' statistics
+
+        uint64_t allocs{0};                 ///< Number of calls to alloc()
+        uint64_t frees{0};                  ///< Number of calls to free()
+        uint64_t failures{0};               ///< Number of allocs that returned nullptr
+        uint64_t cache_hits{0};             ///< Number of allocs served by a per-CPU cache
+        uint64_t zeroed_hits{0};            ///< Number of zeroed pages served by the reserve
+        uint64_t zeroed_misses{0};          ///< Number of zeroed pages that had to be memset
+        uint64_t zeroed_pages{0};           ///< Number of pages currently in the reserve
+        uint64_t num_segments{0};           ///< Number of pool segments that have been added
+        uint64_t phys_index_bytes{0};       ///< Number of bytes held by the phys index
+
+        mem_pool_histogram::histogram_type histogram{};
+    };
+
+    /// Descriptor Cursor
+    ///
+    /// Tracks where a call to descriptors(mdl, num, cursor) left off, so
+    /// that the descriptors can be read in chunks. A cursor starts at the
+    /// lowest virtual address. If since is not 0, only the descriptors that
+    /// changed after generation since are read (see descriptors()).
+    ///
+    struct descriptor_cursor_type
+    {
+        integer_pointer virt{0};            ///< Virtual address to continue from
+        uint64_t since{0};                  ///< Generation the reader is up to date with
+        bool done{false};                   ///< True once every descriptor has been read
+    };
 
     /// Default Destructor
     ///
@@ -132,6 +310,125 @@ public:
     ///
     virtual pointer alloc(size_type size) noexcept;
 
+    /// Allocate Zeroed Memory
+    ///
+    /// Same as alloc, except the memory is zeroed. Page sized requests are
+    /// served from the reserve of pre-zeroed pages when it is not empty,
+    /// otherwise the memory is zeroed after it is allocated.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param size the number of bytes to allocate
+    /// @return a pointer to the starting address of the zeroed memory
+    ///     allocated. Returns 0 otherwise, or on error
+    ///
+    virtual pointer alloc_zeroed(size_type size) noexcept;
+
+    /// Allocate Aligned Memory
+    ///
+    /// Same as alloc, except the resulting address is a multiple of
+    /// alignment. Requests that are not a multiple of MAX_PAGE_SIZE still
+    /// come from the heap, so a small allocation with a large alignment
+    /// does not consume an entire page. Memory allocated by this function
+    /// is released using free.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param size the number of bytes to allocate
+    /// @param alignment the required alignment in bytes. Must be a power of
+    ///     2 that is no larger than MAX_PAGE_SIZE
+    /// @return a pointer to the starting address of the memory allocated.
+    ///     Returns 0 otherwise, or on error (including an unsupported
+    ///     alignment)
+    ///
+    virtual pointer alloc_aligned(size_type size, size_type alignment) noexcept;
+
+    /// Refill Zeroed Pages
+    ///
+    /// Zeroes pages from the page pool until the reserve of pre-zeroed
+    /// pages reaches its target size (or releases pages if the reserve is
+    /// larger than its target). The exit handler calls this when the VMM
+    /// is idle (on VMCALL_STOP). While the VMM is running, maintain()
+    /// tops the reserve up instead, a few pages at a time.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    virtual void refill_zeroed_pages() noexcept;
+
+    /// Set Zeroed Pages Target
+    ///
+    /// Sets the number of pages that refill_zeroed_pages fills the reserve
+    /// to. Setting the target to 0 disables the reserve.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param num the number of pages to keep in the reserve. Values larger
+    ///     than MAX_ZEROED_PAGES are reduced to MAX_ZEROED_PAGES
+    ///
+    virtual void set_zeroed_pages_target(size_type num) noexcept;
+
+    /// Maintain
+    ///
+    /// Periodic housekeeping for the calling CPU. Returns the memory
+    /// cached by the calling CPU's heap cache (including memory other CPUs
+    /// freed to it) to the heap pool. If the zeroed page reserve has
+    /// fallen below half of its target, up to ZEROED_PAGES_REFILL_BATCH
+    /// pages are zeroed and added to it. This is called by the exit handler
+    /// every EXIT_HANDLER_MAINTENANCE_INTERVAL exits, so it must stay cheap.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    virtual void maintain() noexcept;
+
+    /// Allocate Page Table
+    ///
+    /// Allocates a zeroed page to be used as a page table. Page tables come
+    /// from the page table arena, and from the page pool once the arena is
+    /// full. The page must have a memory descriptor, as it is added to the
+    /// page table index (see physint_to_page_table).
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return a pointer to the zeroed page. Returns 0 on error
+    ///
+    virtual pointer alloc_page_table() noexcept;
+
+    /// Free Page Table
+    ///
+    /// Deallocates a page table previously allocated by a call to
+    /// alloc_page_table. If ptr == nullptr, the call is ignored.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param ptr a pointer to memory previously allocated using
+    ///     alloc_page_table.
+    ///
+    virtual void free_page_table(pointer ptr) noexcept;
+
+    /// Physical Address to Page Table
+    ///
+    /// Converts the physical address of a page table allocated using
+    /// alloc_page_table to its virtual address. Unlike physint_to_virtptr,
+    /// this only uses the page table index, which only alloc_page_table and
+    /// free_page_table change, so adding or removing memory descriptors
+    /// (which anyone can do for any physical page) cannot change where a
+    /// page table walk goes.
+    ///
+    /// @expects none
+    /// @ensures ret != nullptr
+    ///
+    /// @param phys the physical address of the page table
+    /// @return the virtual address of the page table
+    ///
+    virtual pointer physint_to_page_table(integer_pointer phys) const;
+
     /// Allocate Map
     ///
     /// Allocates virtual memory to be used for mapping. This memory has no
@@ -150,7 +447,7 @@ public:
     /// Free Memory
     ///
     /// Deallocates a block of memory previously allocated by a call to
-    /// alloc or alloc_map, making it available again for further allocations.
+    /// alloc, alloc_aligned or alloc_map, making it available again for further allocations.
     /// If ptr does not point to memory that was previously allocated, the call
     /// is ignored. If ptr == nullptr, the call is also ignored.
     ///
@@ -161,6 +458,25 @@ public:
     ///
     virtual void free(pointer ptr) noexcept;
 
+    /// Reallocate Memory
+    ///
+    /// Changes the size of memory previously allocated by a call to alloc.
+    /// When possible, the memory is resized in place (i.e. when shrinking, or
+    /// when the memory that directly follows the allocation is free).
+    /// Otherwise, new memory is allocated, the contents are copied, and the
+    /// old memory is freed. If ptr == nullptr, this is the same as alloc. If
+    /// size == 0, this is the same as free, and nullptr is returned.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param ptr a pointer to memory previously allocated using alloc.
+    /// @param size the new size of the allocation in bytes
+    /// @return a pointer to the resized memory, or nullptr on error, in which
+    ///     case the memory pointed to by ptr is left unchanged
+    ///
+    virtual pointer realloc(pointer ptr, size_type size) noexcept;
+
     /// Free Map
     ///
     /// Deallocates a block of memory previously allocated by a call to
@@ -338,6 +654,58 @@ public:
     ///
     virtual void add_md(integer_pointer virt, integer_pointer phys, attr_type attr);
 
+    /// Adds Memory Descriptor List
+    ///
+    /// Adds a list of memory descriptors to the memory manager. The entire
+    /// list is validated before any descriptor is added, and the list is
+    /// added while holding the lock once, so this should be used instead of
+    /// add_md when loading a large number of pages. If any descriptor
+    /// cannot be added, none of them are.
+    ///
+    /// @expects mdl != nullptr
+    /// @expects num != 0
+    /// @expects each descriptor satisfies add_md's expectations
+    /// @ensures none
+    ///
+    /// @param mdl the memory descriptor list to add
+    /// @param num the number of descriptors in mdl
+    ///
+    virtual void add_mdl(const memory_descriptor *mdl, size_type num);
+
+    /// Adds Memory Descriptor Range
+    ///
+    /// Adds a range of pages that are contiguous in both virtual and
+    /// physical memory, and that share the same attributes. This is the
+    /// same as calling add_md for each page in the range, except the lock
+    /// is only taken once. If any page cannot be added, none of them are.
+    ///
+    /// @expects pages != 0
+    /// @expects each page satisfies add_md's expectations
+    /// @ensures none
+    ///
+    /// @param virt virtual address of the first page
+    /// @param phys physical address of the first page
+    /// @param pages the number of pages in the range
+    /// @param attr how the memory was mapped
+    ///
+    virtual void add_md_range(integer_pointer virt, integer_pointer phys, size_type pages, attr_type attr);
+
+    /// Adds Memory Descriptor Range List
+    ///
+    /// Adds a list of memory descriptor ranges (see add_md_range) while
+    /// holding the lock once. The entire list is validated before any range
+    /// is added, and if any range cannot be added, none of them are.
+    ///
+    /// @expects mdl != nullptr
+    /// @expects num != 0
+    /// @expects each range satisfies add_md_range's expectations
+    /// @ensures none
+    ///
+    /// @param mdl the list of memory descriptor ranges to add
+    /// @param num the number of ranges in mdl
+    ///
+    virtual void add_mdl_range(const memory_descriptor_range *mdl, size_type num);
+
     /// Remove Memory Descriptor
     ///
     /// Removes a memory descriptor list to the memory manager.
@@ -349,12 +717,28 @@ public:
     ///
     virtual void remove_md(integer_pointer virt) noexcept;
 
+    /// Remove Memory Descriptor Range
+    ///
+    /// Removes a range of pages that are contiguous in virtual memory. This
+    /// is the same as calling remove_md for each page in the range, except
+    /// the lock is only taken once.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param virt virtual address of the first page to remove
+    /// @param pages the number of pages in the range
+    ///
+    virtual void remove_md_range(integer_pointer virt, size_type pages) noexcept;
+
     /// Descriptor List
     ///
     /// Returns a list of descriptors that have been added to the
     /// memory manager. Note that to limit the amount of memory that is
     /// needed for lookups, this function is expensive has it has to
-    /// reconstruct the descriptors currently being stored.
+    /// reconstruct the descriptors currently being stored. Pages that are
+    /// contiguous in both virtual and physical memory, and that share the
+    /// same attributes are returned as a single range.
     ///
     /// @expects none
     /// @ensures none
@@ -363,6 +747,104 @@ public:
     ///
     virtual memory_descriptor_list descriptors() const;
 
+    /// Descriptor List (Chunked)
+    ///
+    /// Reads the descriptors that have been added to the memory manager,
+    /// in virtual address order, into mdl, starting where cursor left off,
+    /// and advances cursor. Unlike descriptors(), nothing is allocated and
+    /// no lock is taken, so a large list can be read in fixed size chunks
+    /// by calling this function until cursor.done is set. A range is never
+    /// split across two chunks.
+    ///
+    /// If cursor.since is not 0, only the 2m regions of the virtual address
+    /// space that changed after generation cursor.since are read. Every
+    /// page in such a region is described, and pages that are no longer
+    /// present are returned with a type of 0, so a reader can bring its
+    /// copy up to date by applying the descriptors in order. To do so, a
+    /// reader reads generation() before it starts, and uses it as since
+    /// for its next read.
+    ///
+    /// @expects mdl != nullptr
+    /// @expects num != 0
+    /// @ensures none
+    ///
+    /// @param mdl the buffer to read the descriptors into
+    /// @param num the number of descriptors mdl can hold
+    /// @param cursor where to continue from, updated on return
+    /// @return the number of descriptors read into mdl
+    ///
+    virtual size_type descriptors(
+        memory_descriptor_range *mdl, size_type num, descriptor_cursor_type &cursor) const;
+
+    /// Descriptor Generation
+    ///
+    /// Every call to add_md / remove_md that changes the descriptors starts
+    /// a new generation.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the generation of the last change to the descriptors
+    ///
+    virtual uint64_t generation() const noexcept;
+
+    /// Add Pool Segments
+    ///
+    /// Adds memory donated by the driver as pool segments, carving as many
+    /// segments out of [virt, virt + size) as will fit (see
+    /// pool_segment_footprint). Any memory left over is not used. The donated
+    /// memory must already be mapped, and must remain mapped for the life of
+    /// the VMM.
+    ///
+    /// @expects virt is page aligned
+    /// @expects size >= pool_segment_footprint
+    /// @expects fewer than MAX_POOL_SEGMENTS segments have been added
+    /// @ensures none
+    ///
+    /// @param virt the virtual address of the donated memory
+    /// @param size the size in bytes of the donated memory
+    /// @return the number of segments that were added
+    ///
+    virtual size_type add_pool_segments(integer_pointer virt, size_type size);
+
+    /// Free Pool Segments
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of pool segments that can still be added
+    ///
+    virtual size_type free_pool_segments() const noexcept;
+
+    /// Statistics
+    ///
+    /// Returns a snapshot of the memory manager's usage statistics, which
+    /// can be used to size the memory pools based on real workloads. Note
+    /// that this function walks each pool's allocation table, so it should
+    /// not be called on a hot path.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return memory manager statistics
+    ///
+    virtual stats_type stats() const noexcept;
+
+    /// Segment Statistics
+    ///
+    /// Returns a snapshot of a single pool segment's usage statistics.
+    /// Like stats(), this walks the segment's allocation table.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param index the index of the segment, in the order the segments
+    ///     were added (see stats_type::num_segments)
+    /// @return the segment's statistics, or empty statistics if there is
+    ///     no segment at index
+    ///
+    virtual mem_pool_stats segment_stats(size_type index) const noexcept;
+
 private:
 
     memory_manager_x64() noexcept;
@@ -370,15 +852,52 @@ private:
     integer_pointer lower(integer_pointer ptr) const noexcept;
     integer_pointer upper(integer_pointer ptr) const noexcept;
 
+    void release_page_table(integer_pointer addr) noexcept;
+    void fill_zeroed_pages(size_type max_pages) noexcept;
+
+    integer_pointer segment_alloc(size_type size) noexcept;
+    pool_segment_type *find_segment(integer_pointer ptr) const noexcept;
+
 private:
 
-    std::map<integer_pointer, integer_pointer> m_virt_to_phys_map;
-    std::map<integer_pointer, integer_pointer> m_phys_to_virt_map;
-    std::map<integer_pointer, attr_type> m_virt_to_attr_map;
+    // The usage counters are kept per CPU, so that counting an allocation
+    // does not write to a cache line that is shared with the other CPUs,
+    // and are summed by stats().
+
+    struct alignas(x64::cache_line_size) counters_type
+    {
+        std::atomic<uint64_t> allocs{0};
+        std::atomic<uint64_t> frees{0};
+        std::atomic<uint64_t> failures{0};
+        std::atomic<uint64_t> cache_hits{0};
+        std::atomic<uint64_t> zeroed_hits{0};
+        std::atomic<uint64_t> zeroed_misses{0};
+
+        mem_pool_histogram histogram;
+    };
+
+    counters_type &counters() noexcept;
 
-    mem_pool<MAX_HEAP_POOL, x64::cache_line_shift> g_heap_pool;
-    mem_pool<MAX_PAGE_POOL, x64::page_shift> g_page_pool;
+private:
+
+    radix_tree<memory_manager_virt_key_bits> m_virt_index;
+    hash_index m_phys_index;
+    hash_index m_page_table_index;
+
+    heap_pool_type<MAX_HEAP_POOL, x64::cache_line_shift> g_heap_pool;
+    heap_cache_type<MAX_HEAP_POOL, x64::cache_line_shift> g_heap_cache;
+    page_pool_type<MAX_PAGE_POOL, x64::page_shift> g_page_pool;
     mem_pool<MAX_MEM_MAP_POOL, x64::page_shift> g_mem_map_pool;
+    page_table_arena<MAX_PAGE_TABLE_POOL> g_page_table_arena;
+
+    std::array<pool_segment_type *, MAX_POOL_SEGMENTS> m_segments{};
+    std::atomic<size_type> m_num_segments{0};
+
+    std::array<counters_type, MEM_POOL_CACHE_MAX_CPUS> m_counters;
+
+    std::array<integer_pointer, MAX_ZEROED_PAGES> m_zeroed_pages{};
+    size_type m_num_zeroed_pages{0};
+    size_type m_zeroed_pages_target{MAX_ZEROED_PAGES};
 
 public:
 
@@ -399,4 +918,21 @@ public:
 ///
 #define g_mm memory_manager_x64::instance()
 
+/// Get Memory Trace
+///
+/// Returns a pointer to the allocation trace ring for a given CPU. The
+/// trace is only recorded if the memory manager is compiled with
+/// MEMORY_MANAGER_TRACE defined, otherwise this function always fails.
+///
+/// @expects ring != nullptr
+/// @ensures none
+///
+/// @param cpuid defines which trace ring to return
+/// @param ring the resulting trace ring
+/// @return GET_MEM_TRACE_SUCCESS on success, GET_MEM_TRACE_FAILURE
+///     otherwise
+///
+extern "C" EXPORT_MEMORY_MANAGER int64_t get_mem_trace(uint64_t cpuid,
+        struct mem_trace_ring **ring) noexcept;
+
 #endif
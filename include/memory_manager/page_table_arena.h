@@ -0,0 +1,209 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef PAGE_TABLE_ARENA_H
+#define PAGE_TABLE_ARENA_H
+
+#include <mutex>
+#include <cstdint>
+#include <cstring>
+
+#include <bfgsl.h>
+
+#include <memory_manager/mem_pool.h>
+#include <memory_manager/mem_pool_stats.h>
+#include <memory_manager/page_table_entry_x64.h>
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+///
+/// *INDENT-OFF*
+///
+
+/// Page Table Arena
+///
+/// A pool of pages that is dedicated to page tables. Every page table is
+/// exactly one page, so instead of searching, the arena hands out pages that
+/// have never been used in order, and recycles freed pages through a free
+/// list that is stored in the freed pages themselves.
+///
+/// Pages handed out by the arena are always zeroed. The memory backing the
+/// arena must be zeroed when the arena is created, and free() zeroes a page
+/// before it is recycled. Note that page tables are usually empty when they
+/// are freed, so this rarely has to do any real work.
+///
+/// @param total_size total size in bytes of the arena
+///
+template<size_t total_size>
+class page_table_arena
+{
+    static constexpr const auto page_size = x64::page_table::num_bytes;
+    static_assert(total_size > 0, "total size must be larger than 0");
+    static_assert(total_size % page_size == 0, "total size must be a multiple of the page size");
+
+public:
+
+    using size_type = size_t;
+    using integer_pointer = uintptr_t;
+
+    /// Constructor
+    ///
+    /// Creates an arena with the starting virtual address of addr.
+    ///
+    /// @expects addr != 0
+    /// @expects addr is page aligned
+    /// @expects the memory at addr is zeroed
+    /// @ensures none
+    ///
+    /// @param addr the starting address of the arena
+    ///
+    page_table_arena(integer_pointer addr) noexcept_testing :
+        m_addr(addr)
+    {
+        if (addr == 0 || (addr & (page_size - 1)) != 0) {
+            static_construction_error();
+        }
+    }
+
+    /// Default Destructor
+    ///
+    ~page_table_arena() = default;
+
+    /// Allocate Page Table
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the address of a zeroed page, or 0 if the arena is full
+    ///
+    integer_pointer
+    alloc() noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_free != 0) {
+            auto addr = m_free;
+            auto next = reinterpret_cast<integer_pointer *>(addr);
+
+            m_free = *next;
+            *next = 0;
+
+            m_counters.alloc(page_size, page_size);
+            return addr;
+        }
+
+        if (m_next < total_size) {
+            auto addr = m_addr + m_next;
+            m_next += page_size;
+
+            m_counters.alloc(page_size, page_size);
+            return addr;
+        }
+
+        m_counters.failure(page_size);
+        return 0;
+    }
+
+    /// Free Page Table
+    ///
+    /// Returns a page previously allocated using alloc to the arena.
+    /// Addresses that are not owned by the arena are ignored.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr the address of the page to free
+    ///
+    void
+    free(integer_pointer addr) noexcept
+    {
+        if (!contains(addr)) {
+            return;
+        }
+
+        addr &= ~(page_size - 1);
+        std::memset(reinterpret_cast<void *>(addr), 0, page_size);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        *reinterpret_cast<integer_pointer *>(addr) = m_free;
+        m_free = addr;
+
+        m_counters.free(page_size);
+    }
+
+    /// Contains Address
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr to lookup
+    /// @return true if this arena contains addr, false otherwise
+    ///
+    bool
+    contains(integer_pointer addr) const noexcept
+    { return (addr >= m_addr && addr < m_addr + total_size); }
+
+    /// Statistics
+    ///
+    /// Returns a snapshot of this arena's usage counters. Note that unlike
+    /// a memory pool, an arena failure does not mean that a page table
+    /// could not be allocated, only that it had to come from somewhere else.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return usage statistics for this arena
+    ///
+    mem_pool_stats
+    stats() const noexcept
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto largest = m_free != 0 || m_next < total_size ? page_size : 0;
+        return m_counters.stats(total_size, largest);
+    }
+
+private:
+
+    integer_pointer m_addr{0};
+    integer_pointer m_next{0};
+    integer_pointer m_free{0};
+
+    mutable std::mutex m_mutex;
+    mem_pool_counters m_counters;
+
+public:
+
+    page_table_arena(page_table_arena &&) noexcept = delete;
+    page_table_arena &operator=(page_table_arena &&) noexcept = delete;
+
+    page_table_arena(const page_table_arena &) = delete;
+    page_table_arena &operator=(const page_table_arena &) = delete;
+};
+
+///
+/// *INDENT-ON*
+///
+
+#endif
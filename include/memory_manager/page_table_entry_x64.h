@@ -399,6 +399,16 @@ public:
     ///
     void clear() noexcept;
 
+    /// Entry
+    ///
+    /// @expects none
+    /// @ensures ret != nullptr
+    ///
+    /// @return the address of the entry that this page table entry
+    ///     encapsulates
+    ///
+    pointer entry() const noexcept;
+
 private:
 
     pointer m_pte;
@@ -25,10 +25,11 @@
 #include <bfgsl.h>
 #include <bfmemory.h>
 
-#include <vector>
-#include <memory>
+#include <atomic>
 
+#include <memory_manager/epoch.h>
 #include <memory_manager/page_table_entry_x64.h>
+#include <memory_manager/memory_descriptor_range.h>
 
 // -----------------------------------------------------------------------------
 // Exports
@@ -50,6 +51,47 @@
 // Definitions
 // -----------------------------------------------------------------------------
 
+/// Page Table
+///
+/// Manages a 4 level page table structure. Each page table is a single page
+/// allocated from the memory manager's page table arena, and nothing else is
+/// stored for it. A child page table is located using the physical address
+/// stored in its parent's entry, which the memory manager converts back into
+/// a virtual address. An entry refers to a child page table if it is not
+/// blank, and either it is a PML4 entry, or it is a PDPT / PD entry whose
+/// PS bit is not set. For this reason, the PS bit must be set on every PDPT
+/// or PD entry returned by add_page_1g / add_page_2m.
+///
+/// add_range, remove_range, remove_page, virt_to_pte and pt_to_mdl can be
+/// called by many CPUs at the same time without a lock. Every entry is read
+/// and written atomically. A new page table is only made reachable by a
+/// compare-and-swap of its parent's entry, so CPUs that race to add the
+/// same page table agree on one of them. Page tables that are removed are
+/// retired using an epoch, and are only given back to the memory manager
+/// once no walk can still be using them. The epoch chains retired page
+/// tables through their first two entries, which are marked (see retire_pt)
+/// so that a walk that is still in a retired page table stops there, and
+/// is retried from the parent's entry. To remove a page table that is
+/// empty, its parent's entry is first marked (using a bit the hardware
+/// ignores), and the page table is only unlinked if it is still empty. Any
+/// CPU that added an entry to a page table checks that the page table is
+/// still linked and not marked once it is done, and if not, adds the entry
+/// again. If two CPUs change the same virtual address at the same time,
+/// one of them wins, but the page counts might be off by the pages that
+/// were lost.
+///
+/// add_page_xx return an entry that the caller then fills in, so they are
+/// not safe to use while other CPUs change the same page tables.
+///
+/// add_range and remove_range keep the structure as small as they can. A
+/// page table that add_range fills with pages mapping a single, physically
+/// contiguous range with the same flags is replaced by a large page (if the
+/// flags allow it), giving the page table back to the memory manager. When
+/// only part of a large page is added / removed, the large page is split up
+/// into a page table first, so that the rest of it stays mapped. Like any
+/// other change, this does not flush the TLB, and it invalidates entries
+/// previously returned by virt_to_pte for those addresses.
+///
 class EXPORT_MEMORY_MANAGER page_table_x64
 {
 public:
@@ -57,7 +99,49 @@ public:
     using pointer = uintptr_t *;
     using integer_pointer = uintptr_t;
     using size_type = std::size_t;
-    using memory_descriptor_list = std::vector<memory_descriptor>;
+    using memory_descriptor_list = memory_descriptor_range_list;
+
+    /// Range Flags
+    ///
+    /// The bits (everything but the physical address) that add_range writes
+    /// to the entries it adds, for each page size. A page size whose flags
+    /// are 0 is never used. Note that the flags for 1g / 2m pages must
+    /// include the PS bit.
+    ///
+    struct range_flags_type
+    {
+        integer_pointer flags_1g{0};    ///< Entry bits for 1g pages
+        integer_pointer flags_2m{0};    ///< Entry bits for 2m pages
+        integer_pointer flags_4k{0};    ///< Entry bits for 4k pages
+    };
+
+    /// Page Count
+    ///
+    /// The number of pages of each size that are mapped. add_range and
+    /// remove_range update a page count as they add / remove pages.
+    ///
+    struct page_count_type
+    {
+        std::atomic<size_type> num_1g{0};   ///< Number of 1g pages
+        std::atomic<size_type> num_2m{0};   ///< Number of 2m pages
+        std::atomic<size_type> num_4k{0};   ///< Number of 4k pages
+    };
+
+    /// Cursor
+    ///
+    /// Tracks where a call to pt_to_mdl(mdl, num, cursor) left off, so that
+    /// the page tables can be read in chunks. Page tables are visited
+    /// parent first, in the order of the virtual addresses they translate,
+    /// so the next page table is identified by the first virtual address it
+    /// translates, and its level (the bits of the address its entries
+    /// start at, i.e. x64::page_table::xxx::from).
+    ///
+    struct cursor_type
+    {
+        integer_pointer virt{0};                                ///< First address the next page table translates
+        integer_pointer bits{x64::page_table::pml4::from};      ///< Level of the next page table
+        bool done{false};                                       ///< True once every page table has been read
+    };
 
     /// Constructor
     ///
@@ -74,10 +158,12 @@ public:
 
     /// Destructor
     ///
+    /// Frees every page table in the structure.
+    ///
     /// @expects none
     /// @ensures none
     ///
-    ~page_table_x64() = default;
+    ~page_table_x64();
 
     /// Add Page (1g Granularity)
     ///
@@ -95,7 +181,7 @@ public:
     ///     properties (like present) should be set by the caller
     ///
     page_table_entry_x64 add_page_1g(integer_pointer addr)
-    { return add_page(addr, x64::page_table::pml4::from, x64::page_table::pdpt::from); }
+    { epoch::guard guard(m_epoch); return add_page(m_pt, addr, x64::page_table::pml4::from, x64::page_table::pdpt::from); }
 
     /// Add Page (2m Granularity)
     ///
@@ -113,7 +199,7 @@ public:
     ///     properties (like present) should be set by the caller
     ///
     page_table_entry_x64 add_page_2m(integer_pointer addr)
-    { return add_page(addr, x64::page_table::pml4::from, x64::page_table::pd::from); }
+    { epoch::guard guard(m_epoch); return add_page(m_pt, addr, x64::page_table::pml4::from, x64::page_table::pd::from); }
 
     /// Add Page (4k Granularity)
     ///
@@ -131,7 +217,7 @@ public:
     ///     properties (like present) should be set by the caller
     ///
     page_table_entry_x64 add_page_4k(integer_pointer addr)
-    { return add_page(addr, x64::page_table::pml4::from, x64::page_table::pt::from); }
+    { epoch::guard guard(m_epoch); return add_page(m_pt, addr, x64::page_table::pml4::from, x64::page_table::pt::from); }
 
     /// Remove Page
     ///
@@ -145,9 +231,74 @@ public:
     /// @ensures none
     ///
     /// @param addr the virtual address of the page to remove
+    /// @return the size in bytes of the page that was removed, or 0 if
+    ///     addr was not mapped
+    ///
+    size_type remove_page(integer_pointer addr);
+
+    /// Remove Page (Counted)
+    ///
+    /// Same as remove_page, except count is updated. A large page that
+    /// add_range made by promoting a page table (see promotions()) was not
+    /// mapped as a whole, so it is split up, and only the page that addr
+    /// is in is removed. If a page table cannot be allocated to split it,
+    /// std::bad_alloc is thrown, and nothing is removed.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param addr the virtual address of the page to remove
+    /// @param count decremented for the page that is removed
+    /// @return the size in bytes of the page that was removed, or 0 if
+    ///     addr was not mapped
     ///
-    void remove_page(integer_pointer addr)
-    { remove_page(addr, x64::page_table::pml4::from); }
+    size_type remove_page(integer_pointer addr, page_count_type &count);
+
+    /// Add Range
+    ///
+    /// Maps [virt, virt + size) to [phys, phys + size) using a single walk
+    /// of the page table structure, instead of walking it from the PML4
+    /// for each page. Each page is the largest page size that has flags,
+    /// and that both the virtual and physical addresses, and what is left
+    /// of the range, are aligned to. Like add_page_xx, any page tables
+    /// replaced by a large page are removed. In addition, a page table
+    /// that ends up mapping the same memory a large page would is replaced
+    /// by that large page, and a large page that the range only covers
+    /// part of is split up (see promotions() / splits()).
+    ///
+    /// If an exception is thrown, the pages added so far are left in
+    /// place, and are already accounted for in count.
+    ///
+    /// @expects virt, phys and size are page aligned
+    /// @expects flags.flags_4k != 0
+    /// @ensures none
+    ///
+    /// @param virt the virtual address of the range to add
+    /// @param phys the physical address the range maps to
+    /// @param size the size of the range in bytes
+    /// @param flags the entry bits to use for each page size
+    /// @param count incremented for each page that is added
+    ///
+    void add_range(integer_pointer virt, integer_pointer phys, size_type size,
+                   const range_flags_type &flags, page_count_type &count);
+
+    /// Remove Range
+    ///
+    /// Removes every page in [virt, virt + size) using a single walk of the
+    /// page table structure, removing page tables that become empty. A
+    /// large page that is only partly inside the range is split up, so that
+    /// only the part inside the range is removed. If a page table cannot be
+    /// allocated to split it, std::bad_alloc is thrown, and the pages
+    /// removed so far are left removed, and are accounted for in count.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param virt the virtual address of the range to remove
+    /// @param size the size of the range in bytes
+    /// @param count decremented for each page that is removed
+    ///
+    void remove_range(integer_pointer virt, size_type size, page_count_type &count);
 
     /// Virt to Page Table Entry
     ///
@@ -160,14 +311,14 @@ public:
     /// @param addr the virtual address of the pte to locate
     ///
     page_table_entry_x64 virt_to_pte(integer_pointer addr) const
-    { return virt_to_pte(addr, x64::page_table::pml4::from); }
+    { epoch::guard guard(m_epoch); return virt_to_pte(m_pt, addr, x64::page_table::pml4::from); }
 
     /// Page Table to Memory Descriptor List
     ///
     /// This function converts the internal page table tree structure into a
     /// linear, memory descriptor list. Page table entry information is not
-    /// provide, only the page tables.
-    /// pages.
+    /// provide, only the page tables. Page tables that are contiguous in
+    /// both virtual and physical memory are coalesced into a single range.
     ///
     /// @expects
     /// @ensures
@@ -175,30 +326,156 @@ public:
     /// @return memory descriptor list
     ///
     memory_descriptor_list pt_to_mdl() const
-    { memory_descriptor_list mdl; return pt_to_mdl(mdl); }
+    { epoch::guard guard(m_epoch); memory_descriptor_list mdl; return pt_to_mdl(m_pt, x64::page_table::pml4::from, mdl); }
+
+    /// Page Table to Memory Descriptor List (Chunked)
+    ///
+    /// Same as pt_to_mdl(), except the descriptors are read into mdl,
+    /// starting where cursor left off, and cursor is advanced. Nothing is
+    /// allocated, so a large page table structure can be read in fixed size
+    /// chunks by calling this function until cursor.done is set. A range is
+    /// never split across two chunks.
+    ///
+    /// If page tables are added or removed while the chunks are read, the
+    /// result is a mix of the old and new page tables. A reader that needs
+    /// a consistent list compares generation() before and after it reads
+    /// the list, and reads it again if it changed.
+    ///
+    /// @expects mdl != nullptr
+    /// @expects num != 0
+    /// @ensures none
+    ///
+    /// @param mdl the buffer to read the descriptors into
+    /// @param num the number of descriptors mdl can hold
+    /// @param cursor where to continue from, updated on return
+    /// @return the number of descriptors read into mdl
+    ///
+    size_type pt_to_mdl(memory_descriptor_range *mdl, size_type num, cursor_type &cursor) const;
+
+    /// Generation
+    ///
+    /// Incremented each time a page table is added or removed, so a reader
+    /// that has read the page tables (pt_to_mdl) at a given generation only
+    /// has to read them again once the generation changes.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the current generation
+    ///
+    size_type generation() const noexcept
+    { return m_generation.load(); }
+
+    /// Promotions
+    ///
+    /// Each promotion replaced a page table with a large page, and gave the
+    /// page table back to the memory manager.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of page tables replaced by a large page
+    ///
+    size_type promotions() const noexcept
+    { return m_promotions.load(); }
+
+    /// Enable Promotion
+    ///
+    /// Lets add_range replace a page table with a large page once it is
+    /// full of pages that the large page could map. The page table that a
+    /// promotion replaces is given back to the memory manager without
+    /// flushing the paging-structure caches of the CPUs that might still
+    /// be using it, so promotion is disabled by default, and must only be
+    /// enabled while no CPU has loaded the page tables.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void enable_promotion() noexcept
+    { m_promote = true; }
+
+    /// Disable Promotion
+    ///
+    /// Stops add_range from replacing page tables with large pages (see
+    /// enable_promotion()).
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void disable_promotion() noexcept
+    { m_promote = false; }
+
+    /// Splits
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of large pages split up into a page table
+    ///
+    size_type splits() const noexcept
+    { return m_splits.load(); }
+
+    /// Global Size
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of entries in use across all of the page tables
+    ///
+    size_type global_size() const
+    { epoch::guard guard(m_epoch); return global_size(m_pt, x64::page_table::pml4::from); }
+
+    /// Global Capacity
+    ///
+    /// Returns the number of entries across all of the page tables. As a
+    /// page table is a single page with no other bookkeeping, the memory
+    /// used by the page table structure is global_capacity() *
+    /// sizeof(integer_pointer).
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of entries across all of the page tables
+    ///
+    size_type global_capacity() const
+    { epoch::guard guard(m_epoch); return global_capacity(m_pt, x64::page_table::pml4::from); }
 
 private:
 
-    page_table_entry_x64 add_page(integer_pointer addr, integer_pointer bits, integer_pointer end);
-    void remove_page(integer_pointer addr, integer_pointer bits);
-    page_table_entry_x64 virt_to_pte(integer_pointer addr, integer_pointer bits) const;
-    memory_descriptor_list pt_to_mdl(memory_descriptor_list &mdl) const;
+    page_table_entry_x64 add_page(pointer pt, integer_pointer addr, integer_pointer bits, integer_pointer end);
+    size_type remove_page(pointer pt, integer_pointer addr, integer_pointer bits, page_count_type &count);
 
-    bool empty() const noexcept;
-    size_type global_size() const noexcept;
-    size_type global_capacity() const noexcept;
+    void add_range(pointer pt, integer_pointer bits, integer_pointer virt, integer_pointer phys,
+                   size_type size, const range_flags_type &flags, page_count_type &count);
+    void remove_range(pointer pt, integer_pointer bits, integer_pointer virt, size_type size,
+                      page_count_type &count);
+    bool split(integer_pointer &entry, integer_pointer value, integer_pointer bits, page_count_type &count);
+    bool promote(integer_pointer &entry, pointer pt, integer_pointer bits, const range_flags_type &flags,
+                 page_count_type &count);
+    page_table_entry_x64 virt_to_pte(pointer pt, integer_pointer addr, integer_pointer bits) const;
+    memory_descriptor_list pt_to_mdl(pointer pt, integer_pointer bits, memory_descriptor_list &mdl) const;
+    bool pt_to_mdl(pointer pt, integer_pointer bits, integer_pointer virt, gsl::span<memory_descriptor_range> mdl,
+                   std::ptrdiff_t &num, cursor_type &cursor) const;
+
+    size_type global_size(pointer pt, integer_pointer bits) const;
+    size_type global_capacity(pointer pt, integer_pointer bits) const;
 
 private:
 
     friend class memory_manager_ut;
 
-    std::unique_ptr<integer_pointer[]> m_pt;
-    std::vector<std::unique_ptr<page_table_x64>> m_pts;
+    pointer m_pt{nullptr};
+    mutable epoch m_epoch;
+
+    std::atomic<size_type> m_generation{0};
+    std::atomic<size_type> m_promotions{0};
+    std::atomic<size_type> m_splits{0};
+    std::atomic<bool> m_promote{false};
 
 public:
 
-    page_table_x64(page_table_x64 &&) noexcept = default;
-    page_table_x64 &operator=(page_table_x64 &&) noexcept = default;
+    page_table_x64(page_table_x64 &&) noexcept = delete;
+    page_table_x64 &operator=(page_table_x64 &&) noexcept = delete;
 
     page_table_x64(const page_table_x64 &) = delete;
     page_table_x64 &operator=(const page_table_x64 &) = delete;
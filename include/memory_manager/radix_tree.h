@@ -0,0 +1,433 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef RADIX_TREE_H
+#define RADIX_TREE_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+#include <bfgsl.h>
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+constexpr const auto radix_tree_level_bits = 9ULL;
+constexpr const auto radix_tree_level_size = 1ULL << radix_tree_level_bits;
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+///
+/// *INDENT-OFF*
+///
+
+/// Radix Tree
+///
+/// Maps a key_bits wide key (e.g. a page number) to a 64bit value, where a
+/// value of 0 means "not present". Like a page table, the key is split into
+/// 9 bit indexes, one per level of the tree, with the root level taking
+/// whatever bits are left over, so a lookup is a fixed number of loads no
+/// matter how many entries are in the tree.
+///
+/// Every slot in the tree is atomic, and nodes are only ever added while
+/// the tree is in use (they are released when the tree is destroyed), so
+/// get() is lock free and can run at the same time as set() and erase().
+/// Writers on the other hand must be serialized by the caller.
+///
+/// Each call to set() / erase() that changes the tree starts a new
+/// generation, which is stamped on every node along the key's path, so
+/// that for_each_changed() can skip the parts of the tree that have not
+/// changed since a given generation.
+///
+/// @param key_bits the number of bits in a key
+///
+template<size_t key_bits>
+class radix_tree
+{
+    static_assert(key_bits > radix_tree_level_bits, "key bits must be larger than a level");
+    static_assert(key_bits < 64, "key bits must be smaller than 64");
+
+public:
+
+    using key_type = uint64_t;
+    using value_type = uint64_t;
+
+    /// Default Constructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    radix_tree() noexcept
+    {
+        for (auto &slot : m_root) {
+            slot.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /// Destructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    ~radix_tree()
+    {
+        for (auto &slot : m_root) {
+            release(slot.load(std::memory_order_relaxed), 1);
+        }
+    }
+
+    /// Generation
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the generation of the last change made to the tree, or 0 if
+    ///     the tree has never changed
+    ///
+    value_type
+    generation() const noexcept
+    { return m_generation.load(std::memory_order_acquire); }
+
+    /// Get
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param key the key to lookup
+    /// @return the value stored for key, or 0 if key is not present
+    ///
+    value_type
+    get(key_type key) const noexcept
+    {
+        if ((key >> key_bits) != 0) {
+            return 0;
+        }
+
+        auto next = gsl::at(m_root, index(key, 0)).load(std::memory_order_acquire);
+
+        for (auto level = 1ULL; level < num_levels && next != 0; level++) {
+            next = gsl::at(to_node(next)->slots, index(key, level)).load(std::memory_order_acquire);
+        }
+
+        return next;
+    }
+
+    /// Set
+    ///
+    /// Stores val for key, adding any nodes that are needed. Calls to set()
+    /// and erase() must be serialized by the caller.
+    ///
+    /// @expects (key >> key_bits) == 0
+    /// @expects val != 0
+    /// @ensures get(key) == val
+    ///
+    /// @param key the key to store
+    /// @param val the value to store
+    ///
+    void
+    set(key_type key, value_type val)
+    {
+        expects((key >> key_bits) == 0);
+        expects(val != 0);
+
+        auto gen = m_generation.load(std::memory_order_relaxed) + 1;
+        auto slot = &gsl::at(m_root, index(key, 0));
+
+        for (auto level = 1ULL; level < num_levels; level++) {
+            auto next = child(slot);
+
+            to_node(next)->generation.store(gen, std::memory_order_release);
+            slot = &gsl::at(to_node(next)->slots, index(key, level));
+        }
+
+        slot->store(val, std::memory_order_release);
+        m_generation.store(gen, std::memory_order_release);
+    }
+
+    /// Reserve
+    ///
+    /// Adds any nodes that are needed to store a value for key, without
+    /// storing one, so that a later set() of key cannot fail. This lets a
+    /// caller that sets many keys allocate everything up front, so that it
+    /// does not have to undo a partial update. Calls to reserve() must be
+    /// serialized with calls to set() and erase() by the caller.
+    ///
+    /// @expects (key >> key_bits) == 0
+    /// @ensures none
+    ///
+    /// @param key the key to reserve
+    ///
+    void
+    reserve(key_type key)
+    {
+        expects((key >> key_bits) == 0);
+
+        auto slot = &gsl::at(m_root, index(key, 0));
+
+        for (auto level = 1ULL; level < num_levels; level++) {
+            slot = &gsl::at(to_node(child(slot))->slots, index(key, level));
+        }
+    }
+
+    /// Erase
+    ///
+    /// Removes key from the tree. Nodes are not released until the tree is
+    /// destroyed, as a lock free reader might still be walking them. Calls
+    /// to set() and erase() must be serialized by the caller.
+    ///
+    /// @expects none
+    /// @ensures get(key) == 0
+    ///
+    /// @param key the key to remove
+    /// @return the value that was stored for key, or 0 if key was not
+    ///     present
+    ///
+    value_type
+    erase(key_type key) noexcept
+    {
+        if ((key >> key_bits) != 0) {
+            return 0;
+        }
+
+        std::array<node_type *, num_levels - 1> path{};
+        auto slot = &gsl::at(m_root, index(key, 0));
+
+        for (auto level = 1ULL; level < num_levels; level++) {
+
+            auto next = slot->load(std::memory_order_acquire);
+            if (next == 0) {
+                return 0;
+            }
+
+            gsl::at(path, level - 1) = to_node(next);
+            slot = &gsl::at(to_node(next)->slots, index(key, level));
+        }
+
+        auto val = slot->exchange(0, std::memory_order_acq_rel);
+
+        if (val != 0) {
+            auto gen = m_generation.load(std::memory_order_relaxed) + 1;
+
+            for (auto node : path) {
+                node->generation.store(gen, std::memory_order_release);
+            }
+
+            m_generation.store(gen, std::memory_order_release);
+        }
+
+        return val;
+    }
+
+    /// For Each
+    ///
+    /// Calls func(key, val) for every key in the tree, in key order.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param func the function to call
+    ///
+    template<typename F>
+    void
+    for_each(F func) const
+    {
+        for (auto i = 0ULL; i < root_size; i++) {
+            walk(gsl::at(m_root, i).load(std::memory_order_acquire), 1, i, func);
+        }
+    }
+
+    /// For Each Changed
+    ///
+    /// Calls func(key, val) for every key >= first whose leaf node (the
+    /// node holding the values of 512 neighbouring keys) has changed after
+    /// generation since, in key order. Every key in such a node is visited,
+    /// including keys that are not present (val == 0), so that the caller
+    /// can tell which keys were erased. The walk stops as soon as func
+    /// returns false. Passing since == 0 visits every leaf node.
+    ///
+    /// A change made during the walk might be missed, but it always has a
+    /// generation larger than the generation() read before the walk.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param first the first key to visit
+    /// @param since only nodes changed after this generation are visited
+    /// @param func the function to call, returning false to stop the walk
+    /// @return true if the walk finished, false if func stopped it
+    ///
+    template<typename F>
+    bool
+    for_each_changed(key_type first, value_type since, F func) const
+    {
+        if ((first >> key_bits) != 0) {
+            return true;
+        }
+
+        for (auto i = index(first, 0); i < root_size; i++) {
+            if (!walk_changed(gsl::at(m_root, i).load(std::memory_order_acquire), 1, i, first, since, func)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+private:
+
+    using slot_type = std::atomic<value_type>;
+
+    struct node_type
+    {
+        node_type() noexcept
+        {
+            for (auto &slot : slots) {
+                slot.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        std::array<slot_type, radix_tree_level_size> slots;
+        std::atomic<value_type> generation{0};
+    };
+
+    static constexpr const auto num_levels = (key_bits + radix_tree_level_bits - 1) / radix_tree_level_bits;
+    static constexpr const auto root_bits = key_bits - ((num_levels - 1) * radix_tree_level_bits);
+    static constexpr const auto root_size = 1ULL << root_bits;
+
+    static node_type *
+    to_node(value_type val) noexcept
+    { return reinterpret_cast<node_type *>(val); }
+
+    static value_type
+    child(slot_type *slot)
+    {
+        auto next = slot->load(std::memory_order_acquire);
+
+        if (next == 0) {
+            auto node = std::make_unique<node_type>();
+
+            next = reinterpret_cast<value_type>(node.get());
+            slot->store(next, std::memory_order_release);
+
+            node.release();
+        }
+
+        return next;
+    }
+
+    static key_type
+    index(key_type key, key_type level) noexcept
+    {
+        auto shift = (num_levels - 1 - level) * radix_tree_level_bits;
+        auto mask = (level == 0 ? root_size : radix_tree_level_size) - 1;
+
+        return (key >> shift) & mask;
+    }
+
+    template<typename F>
+    static void
+    walk(value_type val, key_type level, key_type key, F &func)
+    {
+        if (val == 0) {
+            return;
+        }
+
+        if (level == num_levels) {
+            func(key, val);
+            return;
+        }
+
+        for (auto i = 0ULL; i < radix_tree_level_size; i++) {
+            walk(gsl::at(to_node(val)->slots, i).load(std::memory_order_acquire), level + 1,
+                 (key << radix_tree_level_bits) | i, func);
+        }
+    }
+
+    template<typename F>
+    static bool
+    walk_changed(value_type val, key_type level, key_type key, key_type first, value_type since, F &func)
+    {
+        if (val == 0 || to_node(val)->generation.load(std::memory_order_acquire) <= since) {
+            return true;
+        }
+
+        auto shift = (num_levels - 1 - level) * radix_tree_level_bits;
+
+        for (auto i = 0ULL; i < radix_tree_level_size; i++) {
+            auto child = (key << radix_tree_level_bits) | i;
+
+            if (((child + 1) << shift) <= first) {
+                continue;
+            }
+
+            auto next = gsl::at(to_node(val)->slots, i).load(std::memory_order_acquire);
+
+            if (level == num_levels - 1) {
+                if (!func(child, next)) {
+                    return false;
+                }
+            }
+            else if (!walk_changed(next, level + 1, child, first, since, func)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static void
+    release(value_type val, key_type level) noexcept
+    {
+        if (val == 0 || level == num_levels) {
+            return;
+        }
+
+        auto node = std::unique_ptr<node_type>(to_node(val));
+
+        for (auto &slot : node->slots) {
+            release(slot.load(std::memory_order_relaxed), level + 1);
+        }
+    }
+
+private:
+
+    std::array<slot_type, root_size> m_root;
+    std::atomic<value_type> m_generation{0};
+
+public:
+
+    radix_tree(radix_tree &&) noexcept = delete;
+    radix_tree &operator=(radix_tree &&) noexcept = delete;
+
+    radix_tree(const radix_tree &) = delete;
+    radix_tree &operator=(const radix_tree &) = delete;
+};
+
+///
+/// *INDENT-ON*
+///
+
+#endif
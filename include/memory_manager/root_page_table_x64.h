@@ -25,7 +25,7 @@
 #include <bfgsl.h>
 #include <bfmemory.h>
 
-#include <mutex>
+#include <atomic>
 #include <vector>
 
 #include <memory_manager/pat_x64.h>
@@ -64,6 +64,10 @@
 /// This needs to be done manually. In general, this class should not be used
 /// directly, but instead mapping should be done via a unique_map_ptr_x64.
 ///
+/// This class does not take a lock. Mapping, unmapping and lookups can be
+/// done by many CPUs at the same time, as page_table_x64 updates the page
+/// tables atomically (see page_table_x64 for details).
+///
 class EXPORT_MEMORY_MANAGER root_page_table_x64
 {
 public:
@@ -74,6 +78,7 @@ public:
     using attr_type = x64::memory_attr::attr_type;
     using size_type = size_t;
     using memory_descriptor_list = page_table_x64::memory_descriptor_list;
+    using cursor_type = page_table_x64::cursor_type;
 
     /// Default Constructor
     ///
@@ -146,7 +151,10 @@ public:
 
     /// Unmap
     ///
-    /// Unmaps memory in the page tables give a virtual address.
+    /// Unmaps memory in the page tables give a virtual address. A page
+    /// mapped using map_1g / map_2m is unmapped as a whole, while a large
+    /// page that map_range made by promoting a page table is split up, so
+    /// that only the 4k page at virt is unmapped.
     ///
     /// @expects
     /// @ensures
@@ -155,6 +163,80 @@ public:
     ///
     virtual void unmap(integer_pointer virt) noexcept;
 
+    /// Map Range
+    ///
+    /// Maps [virt, virt + size) to [phys, phys + size) given a set of
+    /// attributes. Unlike calling map_4k / map_2m / map_1g for each page,
+    /// the page tables are only walked once. Each
+    /// page is mapped using the largest page size (1g, 2m or 4k) that
+    /// virt, phys and the rest of the range are aligned to. 1g pages are
+    /// only used if the CPU supports them (CPUID.80000001H:EDX[26]), as
+    /// the PS bit of a PDPT entry is reserved otherwise.
+    ///
+    /// Promotion is limited to page tables that have not been loaded yet.
+    /// Only then does map_range take pages mapped by earlier calls into
+    /// account, replacing a page table that is full of pages a single large
+    /// page could map with that large page (see enable_promotion()). In
+    /// practice, this is root_pt()'s initial build of the VMM's page
+    /// tables. Mappings made at runtime are never promoted.
+    ///
+    /// @expects virt, phys and size are page aligned
+    /// @ensures none
+    ///
+    /// @param virt the virtual address to map
+    /// @param phys the physical address to map the virt address
+    /// @param size the number of bytes to map
+    /// @param attr describes how to map the virt address
+    ///
+    virtual void map_range(integer_pointer virt, integer_pointer phys, size_type size, attr_type attr)
+    { this->map_pages(virt, phys, size, attr, x64::page_table::pdpt::size_bytes); }
+
+    /// Unmap Range
+    ///
+    /// Unmaps [virt, virt + size), walking the page tables once. Large
+    /// pages that are only partly inside the range are split up, so that
+    /// the rest of the large page stays mapped (see splits()).
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param virt the virtual address to unmap
+    /// @param size the number of bytes to unmap
+    ///
+    virtual void unmap_range(integer_pointer virt, size_type size) noexcept;
+
+    /// Map Range (Untracked)
+    ///
+    /// Same as map_range, except the memory manager's descriptors are not
+    /// updated, so g_mm cannot convert the virtual addresses that are
+    /// mapped. This is meant for very large ranges (like the direct map),
+    /// which would need a descriptor for every page, and whose addresses
+    /// are converted some other way.
+    ///
+    /// @expects virt, phys and size are page aligned
+    /// @ensures none
+    ///
+    /// @param virt the virtual address to map
+    /// @param phys the physical address to map the virt address
+    /// @param size the number of bytes to map
+    /// @param attr describes how to map the virt address
+    ///
+    virtual void map_range_untracked(integer_pointer virt, integer_pointer phys, size_type size, attr_type attr)
+    { this->map_pages(virt, phys, size, attr, x64::page_table::pdpt::size_bytes, false); }
+
+    /// Unmap Range (Untracked)
+    ///
+    /// Unmaps a range previously mapped using map_range_untracked.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param virt the virtual address to unmap
+    /// @param size the number of bytes to unmap
+    ///
+    virtual void unmap_range_untracked(integer_pointer virt, size_type size) noexcept
+    { this->unmap_pages(virt, size, false); }
+
     /// Setup Identify Map (1g Granularity)
     ///
     /// Sets up an identify map in the page tables using 1 gigabyte
@@ -254,8 +336,8 @@ public:
     ///
     /// This function converts the internal page table tree structure into a
     /// linear, memory descriptor list. Page table entry information is not
-    /// provide, only the page tables.
-    /// pages.
+    /// provide, only the page tables. Page tables that are contiguous in
+    /// both virtual and physical memory are coalesced into a single range.
     ///
     /// @expects
     /// @ensures
@@ -264,21 +346,134 @@ public:
     ///
     memory_descriptor_list pt_to_mdl() const;
 
-private:
+    /// Page Table to Memory Descriptor List (Chunked)
+    ///
+    /// Reads the page tables into mdl in chunks, without allocating (see
+    /// page_table_x64::pt_to_mdl(mdl, num, cursor)).
+    ///
+    /// @expects mdl != nullptr
+    /// @expects num != 0
+    /// @ensures none
+    ///
+    /// @param mdl the buffer to read the descriptors into
+    /// @param num the number of descriptors mdl can hold
+    /// @param cursor where to continue from, updated on return
+    /// @return the number of descriptors read into mdl
+    ///
+    size_type pt_to_mdl(memory_descriptor_range *mdl, size_type num, cursor_type &cursor) const;
 
-    page_table_entry_x64 add_page(integer_pointer virt, size_type size);
+    /// Page Table Generation
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return a number that changes each time a page table is added or
+    ///     removed (see page_table_x64::generation())
+    ///
+    size_type generation() const noexcept;
+
+    /// Promotions
+    ///
+    /// While promotion is enabled, map_range replaces a page table that
+    /// ends up full of pages mapping one physically contiguous range with a
+    /// 2m / 1g page, giving the page table back to the memory manager. For
+    /// the VMM's page tables, this only happens while root_pt() builds
+    /// them, so the count does not change after boot.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of page tables reclaimed this way
+    ///
+    size_type promotions() const noexcept;
+
+    /// Enable Promotion
+    ///
+    /// Lets map_range promote page tables (see promotions()). A promoted
+    /// page table is given back to the memory manager once no walk of the
+    /// page tables in software can still reach it (see epoch). That does
+    /// not cover the paging-structure caches of other CPUs, which can keep
+    /// using the page table until they are flushed, and the VMM has no way
+    /// to shoot them down. Promotion is therefore disabled by default, and
+    /// is only safe while the page tables are set up, before any CPU loads
+    /// them. root_pt() only enables it while it sets up the VMM's page
+    /// tables.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void enable_promotion() noexcept;
+
+    /// Disable Promotion
+    ///
+    /// Stops map_range from promoting page tables (see enable_promotion()).
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void disable_promotion() noexcept;
+
+    /// Splits
+    ///
+    /// map_range and unmap_range split up a 2m / 1g page when they only
+    /// change part of it.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of large pages that were split up
+    ///
+    size_type splits() const noexcept;
+
+    /// Mapped Pages
+    ///
+    /// Returns the number of pages of a given size that are currently
+    /// mapped by this page table. This can be used to check how much of
+    /// the VMM is mapped using large pages.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param size the page size in bytes (1g, 2m or 4k)
+    /// @return the number of pages of size currently mapped, or 0 if size
+    ///     is not a supported page size
+    ///
+    size_type mapped_pages(size_type size) const;
+
+    /// Entry Flags
+    ///
+    /// Returns the bits, other than the physical address, of an entry that
+    /// maps a page of the given size using the given attributes. These are
+    /// the same for every page in a range, so map_range only calculates them
+    /// once per page size.
+    ///
+    /// @expects size is 1g, 2m or 4k
+    /// @ensures none
+    ///
+    /// @param attr describes how the page is mapped
+    /// @param size the page size in bytes (1g, 2m or 4k)
+    /// @return the entry bits for a page of size mapped using attr
+    ///
+    static integer_pointer entry_flags(attr_type attr, size_type size);
+
+private:
 
     void map_page(integer_pointer virt, integer_pointer phys, attr_type attr, size_type size);
     void unmap_page(integer_pointer virt) noexcept;
 
+    void map_pages(integer_pointer virt, integer_pointer phys, size_type size, attr_type attr, size_type max_size,
+                   bool track = true);
+    void unmap_pages(integer_pointer virt, size_type size, bool track = true) noexcept;
+
 private:
 
     bool m_is_vmm{false};
+    bool m_1g_pages{false};
 
     integer_pointer m_cr3{0};
     std::unique_ptr<page_table_x64> m_pt;
 
-    mutable std::mutex m_mutex;
+    page_table_x64::page_count_type m_count;
 
 public:
 
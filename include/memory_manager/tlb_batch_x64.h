@@ -0,0 +1,266 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#ifndef TLB_BATCH_X64_H
+#define TLB_BATCH_X64_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include <bfgsl.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_MEMORY_MANAGER
+#ifdef SHARED_MEMORY_MANAGER
+#define EXPORT_MEMORY_MANAGER EXPORT_SYM
+#else
+#define EXPORT_MEMORY_MANAGER IMPORT_SYM
+#endif
+#else
+#define EXPORT_MEMORY_MANAGER
+#endif
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+// The number of pages that are invalidated one at a time. Invalidating more
+// pages than this reloads CR3 instead, which flushes the whole TLB with a
+// single instruction.
+
+#ifndef TLB_BATCH_FLUSH_THRESHOLD
+#define TLB_BATCH_FLUSH_THRESHOLD 32
+#endif
+
+// The number of released ranges each CPU holds before it has to flush.
+
+#ifndef TLB_BATCH_MAX_RELEASES
+#define TLB_BATCH_MAX_RELEASES 16
+#endif
+
+// The number of CPUs with a TLB batch. A CPU whose id is larger invalidates
+// and frees its ranges right away.
+
+#ifndef TLB_BATCH_MAX_CPUS
+#define TLB_BATCH_MAX_CPUS 64
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+/// TLB Batch
+///
+/// Batches the TLB invalidations of the VMM's own mappings. Ranges that are
+/// released (see release()) have already been removed from the page tables,
+/// but their virtual memory is only given back to the memory manager by the
+/// next flush(), once their TLB entries have been invalidated. The exit
+/// handler flushes once per vmcall, so one flush covers all of the maps a
+/// vmcall released. Only the releasing CPU's TLB is flushed, and any other
+/// CPU might still cache a translation for the range, so a new map still
+/// invalidates its range on the CPU that maps it.
+///
+/// Invalidating more than TLB_BATCH_FLUSH_THRESHOLD pages reloads CR3
+/// instead of issuing one INVLPG per page. The VMM's mappings are never
+/// global, so this flushes all of them. If the VMM's address space is
+/// tagged with a PCID (see set_pcid()), and the VMM's CR3 is loaded,
+/// INVPCID is used instead, so that only the VMM's TLB entries are
+/// invalidated.
+///
+/// A TLB batch belongs to a single CPU, and only invalidates the TLB of
+/// that CPU.
+///
+class EXPORT_MEMORY_MANAGER tlb_batch_x64
+{
+public:
+
+    using integer_pointer = uintptr_t;
+    using size_type = size_t;
+
+    /// Default Constructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    tlb_batch_x64() noexcept = default;
+
+    /// Destructor
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    ~tlb_batch_x64() = default;
+
+    /// Invalidate
+    ///
+    /// Invalidates the TLB entries of [virt, virt + size) right away. Any
+    /// range that is already waiting to be flushed is left alone, unless
+    /// CR3 has to be reloaded, in which case it is flushed as well.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param virt the virtual address of the range to invalidate
+    /// @param size the size of the range in bytes
+    ///
+    void invalidate(integer_pointer virt, size_type size) noexcept;
+
+    /// Release
+    ///
+    /// Defers invalidating the TLB entries of a range that was unmapped,
+    /// and giving its virtual memory back to the memory manager (using
+    /// free_map), until the next flush. If TLB_BATCH_MAX_RELEASES ranges are
+    /// already waiting, they are flushed first.
+    ///
+    /// @expects virt was allocated using alloc_map, and is already unmapped
+    /// @ensures none
+    ///
+    /// @param virt the virtual address of the range
+    /// @param size the size of the range in bytes
+    ///
+    void release(integer_pointer virt, size_type size) noexcept;
+
+    /// Flush
+    ///
+    /// Invalidates the TLB entries of every range that was released, and
+    /// gives their virtual memory back to the memory manager.
+    ///
+    /// @expects none
+    /// @ensures num_pending() == 0
+    ///
+    void flush() noexcept;
+
+    /// Set PCID
+    ///
+    /// Tells every CPU's TLB batch which PCID the VMM's CR3 is tagged
+    /// with, so that it can be invalidated using INVPCID. The PCID is only
+    /// used while cr3 is loaded (i.e. not before the VMM is launched).
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param pcid the PCID of the VMM's address space, or 0 if the VMM
+    ///     does not use PCIDs
+    /// @param cr3 the VMM's CR3, including pcid
+    ///
+    static void set_pcid(integer_pointer pcid, integer_pointer cr3 = 0) noexcept;
+
+    /// PCID
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the PCID of the VMM's address space, or 0 if the VMM does
+    ///     not use PCIDs
+    ///
+    static integer_pointer pcid() noexcept;
+
+    /// Number Pending
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of released ranges waiting to be flushed
+    ///
+    size_type num_pending() const noexcept
+    { return m_num; }
+
+    /// Issued
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of INVLPGs, INVPCIDs and CR3 reloads this CPU has
+    ///     done
+    ///
+    size_type issued() const noexcept
+    { return m_issued.load(); }
+
+    /// Saved
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @return the number of INVLPGs this CPU did not have to do, because
+    ///     a CR3 reload covered them
+    ///
+    size_type saved() const noexcept
+    { return m_saved.load(); }
+
+private:
+
+    void flush_all(size_type pages, integer_pointer pcid) noexcept;
+    void free_released() noexcept;
+
+private:
+
+    struct range_type
+    {
+        integer_pointer virt;
+        size_type size;
+    };
+
+    size_type m_num{0};
+    size_type m_pages{0};
+    std::array<range_type, TLB_BATCH_MAX_RELEASES> m_ranges{};
+
+    std::atomic<size_type> m_issued{0};
+    std::atomic<size_type> m_saved{0};
+
+public:
+
+    tlb_batch_x64(tlb_batch_x64 &&) noexcept = delete;
+    tlb_batch_x64 &operator=(tlb_batch_x64 &&) noexcept = delete;
+
+    tlb_batch_x64(const tlb_batch_x64 &) = delete;
+    tlb_batch_x64 &operator=(const tlb_batch_x64 &) = delete;
+};
+
+/// CPU TLB Batch
+///
+/// Returns the TLB batch of the CPU that is calling this function.
+///
+/// @expects none
+/// @ensures none
+///
+/// @return the TLB batch of the calling CPU, or nullptr if
+///     thread_context_cpuid() >= TLB_BATCH_MAX_CPUS
+///
+EXPORT_MEMORY_MANAGER tlb_batch_x64 *tlb_batch_cpu() noexcept;
+
+/// TLB Batch Totals
+///
+/// @expects none
+/// @ensures none
+///
+/// @param issued set to the number of invalidations issued by all CPUs
+/// @param saved set to the number of invalidations saved by all CPUs
+///
+EXPORT_MEMORY_MANAGER void tlb_batch_totals(size_t &issued, size_t &saved) noexcept;
+
+#endif
@@ -0,0 +1,75 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#ifndef TEST_MEMORY_MANAGER_UTILS_H
+#define TEST_MEMORY_MANAGER_UTILS_H
+
+#include <chrono>
+
+#include <bfmemory.h>
+
+#include <memory_manager/memory_manager_x64.h>
+
+extern uint8_t g_page_pool_owner[MAX_PAGE_POOL];
+extern uint8_t g_page_table_pool_owner[MAX_PAGE_TABLE_POOL];
+
+// Child page tables are found through the memory manager's page table
+// index, which is filled in using its virt to phys conversion, so the page
+// table arena, and the page pool that page tables fall back to when the
+// arena is empty, are given an identity map for the life of the fixture.
+
+struct arena_mdl
+{
+    static constexpr const auto num_pool_pages = MAX_PAGE_POOL >> x64::page_shift;
+    static constexpr const auto num_arena_pages = MAX_PAGE_TABLE_POOL >> x64::page_shift;
+
+    arena_mdl()
+    {
+        auto addr1 = reinterpret_cast<uintptr_t>(g_page_pool_owner);
+        auto addr2 = reinterpret_cast<uintptr_t>(g_page_table_pool_owner);
+
+        g_mm->add_md_range(addr1, addr1, num_pool_pages, MEMORY_TYPE_R | MEMORY_TYPE_W);
+        g_mm->add_md_range(addr2, addr2, num_arena_pages, MEMORY_TYPE_R | MEMORY_TYPE_W);
+    }
+
+    ~arena_mdl()
+    {
+        g_mm->remove_md_range(reinterpret_cast<uintptr_t>(g_page_pool_owner), num_pool_pages);
+        g_mm->remove_md_range(reinterpret_cast<uintptr_t>(g_page_table_pool_owner), num_arena_pages);
+    }
+};
+
+// Returns the number of microseconds that func takes to run, for the tests
+// that are tagged as benchmarks.
+
+template<class F>
+auto
+time_it(F func)
+{
+    auto &&start = std::chrono::high_resolution_clock::now();
+    func();
+    auto &&end = std::chrono::high_resolution_clock::now();
+
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+#endif
@@ -47,6 +47,21 @@ extern idt_x64 g_idt;
 #define EXPORT_VMCS
 #endif
 
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+// The PCID the VMM's CR3 is tagged with by default when the CPU supports
+// PCID and INVPCID. This is 0 (never tag the VMM's CR3), as VPIDs are not
+// enabled yet, so VM entries and exits flush the entries of every PCID, and
+// the tag does not keep any of the VMM's entries alive across an exit.
+
+#ifndef VMM_PCID
+#define VMM_PCID 0
+#endif
+
+static_assert(VMM_PCID < 0x1000, "VMM_PCID must fit in bits 11:0 of CR3");
+
 // -----------------------------------------------------------------------------
 // Definitions
 // -----------------------------------------------------------------------------
@@ -69,7 +84,16 @@ class EXPORT_VMCS vmcs_intel_x64_vmm_state : public vmcs_intel_x64_state
 {
 public:
 
-    vmcs_intel_x64_vmm_state();
+    /// Constructor
+    ///
+    /// @expects pcid < 0x1000
+    /// @ensures none
+    ///
+    /// @param pcid the PCID to tag the VMM's CR3 with if the CPU supports
+    ///     PCID and INVPCID, or 0 to never tag it
+    ///
+    explicit vmcs_intel_x64_vmm_state(intel_x64::cr3::value_type pcid = VMM_PCID);
+
     ~vmcs_intel_x64_vmm_state() override = default;
 
     x64::segment_register::value_type cs() const override
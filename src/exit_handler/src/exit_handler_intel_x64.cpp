@@ -26,9 +26,11 @@
 #include <bferrorcodes.h>
 
 #include <memory_manager/memory_manager_x64.h>
+#include <memory_manager/tlb_batch_x64.h>
 #include <exit_handler/exit_handler_intel_x64.h>
 #include <exit_handler/exit_handler_intel_x64_entry.h>
 #include <exit_handler/exit_handler_intel_x64_support.h>
+#include <vmcs/vmcs_intel_x64_resume.h>
 
 #include <intrinsics/x86/common_x64.h>
 #include <intrinsics/x86/intel_x64.h>
@@ -39,10 +41,138 @@ using namespace intel_x64;
 #include <mutex>
 std::mutex g_unimplemented_handler_mutex;
 
+exit_handler_intel_x64::exit_handler_intel_x64()
+{
+    this->add_handler(vmcs::exit_reason::basic_exit_reason::cpuid, [](auto ehlr, auto)
+    { ehlr->handle_cpuid(); return true; });
+
+    this->add_handler(vmcs::exit_reason::basic_exit_reason::invd, [](auto ehlr, auto)
+    { ehlr->handle_invd(); return true; });
+
+    this->add_handler(vmcs::exit_reason::basic_exit_reason::vmcall, [](auto ehlr, auto)
+    { ehlr->handle_vmcall(); return true; });
+
+    this->add_handler(vmcs::exit_reason::basic_exit_reason::vmxoff, [](auto ehlr, auto)
+    { ehlr->handle_vmxoff(); return true; });
+
+    this->add_handler(vmcs::exit_reason::basic_exit_reason::rdmsr, [](auto ehlr, auto)
+    { ehlr->handle_rdmsr(); return true; });
+
+    this->add_handler(vmcs::exit_reason::basic_exit_reason::wrmsr, [](auto ehlr, auto)
+    { ehlr->handle_wrmsr(); return true; });
+}
+
 void
-exit_handler_intel_x64::dispatch()
+exit_handler_intel_x64::dispatch(vmcs::value_type reason)
 {
-    handle_exit(vmcs::exit_reason::basic_exit_reason::get());
+    if ((++m_num_exits & (EXIT_HANDLER_MAINTENANCE_INTERVAL - 1)) == 0) {
+        g_mm->maintain();
+    }
+
+    switch (reason) {
+        case vmcs::exit_reason::basic_exit_reason::invlpg:
+            m_guest_tlb.invalidate(vmcs::exit_qualification::get());
+            break;
+
+        case vmcs::exit_reason::basic_exit_reason::control_register_accesses:
+            if (vmcs::exit_qualification::control_register_access::access_type::get() ==
+                vmcs::exit_qualification::control_register_access::access_type::mov_to_cr) {
+                m_guest_tlb.flush();
+            }
+            break;
+
+        case vmcs::exit_reason::basic_exit_reason::invpcid:
+            m_guest_tlb.flush();
+            break;
+
+        default:
+            break;
+    };
+
+    handle_exit(reason);
+}
+
+bool
+exit_handler_intel_x64::dispatch_fast(vmcs::value_type reason) noexcept
+{
+    // Nothing on the fast path is guarded against exceptions. The guest is
+    // resumed with vmcs_resume, which does not throw, and only returns if
+    // the guest cannot be resumed. The exit was still handled, so true is
+    // returned, and the entry point halts.
+
+    if (reason >= m_fast_handlers.size()) {
+        return false;
+    }
+
+    const auto &entry = gsl::at(m_fast_handlers, reason);
+
+    if (entry.handler == nullptr || !entry.handler(this, entry.data)) {
+        return false;
+    }
+
+    vmcs_resume(m_state_save);
+    return true;
+}
+
+void
+exit_handler_intel_x64::add_handler(
+    vmcs::value_type reason, handler_type handler, void *data)
+{
+    expects(reason < m_handlers.size());
+    expects(handler != nullptr);
+
+    auto &&head = gsl::at(m_handlers, reason);
+
+    if (head.handler != nullptr) {
+        auto &&next = std::make_unique<handler_entry_type>(std::move(head));
+        head.next = std::move(next);
+    }
+
+    head.handler = handler;
+    head.data = data;
+}
+
+void
+exit_handler_intel_x64::remove_handler(
+    vmcs::value_type reason, handler_type handler, void *data)
+{
+    expects(reason < m_handlers.size());
+
+    auto &&head = gsl::at(m_handlers, reason);
+
+    if (head.handler == handler && head.data == data) {
+        if (auto next = std::move(head.next)) {
+            head = std::move(*next);
+        }
+        else {
+            head.handler = nullptr;
+            head.data = nullptr;
+        }
+
+        return;
+    }
+
+    for (auto prev = &head; prev->next; prev = prev->next.get()) {
+        if (prev->next->handler == handler && prev->next->data == data) {
+            prev->next = std::move(prev->next->next);
+            return;
+        }
+    }
+}
+
+void
+exit_handler_intel_x64::set_fast_handler(
+    vmcs::value_type reason, handler_type handler, void *data)
+{
+    expects(reason < m_fast_handlers.size());
+    expects(reason != vmcs::exit_reason::basic_exit_reason::invlpg);
+    expects(reason != vmcs::exit_reason::basic_exit_reason::invpcid);
+    expects(reason != vmcs::exit_reason::basic_exit_reason::control_register_accesses);
+
+    auto &&entry = gsl::at(m_fast_handlers, reason);
+
+    entry.handler = handler;
+    entry.data = data;
 }
 
 void
@@ -81,38 +211,27 @@ exit_handler_intel_x64::halt() noexcept
     pm::stop();
 }
 
+// Each entry in the table holds the first handler of its chain, so the
+// common case (the first handler handles the exit) costs a single indirect
+// call, and only the handlers after it are found through the chain.
+
 void
 exit_handler_intel_x64::handle_exit(vmcs::value_type reason)
 {
-    switch (reason) {
-        case vmcs::exit_reason::basic_exit_reason::cpuid:
-            handle_cpuid();
-            break;
-
-        case vmcs::exit_reason::basic_exit_reason::invd:
-            handle_invd();
-            break;
-
-        case vmcs::exit_reason::basic_exit_reason::vmcall:
-            handle_vmcall();
-            break;
+    auto handled = false;
 
-        case vmcs::exit_reason::basic_exit_reason::vmxoff:
-            handle_vmxoff();
-            break;
-
-        case vmcs::exit_reason::basic_exit_reason::rdmsr:
-            handle_rdmsr();
-            break;
-
-        case vmcs::exit_reason::basic_exit_reason::wrmsr:
-            handle_wrmsr();
-            break;
+    if (reason < m_handlers.size()) {
+        for (auto entry = &gsl::at(m_handlers, reason); entry != nullptr; entry = entry->next.get()) {
+            if (entry->handler != nullptr && entry->handler(this, entry->data)) {
+                handled = true;
+                break;
+            }
+        }
+    }
 
-        default:
-            unimplemented_handler();
-            break;
-    };
+    if (!handled) {
+        unimplemented_handler();
+    }
 
     m_vmcs->resume();
 }
@@ -194,6 +313,7 @@ exit_handler_intel_x64::handle_vmcall()
 
             case VMCALL_STOP:
                 handle_vmcall_stop(regs);
+                g_mm->refill_zeroed_pages();
                 break;
 
             case VMCALL_UNITTEST:
@@ -205,6 +325,10 @@ exit_handler_intel_x64::handle_vmcall()
         };
     });
 
+    if (auto &&batch = tlb_batch_cpu()) {
+        batch->flush();
+    }
+
     complete_vmcall(ret, regs);
 }
 
@@ -443,6 +567,28 @@ exit_handler_intel_x64::handle_vmcall_registers(vmcall_registers_t &regs)
     bfdebug << "r12: " << view_as_pointer(regs.r12) << bfendl;
 }
 
+guest_tlb_x64 *
+exit_handler_intel_x64::guest_tlb()
+{
+    // Besides INVLPG and loads of CR3, the guest flushes its TLB by changing
+    // CR0.PG or CR4.PGE / PCIDE / PAE, which only exit if the guest / host
+    // masks give these bits to the VMM.
+
+    constexpr const auto cr0_mask = cr0::paging::mask;
+    constexpr const auto cr4_mask = cr4::page_global_enable::mask | cr4::pcid_enable_bit::mask |
+                                    cr4::physical_address_extensions::mask;
+
+    if (vmcs::primary_processor_based_vm_execution_controls::invlpg_exiting::is_enabled() &&
+        vmcs::primary_processor_based_vm_execution_controls::cr3_load_exiting::is_enabled() &&
+        (vmcs::cr0_guest_host_mask::get() & cr0_mask) == cr0_mask &&
+        (vmcs::cr4_guest_host_mask::get() & cr4_mask) == cr4_mask) {
+        return &m_guest_tlb;
+    }
+
+    m_guest_tlb.flush();
+    return nullptr;
+}
+
 void
 exit_handler_intel_x64::handle_vmcall_data(vmcall_registers_t &regs)
 {
@@ -454,10 +600,12 @@ exit_handler_intel_x64::handle_vmcall_data(vmcall_registers_t &regs)
     expects(regs.r06 <= VMCALL_IN_BUFFER_SIZE);
     expects(regs.r09 <= VMCALL_OUT_BUFFER_SIZE);
 
+    auto &&tlb = guest_tlb();
+
     auto &&imap = bfn::make_unique_map_x64<char>(regs.r05, vmcs::guest_cr3::get(), regs.r06,
-                  vmcs::guest_ia32_pat::get());
+                  vmcs::guest_ia32_pat::get(), tlb);
     auto &&omap = bfn::make_unique_map_x64<char>(regs.r08, vmcs::guest_cr3::get(), regs.r09,
-                  vmcs::guest_ia32_pat::get());
+                  vmcs::guest_ia32_pat::get(), tlb);
 
     switch (regs.r04) {
         case VMCALL_DATA_STRING_UNFORMATTED: {
@@ -481,6 +629,13 @@ exit_handler_intel_x64::handle_vmcall_data(vmcall_registers_t &regs)
             break;
         }
 
+        case VMCALL_DATA_MEMORY_MANAGER_STATS: {
+            json ojson;
+            handle_vmcall_data_memory_manager_stats(ojson);
+            reply_with_json(regs, ojson, omap);
+            break;
+        }
+
         default:
             throw std::runtime_error("unknown vmcall data type");
     }
@@ -526,12 +681,83 @@ exit_handler_intel_x64::handle_vmcall_data_binary_unformatted(
     memcpy(omap.get(), imap.get(), imap.size());
 }
 
+static json
+histogram_to_json(const mem_pool_histogram::histogram_type &histogram)
+{
+    auto ojson = json::object();
+
+    for (auto i = 0ULL; i < histogram.size(); i++) {
+        if (auto count = gsl::at(histogram, i)) {
+            ojson[std::to_string(1ULL << i)] = count;
+        }
+    }
+
+    return ojson;
+}
+
+static json
+mem_pool_stats_to_json(const mem_pool_stats &stats)
+{
+    return {
+        {"total_size", stats.total_size},
+        {"used", stats.used},
+        {"peak", stats.peak},
+        {"largest_free", stats.largest_free},
+        {"fragmentation", stats.fragmentation()},
+        {"allocs", stats.allocs},
+        {"frees", stats.frees},
+        {"failures", stats.failures},
+        {"histogram", histogram_to_json(stats.histogram)}
+    };
+}
+
+void
+exit_handler_intel_x64::handle_vmcall_data_memory_manager_stats(
+    json &ojson)
+{
+    auto &&stats = g_mm->stats();
+    auto &&segments = json::array();
+
+    size_t tlb_issued = 0;
+    size_t tlb_saved = 0;
+
+    tlb_batch_totals(tlb_issued, tlb_saved);
+
+    for (auto i = 0ULL; i < stats.num_segments; i++) {
+        segments.push_back(mem_pool_stats_to_json(g_mm->segment_stats(i)));
+    }
+
+    ojson = {
+        {"heap", mem_pool_stats_to_json(stats.heap)},
+        {"page", mem_pool_stats_to_json(stats.page)},
+        {"mem_map", mem_pool_stats_to_json(stats.mem_map)},
+        {"page_table", mem_pool_stats_to_json(stats.page_table)},
+        {"allocs", stats.allocs},
+        {"frees", stats.frees},
+        {"failures", stats.failures},
+        {"cache_hits", stats.cache_hits},
+        {"zeroed_hits", stats.zeroed_hits},
+        {"zeroed_misses", stats.zeroed_misses},
+        {"zeroed_pages", stats.zeroed_pages},
+        {"phys_index_bytes", stats.phys_index_bytes},
+        {"segments", segments},
+        {"segments_total", mem_pool_stats_to_json(stats.segments)},
+        {"histogram", histogram_to_json(stats.histogram)},
+        {"guest_tlb", {{"hits", m_guest_tlb.hits()}, {"misses", m_guest_tlb.misses()}}},
+        {"tlb", {{"issued", tlb_issued}, {"saved", tlb_saved}}}
+    };
+}
+
 void exit_handler_intel_x64::reply_with_string(
     vmcall_registers_t &regs, const std::string &str,
     const bfn::unique_map_ptr_x64<char> &omap)
 {
     auto &&len = str.length();
 
+    if (len > omap.size()) {
+        throw std::runtime_error("output buffer too small");
+    }
+
     memcpy(omap.get(), str.data(), len);
 
     regs.r07 = VMCALL_DATA_STRING_UNFORMATTED;
@@ -546,6 +772,10 @@ exit_handler_intel_x64::reply_with_json(
     auto &&dmp = str.dump();
     auto &&len = dmp.length();
 
+    if (len > omap.size()) {
+        throw std::runtime_error("output buffer too small");
+    }
+
     memcpy(omap.get(), dmp.data(), len);
 
     regs.r07 = VMCALL_DATA_STRING_JSON;
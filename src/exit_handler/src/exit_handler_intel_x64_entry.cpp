@@ -30,8 +30,26 @@
 extern "C" void
 exit_handler(exit_handler_intel_x64 *exit_handler) noexcept
 {
-    guard_exceptions([&]()
-    { exit_handler->dispatch(); });
+    using namespace intel_x64::vmcs::exit_reason;
+
+    // The exit reason is read without throwing, so that the fast path
+    // does not need to guard against exceptions. If it cannot be read,
+    // dispatch is left to read it again (and fail) under the guard.
+
+    intel_x64::vmcs::value_type field = 0;
+
+    if (_vmread(addr, &field)) {
+        auto reason = (field & basic_exit_reason::mask) >> basic_exit_reason::from;
+
+        if (!exit_handler->dispatch_fast(reason)) {
+            guard_exceptions([&]()
+            { exit_handler->dispatch(reason); });
+        }
+    }
+    else {
+        guard_exceptions([&]()
+        { exit_handler->dispatch(basic_exit_reason::get()); });
+    }
 
     exit_handler->halt();
 }
@@ -23,15 +23,19 @@
 #include <hippomocks.h>
 
 #include <vmcs/vmcs_intel_x64.h>
+#include <vmcs/vmcs_intel_x64_resume.h>
 #include <intrinsics/x86/common_x64.h>
 #include <intrinsics/x86/intel_x64.h>
 
 #include <exit_handler/exit_handler_intel_x64.h>
+#include <exit_handler/exit_handler_intel_x64_entry.h>
 #include <exit_handler/exit_handler_intel_x64_support.h>
 
 #include <memory_manager/memory_manager_x64.h>
 #include <memory_manager/root_page_table_x64.h>
 
+#include <test/memory_manager_utils.h>
+
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
 using namespace x64;
@@ -44,8 +48,10 @@ vmcs::value_type g_exit_reason = 0;
 vmcs::value_type g_exit_qualification = 0;
 vmcs::value_type g_exit_instruction_length = 8;
 vmcs::value_type g_exit_instruction_information = 0;
+vmcs::value_type g_cr0_guest_host_mask = 0;
+vmcs::value_type g_cr4_guest_host_mask = 0;
 
-constexpr static int g_map_size = 100;
+constexpr static int g_map_size = 0x1000;
 static char g_map[g_map_size];
 static auto g_msg = std::string(R"%({"msg":"hello world"})%");
 static std::map<intel_x64::msrs::field_type, intel_x64::msrs::value_type> g_msrs;
@@ -78,6 +84,12 @@ test_vmread(uint64_t field, uint64_t *val) noexcept
         case vmcs::guest_physical_address::addr:
             *val = 0x0;
             break;
+        case vmcs::cr0_guest_host_mask::addr:
+            *val = g_cr0_guest_host_mask;
+            break;
+        case vmcs::cr4_guest_host_mask::addr:
+            *val = g_cr4_guest_host_mask;
+            break;
         default:
             g_field = field;
             *val = g_value;
@@ -132,6 +144,10 @@ static void
 test_invlpg(const void *addr) noexcept
 { bfignored(addr); }
 
+static void
+test_vmcs_resume(state_save_intel_x64 *state_save) noexcept
+{ bfignored(state_save); }
+
 static void
 setup_intrinsics(MockRepository &mocks)
 {
@@ -235,6 +251,8 @@ setup_pt(MockRepository &mocks)
 
     mocks.OnCall(pt, root_page_table_x64::map_4k);
     mocks.OnCall(pt, root_page_table_x64::unmap);
+    mocks.OnCall(pt, root_page_table_x64::map_range);
+    mocks.OnCall(pt, root_page_table_x64::unmap_range);
 
     return pt;
 }
@@ -246,7 +264,7 @@ TEST_CASE("exit_handler: vm_exit_reason_unknown")
     auto vmcs = setup_vmcs_unhandled(mocks, 0x0000BEEF);
     auto ehlr = setup_ehlr(vmcs);
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 }
 
 TEST_CASE("exit_handler: vm_exit_reason_cpuid")
@@ -256,7 +274,7 @@ TEST_CASE("exit_handler: vm_exit_reason_cpuid")
     auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::cpuid);
     auto ehlr = setup_ehlr(vmcs);
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
 }
 
@@ -267,7 +285,7 @@ TEST_CASE("exit_handler: vm_exit_reason_invd")
     auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::invd);
     auto ehlr = setup_ehlr(vmcs);
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
 }
 
@@ -281,7 +299,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_invalid_opcode")
     ehlr.m_state_save->rax = 0x0000BEEF;
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -296,7 +314,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_invalid_magic")
     ehlr.m_state_save->rax = VMCALL_VERSIONS;
     ehlr.m_state_save->rdx = 0;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -312,7 +330,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_protocol_version")
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;
     ehlr.m_state_save->rcx = 0;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 
@@ -332,7 +350,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_bareflank_version")
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;
     ehlr.m_state_save->rcx = 1;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 
@@ -352,7 +370,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_user_version")
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;
     ehlr.m_state_save->rcx = 10;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 
@@ -372,7 +390,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_unknown_version")
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;
     ehlr.m_state_save->rcx = 0x0000BEEF;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -398,7 +416,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_registers")
     ehlr.m_state_save->r14 = 10;
     ehlr.m_state_save->r15 = 11;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 }
@@ -414,12 +432,12 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_unittest")
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;
 
 #ifdef INCLUDE_LIBCXX_UNITTESTS
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 
 #else
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 
@@ -436,7 +454,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_event")
     ehlr.m_state_save->rax = VMCALL_EVENT;
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 }
@@ -451,7 +469,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_start")
     ehlr.m_state_save->rax = VMCALL_START;
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 }
@@ -462,11 +480,14 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_stop")
     setup_intrinsics(mocks);
     auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::vmcall);
     auto ehlr = setup_ehlr(vmcs);
+    auto mm = setup_mm(mocks);
+
+    mocks.ExpectCall(mm, memory_manager_x64::refill_zeroed_pages);
 
     ehlr.m_state_save->rax = VMCALL_STOP;
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 }
@@ -491,7 +512,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_unknown")
 
     memcpy(static_cast<char *>(g_map), g_msg.data(), g_msg.size());
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -513,7 +534,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_unformatted_input_nul
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -535,7 +556,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_unformatted_output_nu
     ehlr.m_state_save->r11 = 0;                                  // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -557,7 +578,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_unformatted_input_siz
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -579,7 +600,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_unformatted_output_si
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = 0;                                  // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -601,7 +622,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_unformatted_output_si
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = 5;                                  // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -623,7 +644,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_unformatted_input_siz
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = VMCALL_IN_BUFFER_SIZE + 1;          // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -645,7 +666,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_unformatted_output_si
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = VMCALL_OUT_BUFFER_SIZE + 1;         // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -667,7 +688,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_unformatted_map_fails
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -693,7 +714,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_unformatted_success")
 
     memcpy(static_cast<char *>(g_map), g_msg.data(), g_msg.size());
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 }
@@ -715,7 +736,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_input_nullptr")
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -737,7 +758,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_output_nullptr")
     ehlr.m_state_save->r11 = 0;                                  // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -759,7 +780,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_input_size_0")
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -781,7 +802,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_output_size_0")
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = 0;                                  // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -803,7 +824,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_output_size_too_
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = 5;                                  // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -825,7 +846,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_input_size_too_b
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = VMCALL_IN_BUFFER_SIZE + 1;          // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -847,7 +868,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_output_size_too_
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = VMCALL_OUT_BUFFER_SIZE + 1;         // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -869,7 +890,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_map_fails")
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -894,7 +915,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_invalid")
     std::string msg = "hello world";
     memcpy(static_cast<char *>(g_map), msg.data(), msg.size());
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -920,11 +941,94 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_string_json_success")
 
     memcpy(static_cast<char *>(g_map), g_msg.data(), g_msg.size());
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 }
 
+TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_memory_manager_stats_success")
+{
+    bool map_success = true;
+
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::vmcall);
+    auto ehlr = setup_ehlr(vmcs);
+    auto mm = setup_mm(mocks, map_success);
+    setup_pt(mocks);
+
+    memory_manager_x64::stats_type stats;
+    stats.heap.total_size = 0x1000;
+    stats.heap.used = 0x100;
+    stats.heap.largest_free = 0x800;
+    stats.allocs = 42;
+    stats.zeroed_hits = 10;
+    stats.num_segments = 1;
+    stats.phys_index_bytes = 0x3000;
+    stats.segments.used = 0x2000;
+    stats.histogram.at(6) = 42;
+
+    mem_pool_stats segment;
+    segment.used = 0x2000;
+
+    mocks.OnCall(mm, memory_manager_x64::stats).Return(stats);
+    mocks.ExpectCall(mm, memory_manager_x64::segment_stats).With(0UL).Return(segment);
+
+    ehlr.m_state_save->rax = VMCALL_DATA;                        // r00
+    ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;                // r01
+    ehlr.m_state_save->rsi = VMCALL_DATA_MEMORY_MANAGER_STATS;   // r04
+    ehlr.m_state_save->r08 = reinterpret_cast<uint64_t>(g_map);  // r05
+    ehlr.m_state_save->r09 = g_msg.size();                       // r06
+    ehlr.m_state_save->r11 = reinterpret_cast<uint64_t>(g_map);  // r08
+    ehlr.m_state_save->r12 = g_map_size;                         // r09
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK(ehlr.m_state_save->rip == g_rip);
+    CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
+    CHECK(ehlr.m_state_save->r10 == VMCALL_DATA_STRING_JSON);
+
+    auto &&ojson = json::parse(std::string(static_cast<char *>(g_map), ehlr.m_state_save->r12));
+    CHECK(ojson["allocs"] == 42);
+    CHECK(ojson["zeroed_hits"] == 10);
+    CHECK(ojson["segments"].size() == 1);
+    CHECK(ojson["segments"][0]["used"] == 0x2000);
+    CHECK(ojson["segments_total"]["used"] == 0x2000);
+    CHECK(ojson["phys_index_bytes"] == 0x3000);
+    CHECK(ojson["histogram"]["64"] == 42);
+    CHECK(ojson["heap"]["used"] == 0x100);
+    CHECK(ojson["heap"]["fragmentation"] == 47);
+    CHECK(ojson["guest_tlb"]["hits"] == 0);
+    CHECK(ojson["guest_tlb"]["misses"] == 0);
+    CHECK(ojson["tlb"].count("issued") == 1);
+    CHECK(ojson["tlb"].count("saved") == 1);
+}
+
+TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_memory_manager_stats_output_size_too_small")
+{
+    bool map_success = true;
+
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::vmcall);
+    auto ehlr = setup_ehlr(vmcs);
+    auto mm = setup_mm(mocks, map_success);
+    setup_pt(mocks);
+
+    mocks.OnCall(mm, memory_manager_x64::stats).Return(memory_manager_x64::stats_type{});
+
+    ehlr.m_state_save->rax = VMCALL_DATA;                        // r00
+    ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;                // r01
+    ehlr.m_state_save->rsi = VMCALL_DATA_MEMORY_MANAGER_STATS;   // r04
+    ehlr.m_state_save->r08 = reinterpret_cast<uint64_t>(g_map);  // r05
+    ehlr.m_state_save->r09 = g_msg.size();                       // r06
+    ehlr.m_state_save->r11 = reinterpret_cast<uint64_t>(g_map);  // r08
+    ehlr.m_state_save->r12 = g_msg.size();                       // r09
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK(ehlr.m_state_save->rip == g_rip);
+    CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
+}
+
 TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_input_nullptr")
 {
     MockRepository mocks;
@@ -942,7 +1046,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_input_nullp
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -964,7 +1068,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_output_null
     ehlr.m_state_save->r11 = 0;                                  // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -986,7 +1090,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_input_size_
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -1008,7 +1112,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_output_size
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = 0;                                  // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -1030,7 +1134,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_output_size
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = 5;                                  // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -1052,7 +1156,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_input_size_
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = VMCALL_IN_BUFFER_SIZE + 1;          // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -1074,7 +1178,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_output_size
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = VMCALL_OUT_BUFFER_SIZE + 1;         // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -1096,7 +1200,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_map_fails")
     ehlr.m_state_save->r11 = 0x1234U;                            // r08
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_FAILURE);
 }
@@ -1122,7 +1226,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_data_unformatted_success")
 
     memcpy(static_cast<char *>(g_map), g_msg.data(), g_msg.size());
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(ehlr.m_state_save->rip == g_rip);
     CHECK(bfscast(int64_t, ehlr.m_state_save->rdx) == BF_VMCALL_SUCCESS);
 }
@@ -1147,7 +1251,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_data_unknown_type")
     ehlr.m_state_save->r12 = g_msg.size();                       // r09
 
     memcpy(static_cast<char *>(g_map), g_msg.data(), g_msg.size());
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 }
 
 TEST_CASE("exit_handler: vm_exit_reason_vmcall_unittests")
@@ -1160,7 +1264,84 @@ TEST_CASE("exit_handler: vm_exit_reason_vmcall_unittests")
     ehlr.m_state_save->rax = VMCALL_DATA;                        // r00
     ehlr.m_state_save->rdx = VMCALL_MAGIC_NUMBER;                // r01
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+}
+
+TEST_CASE("exit_handler: vm_exit_reason_invlpg_invalidates_guest_tlb")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_unhandled(mocks, exit_reason::basic_exit_reason::invlpg);
+    auto ehlr = setup_ehlr(vmcs);
+
+    guest_tlb_x64::entry_type entry;
+    entry.cr3 = 0x1000;
+    entry.virt = 0x2000;
+    entry.phys = 0x3000;
+    entry.size = 0x1000;
+
+    ehlr.m_guest_tlb.insert(entry);
+    g_exit_qualification = 0x2010;
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK_FALSE(ehlr.m_guest_tlb.lookup(0x1000, 0x2000, entry));
+}
+
+TEST_CASE("exit_handler: vm_exit_reason_mov_to_cr_flushes_guest_tlb")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_unhandled(mocks, exit_reason::basic_exit_reason::control_register_accesses);
+    auto ehlr = setup_ehlr(vmcs);
+
+    guest_tlb_x64::entry_type entry;
+    entry.cr3 = 0x1000;
+    entry.virt = 0x2000;
+    entry.phys = 0x3000;
+    entry.size = 0x1000;
+
+    ehlr.m_guest_tlb.insert(entry);
+    g_exit_qualification = 0x3;
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK_FALSE(ehlr.m_guest_tlb.lookup(0x1000, 0x2000, entry));
+}
+
+class guest_tlb_exit_handler : public exit_handler_intel_x64
+{
+public:
+    using exit_handler_intel_x64::guest_tlb;
+};
+
+TEST_CASE("exit_handler: guest_tlb")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    auto cr0_mask = intel_x64::cr0::paging::mask;
+    auto cr4_mask = intel_x64::cr4::page_global_enable::mask | intel_x64::cr4::pcid_enable_bit::mask |
+                    intel_x64::cr4::physical_address_extensions::mask;
+
+    guest_tlb_exit_handler ehlr;
+
+    g_value = 0xFFFFFFFFFFFFFFFF;
+    g_cr0_guest_host_mask = cr0_mask;
+    g_cr4_guest_host_mask = cr4_mask;
+    CHECK(ehlr.guest_tlb() == &ehlr.m_guest_tlb);
+
+    g_cr0_guest_host_mask = 0;
+    CHECK(ehlr.guest_tlb() == nullptr);
+
+    g_cr0_guest_host_mask = cr0_mask;
+    g_cr4_guest_host_mask = intel_x64::cr4::page_global_enable::mask;
+    CHECK(ehlr.guest_tlb() == nullptr);
+
+    g_cr4_guest_host_mask = cr4_mask;
+    g_value = 0;
+    CHECK(ehlr.guest_tlb() == nullptr);
+
+    g_cr0_guest_host_mask = 0;
+    g_cr4_guest_host_mask = 0;
 }
 
 TEST_CASE("exit_handler: vm_exit_reason_vmxoff")
@@ -1170,7 +1351,7 @@ TEST_CASE("exit_handler: vm_exit_reason_vmxoff")
     auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::vmxoff);
     auto ehlr = setup_ehlr(vmcs);
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 }
 
 TEST_CASE("exit_handler: vm_exit_reason_rdmsr_debug_ctl")
@@ -1183,7 +1364,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_debug_ctl")
     g_value = 0x0000000200000001;
     ehlr.m_state_save->rcx = intel_x64::msrs::ia32_debugctl::addr;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_debugctl::addr);
     CHECK(ehlr.m_state_save->rax == 0x1);
@@ -1203,7 +1384,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_pat")
     g_msrs[intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] =
         intel_x64::msrs::ia32_vmx_true_entry_ctls::load_ia32_pat::mask << 32;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_pat::addr);
     CHECK(ehlr.m_state_save->rax == 0x2);
@@ -1223,7 +1404,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_efer")
     g_msrs[intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] =
         intel_x64::msrs::ia32_vmx_true_entry_ctls::load_ia32_efer::mask << 32;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_efer::addr);
     CHECK(ehlr.m_state_save->rax == 0x3);
@@ -1243,7 +1424,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_perf")
     g_msrs[intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] =
         intel_x64::msrs::ia32_vmx_true_entry_ctls::load_ia32_perf_global_ctrl::mask << 32;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_perf_global_ctrl::addr);
     CHECK(ehlr.m_state_save->rax == 0x3);
@@ -1261,7 +1442,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_cs")
     g_value = 0x0000000500000004;
     ehlr.m_state_save->rcx = intel_x64::msrs::ia32_sysenter_cs::addr;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_sysenter_cs::addr);
     CHECK(ehlr.m_state_save->rax == 0x4);
@@ -1279,7 +1460,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_esp")
     g_value = 0x0000000600000005;
     ehlr.m_state_save->rcx = intel_x64::msrs::ia32_sysenter_esp::addr;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_sysenter_esp::addr);
     CHECK(ehlr.m_state_save->rax == 0x5);
@@ -1297,7 +1478,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_eip")
     g_value = 0x0000000700000006;
     ehlr.m_state_save->rcx = intel_x64::msrs::ia32_sysenter_eip::addr;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_sysenter_eip::addr);
     CHECK(ehlr.m_state_save->rax == 0x6);
@@ -1315,7 +1496,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_fs_base")
     g_value = 0x0000000800000007;
     ehlr.m_state_save->rcx = intel_x64::msrs::ia32_fs_base::addr;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_fs_base::addr);
     CHECK(ehlr.m_state_save->rax == 0x7);
@@ -1333,7 +1514,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_gs_base")
     g_value = 0x0000000900000008;
     ehlr.m_state_save->rcx = intel_x64::msrs::ia32_gs_base::addr;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_gs_base::addr);
     CHECK(ehlr.m_state_save->rax == 0x8);
@@ -1351,7 +1532,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_default")
     g_msrs[0x10] = 0x0000000A00000009;
     ehlr.m_state_save->rcx = 0x10;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(ehlr.m_state_save->rax == 0x9);
     CHECK(ehlr.m_state_save->rdx == 0xA);
@@ -1368,7 +1549,7 @@ TEST_CASE("exit_handler: vm_exit_reason_rdmsr_ignore")
     g_msrs[0x31] = 0x0;
     ehlr.m_state_save->rcx = 0x31;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(ehlr.m_state_save->rax == 0);
     CHECK(ehlr.m_state_save->rdx == 0);
@@ -1386,7 +1567,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_debug_ctrl")
     ehlr.m_state_save->rax = 0x1;
     ehlr.m_state_save->rdx = 0x2;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_debugctl::addr);
     CHECK(g_value == 0x0000000200000001);
@@ -1406,7 +1587,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_pat")
     g_msrs[intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] =
         intel_x64::msrs::ia32_vmx_true_entry_ctls::load_ia32_pat::mask << 32;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_pat::addr);
     CHECK(g_value == 0x0000000300000002);
@@ -1426,7 +1607,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_efer")
     g_msrs[intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] =
         intel_x64::msrs::ia32_vmx_true_entry_ctls::load_ia32_efer::mask << 32;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_efer::addr);
     CHECK(g_value == 0x0000000400000003);
@@ -1446,7 +1627,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_perf")
     g_msrs[intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] =
         intel_x64::msrs::ia32_vmx_true_entry_ctls::load_ia32_perf_global_ctrl::mask << 32;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_perf_global_ctrl::addr);
     CHECK(g_value == 0x0000000400000003);
@@ -1464,7 +1645,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_cs")
     ehlr.m_state_save->rax = 0x4;
     ehlr.m_state_save->rdx = 0x5;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_sysenter_cs::addr);
     CHECK(g_value == 0x0000000500000004);
@@ -1482,7 +1663,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_esp")
     ehlr.m_state_save->rax = 0x5;
     ehlr.m_state_save->rdx = 0x6;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_sysenter_esp::addr);
     CHECK(g_value == 0x0000000600000005);
@@ -1500,7 +1681,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_eip")
     ehlr.m_state_save->rax = 0x6;
     ehlr.m_state_save->rdx = 0x7;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_ia32_sysenter_eip::addr);
     CHECK(g_value == 0x0000000700000006);
@@ -1518,7 +1699,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_fs_base")
     ehlr.m_state_save->rax = 0x7;
     ehlr.m_state_save->rdx = 0x8;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_fs_base::addr);
     CHECK(g_value == 0x0000000800000007);
@@ -1536,7 +1717,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_gs_base")
     ehlr.m_state_save->rax = 0x8;
     ehlr.m_state_save->rdx = 0x9;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 
     CHECK(g_field == vmcs::guest_gs_base::addr);
     CHECK(g_value == 0x0000000900000008);
@@ -1554,7 +1735,7 @@ TEST_CASE("exit_handler: vm_exit_reason_wrmsr_default")
     ehlr.m_state_save->rax = 0x9;
     ehlr.m_state_save->rdx = 0xA;
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
     CHECK(g_msrs[0x10] == 0x0000000A00000009);
     CHECK(ehlr.m_state_save->rip == g_rip);
 }
@@ -1568,7 +1749,7 @@ TEST_CASE("exit_handler: vm_exit_failure_check")
 
     mocks.OnCallFunc(vmcs::check::all).Do(test_vmcs_check_all);
 
-    CHECK_NOTHROW(ehlr.dispatch());
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
 }
 
 TEST_CASE("exit_handler: halt")
@@ -1581,4 +1762,350 @@ TEST_CASE("exit_handler: halt")
     CHECK_NOTHROW(ehlr.halt());
 }
 
+static bool
+test_handler_pass(gsl::not_null<exit_handler_intel_x64 *> ehlr, void *data)
+{
+    bfignored(ehlr);
+
+    (*static_cast<int *>(data))++;
+    return false;
+}
+
+static bool
+test_handler_handle(gsl::not_null<exit_handler_intel_x64 *> ehlr, void *data)
+{
+    bfignored(ehlr);
+
+    (*static_cast<int *>(data))++;
+    return true;
+}
+
+TEST_CASE("exit_handler: add_handler passes the exit down the chain")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::cpuid);
+    auto ehlr = setup_ehlr(vmcs);
+
+    auto count = 0;
+    ehlr.add_handler(exit_reason::basic_exit_reason::cpuid, test_handler_pass, &count);
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK(count == 1);
+    CHECK(ehlr.m_state_save->rip == g_rip);
+}
+
+TEST_CASE("exit_handler: add_handler handles the exit")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::cpuid);
+    auto ehlr = setup_ehlr(vmcs);
+
+    auto count = 0;
+    ehlr.add_handler(exit_reason::basic_exit_reason::cpuid, test_handler_handle, &count);
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK(count == 1);
+    CHECK(ehlr.m_state_save->rip == g_rip - g_exit_instruction_length);
+}
+
+TEST_CASE("exit_handler: add_handler for an unimplemented exit")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::rdtsc);
+    auto ehlr = setup_ehlr(vmcs);
+
+    auto count = 0;
+    ehlr.add_handler(exit_reason::basic_exit_reason::rdtsc, test_handler_handle, &count);
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK(count == 1);
+}
+
+TEST_CASE("exit_handler: add_handler invalid")
+{
+    exit_handler_intel_x64 ehlr;
+
+    auto count = 0;
+
+    CHECK_THROWS(ehlr.add_handler(EXIT_HANDLER_NUM_EXIT_REASONS, test_handler_handle, &count));
+    CHECK_THROWS(ehlr.add_handler(exit_reason::basic_exit_reason::cpuid, nullptr));
+    CHECK_THROWS(ehlr.remove_handler(EXIT_HANDLER_NUM_EXIT_REASONS, test_handler_handle, &count));
+}
+
+TEST_CASE("exit_handler: remove_handler first handler")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::cpuid);
+    auto ehlr = setup_ehlr(vmcs);
+
+    auto count1 = 0;
+    auto count2 = 0;
+
+    ehlr.add_handler(exit_reason::basic_exit_reason::cpuid, test_handler_pass, &count1);
+    ehlr.add_handler(exit_reason::basic_exit_reason::cpuid, test_handler_handle, &count2);
+    ehlr.remove_handler(exit_reason::basic_exit_reason::cpuid, test_handler_handle, &count2);
+    ehlr.remove_handler(exit_reason::basic_exit_reason::cpuid, test_handler_handle, &count1);
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK(count1 == 1);
+    CHECK(count2 == 0);
+    CHECK(ehlr.m_state_save->rip == g_rip);
+}
+
+TEST_CASE("exit_handler: remove_handler chained handler")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_handled(mocks, exit_reason::basic_exit_reason::cpuid);
+    auto ehlr = setup_ehlr(vmcs);
+
+    auto count1 = 0;
+    auto count2 = 0;
+
+    ehlr.add_handler(exit_reason::basic_exit_reason::cpuid, test_handler_handle, &count1);
+    ehlr.add_handler(exit_reason::basic_exit_reason::cpuid, test_handler_pass, &count2);
+    ehlr.remove_handler(exit_reason::basic_exit_reason::cpuid, test_handler_handle, &count1);
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK(count1 == 0);
+    CHECK(count2 == 1);
+    CHECK(ehlr.m_state_save->rip == g_rip);
+}
+
+TEST_CASE("exit_handler: remove_handler last handler")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_unhandled(mocks, exit_reason::basic_exit_reason::rdtsc);
+    auto ehlr = setup_ehlr(vmcs);
+
+    auto count = 0;
+
+    ehlr.add_handler(exit_reason::basic_exit_reason::rdtsc, test_handler_handle, &count);
+    ehlr.remove_handler(exit_reason::basic_exit_reason::rdtsc, test_handler_handle, &count);
+
+    CHECK_NOTHROW(ehlr.dispatch(g_exit_reason));
+    CHECK(count == 0);
+}
+
+TEST_CASE("exit_handler: dispatch_fast")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_halt(mocks, exit_reason::basic_exit_reason::cpuid);
+    auto ehlr = setup_ehlr(vmcs);
+
+    mocks.ExpectCallFunc(vmcs_resume).With(&g_state_save).Do(test_vmcs_resume);
+
+    auto count = 0;
+
+    CHECK_FALSE(ehlr.dispatch_fast(g_exit_reason));
+
+    ehlr.set_fast_handler(exit_reason::basic_exit_reason::cpuid, test_handler_pass, &count);
+    CHECK_FALSE(ehlr.dispatch_fast(g_exit_reason));
+    CHECK(count == 1);
+
+    ehlr.set_fast_handler(exit_reason::basic_exit_reason::cpuid, test_handler_handle, &count);
+    CHECK(ehlr.dispatch_fast(g_exit_reason));
+    CHECK(count == 2);
+
+    ehlr.set_fast_handler(exit_reason::basic_exit_reason::cpuid, nullptr);
+    CHECK_FALSE(ehlr.dispatch_fast(g_exit_reason));
+    CHECK(count == 2);
+}
+
+TEST_CASE("exit_handler: dispatch_fast unknown exit reason")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto vmcs = setup_vmcs_halt(mocks, 0x0000BEEF);
+    auto ehlr = setup_ehlr(vmcs);
+
+    CHECK_FALSE(ehlr.dispatch_fast(g_exit_reason));
+}
+
+TEST_CASE("exit_handler: dispatch_fast resume fails")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    auto vmcs = mocks.Mock<vmcs_intel_x64>();
+    mocks.NeverCall(vmcs, vmcs_intel_x64::resume);
+    mocks.ExpectCallFunc(vmcs_resume).Do(test_vmcs_resume);
+
+    g_msrs[intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] = 0xFFFFFFFFFFFFFFFFUL;
+    g_exit_reason = exit_reason::basic_exit_reason::cpuid;
+
+    auto ehlr = setup_ehlr(vmcs);
+    auto count = 0;
+
+    ehlr.set_fast_handler(exit_reason::basic_exit_reason::cpuid, test_handler_handle, &count);
+
+    CHECK(ehlr.dispatch_fast(g_exit_reason));
+    CHECK(count == 1);
+}
+
+TEST_CASE("exit_handler: entry_fast_resume_fails")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    auto vmcs = mocks.Mock<vmcs_intel_x64>();
+    mocks.NeverCall(vmcs, vmcs_intel_x64::resume);
+    mocks.ExpectCallFunc(vmcs_resume).Do(test_vmcs_resume);
+
+    g_msrs[intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] = 0xFFFFFFFFFFFFFFFFUL;
+    g_exit_reason = exit_reason::basic_exit_reason::cpuid;
+
+    auto ehlr = setup_ehlr(vmcs);
+    auto rip = ehlr.m_state_save->rip;
+    auto count = 0;
+
+    ehlr.set_fast_handler(exit_reason::basic_exit_reason::cpuid, test_handler_handle, &count);
+
+    CHECK_NOTHROW(exit_handler(&ehlr));
+    CHECK(count == 1);
+    CHECK(ehlr.m_state_save->rip == rip);
+}
+
+TEST_CASE("exit_handler: dispatch maintains the memory manager")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+    auto mm = setup_mm(mocks);
+
+    auto vmcs = mocks.Mock<vmcs_intel_x64>();
+    mocks.OnCall(vmcs, vmcs_intel_x64::resume);
+    mocks.ExpectCall(mm, memory_manager_x64::maintain);
+    mocks.NeverCall(mm, memory_manager_x64::refill_zeroed_pages);
+
+    g_exit_reason = exit_reason::basic_exit_reason::cpuid;
+    auto ehlr = setup_ehlr(vmcs);
+
+    CHECK_NOTHROW([&] {
+        for (auto i = 0; i < EXIT_HANDLER_MAINTENANCE_INTERVAL; i++) {
+            ehlr.dispatch(g_exit_reason);
+        }
+    }());
+}
+
+TEST_CASE("exit_handler: set_fast_handler invalid")
+{
+    exit_handler_intel_x64 ehlr;
+
+    CHECK_THROWS(ehlr.set_fast_handler(EXIT_HANDLER_NUM_EXIT_REASONS, test_handler_handle));
+    CHECK_THROWS(ehlr.set_fast_handler(exit_reason::basic_exit_reason::invlpg, test_handler_handle));
+    CHECK_THROWS(ehlr.set_fast_handler(exit_reason::basic_exit_reason::invpcid, test_handler_handle));
+    CHECK_THROWS(ehlr.set_fast_handler(exit_reason::basic_exit_reason::control_register_accesses, test_handler_handle));
+}
+
+// The following compares the cost of dispatching a CPUID exit using the
+// handler table, the fast path, and the switch that handle_exit used before
+// the table was added. The VMCS is mocked, so this measures the dispatch
+// itself (plus the mocked VMREADs), and not the cost of a VM exit. It is
+// hidden as it only reports timings; run it with "[benchmark]".
+
+class switch_exit_handler : public exit_handler_intel_x64
+{
+public:
+
+    static bool
+    handle_cpuid_fast(gsl::not_null<exit_handler_intel_x64 *> ehlr, void *data)
+    {
+        bfignored(data);
+
+        static_cast<switch_exit_handler *>(ehlr.get())->handle_cpuid();
+        return true;
+    }
+
+protected:
+
+    void handle_exit(vmcs::value_type reason) override
+    {
+        switch (reason) {
+            case vmcs::exit_reason::basic_exit_reason::cpuid:
+                handle_cpuid();
+                break;
+
+            case vmcs::exit_reason::basic_exit_reason::invd:
+                handle_invd();
+                break;
+
+            case vmcs::exit_reason::basic_exit_reason::vmcall:
+                handle_vmcall();
+                break;
+
+            case vmcs::exit_reason::basic_exit_reason::vmxoff:
+                handle_vmxoff();
+                break;
+
+            case vmcs::exit_reason::basic_exit_reason::rdmsr:
+                handle_rdmsr();
+                break;
+
+            case vmcs::exit_reason::basic_exit_reason::wrmsr:
+                handle_wrmsr();
+                break;
+
+            default:
+                unimplemented_handler();
+                break;
+        };
+
+        m_vmcs->resume();
+    }
+};
+
+TEST_CASE("exit_handler: dispatch benchmark", "[.][benchmark]")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    auto vmcs = mocks.Mock<vmcs_intel_x64>();
+    mocks.OnCall(vmcs, vmcs_intel_x64::resume);
+    mocks.OnCallFunc(vmcs_resume).Do(test_vmcs_resume);
+
+    g_exit_reason = exit_reason::basic_exit_reason::cpuid;
+    constexpr const auto num_exits = 100000UL;
+
+    exit_handler_intel_x64 ehlr;
+    ehlr.set_vmcs(vmcs);
+    ehlr.set_state_save(&g_state_save);
+
+    switch_exit_handler sw;
+    sw.set_vmcs(vmcs);
+    sw.set_state_save(&g_state_save);
+    sw.set_fast_handler(exit_reason::basic_exit_reason::cpuid, switch_exit_handler::handle_cpuid_fast);
+
+    auto rip = g_state_save.rip;
+
+    auto &&switch_time = time_it([&] {
+        for (auto i = 0UL; i < num_exits; i++) {
+            sw.dispatch(g_exit_reason);
+        }
+    });
+
+    auto &&table_time = time_it([&] {
+        for (auto i = 0UL; i < num_exits; i++) {
+            ehlr.dispatch(g_exit_reason);
+        }
+    });
+
+    auto &&fast_time = time_it([&] {
+        for (auto i = 0UL; i < num_exits; i++) {
+            sw.dispatch_fast(g_exit_reason);
+        }
+    });
+
+    WARN(num_exits << " cpuid exits, switch: " << switch_time << "us");
+    WARN(num_exits << " cpuid exits, table: " << table_time << "us");
+    WARN(num_exits << " cpuid exits, fast path: " << fast_time << "us");
+
+    CHECK(g_state_save.rip == rip + num_exits * 3 * g_exit_instruction_length);
+}
+
 #endif
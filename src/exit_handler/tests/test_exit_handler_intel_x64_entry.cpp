@@ -28,13 +28,63 @@
 
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
+using namespace intel_x64;
+
+static bool
+test_vmread_cpuid(uint64_t field, uint64_t *val) noexcept
+{
+    if (field != vmcs::exit_reason::addr) {
+        return false;
+    }
+
+    *val = vmcs::exit_reason::basic_exit_reason::cpuid;
+    return true;
+}
+
+static bool
+test_vmread_fails(uint64_t field, uint64_t *val) noexcept
+{
+    bfignored(field);
+    bfignored(val);
+
+    return false;
+}
+
 TEST_CASE("exit_handler: entry_valid")
 {
     MockRepository mocks;
     auto eh = mocks.Mock<exit_handler_intel_x64>();
 
+    mocks.ExpectCallFunc(_vmread).Do(test_vmread_cpuid);
+    mocks.OnCall(eh, exit_handler_intel_x64::halt);
+    mocks.ExpectCall(eh, exit_handler_intel_x64::dispatch_fast).With(vmcs::exit_reason::basic_exit_reason::cpuid).Return(false);
+    mocks.ExpectCall(eh, exit_handler_intel_x64::dispatch).With(vmcs::exit_reason::basic_exit_reason::cpuid);
+
+    CHECK_NOTHROW(exit_handler(eh));
+}
+
+TEST_CASE("exit_handler: entry_exit_reason_fails")
+{
+    MockRepository mocks;
+    auto eh = mocks.Mock<exit_handler_intel_x64>();
+
+    mocks.OnCallFunc(_vmread).Do(test_vmread_fails);
+    mocks.ExpectCall(eh, exit_handler_intel_x64::halt);
+    mocks.NeverCall(eh, exit_handler_intel_x64::dispatch_fast);
+    mocks.NeverCall(eh, exit_handler_intel_x64::dispatch);
+
+    CHECK_NOTHROW(exit_handler(eh));
+}
+
+TEST_CASE("exit_handler: entry_fast")
+{
+    MockRepository mocks;
+    auto eh = mocks.Mock<exit_handler_intel_x64>();
+
+    mocks.OnCallFunc(_vmread).Do(test_vmread_cpuid);
     mocks.OnCall(eh, exit_handler_intel_x64::halt);
-    mocks.OnCall(eh, exit_handler_intel_x64::dispatch);
+    mocks.ExpectCall(eh, exit_handler_intel_x64::dispatch_fast).Return(true);
+    mocks.NeverCall(eh, exit_handler_intel_x64::dispatch);
 
     CHECK_NOTHROW(exit_handler(eh));
 }
@@ -44,7 +94,9 @@ TEST_CASE("exit_handler: entry_throws_invalid_argument")
     MockRepository mocks;
     auto eh = mocks.Mock<exit_handler_intel_x64>();
 
+    mocks.OnCallFunc(_vmread).Do(test_vmread_cpuid);
     mocks.ExpectCall(eh, exit_handler_intel_x64::halt);
+    mocks.OnCall(eh, exit_handler_intel_x64::dispatch_fast).Return(false);
     mocks.OnCall(eh, exit_handler_intel_x64::dispatch).Throw(std::invalid_argument(""));
 
     CHECK_NOTHROW(exit_handler(eh));
@@ -55,7 +107,9 @@ TEST_CASE("exit_handler: entry_throws_standard_exception")
     MockRepository mocks;
     auto eh = mocks.Mock<exit_handler_intel_x64>();
 
+    mocks.OnCallFunc(_vmread).Do(test_vmread_cpuid);
     mocks.ExpectCall(eh, exit_handler_intel_x64::halt);
+    mocks.OnCall(eh, exit_handler_intel_x64::dispatch_fast).Return(false);
     mocks.OnCall(eh, exit_handler_intel_x64::dispatch).Throw(std::exception());
 
     CHECK_NOTHROW(exit_handler(eh));
@@ -66,7 +120,9 @@ TEST_CASE("exit_handler: entry_throws_any_exception")
     MockRepository mocks;
     auto eh = mocks.Mock<exit_handler_intel_x64>();
 
+    mocks.OnCallFunc(_vmread).Do(test_vmread_cpuid);
     mocks.ExpectCall(eh, exit_handler_intel_x64::halt);
+    mocks.OnCall(eh, exit_handler_intel_x64::dispatch_fast).Return(false);
     mocks.OnCall(eh, exit_handler_intel_x64::dispatch).Throw(10);
 
     CHECK_NOTHROW(exit_handler(eh));
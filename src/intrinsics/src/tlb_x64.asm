@@ -28,3 +28,8 @@ global _invlpg:function
 _invlpg:
     invlpg [rdi]
     ret
+
+global _invpcid:function
+_invpcid:
+    invpcid rdi, [rsi]
+    ret
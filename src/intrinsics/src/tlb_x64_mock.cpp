@@ -32,3 +32,13 @@ _invlpg(const void *virt) noexcept
     std::cerr << __BFFUNC__ << " called" << '\n';
     abort();
 }
+
+extern "C" void
+_invpcid(uint64_t type, const void *descriptor) noexcept
+{
+    (void) type;
+    (void) descriptor;
+
+    std::cerr << __BFFUNC__ << " called" << '\n';
+    abort();
+}
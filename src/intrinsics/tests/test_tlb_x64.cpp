@@ -23,18 +23,31 @@
 #include <hippomocks.h>
 #include <intrinsics/x86/common_x64.h>
 
+#include <cstring>
+
 #ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
 
 using namespace x64;
 
+static uint64_t g_type = 0;
+static uint64_t g_descriptor[2] = {};
+
 void
 test_invlpg(const void *virt) noexcept
 { (void) virt; }
 
+void
+test_invpcid(uint64_t type, const void *descriptor) noexcept
+{
+    g_type = type;
+    memcpy(static_cast<void *>(g_descriptor), descriptor, sizeof(g_descriptor));
+}
+
 static void
 setup_intrinsics(MockRepository &mocks)
 {
     mocks.OnCallFunc(_invlpg).Do(test_invlpg);
+    mocks.OnCallFunc(_invpcid).Do(test_invpcid);
 }
 
 TEST_CASE("tlb_x64_invlpg")
@@ -46,4 +59,26 @@ TEST_CASE("tlb_x64_invlpg")
     CHECK_NOTHROW(tlb::invlpg(&test));
 }
 
+TEST_CASE("tlb_x64_invpcid")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    tlb::invpcid_individual_address(1, 0x1000);
+    CHECK(g_type == 0);
+    CHECK(g_descriptor[0] == 1);
+    CHECK(g_descriptor[1] == 0x1000);
+
+    tlb::invpcid_single_context(2);
+    CHECK(g_type == 1);
+    CHECK(g_descriptor[0] == 2);
+    CHECK(g_descriptor[1] == 0);
+
+    tlb::invpcid_all_contexts_global();
+    CHECK(g_type == 2);
+
+    tlb::invpcid_all_contexts();
+    CHECK(g_type == 3);
+}
+
 #endif
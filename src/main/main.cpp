@@ -26,11 +26,63 @@
 #include <bfsupport.h>
 #include <bfexception.h>
 
+#include <mutex>
+
 #include <user_data.h>
 
 #include <vcpu/vcpu_manager.h>
 #include <debug_ring/debug_ring.h>
+#include <memory_manager/direct_map_x64.h>
 #include <memory_manager/memory_manager_x64.h>
+#include <memory_manager/root_page_table_x64.h>
+
+// Adds a list of memory descriptors in a single request, where arg1 is the
+// address of the list and arg2 is the number of descriptors in the list.
+// Drivers that do not know about this request can continue to use
+// BF_REQUEST_ADD_MDL one descriptor at a time.
+
+#ifndef BF_REQUEST_ADD_MDL_BATCH
+#define BF_REQUEST_ADD_MDL_BATCH 0x100
+#endif
+
+// Adds a list of memory descriptor ranges in a single request, where arg1 is
+// the address of the list and arg2 is the number of ranges in the list.
+
+#ifndef BF_REQUEST_ADD_MDL_RANGE
+#define BF_REQUEST_ADD_MDL_RANGE 0x101
+#endif
+
+// Donates memory to the VMM's allocator, where arg1 is the address of a list
+// of memory descriptor ranges and arg2 is the number of ranges in the list.
+// Each range must be read / write, and must be at least
+// pool_segment_footprint bytes. The memory is mapped into the VMM's page
+// tables, so the VMM's modules must be added before memory is donated. The
+// request is all or nothing: if it fails, none of the memory is in use, and
+// the driver is free to release it.
+
+#ifndef BF_REQUEST_DONATE_MEMORY
+#define BF_REQUEST_DONATE_MEMORY 0x102
+#endif
+
+// Adds the host's physical memory to the VMM's direct map, where arg1 is the
+// address of a list of memory descriptor ranges and arg2 is the number of
+// ranges in the list. Only the phys and pages fields are used. Each range
+// must be RAM (never MMIO), as it is mapped write-back.
+
+#ifndef BF_REQUEST_ADD_DIRECT_MAP
+#define BF_REQUEST_ADD_DIRECT_MAP 0x103
+#endif
+
+// Gets a CPU's memory trace ring, where arg1 is the CPU's id and arg2 is the
+// address of the pointer to store the ring's address in, the same way as
+// BF_REQUEST_GET_DRR (see mem_trace.h). It fails unless the VMM was built
+// with MEMORY_MANAGER_TRACE.
+
+#ifndef BF_REQUEST_GET_MEM_TRACE
+#define BF_REQUEST_GET_MEM_TRACE 0x104
+#endif
+
+std::mutex g_donate_memory_mutex;
 
 extern "C" int64_t
 private_add_md(struct memory_descriptor *md) noexcept
@@ -45,6 +97,90 @@ private_add_md(struct memory_descriptor *md) noexcept
     });
 }
 
+extern "C" int64_t
+private_add_mdl(struct memory_descriptor *mdl, uint64_t num) noexcept
+{
+    return guard_exceptions(MEMORY_MANAGER_FAILURE, [&] {
+        g_mm->add_mdl(mdl, num);
+    });
+}
+
+extern "C" int64_t
+private_add_mdl_range(struct memory_descriptor_range *mdl, uint64_t num) noexcept
+{
+    return guard_exceptions(MEMORY_MANAGER_FAILURE, [&] {
+        g_mm->add_mdl_range(mdl, num);
+    });
+}
+
+extern "C" int64_t
+private_donate_memory(struct memory_descriptor_range *mdl, uint64_t num) noexcept
+{
+    return guard_exceptions(MEMORY_MANAGER_FAILURE, [&] {
+
+        expects(mdl != nullptr);
+
+        auto list = gsl::make_span(mdl, gsl::narrow_cast<std::ptrdiff_t>(num));
+        auto segments = 0ULL;
+
+        // Every range is validated before any of them is mapped, as once a
+        // range is added as a pool segment it cannot be removed.
+
+        for (const auto &md : list) {
+            expects(md.type == (MEMORY_TYPE_R | MEMORY_TYPE_W));
+            expects(md.pages <= (~0ULL >> x64::page_shift));
+            expects((md.pages << x64::page_shift) >= pool_segment_footprint);
+
+            segments += (md.pages << x64::page_shift) / pool_segment_footprint;
+        }
+
+        std::lock_guard<std::mutex> guard(g_donate_memory_mutex);
+        expects(segments <= g_mm->free_pool_segments());
+
+        // Mapping the memory also adds its descriptors to the memory
+        // manager, the same as BF_REQUEST_ADD_MDL_RANGE. Mapping is the only
+        // step that can still fail.
+
+        auto &&pt = g_pt;
+        auto mapped = 0ULL;
+
+        auto ___ = gsl::on_failure([&] {
+            for (const auto &md : list) {
+                if (mapped-- == 0) {
+                    break;
+                }
+
+                pt->unmap_range(md.virt, md.pages << x64::page_shift);
+            }
+        });
+
+        for (const auto &md : list) {
+            pt->map_range(md.virt, md.phys, md.pages << x64::page_shift, x64::memory_attr::rw_wb);
+            mapped++;
+        }
+
+        for (const auto &md : list) {
+            g_mm->add_pool_segments(md.virt, md.pages << x64::page_shift);
+        }
+    });
+}
+
+extern "C" int64_t
+private_add_direct_map(struct memory_descriptor_range *mdl, uint64_t num) noexcept
+{
+    return guard_exceptions(MEMORY_MANAGER_FAILURE, [&] {
+
+        expects(mdl != nullptr);
+
+        for (const auto &md : gsl::make_span(mdl, gsl::narrow_cast<std::ptrdiff_t>(num))) {
+            g_dm->add_range(md.phys, md.pages << x64::page_shift);
+        }
+
+        bfdebug << "direct map: " << (g_dm->size() >> x64::page_shift) << " pages in "
+                << g_dm->num_ranges() << " ranges" << bfendl;
+    });
+}
+
 user_data *
 WEAK_SYM pre_create_vcpu(vcpuid::type id)
 { (void) id; return nullptr; }
@@ -105,9 +241,24 @@ bfmain(uintptr_t request, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3)
         case BF_REQUEST_ADD_MDL:
             return private_add_md(reinterpret_cast<memory_descriptor *>(arg1));
 
+        case BF_REQUEST_ADD_MDL_BATCH:
+            return private_add_mdl(reinterpret_cast<memory_descriptor *>(arg1), arg2);
+
+        case BF_REQUEST_ADD_MDL_RANGE:
+            return private_add_mdl_range(reinterpret_cast<memory_descriptor_range *>(arg1), arg2);
+
+        case BF_REQUEST_DONATE_MEMORY:
+            return private_donate_memory(reinterpret_cast<memory_descriptor_range *>(arg1), arg2);
+
+        case BF_REQUEST_ADD_DIRECT_MAP:
+            return private_add_direct_map(reinterpret_cast<memory_descriptor_range *>(arg1), arg2);
+
         case BF_REQUEST_GET_DRR:
             return get_drr(arg1, reinterpret_cast<debug_ring_resources_t **>(arg2));
 
+        case BF_REQUEST_GET_MEM_TRACE:
+            return get_mem_trace(arg1, reinterpret_cast<mem_trace_ring **>(arg2));
+
         case BF_REQUEST_VMM_INIT:
             return private_init_vmm(arg1);
 
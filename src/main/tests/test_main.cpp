@@ -0,0 +1,66 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+
+#include <bfsupport.h>
+#include <debug_ring/debug_ring.h>
+#include <memory_manager/memory_manager_x64.h>
+
+#ifndef BF_REQUEST_GET_MEM_TRACE
+#define BF_REQUEST_GET_MEM_TRACE 0x104
+#endif
+
+extern "C" int64_t
+bfmain(uintptr_t request, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3);
+
+TEST_CASE("bfmain: unknown request")
+{
+    CHECK(bfmain(0xDEADBEEF, 0, 0, 0) == ENTRY_ERROR_UNKNOWN);
+}
+
+TEST_CASE("bfmain: get drr")
+{
+    debug_ring dr(0);
+    debug_ring_resources_t *drr = nullptr;
+
+    CHECK(bfmain(BF_REQUEST_GET_DRR, 0, 0, 0) == GET_DRR_FAILURE);
+    CHECK(bfmain(BF_REQUEST_GET_DRR, 0, reinterpret_cast<uintptr_t>(&drr), 0) == GET_DRR_SUCCESS);
+    CHECK(drr != nullptr);
+}
+
+TEST_CASE("bfmain: get mem trace")
+{
+    mem_trace_ring *ring = nullptr;
+    auto &&addr = reinterpret_cast<uintptr_t>(&ring);
+
+    CHECK(bfmain(BF_REQUEST_GET_MEM_TRACE, 0, 0, 0) == GET_MEM_TRACE_FAILURE);
+    CHECK(bfmain(BF_REQUEST_GET_MEM_TRACE, MEM_TRACE_MAX_CPUS, addr, 0) == GET_MEM_TRACE_FAILURE);
+    CHECK(ring == nullptr);
+
+    CHECK(bfmain(BF_REQUEST_GET_MEM_TRACE, 0, addr, 0) == GET_MEM_TRACE_SUCCESS);
+    REQUIRE(ring != nullptr);
+
+    auto epos = ring->epos;
+    g_mm->free(g_mm->alloc(64));
+
+    CHECK(ring->epos == epos + 2);
+}
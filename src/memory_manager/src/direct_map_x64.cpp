@@ -0,0 +1,134 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfgsl.h>
+#include <bfexception.h>
+
+#include <stdexcept>
+
+#include <memory_manager/direct_map_x64.h>
+#include <memory_manager/root_page_table_x64.h>
+
+#include <intrinsics/x86/common_x64.h>
+using namespace x64;
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+direct_map_x64::direct_map_x64(integer_pointer start) :
+    m_start(start)
+{
+    expects((start & (page_table::pdpt::size_bytes - 1)) == 0);
+}
+
+void
+direct_map_x64::add_range(integer_pointer phys, size_type size)
+{
+    expects((phys & (page_table::pt::size_bytes - 1)) == 0);
+    expects((size & (page_table::pt::size_bytes - 1)) == 0);
+    expects(size <= DIRECT_MAP_MAX_PHYS && phys <= DIRECT_MAP_MAX_PHYS - size);
+
+    if (phys == 0 && size != 0) {
+        phys += page_table::pt::size_bytes;
+        size -= page_table::pt::size_bytes;
+    }
+
+    if (size == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto &&num = m_num.load();
+    for (auto i = 0UL; i < num; i++) {
+        const auto &range = gsl::at(m_ranges, i);
+
+        if (phys < range.phys + range.size && range.phys < phys + size) {
+            throw std::runtime_error("direct map: range overlaps a range already added");
+        }
+    }
+
+    if (num > 0) {
+        auto &&last = gsl::at(m_ranges, num - 1);
+
+        if (last.phys + last.size == phys) {
+            g_pt->map_range_untracked(m_start + phys, phys, size, memory_attr::rw_wb);
+
+            last.size += size;
+            return;
+        }
+    }
+
+    if (num == DIRECT_MAP_MAX_RANGES) {
+        throw std::runtime_error("direct map: DIRECT_MAP_MAX_RANGES reached");
+    }
+
+    g_pt->map_range_untracked(m_start + phys, phys, size, memory_attr::rw_wb);
+
+    auto &&range = gsl::at(m_ranges, num);
+
+    range.phys = phys;
+    range.size = size;
+
+    m_num = num + 1;
+}
+
+direct_map_x64::size_type
+direct_map_x64::size() const noexcept
+{
+    auto size = 0UL;
+    auto &&num = m_num.load();
+
+    for (auto i = 0UL; i < num; i++) {
+        size += gsl::at(m_ranges, i).size;
+    }
+
+    return size;
+}
+
+// A range is only counted in m_num once it is mapped, and a range only
+// grows once the memory it grows by is mapped, so a lookup never reports
+// memory that is not mapped yet.
+
+bool
+direct_map_x64::contains(integer_pointer phys) const noexcept
+{
+    auto &&num = m_num.load();
+
+    for (auto i = 0UL; i < num; i++) {
+        const auto &range = gsl::at(m_ranges, i);
+
+        auto &&start = range.phys.load();
+        if (phys >= start && phys - start < range.size) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+direct_map_x64 *
+direct_map() noexcept
+{
+    static direct_map_x64 self;
+    return &self;
+}
@@ -0,0 +1,139 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfgsl.h>
+#include <bfexception.h>
+
+#include <new>
+#include <stdexcept>
+
+#include <memory_manager/kmap_x64.h>
+#include <memory_manager/memory_manager_x64.h>
+#include <memory_manager/root_page_table_x64.h>
+
+#include <intrinsics/x86/common_x64.h>
+using namespace x64;
+
+// -----------------------------------------------------------------------------
+// Global Memory
+// -----------------------------------------------------------------------------
+
+/// \cond
+
+std::array<kmap_x64, KMAP_MAX_CPUS> g_kmap_cpus;
+
+/// \endcond
+
+constexpr const auto kmap_size = KMAP_SLOTS * page_table::pt::size_bytes;
+constexpr const uint64_t kmap_slots_mask = ~0ULL >> (64 - KMAP_SLOTS);
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+kmap_x64::integer_pointer
+kmap_x64::map(integer_pointer phys, attr_type attr)
+{
+    expects(phys != 0);
+    expects((phys & (page_table::pt::size_bytes - 1)) == 0);
+
+    auto &&flags = root_page_table_x64::entry_flags(attr, page_table::pt::size_bytes);
+
+    if (m_virt == 0) {
+        this->setup();
+    }
+
+    auto &&free = ~m_used & kmap_slots_mask;
+    if (free == 0) {
+        throw std::runtime_error("kmap: out of mapping slots");
+    }
+
+    auto &&slot = static_cast<size_type>(__builtin_ctzll(free));
+    auto &&virt = m_virt + (slot << page_shift);
+
+    __atomic_store_n(gsl::at(m_ptes, slot), phys | flags, __ATOMIC_RELEASE);
+    tlb::invlpg(virt);
+
+    m_used |= 1ULL << slot;
+    return virt;
+}
+
+void
+kmap_x64::unmap(integer_pointer virt) noexcept
+{
+    if (m_virt == 0 || virt < m_virt || virt >= m_virt + kmap_size) {
+        return;
+    }
+
+    auto &&slot = static_cast<size_type>((virt - m_virt) >> page_shift);
+
+    __atomic_store_n(gsl::at(m_ptes, slot), m_idle, __ATOMIC_RELEASE);
+    m_used &= ~(1ULL << slot);
+}
+
+void
+kmap_x64::setup()
+{
+    auto &&window = g_mm->alloc_map(kmap_size);
+    if (window == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    auto &&idle = g_mm->alloc_zeroed(page_table::pt::size_bytes);
+    if (idle == nullptr) {
+        g_mm->free_map(window);
+        throw std::bad_alloc();
+    }
+
+    auto &&vmap = reinterpret_cast<integer_pointer>(window);
+
+    auto ___ = gsl::on_failure([&]
+    {
+        g_pt->unmap_range(vmap, kmap_size);
+
+        g_mm->free_map(window);
+        g_mm->free(idle);
+    });
+
+    auto &&phys = g_mm->virtptr_to_physint(idle);
+
+    for (auto slot = 0UL; slot < KMAP_SLOTS; slot++) {
+        auto &&virt = vmap + (slot << page_shift);
+
+        g_pt->map_4k(virt, phys, memory_attr::rw_wb);
+        gsl::at(m_ptes, slot) = g_pt->virt_to_pte(virt).entry();
+    }
+
+    m_idle = *m_ptes.front();
+    m_virt = vmap;
+}
+
+kmap_x64 *
+kmap_cpu()
+{
+    auto &&cpuid = thread_context_cpuid();
+
+    if (cpuid >= KMAP_MAX_CPUS) {
+        throw std::runtime_error("kmap: cpuid >= KMAP_MAX_CPUS");
+    }
+
+    return &gsl::at(g_kmap_cpus, cpuid);
+}
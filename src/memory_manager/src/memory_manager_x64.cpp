@@ -23,6 +23,11 @@
 #include <bfconstants.h>
 #include <bfexception.h>
 
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
 #include <memory_manager/mem_pool.h>
 #include <memory_manager/map_ptr_x64.h>
 #include <memory_manager/page_table_x64.h>
@@ -35,10 +40,16 @@ using namespace x64;
 // Global Memory
 // -----------------------------------------------------------------------------
 
+// The pools are aligned to 2m so that root_pt() can map them using 2m pages
+// (as long as the physical memory backing them is also 2m aligned and
+// contiguous), which the heap and page pools benefit from as they make up
+// most of the VMM's working set.
+
 /// \cond
 
-alignas(page_size) uint8_t g_heap_pool_owner[MAX_HEAP_POOL] = {};
-alignas(page_size) uint8_t g_page_pool_owner[MAX_PAGE_POOL] = {};
+alignas(page_table::pd::size_bytes) uint8_t g_heap_pool_owner[MAX_HEAP_POOL] = {};
+alignas(page_table::pd::size_bytes) uint8_t g_page_pool_owner[MAX_PAGE_POOL] = {};
+alignas(page_table::pt::size_bytes) uint8_t g_page_table_pool_owner[MAX_PAGE_TABLE_POOL] = {};
 
 /// \endcond
 
@@ -48,6 +59,146 @@ alignas(page_size) uint8_t g_page_pool_owner[MAX_PAGE_POOL] = {};
 
 #include <mutex>
 std::mutex g_add_md_mutex;
+std::mutex g_page_table_index_mutex;
+std::mutex g_zeroed_pages_mutex;
+std::mutex g_pool_segments_mutex;
+
+// -----------------------------------------------------------------------------
+// Allocation Trace
+// -----------------------------------------------------------------------------
+
+// When MEMORY_MANAGER_TRACE is not defined, mem_trace() expands to nothing,
+// including its arguments, so the trace costs nothing. When it is defined,
+// each CPU records into its own statically allocated ring, so recording an
+// event neither takes a lock nor allocates memory.
+//
+// The caller recorded for an event is the return address of the memory
+// manager call. Calls made through malloc / free (and new / delete, which
+// are replaced below when tracing) would all record the same wrapper, so
+// these use mem_trace_caller() to record their own caller instead, for the
+// rest of the call.
+
+#ifdef MEMORY_MANAGER_TRACE
+
+std::array<mem_trace_ring, MEM_TRACE_MAX_CPUS> g_mem_trace_rings = {};
+std::array<void *, MEM_TRACE_MAX_CPUS> g_mem_trace_callers = {};
+
+class mem_trace_caller_guard
+{
+public:
+
+    mem_trace_caller_guard(void *caller) noexcept :
+        m_cpuid(thread_context_cpuid())
+    {
+        if (m_cpuid < MEM_TRACE_MAX_CPUS) {
+            m_prev = gsl::at(g_mem_trace_callers, m_cpuid);
+            gsl::at(g_mem_trace_callers, m_cpuid) = caller;
+        }
+    }
+
+    ~mem_trace_caller_guard()
+    {
+        if (m_cpuid < MEM_TRACE_MAX_CPUS) {
+            gsl::at(g_mem_trace_callers, m_cpuid) = m_prev;
+        }
+    }
+
+    mem_trace_caller_guard(mem_trace_caller_guard &&) noexcept = delete;
+    mem_trace_caller_guard &operator=(mem_trace_caller_guard &&) noexcept = delete;
+
+    mem_trace_caller_guard(const mem_trace_caller_guard &) = delete;
+    mem_trace_caller_guard &operator=(const mem_trace_caller_guard &) = delete;
+
+private:
+
+    uint64_t m_cpuid;
+    void *m_prev{nullptr};
+};
+
+static void
+record_mem_trace(uint32_t op, uint32_t pool, uintptr_t addr, size_t size, void *caller) noexcept
+{
+    auto cpuid = thread_context_cpuid();
+
+    if (cpuid >= MEM_TRACE_MAX_CPUS) {
+        return;
+    }
+
+    if (auto wrapped = gsl::at(g_mem_trace_callers, cpuid)) {
+        caller = wrapped;
+    }
+
+    mem_trace_record(gsl::at(g_mem_trace_rings, cpuid), {
+        read_tsc::get(), cpuid, addr, size, reinterpret_cast<uintptr_t>(caller), op, pool
+    });
+}
+
+#define mem_trace(op, pool, addr, size) \
+    record_mem_trace(mem_trace_op_ ## op, mem_trace_pool_ ## pool, addr, size, __builtin_return_address(0))
+
+#define mem_trace_caller() \
+    mem_trace_caller_guard ___caller(__builtin_return_address(0))
+
+#else
+
+#define mem_trace(op, pool, addr, size)
+#define mem_trace_caller()
+
+#endif
+
+extern "C" int64_t
+get_mem_trace(uint64_t cpuid, struct mem_trace_ring **ring) noexcept
+{
+#ifdef MEMORY_MANAGER_TRACE
+    if (ring != nullptr && cpuid < MEM_TRACE_MAX_CPUS) {
+        *ring = &gsl::at(g_mem_trace_rings, cpuid);
+        return GET_MEM_TRACE_SUCCESS;
+    }
+#else
+    (void) cpuid;
+    (void) ring;
+#endif
+
+    return GET_MEM_TRACE_FAILURE;
+}
+
+// -----------------------------------------------------------------------------
+// Translation Index
+// -----------------------------------------------------------------------------
+
+// Entries in the virt index store the physical address of the page in the
+// upper bits and its attributes in the lower bits. Entries in the phys index
+// store the virtual address of the page, with a present bit as virt might
+// be 0.
+
+constexpr const auto phys_index_present = 1ULL;
+constexpr const auto virt_sign_bit = 1ULL << (memory_manager_virt_key_bits + x64::page_shift - 1);
+constexpr const auto virt_sign_ext = ~((virt_sign_bit << 1) - 1);
+
+static auto
+virt_key(uintptr_t virt) noexcept
+{ return (virt >> x64::page_shift) & ((1ULL << memory_manager_virt_key_bits) - 1); }
+
+static auto
+key_virt(uintptr_t key) noexcept
+{
+    auto virt = key << x64::page_shift;
+    return (virt & virt_sign_bit) != 0 ? virt | virt_sign_ext : virt;
+}
+
+static auto
+phys_key(uintptr_t phys) noexcept
+{ return phys >> x64::page_shift; }
+
+static void
+validate_md(uintptr_t virt, uintptr_t phys, uint64_t attr)
+{
+    expects(attr != 0);
+    expects(attr < x64::page_size);
+    expects((virt & (x64::page_size - 1)) == 0);
+    expects((phys & (x64::page_size - 1)) == 0);
+    expects((phys_key(phys) >> memory_manager_phys_key_bits) == 0);
+}
 
 // -----------------------------------------------------------------------------
 // Implementation
@@ -69,19 +220,271 @@ memory_manager_x64::alloc(size_type size) noexcept
         return nullptr;
     }
 
+    auto &&ctrs = counters();
+
+    ctrs.allocs.fetch_add(1, std::memory_order_relaxed);
+    ctrs.histogram.add(size);
+
     try {
         if (lower(size) == 0) {
-            return reinterpret_cast<pointer>(g_page_pool.alloc(size));
+            auto addr = g_page_pool.alloc(size);
+            mem_trace(alloc, page, addr, size);
+
+            return reinterpret_cast<pointer>(addr);
+        }
+
+        if (auto addr = g_heap_cache.alloc(size, thread_context_cpuid())) {
+            ctrs.cache_hits.fetch_add(1, std::memory_order_relaxed);
+            mem_trace(alloc, cache, addr, size);
+
+            return reinterpret_cast<pointer>(addr);
+        }
+
+        auto addr = g_heap_pool.alloc(size);
+        mem_trace(alloc, heap, addr, size);
+
+        return reinterpret_cast<pointer>(addr);
+    }
+    catch (...)
+    { }
+
+    if (auto addr = segment_alloc(size)) {
+        mem_trace(alloc, segment, addr, size);
+        return reinterpret_cast<pointer>(addr);
+    }
+
+    ctrs.failures.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+memory_manager_x64::pointer
+memory_manager_x64::alloc_zeroed(size_type size) noexcept
+{
+    if (size == page_size) {
+        integer_pointer addr = 0;
+
+        try {
+            std::lock_guard<std::mutex> guard(g_zeroed_pages_mutex);
+
+            if (m_num_zeroed_pages > 0) {
+                addr = gsl::at(m_zeroed_pages, --m_num_zeroed_pages);
+            }
+        }
+        catch (...)
+        { }
+
+        auto &&ctrs = counters();
+
+        if (addr != 0) {
+            ctrs.allocs.fetch_add(1, std::memory_order_relaxed);
+            ctrs.zeroed_hits.fetch_add(1, std::memory_order_relaxed);
+            ctrs.histogram.add(size);
+            mem_trace(alloc, page, addr, size);
+
+            return reinterpret_cast<pointer>(addr);
+        }
+
+        ctrs.zeroed_misses.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (auto ptr = this->alloc(size)) {
+        return std::memset(ptr, 0, size);
+    }
+
+    return nullptr;
+}
+
+memory_manager_x64::pointer
+memory_manager_x64::alloc_aligned(size_type size, size_type alignment) noexcept
+{
+    if (size == 0 || alignment == 0 || alignment > page_size) {
+        return nullptr;
+    }
+
+    if ((alignment & (alignment - 1)) != 0) {
+        return nullptr;
+    }
+
+    // Page sized requests are always page aligned, and every heap block is
+    // cache line aligned, so only larger alignments on the heap need the
+    // aligned search. These bypass the per-CPU cache as its objects are
+    // only block aligned.
+
+    if (lower(size) == 0 || alignment <= cache_line_size) {
+        return this->alloc(size);
+    }
+
+    auto &&ctrs = counters();
+
+    ctrs.allocs.fetch_add(1, std::memory_order_relaxed);
+    ctrs.histogram.add(size);
+
+    try {
+        auto addr = g_heap_pool.alloc_aligned(size, alignment);
+        mem_trace(alloc, heap, addr, size);
+
+        return reinterpret_cast<pointer>(addr);
+    }
+    catch (...)
+    { }
+
+    if (auto addr = segment_alloc(size)) {
+        mem_trace(alloc, segment, addr, size);
+        return reinterpret_cast<pointer>(addr);
+    }
+
+    ctrs.failures.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+void
+memory_manager_x64::refill_zeroed_pages() noexcept
+{ this->fill_zeroed_pages(MAX_ZEROED_PAGES); }
+
+// Zeroes up to max_pages pages, and adds them to the reserve, stopping once
+// the reserve reaches its target. The reserve's lock is not held while the
+// pages are zeroed.
+
+void
+memory_manager_x64::fill_zeroed_pages(size_type max_pages) noexcept
+{
+    try {
+        for (auto i = 0UL; i < max_pages; i++) {
+            {
+                std::lock_guard<std::mutex> guard(g_zeroed_pages_mutex);
+
+                while (m_num_zeroed_pages > m_zeroed_pages_target) {
+                    g_page_pool.free(gsl::at(m_zeroed_pages, --m_num_zeroed_pages));
+                }
+
+                if (m_num_zeroed_pages == m_zeroed_pages_target) {
+                    return;
+                }
+            }
+
+            auto addr = g_page_pool.alloc(page_size);
+            std::memset(reinterpret_cast<pointer>(addr), 0, page_size);
+
+            std::lock_guard<std::mutex> guard(g_zeroed_pages_mutex);
+
+            if (m_num_zeroed_pages == m_zeroed_pages_target) {
+                g_page_pool.free(addr);
+                return;
+            }
+
+            gsl::at(m_zeroed_pages, m_num_zeroed_pages++) = addr;
         }
+    }
+    catch (...)
+    { }
+}
 
-        return reinterpret_cast<pointer>(g_heap_pool.alloc(size));
+void
+memory_manager_x64::set_zeroed_pages_target(size_type num) noexcept
+{
+    try {
+        std::lock_guard<std::mutex> guard(g_zeroed_pages_mutex);
+        m_zeroed_pages_target = num < MAX_ZEROED_PAGES ? num : MAX_ZEROED_PAGES;
+    }
+    catch (...)
+    { }
+}
+
+void
+memory_manager_x64::maintain() noexcept
+{
+    g_heap_cache.flush(thread_context_cpuid());
+
+    auto low = false;
+
+    try {
+        std::lock_guard<std::mutex> guard(g_zeroed_pages_mutex);
+        low = m_num_zeroed_pages < m_zeroed_pages_target / 2;
     }
     catch (...)
     { }
 
+    if (low) {
+        this->fill_zeroed_pages(ZEROED_PAGES_REFILL_BATCH);
+    }
+}
+
+memory_manager_x64::pointer
+memory_manager_x64::alloc_page_table() noexcept
+{
+    auto addr = g_page_table_arena.alloc();
+
+    if (addr == 0) {
+        addr = reinterpret_cast<integer_pointer>(this->alloc_zeroed(page_size));
+    }
+
+    if (addr == 0) {
+        return nullptr;
+    }
+
+    // Page tables are found from the physical addresses stored in their
+    // parent's entries, so each one is added to the page table index. The
+    // phys index cannot be used for this, as it is changed by whoever adds
+    // or removes a descriptor for the same physical page (e.g. a guest
+    // that passes a page table's address as a VMCALL buffer).
+
+    try {
+        auto phys = this->virtint_to_physint(addr);
+
+        std::lock_guard<std::mutex> guard(g_page_table_index_mutex);
+        m_page_table_index.set(phys_key(phys), addr | phys_index_present);
+
+        return reinterpret_cast<pointer>(addr);
+    }
+    catch (...)
+    { }
+
+    this->release_page_table(addr);
     return nullptr;
 }
 
+void
+memory_manager_x64::free_page_table(pointer ptr) noexcept
+{
+    auto uintptr = reinterpret_cast<integer_pointer>(ptr);
+
+    if (uintptr == 0) {
+        return;
+    }
+
+    guard_exceptions([&] {
+        auto phys = this->virtint_to_physint(uintptr);
+
+        std::lock_guard<std::mutex> guard(g_page_table_index_mutex);
+        m_page_table_index.erase(phys_key(phys));
+    });
+
+    this->release_page_table(uintptr);
+}
+
+memory_manager_x64::pointer
+memory_manager_x64::physint_to_page_table(integer_pointer phys) const
+{
+    // [[ensures ret: ret != nullptr]]
+
+    auto val = m_page_table_index.get(phys_key(phys));
+    if (val == 0) {
+        throw std::out_of_range("physint_to_page_table: phys not found");
+    }
+
+    return reinterpret_cast<pointer>(upper(val) | lower(phys));
+}
+
+void
+memory_manager_x64::release_page_table(integer_pointer addr) noexcept
+{
+    if (g_page_table_arena.contains(addr)) {
+        return g_page_table_arena.free(addr);
+    }
+
+    this->free(reinterpret_cast<pointer>(addr));
+}
+
 memory_manager_x64::pointer
 memory_manager_x64::alloc_map(size_type size) noexcept
 {
@@ -90,7 +493,10 @@ memory_manager_x64::alloc_map(size_type size) noexcept
     }
 
     try {
-        return reinterpret_cast<pointer>(g_mem_map_pool.alloc(size));
+        auto addr = g_mem_map_pool.alloc(size);
+        mem_trace(alloc_map, map, addr, size);
+
+        return reinterpret_cast<pointer>(addr);
     }
     catch (...)
     { }
@@ -104,12 +510,85 @@ memory_manager_x64::free(pointer ptr) noexcept
     auto uintptr = reinterpret_cast<integer_pointer>(ptr);
 
     if (g_heap_pool.contains(uintptr)) {
+        counters().frees.fetch_add(1, std::memory_order_relaxed);
+
+        if (g_heap_cache.free(uintptr, thread_context_cpuid())) {
+            mem_trace(free, cache, uintptr, g_heap_pool.size(uintptr));
+            return;
+        }
+
+        mem_trace(free, heap, uintptr, g_heap_pool.size(uintptr));
         return g_heap_pool.free(uintptr);
     }
 
     if (g_page_pool.contains(uintptr)) {
+        counters().frees.fetch_add(1, std::memory_order_relaxed);
+        mem_trace(free, page, uintptr, g_page_pool.size(uintptr));
+
         return g_page_pool.free(uintptr);
     }
+
+    if (auto segment = find_segment(uintptr)) {
+        counters().frees.fetch_add(1, std::memory_order_relaxed);
+        mem_trace(free, segment, uintptr, segment->size(uintptr));
+
+        return segment->free(uintptr);
+    }
+}
+
+memory_manager_x64::pointer
+memory_manager_x64::realloc(pointer ptr, size_type size) noexcept
+{
+    if (ptr == nullptr) {
+        return this->alloc(size);
+    }
+
+    if (size == 0) {
+        this->free(ptr);
+        return nullptr;
+    }
+
+    auto uintptr = reinterpret_cast<integer_pointer>(ptr);
+    auto old_size = this->size(ptr);
+
+    if (old_size == 0) {
+        return nullptr;
+    }
+
+    // Memory that is owned by a per-CPU cache belongs to a fixed size class,
+    // so it can only be resized in place if the new size still fits.
+
+    if (g_heap_cache.owns(uintptr)) {
+        if (size <= old_size) {
+            return ptr;
+        }
+    }
+    else if (g_heap_pool.contains(uintptr)) {
+        if (g_heap_pool.resize(uintptr, size)) {
+            return ptr;
+        }
+    }
+    else if (g_page_pool.contains(uintptr)) {
+        if (g_page_pool.resize(uintptr, size)) {
+            return ptr;
+        }
+    }
+    else if (auto segment = find_segment(uintptr)) {
+        if (segment->resize(uintptr, size)) {
+            return ptr;
+        }
+    }
+
+    auto new_ptr = this->alloc(size);
+
+    if (new_ptr == nullptr) {
+        return nullptr;
+    }
+
+    std::memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    this->free(ptr);
+
+    return new_ptr;
 }
 
 void
@@ -118,6 +597,7 @@ memory_manager_x64::free_map(pointer ptr) noexcept
     auto uintptr = reinterpret_cast<integer_pointer>(ptr);
 
     if (g_mem_map_pool.contains(uintptr)) {
+        mem_trace(free_map, map, uintptr, g_mem_map_pool.size(uintptr));
         return g_mem_map_pool.free(uintptr);
     }
 }
@@ -135,6 +615,10 @@ memory_manager_x64::size(pointer ptr) const noexcept
         return g_page_pool.size(uintptr);
     }
 
+    if (auto segment = find_segment(uintptr)) {
+        return segment->size(uintptr);
+    }
+
     return 0;
 }
 
@@ -156,8 +640,12 @@ memory_manager_x64::virtint_to_physint(integer_pointer virt) const
     // [[ensures ret: ret != 0]]
     expects(virt != 0);
 
-    std::lock_guard<std::mutex> guard(g_add_md_mutex);
-    return upper(m_virt_to_phys_map.at(upper(virt))) | lower(virt);
+    auto val = m_virt_index.get(virt_key(virt));
+    if (val == 0) {
+        throw std::out_of_range("virtint_to_physint: virt not found");
+    }
+
+    return upper(val) | lower(virt);
 }
 
 memory_manager_x64::integer_pointer
@@ -178,8 +666,12 @@ memory_manager_x64::physint_to_virtint(integer_pointer phys) const
     // [[ensures ret: ret != 0]]
     expects(phys != 0);
 
-    std::lock_guard<std::mutex> guard(g_add_md_mutex);
-    return upper(m_phys_to_virt_map.at(upper(phys))) | lower(phys);
+    auto val = m_phys_index.get(phys_key(phys));
+    if (val == 0) {
+        throw std::out_of_range("physint_to_virtint: phys not found");
+    }
+
+    return upper(val) | lower(phys);
 }
 
 memory_manager_x64::integer_pointer
@@ -199,8 +691,12 @@ memory_manager_x64::virtint_to_attrint(integer_pointer virt) const
 {
     expects(virt != 0);
 
-    std::lock_guard<std::mutex> guard(g_add_md_mutex);
-    return m_virt_to_attr_map.at(upper(virt));
+    auto val = m_virt_index.get(virt_key(virt));
+    if (val == 0) {
+        throw std::out_of_range("virtint_to_attrint: virt not found");
+    }
+
+    return gsl::narrow_cast<attr_type>(lower(val));
 }
 
 memory_manager_x64::attr_type
@@ -213,29 +709,111 @@ memory_manager_x64::add_md(integer_pointer virt, integer_pointer phys, attr_type
     auto ___ = gsl::on_failure([&] {
         std::lock_guard<std::mutex> guard(g_add_md_mutex);
 
-        m_virt_to_phys_map.erase(virt);
-        m_phys_to_virt_map.erase(phys);
-        m_virt_to_attr_map.erase(virt);
+        m_virt_index.erase(virt_key(virt));
+        m_phys_index.erase(phys_key(phys));
     });
 
-    expects(attr != 0);
-    expects(lower(virt) == 0);
-    expects(lower(phys) == 0);
+    validate_md(virt, phys, attr);
 
     {
         std::lock_guard<std::mutex> guard(g_add_md_mutex);
 
-        m_virt_to_phys_map[virt] = phys;
-        m_phys_to_virt_map[phys] = virt;
-        m_virt_to_attr_map[virt] = attr;
+        m_virt_index.set(virt_key(virt), phys | attr);
+        m_phys_index.set(phys_key(phys), virt | phys_index_present);
     }
 }
 
 void
-memory_manager_x64::remove_md(integer_pointer virt) noexcept
+memory_manager_x64::add_mdl(const memory_descriptor *mdl, size_type num)
 {
-    integer_pointer phys;
+    expects(mdl != nullptr);
+    expects(num != 0);
+
+    auto list = gsl::make_span(mdl, gsl::narrow_cast<std::ptrdiff_t>(num));
+
+    for (const auto &md : list) {
+        validate_md(md.virt, md.phys, md.type);
+    }
+
+    std::lock_guard<std::mutex> guard(g_add_md_mutex);
+
+    // See add_mdl_range() for why the memory is allocated up front.
+
+    for (const auto &md : list) {
+        m_virt_index.reserve(virt_key(md.virt));
+    }
+
+    m_phys_index.reserve(num);
+
+    for (const auto &md : list) {
+        m_virt_index.set(virt_key(md.virt), md.phys | md.type);
+        m_phys_index.set(phys_key(md.phys), md.virt | phys_index_present);
+    }
+}
+
+void
+memory_manager_x64::add_md_range(integer_pointer virt, integer_pointer phys, size_type pages, attr_type attr)
+{
+    memory_descriptor_range md = {phys, virt, pages, attr};
+    this->add_mdl_range(&md, 1);
+}
+
+void
+memory_manager_x64::add_mdl_range(const memory_descriptor_range *mdl, size_type num)
+{
+    expects(mdl != nullptr);
+    expects(num != 0);
+
+    auto list = gsl::make_span(mdl, gsl::narrow_cast<std::ptrdiff_t>(num));
+
+    for (const auto &md : list) {
+        expects(md.pages != 0);
+        expects(md.pages <= (1ULL << memory_manager_virt_key_bits));
+
+        auto last = (md.pages - 1) << x64::page_shift;
 
+        expects(md.virt + last >= md.virt);
+        expects(md.phys + last >= md.phys);
+
+        validate_md(md.virt, md.phys, md.type);
+        validate_md(md.virt + last, md.phys + last, md.type);
+    }
+
+    std::lock_guard<std::mutex> guard(g_add_md_mutex);
+
+    // All of the memory the ranges need is allocated before any descriptor
+    // is stored, so that running out of memory leaves both indexes as they
+    // were, including any descriptors the ranges would have replaced.
+
+    auto pages = 0ULL;
+
+    for (const auto &md : list) {
+        for (auto i = 0ULL; i < md.pages; i++) {
+            m_virt_index.reserve(virt_key(md.virt + (i << x64::page_shift)));
+        }
+
+        pages += md.pages;
+    }
+
+    m_phys_index.reserve(pages);
+
+    for (const auto &md : list) {
+        for (auto i = 0ULL; i < md.pages; i++) {
+            auto offset = i << x64::page_shift;
+
+            m_virt_index.set(virt_key(md.virt + offset), (md.phys + offset) | md.type);
+            m_phys_index.set(phys_key(md.phys + offset), (md.virt + offset) | phys_index_present);
+        }
+    }
+}
+
+void
+memory_manager_x64::remove_md(integer_pointer virt) noexcept
+{ this->remove_md_range(virt, 1); }
+
+void
+memory_manager_x64::remove_md_range(integer_pointer virt, size_type pages) noexcept
+{
     if (virt == 0) {
         bferror << "remove_md: virt == 0" << bfendl;
         return;
@@ -247,12 +825,23 @@ memory_manager_x64::remove_md(integer_pointer virt) noexcept
     }
 
     guard_exceptions([&] {
-        phys = virtint_to_physint(virt);
         std::lock_guard<std::mutex> guard(g_add_md_mutex);
 
-        m_virt_to_phys_map.erase(virt);
-        m_phys_to_virt_map.erase(phys);
-        m_virt_to_attr_map.erase(virt);
+        for (auto i = 0ULL; i < pages; i++) {
+            auto page = virt + (i << x64::page_shift);
+
+            // The same physical page can be described more than once (for
+            // example a page mapped into a map_ptr window), so the phys
+            // entry is only removed if it still points to this page.
+
+            if (auto val = m_virt_index.erase(virt_key(page))) {
+                auto key = phys_key(upper(val));
+
+                if (upper(m_phys_index.get(key)) == page) {
+                    m_phys_index.erase(key);
+                }
+            }
+        }
     });
 }
 
@@ -260,23 +849,164 @@ memory_manager_x64::memory_descriptor_list
 memory_manager_x64::descriptors() const
 {
     memory_descriptor_list list;
-    std::lock_guard<std::mutex> guard(g_add_md_mutex);
 
-    for (const auto &p : m_virt_to_phys_map) {
-        auto virt = p.first;
-        auto phys = p.second;
-        auto attr = m_virt_to_attr_map.at(virt);
+    m_virt_index.for_each([&](auto key, auto val) {
+        add_page_to_range_list(list, upper(val), key_virt(key), lower(val));
+    });
+
+    return list;
+}
+
+memory_manager_x64::size_type
+memory_manager_x64::descriptors(
+    memory_descriptor_range *mdl, size_type num, descriptor_cursor_type &cursor) const
+{
+    expects(mdl != nullptr);
+    expects(num != 0);
 
-        list.push_back({phys, virt, attr});
+    if (cursor.done) {
+        return 0;
     }
 
-    return list;
+    auto &&view = gsl::make_span(mdl, gsl::narrow_cast<std::ptrdiff_t>(num));
+    auto read = 0L;
+
+    cursor.done = m_virt_index.for_each_changed(virt_key(cursor.virt), cursor.since, [&](auto key, auto val) {
+        if (val == 0 && cursor.since == 0) {
+            return true;
+        }
+
+        auto &&virt = key_virt(key);
+
+        if (!add_page_to_range_buffer(view, read, val != 0 ? upper(val) : 0, virt, val != 0 ? lower(val) : 0)) {
+            cursor.virt = virt;
+            return false;
+        }
+
+        return true;
+    });
+
+    return gsl::narrow_cast<size_type>(read);
+}
+
+uint64_t
+memory_manager_x64::generation() const noexcept
+{ return m_virt_index.generation(); }
+
+memory_manager_x64::size_type
+memory_manager_x64::add_pool_segments(integer_pointer virt, size_type size)
+{
+    expects(lower(virt) == 0);
+    expects(size >= pool_segment_footprint);
+
+    std::lock_guard<std::mutex> guard(g_pool_segments_mutex);
+
+    auto num = m_num_segments.load(std::memory_order_relaxed);
+    expects(num < MAX_POOL_SEGMENTS);
+
+    auto added = 0ULL;
+
+    // The segment is written to its slot before the number of segments is
+    // incremented, so alloc / free can walk the segments without taking the
+    // lock.
+
+    while (size >= pool_segment_footprint && num < MAX_POOL_SEGMENTS) {
+        auto segment = new (reinterpret_cast<pointer>(virt))
+                       pool_segment_type(virt + pool_segment_header_size);
+
+        gsl::at(m_segments, num++) = segment;
+        m_num_segments.store(num, std::memory_order_release);
+
+        virt += pool_segment_footprint;
+        size -= pool_segment_footprint;
+        added++;
+    }
+
+    return added;
+}
+
+memory_manager_x64::size_type
+memory_manager_x64::free_pool_segments() const noexcept
+{ return MAX_POOL_SEGMENTS - m_num_segments.load(std::memory_order_acquire); }
+
+memory_manager_x64::stats_type
+memory_manager_x64::stats() const noexcept
+{
+    stats_type stats;
+
+    stats.heap = g_heap_pool.stats();
+    stats.page = g_page_pool.stats();
+    stats.mem_map = g_mem_map_pool.stats();
+    stats.page_table = g_page_table_arena.stats();
+
+    for (const auto &ctrs : m_counters) {
+        stats.allocs += ctrs.allocs.load(std::memory_order_relaxed);
+        stats.frees += ctrs.frees.load(std::memory_order_relaxed);
+        stats.failures += ctrs.failures.load(std::memory_order_relaxed);
+        stats.cache_hits += ctrs.cache_hits.load(std::memory_order_relaxed);
+        stats.zeroed_hits += ctrs.zeroed_hits.load(std::memory_order_relaxed);
+        stats.zeroed_misses += ctrs.zeroed_misses.load(std::memory_order_relaxed);
+
+        auto histogram = ctrs.histogram.get();
+
+        for (auto i = 0ULL; i < histogram.size(); i++) {
+            gsl::at(stats.histogram, i) += gsl::at(histogram, i);
+        }
+    }
+
+    try {
+        std::lock_guard<std::mutex> guard(g_zeroed_pages_mutex);
+        stats.zeroed_pages = m_num_zeroed_pages;
+    }
+    catch (...)
+    { }
+
+    stats.num_segments = m_num_segments.load(std::memory_order_acquire);
+    stats.phys_index_bytes = m_phys_index.bytes();
+
+    // Each segment's statistics are added to the total one at a time, so
+    // only one segment's snapshot is on the stack at once. The peak is the
+    // sum of each segment's peak, and the largest free extent is the
+    // largest of any segment, as an allocation cannot span segments.
+
+    for (auto i = 0ULL; i < stats.num_segments; i++) {
+        auto &&segment = gsl::at(m_segments, i)->stats();
+
+        stats.segments.total_size += segment.total_size;
+        stats.segments.used += segment.used;
+        stats.segments.peak += segment.peak;
+        stats.segments.allocs += segment.allocs;
+        stats.segments.frees += segment.frees;
+        stats.segments.failures += segment.failures;
+
+        if (segment.largest_free > stats.segments.largest_free) {
+            stats.segments.largest_free = segment.largest_free;
+        }
+
+        for (auto j = 0ULL; j < segment.histogram.size(); j++) {
+            gsl::at(stats.segments.histogram, j) += gsl::at(segment.histogram, j);
+        }
+    }
+
+    return stats;
+}
+
+mem_pool_stats
+memory_manager_x64::segment_stats(size_type index) const noexcept
+{
+    if (index >= m_num_segments.load(std::memory_order_acquire)) {
+        return {};
+    }
+
+    return gsl::at(m_segments, index)->stats();
 }
 
 memory_manager_x64::memory_manager_x64() noexcept :
     g_heap_pool(reinterpret_cast<uintptr_t>(g_heap_pool_owner)),
+    g_heap_cache(g_heap_pool, reinterpret_cast<uintptr_t>(g_heap_pool_owner)),
     g_page_pool(reinterpret_cast<uintptr_t>(g_page_pool_owner)),
-    g_mem_map_pool(MEM_MAP_POOL_START)
+    g_mem_map_pool(MEM_MAP_POOL_START),
+    g_page_table_arena(reinterpret_cast<uintptr_t>(g_page_table_pool_owner))
 { }
 
 memory_manager_x64::integer_pointer
@@ -287,42 +1017,165 @@ memory_manager_x64::integer_pointer
 memory_manager_x64::upper(integer_pointer ptr) const noexcept
 { return ptr & ~(page_size - 1); }
 
+memory_manager_x64::integer_pointer
+memory_manager_x64::segment_alloc(size_type size) noexcept
+{
+    if (size > MAX_POOL_SEGMENT_SIZE) {
+        return 0;
+    }
+
+    auto num = m_num_segments.load(std::memory_order_acquire);
+
+    for (auto i = 0ULL; i < num; i++) {
+        try {
+            return gsl::at(m_segments, i)->alloc(size);
+        }
+        catch (...)
+        { }
+    }
+
+    return 0;
+}
+
+pool_segment_type *
+memory_manager_x64::find_segment(integer_pointer ptr) const noexcept
+{
+    auto num = m_num_segments.load(std::memory_order_acquire);
+
+    for (auto i = 0ULL; i < num; i++) {
+        if (gsl::at(m_segments, i)->contains(ptr)) {
+            return gsl::at(m_segments, i);
+        }
+    }
+
+    return nullptr;
+}
+
+memory_manager_x64::counters_type &
+memory_manager_x64::counters() noexcept
+{
+    // CPUs past the end of the table share the last entry, which is still
+    // correct as the counters are atomic, just not contention free.
+
+    auto cpuid = thread_context_cpuid();
+
+    if (cpuid >= m_counters.size()) {
+        cpuid = m_counters.size() - 1;
+    }
+
+    return gsl::at(m_counters, cpuid);
+}
+
 #ifdef VMM
 
 extern "C" EXPORT_MEMORY_MANAGER void *
 _malloc_r(struct _reent *, size_t size)
-{ return g_mm->alloc(size); }
+{
+    mem_trace_caller();
+    return g_mm->alloc(size);
+}
 
 extern "C" EXPORT_MEMORY_MANAGER void
 _free_r(struct _reent *, void *ptr)
-{ g_mm->free(ptr); }
+{
+    mem_trace_caller();
+    g_mm->free(ptr);
+}
 
 extern "C" EXPORT_MEMORY_MANAGER void *
 _calloc_r(struct _reent *, size_t nmemb, size_t size)
 {
-    if (auto ptr = g_mm->alloc(nmemb * size)) {
-        return __builtin_memset(ptr, 0, nmemb * size);
+    mem_trace_caller();
+
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return nullptr;
     }
 
-    return nullptr;
+    return g_mm->alloc_zeroed(nmemb * size);
 }
 
 extern "C" EXPORT_MEMORY_MANAGER void *
 _realloc_r(struct _reent *, void *ptr, size_t size)
 {
-    auto old_sze = g_mm->size(ptr);
-    auto new_ptr = g_mm->alloc(size);
+    mem_trace_caller();
+    return g_mm->realloc(ptr, size);
+}
 
-    if (!new_ptr || old_sze == 0) {
-        return nullptr;
+extern "C" EXPORT_MEMORY_MANAGER void *
+_memalign_r(struct _reent *, size_t alignment, size_t size)
+{
+    mem_trace_caller();
+    return g_mm->alloc_aligned(size, alignment);
+}
+
+extern "C" EXPORT_MEMORY_MANAGER void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    mem_trace_caller();
+    return g_mm->alloc_aligned(size, alignment);
+}
+
+extern "C" EXPORT_MEMORY_MANAGER int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    mem_trace_caller();
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || (alignment % sizeof(void *)) != 0) {
+        return EINVAL;
     }
 
-    if (ptr) {
-        __builtin_memcpy(new_ptr, ptr, size > old_sze ? old_sze : size);
-        g_mm->free(ptr);
+    if (auto ptr = g_mm->alloc_aligned(size, alignment)) {
+        *memptr = ptr;
+        return 0;
     }
 
-    return new_ptr;
+    return ENOMEM;
+}
+
+// new / delete normally reach the memory manager through malloc / free,
+// so when tracing, they are replaced so that the caller that is recorded is
+// the code that called new / delete, and not the C++ runtime.
+
+#ifdef MEMORY_MANAGER_TRACE
+
+void *
+operator new(size_t size)
+{
+    mem_trace_caller();
+
+    if (auto ptr = g_mm->alloc(size != 0 ? size : 1)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void *
+operator new[](size_t size)
+{
+    mem_trace_caller();
+
+    if (auto ptr = g_mm->alloc(size != 0 ? size : 1)) {
+        return ptr;
+    }
+
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void *ptr) noexcept
+{
+    mem_trace_caller();
+    g_mm->free(ptr);
 }
 
+void
+operator delete[](void *ptr) noexcept
+{
+    mem_trace_caller();
+    g_mm->free(ptr);
+}
+
+#endif
+
 #endif
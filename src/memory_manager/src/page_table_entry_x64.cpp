@@ -272,3 +272,7 @@ page_table_entry_x64::set_pat_index_large(pat_index_type index)
 void
 page_table_entry_x64::clear() noexcept
 { *m_pte = 0; }
+
+page_table_entry_x64::pointer
+page_table_entry_x64::entry() const noexcept
+{ return m_pte; }
@@ -19,7 +19,9 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
 
-#include <bfvector.h>
+#include <bfexception.h>
+
+#include <algorithm>
 
 #include <memory_manager/pat_x64.h>
 #include <memory_manager/page_table_x64.h>
@@ -28,142 +30,842 @@
 #include <intrinsics/x86/common_x64.h>
 using namespace x64;
 
-page_table_x64::page_table_x64(gsl::not_null<pointer> pte)
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+using entry_type = page_table_x64::integer_pointer;
+
+// Entries are shared with other CPUs (and the hardware), so they are always
+// read and written atomically.
+
+static entry_type
+load(const entry_type &entry) noexcept
+{ return __atomic_load_n(&entry, __ATOMIC_SEQ_CST); }
+
+static void
+store(entry_type &entry, entry_type value) noexcept
+{ __atomic_store_n(&entry, value, __ATOMIC_SEQ_CST); }
+
+static bool
+cas(entry_type &entry, entry_type expected, entry_type desired) noexcept
+{ return __atomic_compare_exchange_n(&entry, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+
+// Set on the entry that points to a page table while the page table is
+// being removed. Bits 9-11 of an entry are ignored by the hardware, and are
+// not part of the physical address.
+
+constexpr const entry_type removing = 1UL << 9;
+
+// Set on a large page that promote() made out of a page table, and kept on
+// the large pages it is split back up into, so that remove_page splits it
+// up instead of removing memory that was mapped one page at a time.
+
+constexpr const entry_type promoted = 1UL << 10;
+
+// The accessed and dirty bits are set by the hardware, so they are ignored
+// when deciding whether a page table can be replaced by a large page, along
+// with the promoted bit.
+
+constexpr const entry_type ignored = (1UL << 5) | (1UL << 6) | promoted;
+
+// Set (along with removing) on every entry of a retired page table. Such an
+// entry is not present, is never changed by a walk, and tells a walk that is
+// still in the page table that it has been removed. The epoch chains retired
+// page tables through their first two entries, keeping these bits set.
+
+constexpr const entry_type retired = (1UL << 11) | removing;
+
+static bool
+is_retired(entry_type entry) noexcept
+{ return (entry & retired) == retired; }
+
+static entry_type
+wait(const entry_type &entry) noexcept
+{
+    auto value = load(entry);
+
+    while ((value & removing) != 0 && !is_retired(value)) {
+        __builtin_ia32_pause();
+        value = load(entry);
+    }
+
+    return value;
+}
+
+// Page tables are allocated from the memory manager's page table arena, which
+// hands out pages that are already zeroed, so they are ready to be linked
+// into the page table structure as soon as they are allocated.
+
+static page_table_x64::pointer
+alloc_pt()
+{
+    auto pt = static_cast<page_table_x64::pointer>(g_mm->alloc_page_table());
+
+    if (pt == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return pt;
+}
+
+static entry_type
+pt_entry(page_table_x64::pointer pt)
 {
-    m_pt = std::make_unique<integer_pointer[]>(page_table::num_entries);
+    auto value = 0UL;
+    auto &&entry = page_table_entry_x64(&value);
 
-    auto &&entry = page_table_entry_x64(pte);
-    entry.clear();
-    entry.set_phys_addr(g_mm->virtptr_to_physint(m_pt.get()));
+    entry.set_phys_addr(g_mm->virtptr_to_physint(pt));
     entry.set_present(true);
     entry.set_rw(true);
     entry.set_pat_index_4k(pat::write_back_index);
+
+    return value;
+}
+
+static bool
+is_pt(entry_type entry, entry_type bits) noexcept
+{
+    if ((entry & ~removing) == 0 || is_retired(entry) || bits == page_table::pt::from) {
+        return false;
+    }
+
+    return bits == page_table::pml4::from || !page_table_entry_x64(&entry).ps();
+}
+
+static bool
+is_large(entry_type entry, entry_type bits) noexcept
+{ return bits != page_table::pt::from && (entry & ~removing) != 0 && !is_retired(entry) && !is_pt(entry, bits); }
+
+static page_table_x64::pointer
+child_pt(entry_type entry)
+{ return static_cast<page_table_x64::pointer>(g_mm->physint_to_page_table(page_table_entry_x64(&entry).phys_addr())); }
+
+static bool
+empty(page_table_x64::pointer pt) noexcept
+{
+    auto &&view = gsl::make_span(pt, page_table::num_entries);
+    return std::all_of(view.begin(), view.end(), [](const auto & entry) { return load(entry) == 0; });
+}
+
+static void
+free_pt(page_table_x64::pointer pt, entry_type bits) noexcept
+{
+    for (const auto &entry : gsl::make_span(pt, page_table::num_entries)) {
+        auto value = load(entry);
+
+        if (is_pt(value, bits)) {
+            guard_exceptions([&]
+            { free_pt(child_pt(value), bits - page_table::pt::size); });
+        }
+    }
+
+    g_mm->free_page_table(pt);
+}
+
+// Retires pt (which must already be unlinked) and the page tables below
+// it. Walks might still be changing pt, so every entry is marked as retired
+// with a compare-and-swap, waiting for a prune / promote of the entry to
+// finish first. Once an entry is marked, the page table it pointed to (if
+// any) belongs to this call, and no walk can link anything new into pt.
+
+static void
+retire_pt(epoch &e, page_table_x64::pointer pt, entry_type bits) noexcept
+{
+    for (auto &entry : gsl::make_span(pt, page_table::num_entries)) {
+        auto value = wait(entry);
+
+        while (!cas(entry, value, retired)) {
+            value = wait(entry);
+        }
+
+        if (is_pt(value, bits)) {
+            guard_exceptions([&]
+            { retire_pt(e, child_pt(value), bits - page_table::pt::size); });
+        }
+    }
+
+    e.retire(pt);
+}
+
+// Returns the page table that entry points to, adding one if needed. If
+// another CPU adds a page table first, theirs is used instead. Returns
+// nullptr if the page table that holds entry has been retired.
+
+static page_table_x64::pointer
+descend(entry_type &entry, entry_type bits, std::atomic<page_table_x64::size_type> &generation)
+{
+    while (true) {
+        auto value = wait(entry);
+
+        if (is_pt(value, bits)) {
+            return child_pt(value);
+        }
+
+        if (is_retired(value)) {
+            return nullptr;
+        }
+
+        auto pt = alloc_pt();
+
+        auto ___ = gsl::on_failure([&]
+        { g_mm->free_page_table(pt); });
+
+        if (cas(entry, value, pt_entry(pt))) {
+            generation++;
+            return pt;
+        }
+
+        g_mm->free_page_table(pt);
+    }
+}
+
+static bool
+linked(const entry_type &entry, page_table_x64::pointer pt, entry_type bits)
+{
+    auto value = load(entry);
+    return (value & removing) == 0 && is_pt(value, bits) && child_pt(value) == pt;
+}
+
+// Removes pt (which entry points to) if it is empty. The entry is marked
+// first so that a CPU that adds to pt at the same time either sees the mark
+// once it is done (and adds its entry again), or its entry is seen here and
+// pt is kept.
+
+static void
+prune(epoch &e, entry_type &entry, page_table_x64::pointer pt, entry_type bits,
+      std::atomic<page_table_x64::size_type> &generation)
+{
+    auto value = load(entry);
+
+    if ((value & removing) != 0 || !is_pt(value, bits) || child_pt(value) != pt) {
+        return;
+    }
+
+    if (!cas(entry, value, value | removing)) {
+        return;
+    }
+
+    if (!empty(pt)) {
+        store(entry, value);
+        return;
+    }
+
+    store(entry, 0);
+    retire_pt(e, pt, bits - page_table::pt::size);
+
+    generation++;
+}
+
+static page_table_x64::integer_pointer
+range_flags(const page_table_x64::range_flags_type &flags, page_table_x64::integer_pointer bits) noexcept
+{
+    switch (bits) {
+        case page_table::pdpt::from:
+            return flags.flags_1g;
+
+        case page_table::pd::from:
+            return flags.flags_2m;
+
+        case page_table::pt::from:
+            return flags.flags_4k;
+
+        default:
+            return 0;
+    }
+}
+
+static std::atomic<page_table_x64::size_type> &
+num_pages(page_table_x64::page_count_type &count, page_table_x64::integer_pointer bits) noexcept
+{
+    switch (bits) {
+        case page_table::pdpt::from:
+            return count.num_1g;
+
+        case page_table::pd::from:
+            return count.num_2m;
+
+        default:
+            return count.num_4k;
+    }
+}
+
+static void
+add_count(page_table_x64::page_count_type &count, const page_table_x64::page_count_type &pages) noexcept
+{
+    count.num_1g += pages.num_1g;
+    count.num_2m += pages.num_2m;
+    count.num_4k += pages.num_4k;
+}
+
+// Subtracts the pages that pt (a page table at bits), and the page tables
+// below it, map from count, for when pt is replaced as a whole.
+
+static void
+sub_count(page_table_x64::pointer pt, entry_type bits, page_table_x64::page_count_type &count) noexcept
+{
+    for (const auto &entry : gsl::make_span(pt, page_table::num_entries)) {
+        auto value = load(entry);
+
+        if (is_pt(value, bits)) {
+            sub_count(child_pt(value), bits - page_table::pt::size, count);
+        }
+        else if (value != 0 && !is_retired(value)) {
+            num_pages(count, bits)--;
+        }
+    }
+}
+
+// Returns true if every entry in pt (a page table at bits) maps the next
+// page of a single, physically contiguous range that a large page at the
+// level above could map, using flags. base is set to the start of the
+// range. The last entry is checked first, so a page table that is still
+// being filled in order is rejected right away.
+
+static bool
+contiguous(page_table_x64::pointer pt, entry_type bits, entry_type flags, entry_type &base) noexcept
+{
+    auto &&view = gsl::make_span(pt, page_table::num_entries);
+    auto &&last = page_table::num_entries - 1;
+
+    base = (load(view.at(0)) & ~ignored) & ~flags;
+
+    if ((base & ((1UL << (bits + page_table::pt::size)) - 1)) != 0) {
+        return false;
+    }
+
+    if ((load(view.at(last)) & ~ignored) != ((base + (last << bits)) | flags)) {
+        return false;
+    }
+
+    for (auto i = 0UL; i < last; i++) {
+        if ((load(view.at(i)) & ~ignored) != ((base + (i << bits)) | flags)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+page_table_x64::page_table_x64(gsl::not_null<pointer> pte) :
+    m_pt(alloc_pt()),
+    m_epoch([](epoch::pointer pt) { g_mm->free_page_table(pt); }, retired)
+{
+    auto ___ = gsl::on_failure([&]
+    { g_mm->free_page_table(m_pt); });
+
+    *pte = pt_entry(m_pt);
+}
+
+page_table_x64::~page_table_x64()
+{ free_pt(m_pt, page_table::pml4::from); }
+
+page_table_x64::size_type
+page_table_x64::remove_page(integer_pointer addr)
+{
+    page_count_type count;
+    return this->remove_page(addr, count);
+}
+
+page_table_x64::size_type
+page_table_x64::remove_page(integer_pointer addr, page_count_type &count)
+{
+    auto size = 0UL;
+
+    {
+        epoch::guard guard(m_epoch);
+        size = remove_page(m_pt, addr, page_table::pml4::from, count);
+    }
+
+    m_epoch.reclaim();
+    return size;
+}
+
+void
+page_table_x64::add_range(integer_pointer virt, integer_pointer phys, size_type size,
+                          const range_flags_type &flags, page_count_type &count)
+{
+    expects((virt & (page_table::pt::size_bytes - 1)) == 0);
+    expects((phys & (page_table::pt::size_bytes - 1)) == 0);
+    expects((size & (page_table::pt::size_bytes - 1)) == 0);
+    expects(flags.flags_4k != 0);
+
+    {
+        epoch::guard guard(m_epoch);
+        add_range(m_pt, page_table::pml4::from, virt, phys, size, flags, count);
+    }
+
+    m_epoch.reclaim();
+}
+
+void
+page_table_x64::remove_range(integer_pointer virt, size_type size, page_count_type &count)
+{
+    {
+        epoch::guard guard(m_epoch);
+        remove_range(m_pt, page_table::pml4::from, virt, size, count);
+    }
+
+    m_epoch.reclaim();
 }
 
 page_table_entry_x64
-page_table_x64::add_page(integer_pointer addr, integer_pointer bits, integer_pointer end)
+page_table_x64::add_page(pointer pt, integer_pointer addr, integer_pointer bits, integer_pointer end)
 {
-    auto &&index = page_table::index(addr, bits);
+    auto &&view = gsl::make_span(pt, page_table::num_entries);
+    auto &&entry = view.at(page_table::index(addr, bits));
 
     if (bits > end) {
-        if (m_pts.empty()) {
-            m_pts = std::vector<std::unique_ptr<page_table_x64>>(page_table::num_entries);
-        }
+        auto child = descend(entry, bits, m_generation);
 
-        auto &&iter = bfn::find(m_pts, index);
-        if (!(*iter)) {
-            auto &&view = gsl::make_span(m_pt, page_table::num_entries);
-            (*iter) = std::make_unique<page_table_x64>(&view.at(index));
+        if (child == nullptr) {
+            throw std::runtime_error("page table removed while adding a page");
         }
 
-        return (*iter)->add_page(addr, bits - page_table::pt::size, end);
+        return add_page(child, addr, bits - page_table::pt::size, end);
     }
 
-    if (!m_pts.empty()) {
-        m_pts.clear();
-        m_pts.shrink_to_fit();
+    // Large pages can share a page table with pointers to smaller page
+    // tables, so only the page table that this entry replaces (if any) is
+    // removed.
+
+    auto value = wait(entry);
+
+    if (is_pt(value, bits) && cas(entry, value, 0)) {
+        retire_pt(m_epoch, child_pt(value), bits - page_table::pt::size);
+        m_generation++;
     }
 
-    auto &&view = gsl::make_span(m_pt, page_table::num_entries);
-    return page_table_entry_x64(&view.at(index));
+    return page_table_entry_x64(&entry);
+}
+
+page_table_x64::size_type
+page_table_x64::remove_page(pointer pt, integer_pointer addr, integer_pointer bits, page_count_type &count)
+{
+    auto &&view = gsl::make_span(pt, page_table::num_entries);
+    auto &&entry = view.at(page_table::index(addr, bits));
+
+    while (true) {
+        auto value = load(entry);
+
+        if (is_pt(value, bits)) {
+            auto child = child_pt(value);
+            auto size = remove_page(child, addr, bits - page_table::pt::size, count);
+
+            // If the page table was replaced by a large page while the page
+            // was being removed from it, the page is removed again.
+
+            if (is_large(wait(entry), bits)) {
+                continue;
+            }
+
+            if (empty(child)) {
+                prune(m_epoch, entry, child, bits, m_generation);
+            }
+
+            return size;
+        }
+
+        if (value == 0 || is_retired(value)) {
+            return 0;
+        }
+
+        if ((value & promoted) != 0 && is_large(value, bits)) {
+            if (!split(entry, value, bits, count)) {
+                throw std::bad_alloc();
+            }
+
+            continue;
+        }
+
+        if (cas(entry, value, 0)) {
+            num_pages(count, bits)--;
+            return 1UL << bits;
+        }
+    }
 }
 
 void
-page_table_x64::remove_page(integer_pointer addr, integer_pointer bits)
+page_table_x64::add_range(pointer pt, integer_pointer bits, integer_pointer virt, integer_pointer phys,
+                          size_type size, const range_flags_type &flags, page_count_type &count)
 {
-    auto &&index = page_table::index(addr, bits);
+    auto &&view = gsl::make_span(pt, page_table::num_entries);
+    auto &&page_size = 1UL << bits;
+
+    while (size != 0) {
+        auto &&entry = view.at(page_table::index(virt, bits));
+        auto chunk = std::min(page_size - (virt & (page_size - 1)), size);
+        auto &&leaf = range_flags(flags, bits);
 
-    if (!m_pts.empty()) {
-        auto &&iter = bfn::find(m_pts, index);
-        if (auto pt = (*iter).get()) {
-            pt->remove_page(addr, bits - page_table::pt::size);
-            if (pt->empty()) {
-                (*iter) = nullptr;
+        if (leaf != 0 && chunk == page_size && (phys & (page_size - 1)) == 0) {
+            auto value = wait(entry);
+
+            if (is_retired(value)) {
+                return;
+            }
 
-                auto &&view = gsl::make_span(m_pt, page_table::num_entries);
-                view.at(index) = 0;
+            if (!cas(entry, value, phys | leaf)) {
+                continue;
             }
+
+            if (is_pt(value, bits)) {
+                sub_count(child_pt(value), bits - page_table::pt::size, count);
+                retire_pt(m_epoch, child_pt(value), bits - page_table::pt::size);
+                m_generation++;
+            }
+            else if (value != 0) {
+                num_pages(count, bits)--;
+            }
+
+            num_pages(count, bits)++;
         }
+        else {
+            page_count_type pages;
+
+            // Only part of a large page is changed, so the large page is
+            // split up first, keeping the rest of it mapped.
+
+            auto value = wait(entry);
+
+            if (is_large(value, bits)) {
+                if (!split(entry, value, bits, count)) {
+                    throw std::bad_alloc();
+                }
+
+                continue;
+            }
+
+            auto child = descend(entry, bits, m_generation);
+
+            if (child == nullptr) {
+                return;
+            }
+
+            add_range(child, bits - page_table::pt::size, virt, phys, chunk, flags, pages);
+
+            // If the page table was removed while the range was being added
+            // to it, the range is added again, and the pages that were
+            // added to the removed page table are not counted. Note that
+            // decrements wrap, but they are undone when they are added.
+
+            if (!linked(entry, child, bits)) {
+                continue;
+            }
+
+            add_count(count, pages);
+            promote(entry, child, bits, flags, count);
+        }
+
+        virt += chunk;
+        phys += chunk;
+        size -= chunk;
     }
-    else {
-        auto &&view = gsl::make_span(m_pt, page_table::num_entries);
-        view.at(index) = 0;
+}
 
-        return;
+void
+page_table_x64::remove_range(pointer pt, integer_pointer bits, integer_pointer virt, size_type size,
+                             page_count_type &count)
+{
+    auto &&view = gsl::make_span(pt, page_table::num_entries);
+    auto &&page_size = 1UL << bits;
+
+    while (size != 0) {
+        auto &&entry = view.at(page_table::index(virt, bits));
+        auto chunk = std::min(page_size - (virt & (page_size - 1)), size);
+        auto value = load(entry);
+
+        if (is_retired(value)) {
+            return;
+        }
+
+        if (is_pt(value, bits)) {
+            page_count_type pages;
+
+            // If a large page below cannot be split, the pages removed so
+            // far are still counted.
+
+            auto ___ = gsl::on_failure([&] {
+                if (!is_large(load(entry), bits)) {
+                    add_count(count, pages);
+                }
+            });
+
+            auto child = child_pt(value);
+            remove_range(child, bits - page_table::pt::size, virt, chunk, pages);
+
+            // If the page table was replaced by a large page while the range
+            // was being removed from it, the range is removed again, and the
+            // pages removed from the old page table are not counted.
+
+            if (is_large(wait(entry), bits)) {
+                continue;
+            }
+
+            add_count(count, pages);
+
+            if (empty(child)) {
+                prune(m_epoch, entry, child, bits, m_generation);
+            }
+        }
+        else if (value != 0) {
+
+            // A large page that is only partly inside the range is split
+            // up, so that the rest of it stays mapped.
+
+            if (chunk != page_size && is_large(value, bits)) {
+                if (!split(entry, value, bits, count)) {
+                    throw std::bad_alloc();
+                }
+
+                continue;
+            }
+
+            if (!cas(entry, value, 0)) {
+                continue;
+            }
+
+            num_pages(count, bits)--;
+        }
+
+        virt += chunk;
+        size -= chunk;
+    }
+}
+
+// Replaces the large page that entry maps (value) with a page table that
+// maps the same memory using the next page size down, so that part of the
+// large page can be changed. Returns false if a page table could not be
+// allocated. If entry no longer holds value, nothing is changed, and the
+// caller is expected to read entry again.
+
+bool
+page_table_x64::split(integer_pointer &entry, integer_pointer value, integer_pointer bits, page_count_type &count)
+{
+    auto pt = static_cast<pointer>(g_mm->alloc_page_table());
+
+    if (pt == nullptr) {
+        return false;
+    }
+
+    auto ___ = gsl::on_failure([&]
+    { g_mm->free_page_table(pt); });
+
+    auto &&size = 1UL << bits;
+    auto &&child_bits = bits - page_table::pt::size;
+    auto &&phys = page_table_entry_x64(&value).phys_addr() & ~(size - 1);
+    auto flags = value & ~phys;
+
+    if (child_bits == page_table::pt::from) {
+        auto &&entry_flags = page_table_entry_x64(&flags);
+        auto &&pat = entry_flags.pat_large();
+
+        entry_flags.set_pat_large(false);
+        entry_flags.set_pat_4k(pat);
+
+        flags &= ~promoted;
+    }
+
+    auto &&view = gsl::make_span(pt, page_table::num_entries);
+
+    for (auto i = 0UL; i < page_table::num_entries; i++) {
+        store(view.at(i), (phys + (i << child_bits)) | flags);
     }
+
+    if (!cas(entry, value, pt_entry(pt))) {
+        g_mm->free_page_table(pt);
+        return true;
+    }
+
+    num_pages(count, bits)--;
+    num_pages(count, child_bits) += page_table::num_entries;
+
+    m_generation++;
+    m_splits++;
+
+    return true;
+}
+
+// Replaces pt (which entry points to) with a large page if pt is full of
+// pages that the large page would map the same way. As with prune, the
+// entry is marked first, and pt is checked again once it is marked, so a CPU
+// that changes pt at the same time either changes it before it is checked
+// again, or sees the mark once it is done (and makes its change again).
+
+bool
+page_table_x64::promote(integer_pointer &entry, pointer pt, integer_pointer bits, const range_flags_type &flags,
+                        page_count_type &count)
+{
+    auto &&leaf = range_flags(flags, bits);
+    auto &&child_bits = bits - page_table::pt::size;
+    auto &&child_flags = range_flags(flags, child_bits);
+
+    if (!m_promote || leaf == 0 || child_flags == 0) {
+        return false;
+    }
+
+    auto value = load(entry);
+    auto base = 0UL;
+
+    if ((value & removing) != 0 || !is_pt(value, bits) || child_pt(value) != pt) {
+        return false;
+    }
+
+    if (!contiguous(pt, child_bits, child_flags, base)) {
+        return false;
+    }
+
+    if (!cas(entry, value, value | removing)) {
+        return false;
+    }
+
+    if (!contiguous(pt, child_bits, child_flags, base)) {
+        store(entry, value);
+        return false;
+    }
+
+    store(entry, base | leaf | promoted);
+    retire_pt(m_epoch, pt, child_bits);
+
+    num_pages(count, child_bits) -= page_table::num_entries;
+    num_pages(count, bits)++;
+
+    m_generation++;
+    m_promotions++;
+
+    return true;
 }
 
 page_table_entry_x64
-page_table_x64::virt_to_pte(integer_pointer addr, integer_pointer bits) const
+page_table_x64::virt_to_pte(pointer pt, integer_pointer addr, integer_pointer bits) const
 {
-    auto &&index = page_table::index(addr, bits);
+    auto &&view = gsl::make_span(pt, page_table::num_entries);
+    auto &&entry = view.at(page_table::index(addr, bits));
+    auto value = load(entry);
 
-    if (!m_pts.empty()) {
-        auto &&iter = bfn::cfind(m_pts, index);
-        if (auto pt = (*iter).get()) {
-            return pt->virt_to_pte(addr, bits - page_table::pt::size);
-        }
+    if (is_pt(value, bits)) {
+        return virt_to_pte(child_pt(value), addr, bits - page_table::pt::size);
+    }
 
+    if (value == 0 && bits != page_table::pt::from) {
         throw std::runtime_error("unable to locate pte. invalid address");
     }
 
-    auto &&view = gsl::make_span(m_pt, page_table::num_entries);
-    return page_table_entry_x64(&view.at(index));
+    return page_table_entry_x64(&entry);
 }
 
 page_table_x64::memory_descriptor_list
-page_table_x64::pt_to_mdl(memory_descriptor_list &mdl) const
+page_table_x64::pt_to_mdl(pointer pt, integer_pointer bits, memory_descriptor_list &mdl) const
 {
-    auto &&virt = reinterpret_cast<uintptr_t>(m_pt.get());
+    auto &&virt = reinterpret_cast<uintptr_t>(pt);
     auto &&phys = g_mm->virtint_to_physint(virt);
     auto &&type = MEMORY_TYPE_R | MEMORY_TYPE_W;
 
-    mdl.push_back({phys, virt, type});
+    add_page_to_range_list(mdl, phys, virt, type);
 
-    for (const auto &pt : m_pts) {
-        if (pt != nullptr) { pt->pt_to_mdl(mdl); }
+    for (const auto &entry : gsl::make_span(pt, page_table::num_entries)) {
+        auto value = load(entry);
+
+        if (is_pt(value, bits)) {
+            pt_to_mdl(child_pt(value), bits - page_table::pt::size, mdl);
+        }
     }
 
     return mdl;
 }
 
+page_table_x64::size_type
+page_table_x64::pt_to_mdl(memory_descriptor_range *mdl, size_type num, cursor_type &cursor) const
+{
+    expects(mdl != nullptr);
+    expects(num != 0);
+
+    if (cursor.done) {
+        return 0;
+    }
+
+    auto &&view = gsl::make_span(mdl, gsl::narrow_cast<std::ptrdiff_t>(num));
+    auto read = 0L;
+
+    {
+        epoch::guard guard(m_epoch);
+        cursor.done = pt_to_mdl(m_pt, page_table::pml4::from, 0, view, read, cursor);
+    }
+
+    return gsl::narrow_cast<size_type>(read);
+}
+
+// A page table is read if it comes at or after the cursor, and a child page
+// table is only visited if some of the addresses it translates come at or
+// after the cursor, as everything before the cursor was read by an earlier
+// call.
+
 bool
-page_table_x64::empty() const noexcept
+page_table_x64::pt_to_mdl(pointer pt, integer_pointer bits, integer_pointer virt,
+                          gsl::span<memory_descriptor_range> mdl, std::ptrdiff_t &num, cursor_type &cursor) const
 {
-    auto size = 0UL;
+    if (virt > cursor.virt || (virt == cursor.virt && bits <= cursor.bits)) {
+        auto &&pt_virt = reinterpret_cast<uintptr_t>(pt);
+        auto &&pt_phys = g_mm->virtint_to_physint(pt_virt);
+
+        if (!add_page_to_range_buffer(mdl, num, pt_phys, pt_virt, MEMORY_TYPE_R | MEMORY_TYPE_W)) {
+            cursor.virt = virt;
+            cursor.bits = bits;
+
+            return false;
+        }
+    }
 
-    auto &&view = gsl::make_span(m_pt, x64::page_table::num_entries);
-    for (auto element : view) {
-        size += element != 0 ? 1U : 0U;
+    auto &&size = 1UL << bits;
+    auto &&view = gsl::make_span(pt, page_table::num_entries);
+
+    for (auto i = 0UL; i < page_table::num_entries; i++) {
+        auto &&child_virt = virt + (i << bits);
+        auto value = load(view.at(i));
+
+        if (child_virt + size <= cursor.virt || !is_pt(value, bits)) {
+            continue;
+        }
+
+        if (!pt_to_mdl(child_pt(value), bits - page_table::pt::size, child_virt, mdl, num, cursor)) {
+            return false;
+        }
     }
 
-    return size == 0;
+    return true;
 }
 
 page_table_x64::size_type
-page_table_x64::global_size() const noexcept
+page_table_x64::global_size(pointer pt, integer_pointer bits) const
 {
     auto size = 0UL;
 
-    auto &&view = gsl::make_span(m_pt, x64::page_table::num_entries);
-    for (auto element : view) {
-        size += element != 0 ? 1U : 0U;
-    }
+    for (const auto &entry : gsl::make_span(pt, page_table::num_entries)) {
+        auto value = load(entry);
+        size += value != 0 ? 1U : 0U;
 
-    for (const auto &pt : m_pts) {
-        if (pt != nullptr) { size += pt->global_size(); }
+        if (is_pt(value, bits)) {
+            size += global_size(child_pt(value), bits - page_table::pt::size);
+        }
     }
 
     return size;
 }
 
 page_table_x64::size_type
-page_table_x64::global_capacity() const noexcept
+page_table_x64::global_capacity(pointer pt, integer_pointer bits) const
 {
-    auto size = m_pts.capacity();
+    auto size = page_table::num_entries;
 
-    for (const auto &pt : m_pts) {
-        if (pt != nullptr) { size += pt->global_capacity(); }
+    for (const auto &entry : gsl::make_span(pt, page_table::num_entries)) {
+        auto value = load(entry);
+
+        if (is_pt(value, bits)) {
+            size += global_capacity(child_pt(value), bits - page_table::pt::size);
+        }
     }
 
     return size;
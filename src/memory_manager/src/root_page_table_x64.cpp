@@ -25,6 +25,8 @@
 #include <memory_manager/memory_manager_x64.h>
 #include <memory_manager/root_page_table_x64.h>
 
+#include <intrinsics/x86/intel/cpuid_intel_x64.h>
+
 using namespace x64;
 
 // -----------------------------------------------------------------------------
@@ -45,12 +47,82 @@ void root_page_table_terminate()
 
 #endif
 
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static void
+set_entry(page_table_entry_x64 &entry, root_page_table_x64::integer_pointer phys,
+          root_page_table_x64::attr_type attr, root_page_table_x64::size_type size)
+{
+    switch (size) {
+        case page_table::pdpt::size_bytes:
+            entry.clear();
+            entry.set_phys_addr(phys & ~(page_table::pdpt::size_bytes - 1));
+            entry.set_present(true);
+            entry.set_ps(true);
+            entry.set_pat_index_large(pat::mem_attr_to_pat_index(attr));
+            break;
+
+        case page_table::pd::size_bytes:
+            entry.clear();
+            entry.set_phys_addr(phys & ~(page_table::pd::size_bytes - 1));
+            entry.set_present(true);
+            entry.set_ps(true);
+            entry.set_pat_index_large(pat::mem_attr_to_pat_index(attr));
+            break;
+
+        case page_table::pt::size_bytes:
+            entry.clear();
+            entry.set_phys_addr(phys & ~(page_table::pt::size_bytes - 1));
+            entry.set_present(true);
+            entry.set_pat_index_4k(pat::mem_attr_to_pat_index(attr));
+            break;
+    }
+
+    switch (attr) {
+        case memory_attr::rw_uc:
+        case memory_attr::rw_wc:
+        case memory_attr::rw_wt:
+        case memory_attr::rw_wp:
+        case memory_attr::rw_wb:
+        case memory_attr::rw_uc_m:
+            entry.set_rw(true);
+            entry.set_nx(true);
+            break;
+
+        case memory_attr::re_uc:
+        case memory_attr::re_wc:
+        case memory_attr::re_wt:
+        case memory_attr::re_wp:
+        case memory_attr::re_wb:
+        case memory_attr::re_uc_m:
+            entry.set_rw(false);
+            entry.set_nx(false);
+            break;
+
+        case memory_attr::pt_uc:
+        case memory_attr::pt_wc:
+        case memory_attr::pt_wt:
+        case memory_attr::pt_wp:
+        case memory_attr::pt_wb:
+        case memory_attr::pt_uc_m:
+            entry.set_rw(true);
+            entry.set_nx(false);
+            break;
+
+        default:
+            throw std::logic_error("unsupported memory permissions");
+    }
+}
+
 // -----------------------------------------------------------------------------
 // Implementation
 // -----------------------------------------------------------------------------
 
 root_page_table_x64::root_page_table_x64(bool is_vmm) :
     m_is_vmm(is_vmm),
+    m_1g_pages(intel_x64::cpuid::ext_feature_info::edx::pages_avail::is_enabled()),
     m_pt{std::make_unique<page_table_x64>(&m_cr3)}
 { }
 
@@ -60,9 +132,20 @@ root_page_table_x64::cr3()
 
 void
 root_page_table_x64::unmap(integer_pointer virt) noexcept
+{ unmap_page(virt); }
+
+void
+root_page_table_x64::unmap_range(integer_pointer virt, size_type size) noexcept
+{ unmap_pages(virt, size); }
+
+root_page_table_x64::integer_pointer
+root_page_table_x64::entry_flags(attr_type attr, size_type size)
 {
-    std::lock_guard<std::mutex> guard(m_mutex);
-    unmap_page(virt);
+    auto flags = 0UL;
+    auto &&entry = page_table_entry_x64(&flags);
+
+    set_entry(entry, 0, attr, size);
+    return flags;
 }
 
 void
@@ -72,9 +155,7 @@ root_page_table_x64::setup_identity_map_1g(
     expects((saddr & (page_table::pdpt::size_bytes - 1)) == 0);
     expects((eaddr & (page_table::pdpt::size_bytes - 1)) == 0);
 
-    for (auto virt = saddr; virt < eaddr; virt += page_table::pdpt::size_bytes) {
-        this->map_1g(virt, virt, x64::memory_attr::pt_wb);
-    }
+    this->map_pages(saddr, saddr, eaddr - saddr, x64::memory_attr::pt_wb, page_table::pdpt::size_bytes);
 }
 
 void
@@ -84,9 +165,7 @@ root_page_table_x64::setup_identity_map_2m(
     expects((saddr & (page_table::pd::size_bytes - 1)) == 0);
     expects((eaddr & (page_table::pd::size_bytes - 1)) == 0);
 
-    for (auto virt = saddr; virt < eaddr; virt += page_table::pd::size_bytes) {
-        this->map_2m(virt, virt, x64::memory_attr::pt_wb);
-    }
+    this->map_pages(saddr, saddr, eaddr - saddr, x64::memory_attr::pt_wb, page_table::pd::size_bytes);
 }
 
 void
@@ -96,9 +175,7 @@ root_page_table_x64::setup_identity_map_4k(
     expects((saddr & (page_table::pt::size_bytes - 1)) == 0);
     expects((eaddr & (page_table::pt::size_bytes - 1)) == 0);
 
-    for (auto virt = saddr; virt < eaddr; virt += page_table::pt::size_bytes) {
-        this->map_4k(virt, virt, x64::memory_attr::pt_wb);
-    }
+    this->map_pages(saddr, saddr, eaddr - saddr, x64::memory_attr::pt_wb, page_table::pt::size_bytes);
 }
 
 void
@@ -108,9 +185,7 @@ root_page_table_x64::unmap_identity_map_1g(
     expects((saddr & (page_table::pdpt::size_bytes - 1)) == 0);
     expects((eaddr & (page_table::pdpt::size_bytes - 1)) == 0);
 
-    for (auto virt = saddr; virt < eaddr; virt += page_table::pdpt::size_bytes) {
-        this->unmap(virt);
-    }
+    this->unmap_range(saddr, eaddr - saddr);
 }
 
 void
@@ -120,9 +195,7 @@ root_page_table_x64::unmap_identity_map_2m(
     expects((saddr & (page_table::pd::size_bytes - 1)) == 0);
     expects((eaddr & (page_table::pd::size_bytes - 1)) == 0);
 
-    for (auto virt = saddr; virt < eaddr; virt += page_table::pd::size_bytes) {
-        this->unmap(virt);
-    }
+    this->unmap_range(saddr, eaddr - saddr);
 }
 
 void
@@ -132,128 +205,126 @@ root_page_table_x64::unmap_identity_map_4k(
     expects((saddr & (page_table::pt::size_bytes - 1)) == 0);
     expects((eaddr & (page_table::pt::size_bytes - 1)) == 0);
 
-    for (auto virt = saddr; virt < eaddr; virt += page_table::pt::size_bytes) {
-        this->unmap(virt);
-    }
+    this->unmap_range(saddr, eaddr - saddr);
 }
 
 page_table_entry_x64
 root_page_table_x64::virt_to_pte(integer_pointer virt) const
-{
-    std::lock_guard<std::mutex> guard(m_mutex);
-    return m_pt->virt_to_pte(virt);
-}
+{ return m_pt->virt_to_pte(virt); }
 
 root_page_table_x64::memory_descriptor_list
 root_page_table_x64::pt_to_mdl() const
-{
-    std::lock_guard<std::mutex> guard(m_mutex);
-    return m_pt->pt_to_mdl();
-}
+{ return m_pt->pt_to_mdl(); }
 
-page_table_entry_x64
-root_page_table_x64::add_page(integer_pointer virt, size_type size)
+root_page_table_x64::size_type
+root_page_table_x64::pt_to_mdl(memory_descriptor_range *mdl, size_type num, cursor_type &cursor) const
+{ return m_pt->pt_to_mdl(mdl, num, cursor); }
+
+root_page_table_x64::size_type
+root_page_table_x64::generation() const noexcept
+{ return m_pt->generation(); }
+
+root_page_table_x64::size_type
+root_page_table_x64::promotions() const noexcept
+{ return m_pt->promotions(); }
+
+void
+root_page_table_x64::enable_promotion() noexcept
+{ m_pt->enable_promotion(); }
+
+void
+root_page_table_x64::disable_promotion() noexcept
+{ m_pt->disable_promotion(); }
+
+root_page_table_x64::size_type
+root_page_table_x64::splits() const noexcept
+{ return m_pt->splits(); }
+
+root_page_table_x64::size_type
+root_page_table_x64::mapped_pages(size_type size) const
 {
     switch (size) {
         case page_table::pdpt::size_bytes:
-            return m_pt->add_page_1g(virt);
+            return m_count.num_1g;
 
         case page_table::pd::size_bytes:
-            return m_pt->add_page_2m(virt);
+            return m_count.num_2m;
 
         case page_table::pt::size_bytes:
-            return m_pt->add_page_4k(virt);
+            return m_count.num_4k;
 
         default:
-            throw std::logic_error("invalid pt size");
+            return 0;
     }
 }
 
 void
 root_page_table_x64::map_page(integer_pointer virt, integer_pointer phys, attr_type attr,
                               size_type size)
+{ this->map_pages(virt & ~(size - 1), phys & ~(size - 1), size, attr, size); }
+
+void
+root_page_table_x64::unmap_page(integer_pointer virt) noexcept
 {
-    std::lock_guard<std::mutex> guard(m_mutex);
+    auto size = 0UL;
 
-    auto &&entry = add_page(virt, size);
+    guard_exceptions([&]
+    { size = m_pt->remove_page(virt, m_count); });
 
-    auto ___ = gsl::on_failure([&]
-    { this->unmap_page(virt); });
+    if (m_is_vmm) {
 
-    switch (size) {
-        case page_table::pdpt::size_bytes:
-            entry.clear();
-            entry.set_phys_addr(phys & ~(page_table::pdpt::size_bytes - 1));
-            entry.set_present(true);
-            entry.set_ps(true);
-            entry.set_pat_index_large(pat::mem_attr_to_pat_index(attr));
-            break;
+        // A large page is removed as a whole, so its descriptors start at
+        // the beginning of the page, and not at virt.
 
-        case page_table::pd::size_bytes:
-            entry.clear();
-            entry.set_phys_addr(phys & ~(page_table::pd::size_bytes - 1));
-            entry.set_present(true);
-            entry.set_ps(true);
-            entry.set_pat_index_large(pat::mem_attr_to_pat_index(attr));
-            break;
+        auto base = size != 0 ? virt & ~(size - 1) : virt;
+        auto pages = size != 0 ? size >> page_shift : 1;
 
-        case page_table::pt::size_bytes:
-            entry.clear();
-            entry.set_phys_addr(phys & ~(page_table::pt::size_bytes - 1));
-            entry.set_present(true);
-            entry.set_pat_index_4k(pat::mem_attr_to_pat_index(attr));
-            break;
+        g_mm->remove_md_range(base, pages);
     }
+}
 
-    switch (attr) {
-        case memory_attr::rw_uc:
-        case memory_attr::rw_wc:
-        case memory_attr::rw_wt:
-        case memory_attr::rw_wp:
-        case memory_attr::rw_wb:
-        case memory_attr::rw_uc_m:
-            entry.set_rw(true);
-            entry.set_nx(true);
-            break;
+void
+root_page_table_x64::map_pages(integer_pointer virt, integer_pointer phys, size_type size, attr_type attr,
+                               size_type max_size, bool track)
+{
+    expects((virt & (page_table::pt::size_bytes - 1)) == 0);
+    expects((phys & (page_table::pt::size_bytes - 1)) == 0);
+    expects((size & (page_table::pt::size_bytes - 1)) == 0);
 
-        case memory_attr::re_uc:
-        case memory_attr::re_wc:
-        case memory_attr::re_wt:
-        case memory_attr::re_wp:
-        case memory_attr::re_wb:
-        case memory_attr::re_uc_m:
-            entry.set_rw(false);
-            entry.set_nx(false);
-            break;
+    if (size == 0) {
+        return;
+    }
 
-        case memory_attr::pt_uc:
-        case memory_attr::pt_wc:
-        case memory_attr::pt_wt:
-        case memory_attr::pt_wp:
-        case memory_attr::pt_wb:
-        case memory_attr::pt_uc_m:
-            entry.set_rw(true);
-            entry.set_nx(false);
-            break;
+    page_table_x64::range_flags_type flags;
 
-        default:
-            throw std::logic_error("unsupported memory permissions");
+    if (max_size >= page_table::pdpt::size_bytes && m_1g_pages) {
+        flags.flags_1g = entry_flags(attr, page_table::pdpt::size_bytes);
     }
 
-    if (m_is_vmm) {
-        g_mm->add_md(virt, phys, attr);
+    if (max_size >= page_table::pd::size_bytes) {
+        flags.flags_2m = entry_flags(attr, page_table::pd::size_bytes);
+    }
+
+    flags.flags_4k = entry_flags(attr, page_table::pt::size_bytes);
+
+    auto ___ = gsl::on_failure([&]
+    { this->unmap_pages(virt, size, track); });
+
+    m_pt->add_range(virt, phys, size, flags, m_count);
+
+    if (m_is_vmm && track) {
+        g_mm->add_md_range(virt, phys, size >> page_shift, attr);
     }
 }
 
 void
-root_page_table_x64::unmap_page(integer_pointer virt) noexcept
+root_page_table_x64::unmap_pages(integer_pointer virt, size_type size, bool track) noexcept
 {
     guard_exceptions([&]
-    { m_pt->remove_page(virt); });
+    { m_pt->remove_range(virt, size, m_count); });
 
-    if (m_is_vmm) {
-        guard_exceptions([&]
-        { g_mm->remove_md(virt); });
+    if (m_is_vmm && track) {
+        g_mm->remove_md_range(virt, size >> page_shift);
     }
 }
 
@@ -266,6 +337,12 @@ root_pt() noexcept
         rpt = std::make_unique<root_page_table_x64>(true);
 
         try {
+
+            // Promotion is only safe before any CPU loads the page tables
+            // (see enable_promotion()), so it is limited to this build.
+
+            rpt->enable_promotion();
+
             for (const auto &md : g_mm->descriptors()) {
                 auto attr = memory_attr::invalid;
 
@@ -276,8 +353,15 @@ root_pt() noexcept
                     attr = memory_attr::re_wb;
                 }
 
-                rpt->map_4k(md.virt, md.phys, attr);
+                rpt->map_range(md.virt, md.phys, md.pages << page_shift, attr);
             }
+
+            rpt->disable_promotion();
+
+            bfdebug << "root page tables: " << rpt->mapped_pages(page_table::pdpt::size_bytes)
+                    << " 1g pages, " << rpt->mapped_pages(page_table::pd::size_bytes)
+                    << " 2m pages, " << rpt->mapped_pages(page_table::pt::size_bytes)
+                    << " 4k pages, " << rpt->promotions() << " page tables reclaimed" << bfendl;
         }
         catch (std::exception &e) {
             rpt.reset();
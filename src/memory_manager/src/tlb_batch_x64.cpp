@@ -0,0 +1,211 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#include <bfgsl.h>
+
+#include <memory_manager/tlb_batch_x64.h>
+#include <memory_manager/memory_manager_x64.h>
+
+#include <intrinsics/x86/common_x64.h>
+#include <intrinsics/x86/intel/crs_intel_x64.h>
+using namespace x64;
+
+// -----------------------------------------------------------------------------
+// Global Memory
+// -----------------------------------------------------------------------------
+
+/// \cond
+
+std::array<tlb_batch_x64, TLB_BATCH_MAX_CPUS> g_tlb_batch_cpus;
+std::atomic<tlb_batch_x64::integer_pointer> g_tlb_batch_pcid{0};
+std::atomic<tlb_batch_x64::integer_pointer> g_tlb_batch_cr3{0};
+
+/// \endcond
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+static tlb_batch_x64::size_type
+num_pages(tlb_batch_x64::integer_pointer virt, tlb_batch_x64::size_type size) noexcept
+{
+    auto &&lower = virt & (page_table::pt::size_bytes - 1);
+    return (lower + size + page_table::pt::size_bytes - 1) >> page_shift;
+}
+
+// The PCID that set_pcid() recorded is only used while the VMM's own CR3 is
+// loaded. Before the VMM is launched (and on the host side of the launch
+// path), the CPU runs in the host OS's CR3, where the VMM's PCID might mean
+// something else, or CR4.PCIDE might be clear, in which case INVPCID with a
+// PCID other than 0 faults. INVLPG and CR3 reloads are used instead then.
+
+static tlb_batch_x64::integer_pointer
+usable_pcid() noexcept
+{
+    auto &&pcid = g_tlb_batch_pcid.load();
+
+    if (pcid != 0 && intel_x64::cr3::get() == g_tlb_batch_cr3.load()) {
+        return pcid;
+    }
+
+    return 0;
+}
+
+static void
+invlpg_range(tlb_batch_x64::integer_pointer virt, tlb_batch_x64::size_type size,
+             tlb_batch_x64::integer_pointer pcid) noexcept
+{
+    auto &&vmap = virt & ~(page_table::pt::size_bytes - 1);
+
+    for (auto vadr = vmap; vadr < virt + size; vadr += page_table::pt::size_bytes) {
+        if (pcid != 0) {
+            tlb::invpcid_individual_address(pcid, vadr);
+        }
+        else {
+            tlb::invlpg(vadr);
+        }
+    }
+}
+
+void
+tlb_batch_x64::invalidate(integer_pointer virt, size_type size) noexcept
+{
+    if (size == 0) {
+        return;
+    }
+
+    auto &&pages = num_pages(virt, size);
+    auto &&pcid = usable_pcid();
+
+    if (pages > TLB_BATCH_FLUSH_THRESHOLD) {
+        this->flush_all(m_pages + pages, pcid);
+        this->free_released();
+
+        return;
+    }
+
+    invlpg_range(virt, size, pcid);
+    m_issued += pages;
+}
+
+void
+tlb_batch_x64::release(integer_pointer virt, size_type size) noexcept
+{
+    if (m_num == TLB_BATCH_MAX_RELEASES) {
+        this->flush();
+    }
+
+    auto &&range = gsl::at(m_ranges, m_num++);
+
+    range.virt = virt;
+    range.size = size;
+
+    m_pages += num_pages(virt, size);
+}
+
+void
+tlb_batch_x64::flush() noexcept
+{
+    if (m_num == 0) {
+        return;
+    }
+
+    auto &&pcid = usable_pcid();
+
+    if (m_pages > TLB_BATCH_FLUSH_THRESHOLD) {
+        this->flush_all(m_pages, pcid);
+    }
+    else {
+        for (auto i = 0UL; i < m_num; i++) {
+            const auto &range = gsl::at(m_ranges, i);
+            invlpg_range(range.virt, range.size, pcid);
+        }
+
+        m_issued += m_pages;
+    }
+
+    this->free_released();
+}
+
+// The VMM's mappings are never global, so reloading CR3 invalidates all of
+// them, which replaces one INVLPG per page with a single instruction. When
+// the VMM's address space is tagged with a PCID, only that PCID is flushed.
+
+void
+tlb_batch_x64::flush_all(size_type pages, integer_pointer pcid) noexcept
+{
+    if (pcid != 0) {
+        tlb::invpcid_single_context(pcid);
+    }
+    else {
+        intel_x64::cr3::set(intel_x64::cr3::get());
+    }
+
+    m_issued += 1;
+    m_saved += pages - 1;
+}
+
+void
+tlb_batch_x64::free_released() noexcept
+{
+    for (auto i = 0UL; i < m_num; i++) {
+        g_mm->free_map(reinterpret_cast<memory_manager_x64::pointer>(gsl::at(m_ranges, i).virt));
+    }
+
+    m_num = 0;
+    m_pages = 0;
+}
+
+void
+tlb_batch_x64::set_pcid(integer_pointer pcid, integer_pointer cr3) noexcept
+{
+    g_tlb_batch_cr3 = pcid != 0 ? cr3 : 0;
+    g_tlb_batch_pcid = pcid;
+}
+
+tlb_batch_x64::integer_pointer
+tlb_batch_x64::pcid() noexcept
+{ return g_tlb_batch_pcid.load(); }
+
+tlb_batch_x64 *
+tlb_batch_cpu() noexcept
+{
+    auto &&cpuid = thread_context_cpuid();
+
+    if (cpuid >= TLB_BATCH_MAX_CPUS) {
+        return nullptr;
+    }
+
+    return &gsl::at(g_tlb_batch_cpus, cpuid);
+}
+
+void
+tlb_batch_totals(size_t &issued, size_t &saved) noexcept
+{
+    issued = 0;
+    saved = 0;
+
+    for (const auto &batch : g_tlb_batch_cpus) {
+        issued += batch.issued();
+        saved += batch.saved();
+    }
+}
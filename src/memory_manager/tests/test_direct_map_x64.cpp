@@ -0,0 +1,155 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfgsl.h>
+#include <bfmemory.h>
+
+#include <memory_manager/map_ptr_x64.h>
+#include <memory_manager/direct_map_x64.h>
+#include <memory_manager/memory_manager_x64.h>
+#include <memory_manager/root_page_table_x64.h>
+
+#include <test/memory_manager_utils.h>
+
+#include <intrinsics/x86/intel/cpuid_intel_x64.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace x64;
+
+// Every test uses its own start address, as the direct map is never
+// unmapped from the root page tables.
+
+constexpr const auto start1 = 0x0000700000000000UL;
+constexpr const auto start2 = 0x0000710000000000UL;
+
+// The VMM's root page tables read CPUID when they are created, to see if
+// the CPU supports 1g pages, so every test says that it does.
+
+static void
+setup_intrinsics(MockRepository &mocks)
+{
+    auto &&mask = intel_x64::cpuid::ext_feature_info::edx::pages_avail::mask;
+    mocks.OnCallFunc(_cpuid_edx).Return(gsl::narrow_cast<uint32_t>(mask));
+}
+
+TEST_CASE("direct_map_x64: add_range uses large pages and no descriptors")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    arena_mdl mdl;
+    direct_map_x64 dm{start1};
+
+    auto num_1g = g_pt->mapped_pages(page_table::pdpt::size_bytes);
+    auto num_2m = g_pt->mapped_pages(page_table::pd::size_bytes);
+
+    dm.add_range(0x40000000, 0x40000000 + 0x200000);
+
+    CHECK(g_pt->mapped_pages(page_table::pdpt::size_bytes) == num_1g + 1);
+    CHECK(g_pt->mapped_pages(page_table::pd::size_bytes) == num_2m + 1);
+
+    CHECK(g_pt->virt_to_pte(start1 + 0x40000000).ps());
+    CHECK(g_pt->virt_to_pte(start1 + 0x40000000).phys_addr() == 0x40000000);
+    CHECK(g_pt->virt_to_pte(start1 + 0x80000000).phys_addr() == 0x80000000);
+    CHECK_THROWS(g_mm->virtint_to_physint(start1 + 0x40000000));
+
+    CHECK(dm.phys_to_direct(0x40000000) == start1 + 0x40000000);
+    CHECK(dm.phys_to_direct(0x80123456) == start1 + 0x80123456);
+    CHECK(dm.phys_to_direct(0x80200000) == 0);
+    CHECK(dm.phys_to_direct(0x3FFFF000) == 0);
+
+    CHECK(dm.direct_to_phys(start1 + 0x40001234) == 0x40001234);
+    CHECK(dm.direct_to_phys(start1 + 0x80200000) == 0);
+    CHECK(dm.direct_to_phys(start1 - 0x1000) == 0);
+    CHECK(dm.direct_to_phys(0x40000000) == 0);
+
+    CHECK(dm.size() == 0x40000000 + 0x200000);
+    CHECK(dm.num_ranges() == 1);
+}
+
+TEST_CASE("direct_map_x64: ranges")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    arena_mdl mdl;
+    direct_map_x64 dm{start2};
+
+    dm.add_range(0, 0x2000);
+    CHECK(dm.phys_to_direct(0) == 0);
+    CHECK(dm.phys_to_direct(0x1000) == start2 + 0x1000);
+
+    dm.add_range(0x2000, 0x1000);
+    CHECK(dm.num_ranges() == 1);
+    CHECK(dm.size() == 0x2000);
+
+    dm.add_range(0x10000, 0x1000);
+    CHECK(dm.num_ranges() == 2);
+    CHECK(dm.phys_to_direct(0x10000) == start2 + 0x10000);
+    CHECK(dm.phys_to_direct(0x3000) == 0);
+
+    CHECK_THROWS(dm.add_range(0x2000, 0x1000));
+    CHECK_THROWS(dm.add_range(0x8000, 0x10000));
+    CHECK_THROWS(dm.add_range(0x20001, 0x1000));
+    CHECK_THROWS(dm.add_range(0x20000, 0x1001));
+    CHECK_THROWS(dm.add_range(DIRECT_MAP_MAX_PHYS, 0x1000));
+    CHECK_NOTHROW(dm.add_range(0x20000, 0));
+
+    CHECK(dm.num_ranges() == 2);
+    CHECK(dm.size() == 0x3000);
+
+    CHECK_THROWS(direct_map_x64{start2 + 0x1000});
+}
+
+TEST_CASE("direct_map_x64: make_unique_map_x64 uses the direct map")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    arena_mdl mdl;
+    auto phys = 0x0000000100000000UL;
+
+    g_dm->add_range(phys, 0x200000);
+
+    CHECK(phys_to_direct(phys) == DIRECT_MAP_START + phys);
+    CHECK(direct_to_phys(DIRECT_MAP_START + phys) == phys);
+
+    auto num_4k = g_pt->mapped_pages(page_table::pt::size_bytes);
+
+    {
+        auto &&map = bfn::make_unique_map_x64<char>(phys + 0x1000);
+
+        CHECK(reinterpret_cast<uintptr_t>(map.get()) == DIRECT_MAP_START + phys + 0x1000);
+        CHECK(map.size() == page_size);
+        CHECK(g_pt->mapped_pages(page_table::pt::size_bytes) == num_4k);
+    }
+
+    CHECK(g_pt->virt_to_pte(DIRECT_MAP_START + phys).phys_addr() == phys);
+    CHECK_THROWS(bfn::make_unique_map_x64<char>(phys + 1));
+
+}
+
+#endif
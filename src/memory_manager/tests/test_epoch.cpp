@@ -0,0 +1,233 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <memory_manager/epoch.h>
+
+// retire() writes two words into the memory it is given, so every object
+// that is retired starts with room for them.
+
+struct object_type
+{
+    epoch::integer_pointer link[2];
+    int value;
+};
+
+static std::atomic<int> g_num_freed{0};
+
+static epoch::pointer
+alloc_object(int value = 0)
+{ return new object_type{{0, 0}, value}; }
+
+static void
+count_free(epoch::pointer ptr)
+{ delete static_cast<object_type *>(ptr); g_num_freed++; }
+
+TEST_CASE("epoch: retire without readers")
+{
+    g_num_freed = 0;
+    epoch e{count_free};
+
+    e.retire(alloc_object());
+    CHECK(e.num_retired() == 1);
+
+    e.reclaim();
+    CHECK(g_num_freed == 0);
+    e.reclaim();
+    CHECK(g_num_freed == 1);
+    CHECK(e.num_retired() == 0);
+}
+
+TEST_CASE("epoch: reader delays free")
+{
+    g_num_freed = 0;
+    epoch e{count_free};
+
+    {
+        epoch::guard guard(e);
+        e.retire(alloc_object());
+
+        for (auto i = 0; i < 10; i++) {
+            e.reclaim();
+        }
+
+        CHECK(g_num_freed == 0);
+    }
+
+    e.reclaim();
+    e.reclaim();
+    CHECK(g_num_freed == 1);
+}
+
+TEST_CASE("epoch: new readers do not delay free")
+{
+    g_num_freed = 0;
+    epoch e{count_free};
+
+    e.retire(alloc_object());
+    e.reclaim();
+
+    epoch::guard guard(e);
+    e.reclaim();
+
+    CHECK(g_num_freed == 1);
+}
+
+TEST_CASE("epoch: only old memory is freed")
+{
+    g_num_freed = 0;
+    epoch e{count_free};
+
+    e.retire(alloc_object());
+    e.reclaim();
+    e.retire(alloc_object());
+    e.retire(alloc_object());
+    e.reclaim();
+
+    CHECK(g_num_freed == 1);
+    CHECK(e.num_retired() == 2);
+
+    e.reclaim();
+    CHECK(g_num_freed == 3);
+    CHECK(e.num_retired() == 0);
+}
+
+TEST_CASE("epoch: reclaim does not wait for readers")
+{
+    constexpr const auto num_retired = 1000;
+
+    g_num_freed = 0;
+    epoch e{count_free};
+
+    std::atomic<bool> entered{false};
+    std::atomic<bool> done{false};
+
+    std::thread reader([&] {
+        epoch::guard guard(e);
+        entered = true;
+
+        while (!done) {
+            std::this_thread::yield();
+        }
+    });
+
+    while (!entered) {
+        std::this_thread::yield();
+    }
+
+    for (auto i = 0; i < num_retired; i++) {
+        e.retire(alloc_object());
+        e.reclaim();
+    }
+
+    CHECK(e.num_retired() == num_retired);
+
+    done = true;
+    reader.join();
+
+    e.reclaim();
+    e.reclaim();
+    CHECK(g_num_freed == num_retired);
+}
+
+TEST_CASE("epoch: retired memory is tagged")
+{
+    constexpr const auto tag = 0x5UL;
+
+    epoch e{count_free, tag};
+
+    auto first = alloc_object();
+    auto second = alloc_object();
+
+    e.retire(first);
+    e.retire(second);
+
+    auto &&first_link = static_cast<object_type *>(first)->link;
+    auto &&second_link = static_cast<object_type *>(second)->link;
+
+    CHECK(first_link[0] == tag);
+    CHECK((first_link[1] & tag) == tag);
+    CHECK(second_link[0] == (reinterpret_cast<epoch::integer_pointer>(first) | tag));
+    CHECK((second_link[1] & tag) == tag);
+}
+
+TEST_CASE("epoch: destructor frees retired")
+{
+    g_num_freed = 0;
+
+    {
+        epoch e{count_free};
+        e.retire(alloc_object());
+        e.retire(alloc_object());
+    }
+
+    CHECK(g_num_freed == 2);
+}
+
+// Readers copy the value of a shared object while writers replace it and
+// retire the old one. Freed objects are poisoned, so a reader that sees a
+// poisoned value has read memory after it was reclaimed.
+
+TEST_CASE("epoch: stress")
+{
+    constexpr const auto num_threads = 8;
+    constexpr const auto num_loops = 10000;
+
+    epoch e{[](epoch::pointer ptr) { static_cast<object_type *>(ptr)->value = -1; delete static_cast<object_type *>(ptr); }};
+    std::atomic<object_type *> shared{static_cast<object_type *>(alloc_object())};
+    std::atomic<bool> failed{false};
+
+    std::vector<std::thread> threads;
+    for (auto t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            for (auto i = 0; i < num_loops; i++) {
+                if (t % 2 == 0) {
+                    epoch::guard guard(e);
+
+                    if (shared.load()->value < 0) {
+                        failed = true;
+                    }
+                }
+                else {
+                    {
+                        epoch::guard guard(e);
+                        e.retire(shared.exchange(static_cast<object_type *>(alloc_object(i))));
+                    }
+
+                    e.reclaim();
+                }
+            }
+        });
+    }
+
+    for (auto &&thread : threads) {
+        thread.join();
+    }
+
+    CHECK_FALSE(failed);
+    delete shared.load();
+}
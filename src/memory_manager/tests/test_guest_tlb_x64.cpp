@@ -0,0 +1,105 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include <memory_manager/guest_tlb_x64.h>
+
+constexpr const auto cr3_1 = 0x0000000000100000UL;
+constexpr const auto cr3_2 = 0x0000000000200000UL;
+
+constexpr const auto virt_4k = 0x0000111100001000UL;
+constexpr const auto phys_4k = 0x0000222200005000UL;
+constexpr const auto virt_2m = 0x0000111100400000UL;
+constexpr const auto phys_2m = 0x0000222200800000UL;
+
+static guest_tlb_x64::entry_type
+make_entry(uintptr_t cr3, uintptr_t virt, uintptr_t phys, size_t size)
+{
+    guest_tlb_x64::entry_type entry;
+
+    entry.cr3 = cr3;
+    entry.virt = virt;
+    entry.phys = phys;
+    entry.size = size;
+    entry.pati = 1;
+
+    return entry;
+}
+
+TEST_CASE("guest_tlb_x64: lookup")
+{
+    guest_tlb_x64 tlb;
+    guest_tlb_x64::entry_type entry;
+
+    CHECK_FALSE(tlb.lookup(cr3_1, virt_4k, entry));
+    CHECK(tlb.misses() == 1);
+
+    tlb.insert(make_entry(cr3_1, virt_4k + 0x10, phys_4k, 0x1000));
+
+    CHECK(tlb.lookup(cr3_1, virt_4k + 0x20, entry));
+    CHECK(entry.virt == virt_4k);
+    CHECK(entry.phys == phys_4k);
+    CHECK(entry.pati == 1);
+    CHECK(entry.phys_addr(virt_4k + 0x20) == phys_4k + 0x20);
+    CHECK(tlb.hits() == 1);
+
+    CHECK_FALSE(tlb.lookup(cr3_2, virt_4k, entry));
+    CHECK_FALSE(tlb.lookup(cr3_1, virt_4k + (GUEST_TLB_SIZE << 12), entry));
+    CHECK(tlb.misses() == 3);
+}
+
+TEST_CASE("guest_tlb_x64: large pages")
+{
+    guest_tlb_x64 tlb;
+    guest_tlb_x64::entry_type entry;
+
+    tlb.insert(make_entry(cr3_1, virt_2m + 0x3000, phys_2m + 0x3000, 0x200000));
+
+    CHECK(tlb.lookup(cr3_1, virt_2m + 0x3010, entry));
+    CHECK(entry.phys == phys_2m);
+    CHECK(entry.phys_addr(virt_2m + 0x3010) == phys_2m + 0x3010);
+
+    tlb.invalidate(virt_2m + 0x100000);
+    CHECK_FALSE(tlb.lookup(cr3_1, virt_2m + 0x3010, entry));
+}
+
+TEST_CASE("guest_tlb_x64: invalidate")
+{
+    guest_tlb_x64 tlb;
+    guest_tlb_x64::entry_type entry;
+
+    tlb.insert(make_entry(cr3_1, virt_4k, phys_4k, 0x1000));
+    tlb.insert(make_entry(cr3_2, virt_4k + 0x1000, phys_4k, 0x1000));
+
+    tlb.invalidate(virt_4k + 0x2000);
+    CHECK(tlb.lookup(cr3_1, virt_4k, entry));
+    CHECK(tlb.lookup(cr3_2, virt_4k + 0x1000, entry));
+
+    tlb.invalidate(virt_4k + 0x1fff);
+    CHECK(tlb.lookup(cr3_1, virt_4k, entry));
+    CHECK_FALSE(tlb.lookup(cr3_2, virt_4k + 0x1000, entry));
+
+    tlb.flush();
+    CHECK_FALSE(tlb.lookup(cr3_1, virt_4k, entry));
+}
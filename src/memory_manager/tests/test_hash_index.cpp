@@ -0,0 +1,178 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include <atomic>
+#include <thread>
+
+#include <bfgsl.h>
+#include <memory_manager/hash_index.h>
+
+TEST_CASE("hash_index: get empty")
+{
+    hash_index index;
+
+    CHECK(index.get(0) == 0);
+    CHECK(index.get(0x123456789) == 0);
+    CHECK(index.get(0xFFFFFFFFFFFFFFFF) == 0);
+    CHECK(index.size() == 0);
+    CHECK(index.bytes() == 0);
+}
+
+TEST_CASE("hash_index: set invalid")
+{
+    hash_index index;
+
+    CHECK_THROWS(index.set(0xFFFFFFFFFFFFFFFF, 1));
+    CHECK_THROWS(index.set(1, 0));
+}
+
+TEST_CASE("hash_index: set / get")
+{
+    hash_index index;
+
+    index.set(0, 10);
+    index.set(1, 11);
+    index.set(0x200, 12);
+    index.set(0xFFFFFFFFF, 13);
+
+    CHECK(index.get(0) == 10);
+    CHECK(index.get(1) == 11);
+    CHECK(index.get(2) == 0);
+    CHECK(index.get(0x200) == 12);
+    CHECK(index.get(0xFFFFFFFFF) == 13);
+    CHECK(index.get(0xFFFFFFFFE) == 0);
+    CHECK(index.size() == 4);
+
+    index.set(1, 14);
+    CHECK(index.get(1) == 14);
+    CHECK(index.size() == 4);
+}
+
+TEST_CASE("hash_index: erase")
+{
+    hash_index index;
+
+    CHECK(index.erase(1) == 0);
+    CHECK(index.erase(0xFFFFFFFFFFFFFFFF) == 0);
+
+    index.set(1, 11);
+    index.set(2, 12);
+
+    CHECK(index.erase(1) == 11);
+    CHECK(index.get(1) == 0);
+    CHECK(index.get(2) == 12);
+    CHECK(index.erase(1) == 0);
+    CHECK(index.size() == 1);
+}
+
+TEST_CASE("hash_index: erase keeps colliding keys")
+{
+    hash_index index;
+
+    // Keys that are a multiple of the table size apart are likely to share
+    // a probe sequence, so erasing one must move the others back.
+
+    for (auto i = 0ULL; i < 100; i++) {
+        index.set(i << 32, i + 1);
+    }
+
+    for (auto i = 0ULL; i < 100; i += 2) {
+        CHECK(index.erase(i << 32) == i + 1);
+    }
+
+    for (auto i = 0ULL; i < 100; i++) {
+        CHECK(index.get(i << 32) == ((i & 1) != 0 ? i + 1 : 0));
+    }
+
+    CHECK(index.size() == 50);
+}
+
+TEST_CASE("hash_index: reserve")
+{
+    hash_index index;
+
+    CHECK_THROWS(index.reserve(0xFFFFFFFFFFFFFFFF));
+
+    index.set(1, 11);
+
+    auto bytes = index.bytes();
+    index.reserve(1000);
+
+    CHECK(index.bytes() > bytes);
+    CHECK(index.get(1) == 11);
+
+    bytes = index.bytes();
+
+    for (auto i = 0ULL; i < 1000; i++) {
+        index.set(i + 2, i + 12);
+    }
+
+    CHECK(index.bytes() == bytes);
+    CHECK(index.get(1001) == 1011);
+    CHECK(index.size() == 1001);
+}
+
+TEST_CASE("hash_index: bytes of scattered keys")
+{
+    hash_index index;
+
+    for (auto i = 0ULL; i < 0x10000; i++) {
+        index.set(i * 0x201, i + 1);
+    }
+
+    for (auto i = 0ULL; i < 0x10000; i++) {
+        CHECK(index.get(i * 0x201) == i + 1);
+    }
+
+    CHECK(index.bytes() <= index.size() * 64);
+}
+
+TEST_CASE("hash_index: concurrent get / set / erase")
+{
+    hash_index index;
+    std::atomic<bool> done{false};
+
+    for (auto i = 0ULL; i < 0x100; i++) {
+        index.set(i, i + 1);
+    }
+
+    auto &&reader = std::thread([&] {
+        while (!done) {
+            for (auto i = 0ULL; i < 0x100; i++) {
+                CHECK(index.get(i) == i + 1);
+            }
+        }
+    });
+
+    for (auto i = 0x100ULL; i < 0x10000; i++) {
+        index.set(i, i + 1);
+    }
+
+    for (auto i = 0x100ULL; i < 0x10000; i++) {
+        index.erase(i);
+    }
+
+    done = true;
+    reader.join();
+}
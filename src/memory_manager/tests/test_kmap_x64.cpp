@@ -0,0 +1,169 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <vector>
+
+#include <bfgsl.h>
+#include <bfmemory.h>
+
+#include <memory_manager/kmap_x64.h>
+#include <memory_manager/memory_manager_x64.h>
+#include <memory_manager/root_page_table_x64.h>
+
+#include <test/memory_manager_utils.h>
+
+#include <intrinsics/x86/common_x64.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace x64;
+
+constexpr const auto phys1 = 0x0000222200001000UL;
+constexpr const auto phys2 = 0x0000222200002000UL;
+
+static void
+test_invlpg(const void *virt) noexcept
+{ (void) virt; }
+
+static void
+setup_intrinsics(MockRepository &mocks)
+{
+    mocks.OnCallFunc(_invlpg).Do(test_invlpg);
+    mocks.OnCallFunc(_cpuid_edx).Return(0U);
+}
+
+TEST_CASE("kmap_x64: map rewrites the slot's entry")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    arena_mdl mdl;
+    auto kmap = kmap_cpu();
+
+    auto virt = kmap->map(phys1, memory_attr::rw_wb);
+    auto &&pte = g_pt->virt_to_pte(virt);
+
+    CHECK(virt >= kmap->window());
+    CHECK(virt < kmap->window() + KMAP_SLOTS * page_size);
+    CHECK((virt & (page_size - 1)) == 0);
+    CHECK(kmap->num_mapped() == 1);
+
+    CHECK(pte.present());
+    CHECK(pte.rw());
+    CHECK(pte.phys_addr() == phys1);
+
+    kmap->unmap(virt);
+
+    CHECK(kmap->num_mapped() == 0);
+    CHECK(pte.present());
+    CHECK(pte.phys_addr() != phys1);
+}
+
+TEST_CASE("kmap_x64: nested maps use different slots")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    arena_mdl mdl;
+    auto kmap = kmap_cpu();
+
+    auto virt1 = kmap->map(phys1);
+    auto virt2 = kmap->map(phys2);
+
+    CHECK(virt1 != virt2);
+    CHECK(kmap->num_mapped() == 2);
+    CHECK(g_pt->virt_to_pte(virt1).phys_addr() == phys1);
+    CHECK(g_pt->virt_to_pte(virt2).phys_addr() == phys2);
+
+    kmap->unmap(virt1);
+    CHECK(kmap->map(phys2) == virt1);
+
+    kmap->unmap(virt1);
+    kmap->unmap(virt2);
+
+    CHECK(kmap->num_mapped() == 0);
+}
+
+TEST_CASE("kmap_x64: map failures")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    arena_mdl mdl;
+    auto kmap = kmap_cpu();
+
+    CHECK_THROWS(kmap->map(0));
+    CHECK_THROWS(kmap->map(phys1 + 1));
+    CHECK_THROWS(kmap->map(phys1, 0));
+    CHECK(kmap->num_mapped() == 0);
+
+    std::vector<kmap_x64::integer_pointer> slots;
+    for (auto i = 0; i < KMAP_SLOTS; i++) {
+        slots.push_back(kmap->map(phys1));
+    }
+
+    CHECK_THROWS(kmap->map(phys2));
+
+    for (const auto &virt : slots) {
+        kmap->unmap(virt);
+    }
+
+    kmap->unmap(0);
+    kmap->unmap(kmap->window() + KMAP_SLOTS * page_size);
+
+    CHECK(kmap->num_mapped() == 0);
+}
+
+TEST_CASE("kmap_x64: unique_kmap_ptr_x64")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    arena_mdl mdl;
+    auto kmap = kmap_cpu();
+
+    {
+        auto &&map1 = bfn::make_unique_kmap_x64<uintptr_t>(phys1);
+        CHECK(map1);
+        CHECK(kmap->num_mapped() == 1);
+        CHECK(g_pt->virt_to_pte(reinterpret_cast<uintptr_t>(map1.get())).phys_addr() == phys1);
+
+        auto map2 = std::move(map1);
+        CHECK_FALSE(map1);
+        CHECK(map2);
+        CHECK(kmap->num_mapped() == 1);
+
+        map2.reset();
+        CHECK_FALSE(map2);
+        CHECK(kmap->num_mapped() == 0);
+
+        map2 = bfn::make_unique_kmap_x64<uintptr_t>(phys2);
+        CHECK(kmap->num_mapped() == 1);
+    }
+
+    CHECK(kmap->num_mapped() == 0);
+}
+
+#endif
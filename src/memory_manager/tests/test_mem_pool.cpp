@@ -22,9 +22,342 @@
 #define CATCH_CONFIG_MAIN
 #include <catch/catch.hpp>
 
-TEST_CASE("test name goes here")
+#define TESTING_MEM_POOL
+
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <bfgsl.h>
+#include <memory_manager/mem_pool.h>
+
+using pool_type = mem_pool<128, 3>;
+using stress_pool_type = mem_pool<0x100000, 6>;
+
+constexpr const auto stress_pool_addr = 0x100000ULL;
+constexpr const auto stress_num_threads = 8ULL;
+constexpr const auto stress_num_blocks = 0x100000ULL >> 6;
+
+TEST_CASE("mem_pool: free invalid address")
+{
+    pool_type pool{100};
+
+    CHECK_NOTHROW(pool.free(0));
+    CHECK_NOTHROW(pool.free(0xFFFFFFFFFFFFFFFF));
+}
+
+TEST_CASE("mem_pool: free twice")
+{
+    pool_type pool{100};
+
+    auto addr = pool.alloc(1 << 3);
+    CHECK_NOTHROW(pool.free(addr));
+    CHECK_NOTHROW(pool.free(addr));
+}
+
+TEST_CASE("mem_pool: size")
+{
+    pool_type pool{100};
+
+    CHECK(pool.size(0) == 0);
+    CHECK(pool.size(100) == 0);
+
+    auto addr = pool.alloc(9);
+    CHECK(pool.size(addr) == 16);
+
+    pool.free(addr);
+    CHECK(pool.size(addr) == 0);
+}
+
+TEST_CASE("mem_pool: free then alloc")
+{
+    pool_type pool{100};
+    std::vector<pool_type::integer_pointer> addrs;
+
+    for (auto i = 0; i < 16; i++) {
+        addrs.push_back(pool.alloc(1 << 3));
+    }
+
+    CHECK_THROWS(pool.alloc(1 << 3));
+
+    for (const auto &addr : addrs) {
+        pool.free(addr);
+    }
+
+    CHECK(pool.alloc(128) == 100);
+}
+
+TEST_CASE("mem_pool: alloc_n / free_n")
+{
+    pool_type pool{100};
+    std::array<pool_type::integer_pointer, 20> addrs{};
+
+    CHECK_THROWS(pool.alloc_n(0, addrs.data(), addrs.size()));
+    CHECK_THROWS(pool.alloc_n(129, addrs.data(), addrs.size()));
+    CHECK_THROWS(pool.alloc_n(1 << 3, nullptr, addrs.size()));
+
+    CHECK(pool.alloc_n(1 << 3, addrs.data(), 0) == 0);
+
+    // The pool only has 16 blocks, so the batch stops short
+
+    CHECK(pool.alloc_n(1 << 3, addrs.data(), addrs.size()) == 16);
+    CHECK(pool.stats().failures == 1);
+    CHECK_THROWS(pool.alloc(1 << 3));
+
+    CHECK_NOTHROW(pool.free_n(nullptr, 16));
+    CHECK_NOTHROW(pool.free_n(addrs.data(), 16));
+
+    auto addr = pool.alloc(128);
+    CHECK(addr == 100);
+    pool.free(addr);
+
+    CHECK(pool.alloc_n(2 << 3, addrs.data(), 2) == 2);
+    CHECK(addrs.at(0) == 100);
+    CHECK(addrs.at(1) == 116);
+    CHECK(pool.size(addrs.at(1)) == 2 << 3);
+
+    pool.free_n(addrs.data(), 2);
+    CHECK(pool.stats().used == 0);
+}
+
+TEST_CASE("mem_pool: resize")
+{
+    pool_type pool{100};
+
+    CHECK_FALSE(pool.resize(0, 8));
+    CHECK_FALSE(pool.resize(100, 8));
+
+    auto addr1 = pool.alloc(1 << 3);
+    auto addr2 = pool.alloc(1 << 3);
+
+    CHECK_FALSE(pool.resize(addr1, 0));
+    CHECK_FALSE(pool.resize(addr1, 129));
+    CHECK_FALSE(pool.resize(addr1, 2 << 3));
+
+    CHECK(pool.resize(addr2, 4 << 3));
+    CHECK(pool.size(addr2) == 4 << 3);
+
+    CHECK(pool.resize(addr2, 1 << 3));
+    CHECK(pool.size(addr2) == 1 << 3);
+
+    CHECK(pool.resize(addr2, 15 << 3));
+    CHECK_FALSE(pool.resize(addr2, 16 << 3));
+    CHECK_THROWS(pool.alloc(1 << 3));
+
+    pool.free(addr1);
+    pool.free(addr2);
+
+    CHECK(pool.stats().used == 0);
+}
+
+TEST_CASE("mem_pool: alloc_aligned")
+{
+    pool_type pool{0x1000};
+
+    CHECK_THROWS(pool.alloc_aligned(1 << 3, 0));
+    CHECK_THROWS(pool.alloc_aligned(1 << 3, 24));
+
+    CHECK(pool.alloc_aligned(1 << 3, 1) == 0x1000);
+    CHECK(pool.alloc_aligned(1 << 3, 32) == 0x1020);
+    CHECK(pool.alloc_aligned(1 << 3, 8) == 0x1028);
+    CHECK(pool.alloc_aligned(2 << 3, 64) == 0x1040);
+    CHECK(pool.size(0x1040) == 2 << 3);
+
+    CHECK_THROWS(pool.alloc_aligned(1 << 3, 128));
+}
+
+TEST_CASE("mem_pool: stats")
+{
+    pool_type pool{100};
+
+    auto addr1 = pool.alloc(1 << 3);
+    auto addr2 = pool.alloc(2 << 3);
+    auto addr3 = pool.alloc(1 << 3);
+
+    CHECK_THROWS(pool.alloc(128));
+
+    pool.free(addr2);
+
+    auto stats = pool.stats();
+    CHECK(stats.total_size == 128);
+    CHECK(stats.used == 16);
+    CHECK(stats.peak == 32);
+    CHECK(stats.largest_free == 96);
+    CHECK(stats.allocs == 3);
+    CHECK(stats.frees == 1);
+    CHECK(stats.failures == 1);
+    CHECK(stats.fragmentation() == 15);
+
+    pool.free(addr1);
+    pool.free(addr3);
+
+    CHECK(pool.stats().used == 0);
+}
+
+// -----------------------------------------------------------------------------
+// Concurrency
+// -----------------------------------------------------------------------------
+
+// Each block of the stress pool is given an owner. A thread claims every
+// block of an allocation before using it and releases the blocks before
+// freeing it, so two threads being handed overlapping memory is detected as
+// a failed claim.
+
+static bool
+claim(std::vector<std::atomic<uint64_t>> &owners, uintptr_t addr, size_t size, uint64_t id)
+{
+    auto start = (addr - stress_pool_addr) >> 6;
+    auto ok = true;
+
+    for (auto i = start; i < start + (size >> 6); i++) {
+        uint64_t expected = 0;
+        if (!owners.at(i).compare_exchange_strong(expected, id)) {
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+static void
+release(std::vector<std::atomic<uint64_t>> &owners, uintptr_t addr, size_t size)
+{
+    auto start = (addr - stress_pool_addr) >> 6;
+
+    for (auto i = start; i < start + (size >> 6); i++) {
+        owners.at(i).store(0);
+    }
+}
+
+static void
+stress(stress_pool_type &pool, std::vector<std::atomic<uint64_t>> &owners,
+       std::atomic<bool> &failed, uint64_t id, size_t iterations)
+{
+    std::vector<std::pair<uintptr_t, size_t>> addrs;
+
+    for (auto i = 0ULL; i < iterations; i++) {
+        auto size = ((i * 7 + id) % 16 + 1) << 6;
+
+        try {
+            auto addr = pool.alloc(size);
+
+            if (pool.size(addr) != size || !claim(owners, addr, size, id)) {
+                failed = true;
+            }
+
+            addrs.emplace_back(addr, size);
+        }
+        catch (std::bad_alloc &)
+        { }
+
+        if (addrs.size() > 32 || (i % 3 == 0 && !addrs.empty())) {
+            auto entry = addrs.front();
+            addrs.erase(addrs.begin());
+
+            if (pool.size(entry.first) != entry.second) {
+                failed = true;
+            }
+
+            release(owners, entry.first, entry.second);
+            pool.free(entry.first);
+        }
+    }
+
+    for (const auto &entry : addrs) {
+        release(owners, entry.first, entry.second);
+        pool.free(entry.first);
+    }
+}
+
+TEST_CASE("mem_pool: concurrent alloc / free / size")
+{
+    auto pool = std::make_unique<stress_pool_type>(stress_pool_addr);
+    std::vector<std::atomic<uint64_t>> owners(stress_num_blocks);
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+
+    for (auto &owner : owners) {
+        owner = 0;
+    }
+
+    for (auto id = 1ULL; id <= stress_num_threads; id++) {
+        threads.emplace_back(stress, std::ref(*pool), std::ref(owners), std::ref(failed), id, 10000);
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    CHECK_FALSE(failed);
+
+    for (auto i = 0ULL; i < stress_num_blocks; i++) {
+        pool->alloc(64);
+    }
+
+    CHECK_THROWS(pool->alloc(64));
+}
+
+// The following measures the throughput of free() and size() with many
+// threads, both as they are, and serialized behind a single lock (which is
+// how they used to behave). It is hidden as timing results depend on the
+// machine; run it with "[benchmark]".
+
+template<typename F>
+static double
+measure(F func)
+{
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (auto id = 1ULL; id <= stress_num_threads; id++) {
+        threads.emplace_back(func, id);
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(stop - start).count();
+}
+
+TEST_CASE("mem_pool: concurrent free / size throughput", "[.][benchmark]")
 {
-    CHECK(true);
+    constexpr const auto iterations = 1000000ULL;
+
+    auto pool = std::make_unique<stress_pool_type>(stress_pool_addr);
+    std::mutex mutex;
+
+    std::vector<uintptr_t> addrs;
+    for (auto id = 0ULL; id <= stress_num_threads; id++) {
+        addrs.push_back(pool->alloc(64));
+    }
+
+    std::atomic<uint64_t> total{0};
+
+    auto lock_free = measure([&](uint64_t id) {
+        auto sum = 0ULL;
+        for (auto i = 0ULL; i < iterations; i++) {
+            sum += pool->size(addrs.at(id));
+        }
+        total += sum;
+    });
+
+    auto locked = measure([&](uint64_t id) {
+        auto sum = 0ULL;
+        for (auto i = 0ULL; i < iterations; i++) {
+            std::lock_guard<std::mutex> lock(mutex);
+            sum += pool->size(addrs.at(id));
+        }
+        total += sum;
+    });
+
+    CHECK(total == iterations * stress_num_threads * 64 * 2);
+
+    WARN("size(): lock free " << lock_free << "s, locked " << locked << "s, speedup " << locked / lock_free << "x");
 }
 
 // #define TESTING_MEM_POOL
@@ -0,0 +1,453 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#define TESTING_MEM_POOL
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <bfgsl.h>
+#include <memory_manager/mem_pool_bitmap.h>
+
+using pool_type = mem_pool_bitmap<128, 3>;
+using large_pool_type = mem_pool_bitmap<0x10000, 3>;
+
+TEST_CASE("mem_pool_bitmap: invalid pool")
+{
+    CHECK_THROWS(pool_type{0});
+}
+
+TEST_CASE("mem_pool_bitmap: free invalid address")
+{
+    pool_type pool{100};
+
+    CHECK_NOTHROW(pool.free(0));
+    CHECK_NOTHROW(pool.free(0xFFFFFFFFFFFFFFFF));
+}
+
+TEST_CASE("mem_pool_bitmap: free twice")
+{
+    pool_type pool{100};
+
+    auto addr = pool.alloc(1 << 3);
+    CHECK_NOTHROW(pool.free(addr));
+    CHECK_NOTHROW(pool.free(addr));
+}
+
+TEST_CASE("mem_pool_bitmap: alloc invalid size")
+{
+    pool_type pool{100};
+
+    CHECK_THROWS(pool.alloc(0));
+    CHECK_THROWS(pool.alloc(129));
+    CHECK_THROWS(pool.alloc(0xFFFFFFFFFFFFFFFF));
+}
+
+TEST_CASE("mem_pool_bitmap: alloc is contiguous")
+{
+    pool_type pool{100};
+
+    CHECK(pool.alloc(1 << 3) == 100);
+    CHECK(pool.alloc(1 << 3) == 108);
+    CHECK(pool.alloc((1 << 3) + 2) == 116);
+    CHECK(pool.alloc(1 << 3) == 132);
+}
+
+TEST_CASE("mem_pool_bitmap: alloc all of memory")
+{
+    pool_type pool{100};
+    std::vector<pool_type::integer_pointer> addrs;
+
+    for (auto i = 0; i < 16; i++) {
+        addrs.push_back(pool.alloc(1 << 3));
+    }
+
+    CHECK_THROWS(pool.alloc(1 << 3));
+
+    for (const auto &addr : addrs) {
+        pool.free(addr);
+    }
+
+    CHECK(pool.alloc(128) == 100);
+    CHECK_THROWS(pool.alloc(1 << 3));
+}
+
+TEST_CASE("mem_pool_bitmap: alloc_n / free_n")
+{
+    pool_type pool{100};
+    std::array<pool_type::integer_pointer, 20> addrs{};
+
+    CHECK_THROWS(pool.alloc_n(0, addrs.data(), addrs.size()));
+    CHECK_THROWS(pool.alloc_n(129, addrs.data(), addrs.size()));
+    CHECK_THROWS(pool.alloc_n(1 << 3, nullptr, addrs.size()));
+
+    CHECK(pool.alloc_n(1 << 3, addrs.data(), 0) == 0);
+
+    // The pool only has 16 blocks, so the batch stops short
+
+    CHECK(pool.alloc_n(1 << 3, addrs.data(), addrs.size()) == 16);
+    CHECK(pool.stats().failures == 1);
+    CHECK_THROWS(pool.alloc(1 << 3));
+
+    CHECK_NOTHROW(pool.free_n(nullptr, 16));
+    CHECK_NOTHROW(pool.free_n(addrs.data(), 16));
+
+    auto addr = pool.alloc(128);
+    CHECK(addr == 100);
+    pool.free(addr);
+
+    CHECK(pool.alloc_n(2 << 3, addrs.data(), 2) == 2);
+    CHECK(addrs.at(0) == 100);
+    CHECK(addrs.at(1) == 116);
+    CHECK(pool.size(addrs.at(1)) == 2 << 3);
+
+    pool.free_n(addrs.data(), 2);
+    CHECK(pool.stats().used == 0);
+}
+
+TEST_CASE("mem_pool_bitmap: alloc fragmented")
+{
+    pool_type pool{100};
+    std::vector<pool_type::integer_pointer> addrs;
+
+    for (auto i = 0; i < 16; i++) {
+        addrs.push_back(pool.alloc(1 << 3));
+    }
+
+    for (auto i = 0U; i < addrs.size(); i += 2) {
+        pool.free(addrs.at(i));
+    }
+
+    CHECK_THROWS(pool.alloc(2 << 3));
+    CHECK(pool.alloc(1 << 3) == addrs.at(0));
+
+    pool.free(addrs.at(5));
+    CHECK(pool.alloc(3 << 3) == addrs.at(4));
+}
+
+TEST_CASE("mem_pool_bitmap: alloc spans words")
+{
+    large_pool_type pool{0x1000};
+
+    auto addr1 = pool.alloc(60 << 3);
+    auto addr2 = pool.alloc(10 << 3);
+    auto addr3 = pool.alloc(200 << 3);
+
+    CHECK(addr1 == 0x1000);
+    CHECK(addr2 == 0x1000 + (60 << 3));
+    CHECK(addr3 == 0x1000 + (70 << 3));
+
+    pool.free(addr2);
+    CHECK(pool.alloc(11 << 3) == 0x1000 + (270 << 3));
+    CHECK(pool.alloc(10 << 3) == addr2);
+}
+
+TEST_CASE("mem_pool_bitmap: alloc skips used words")
+{
+    large_pool_type pool{0x1000};
+    std::vector<large_pool_type::integer_pointer> addrs;
+
+    for (auto i = 0; i < 0x2000; i++) {
+        addrs.push_back(pool.alloc(1 << 3));
+    }
+
+    CHECK_THROWS(pool.alloc(1 << 3));
+
+    pool.free(addrs.at(0x1234));
+    CHECK(pool.alloc(1 << 3) == addrs.at(0x1234));
+}
+
+TEST_CASE("mem_pool_bitmap: alloc_aligned")
+{
+    pool_type pool{0x1000};
+
+    CHECK_THROWS(pool.alloc_aligned(1 << 3, 0));
+    CHECK_THROWS(pool.alloc_aligned(1 << 3, 24));
+
+    CHECK(pool.alloc_aligned(1 << 3, 1) == 0x1000);
+    CHECK(pool.alloc_aligned(1 << 3, 32) == 0x1020);
+    CHECK(pool.alloc_aligned(1 << 3, 8) == 0x1008);
+    CHECK(pool.alloc_aligned(2 << 3, 64) == 0x1040);
+    CHECK(pool.size(0x1040) == 2 << 3);
+
+    CHECK_THROWS(pool.alloc_aligned(1 << 3, 128));
+}
+
+TEST_CASE("mem_pool_bitmap: alloc_aligned spans words")
+{
+    large_pool_type pool{0x1000};
+
+    auto addr1 = pool.alloc(1 << 3);
+    auto addr2 = pool.alloc_aligned(100 << 3, 0x400);
+    auto addr3 = pool.alloc(1 << 3);
+
+    CHECK(addr1 == 0x1000);
+    CHECK(addr2 == 0x1400);
+    CHECK(addr3 == 0x1008);
+}
+
+TEST_CASE("mem_pool_bitmap: size")
+{
+    pool_type pool{100};
+
+    CHECK(pool.size(0) == 0);
+    CHECK(pool.size(100) == 0);
+
+    auto addr = pool.alloc(9);
+    CHECK(pool.size(addr) == 16);
+    CHECK(pool.size(addr + 8) == 0);
+
+    pool.free(addr);
+    CHECK(pool.size(addr) == 0);
+}
+
+TEST_CASE("mem_pool_bitmap: contains")
+{
+    pool_type pool{100};
+
+    CHECK(pool.contains(100));
+    CHECK(pool.contains(227));
+
+    CHECK_FALSE(pool.contains(0));
+    CHECK_FALSE(pool.contains(99));
+    CHECK_FALSE(pool.contains(228));
+}
+
+TEST_CASE("mem_pool_bitmap: clear")
+{
+    pool_type pool{100};
+
+    pool.alloc(64);
+    pool.clear();
+
+    CHECK(pool.alloc(128) == 100);
+}
+
+TEST_CASE("mem_pool_bitmap: stats")
+{
+    pool_type pool{100};
+
+    auto addr1 = pool.alloc(9);
+    auto addr2 = pool.alloc(1 << 3);
+    auto addr3 = pool.alloc(1 << 3);
+
+    CHECK_THROWS(pool.alloc(128));
+
+    pool.free(addr2);
+
+    auto stats = pool.stats();
+    CHECK(stats.total_size == 128);
+    CHECK(stats.used == 24);
+    CHECK(stats.peak == 32);
+    CHECK(stats.largest_free == 96);
+    CHECK(stats.allocs == 3);
+    CHECK(stats.frees == 1);
+    CHECK(stats.failures == 1);
+    CHECK(stats.fragmentation() == 8);
+    CHECK(stats.histogram.at(3) == 2);
+    CHECK(stats.histogram.at(4) == 1);
+    CHECK(stats.histogram.at(7) == 1);
+
+    pool.free(addr1);
+    pool.free(addr3);
+
+    CHECK(pool.stats().used == 0);
+    CHECK(pool.stats().fragmentation() == 0);
+}
+
+TEST_CASE("mem_pool_bitmap: resize")
+{
+    pool_type pool{100};
+
+    CHECK_FALSE(pool.resize(0, 8));
+    CHECK_FALSE(pool.resize(100, 8));
+
+    auto addr1 = pool.alloc(1 << 3);
+    auto addr2 = pool.alloc(1 << 3);
+
+    CHECK_FALSE(pool.resize(addr1, 0));
+    CHECK_FALSE(pool.resize(addr1, 129));
+    CHECK_FALSE(pool.resize(addr1, 2 << 3));
+
+    CHECK(pool.resize(addr2, 4 << 3));
+    CHECK(pool.size(addr2) == 4 << 3);
+    CHECK(pool.alloc(1 << 3) == addr2 + (4 << 3));
+
+    CHECK(pool.resize(addr2, 1 << 3));
+    CHECK(pool.size(addr2) == 1 << 3);
+    CHECK(pool.alloc(3 << 3) == addr2 + (1 << 3));
+}
+
+TEST_CASE("mem_pool_bitmap: resize spans words")
+{
+    large_pool_type pool{0x1000};
+
+    auto addr = pool.alloc(60 << 3);
+
+    CHECK(pool.resize(addr, 200 << 3));
+    CHECK(pool.alloc(1 << 3) == 0x1000 + (200 << 3));
+
+    CHECK(pool.resize(addr, 10 << 3));
+    CHECK(pool.alloc(190 << 3) == 0x1000 + (10 << 3));
+}
+
+// -----------------------------------------------------------------------------
+// Concurrency
+// -----------------------------------------------------------------------------
+
+// Each thread claims every block of an allocation before using it, so two
+// threads being handed overlapping memory is detected as a failed claim.
+
+TEST_CASE("mem_pool_bitmap: concurrent alloc / free / size")
+{
+    using stress_pool_type = mem_pool_bitmap<0x100000, 6>;
+
+    constexpr const auto num_threads = 8ULL;
+    constexpr const auto num_blocks = 0x100000ULL >> 6;
+
+    auto pool = std::make_unique<stress_pool_type>(0x100000ULL);
+    std::vector<std::atomic<uint64_t>> owners(num_blocks);
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+
+    for (auto &owner : owners) {
+        owner = 0;
+    }
+
+    auto claim = [&](uintptr_t addr, size_t size, uint64_t id) {
+        auto start = (addr - 0x100000ULL) >> 6;
+
+        for (auto i = start; i < start + (size >> 6); i++) {
+            uint64_t expected = 0;
+            if (!owners.at(i).compare_exchange_strong(expected, id)) {
+                failed = true;
+            }
+        }
+    };
+
+    auto release = [&](uintptr_t addr, size_t size) {
+        auto start = (addr - 0x100000ULL) >> 6;
+
+        for (auto i = start; i < start + (size >> 6); i++) {
+            owners.at(i) = 0;
+        }
+    };
+
+    auto stress = [&](uint64_t id) {
+        std::vector<std::pair<uintptr_t, size_t>> addrs;
+
+        for (auto i = 0ULL; i < 10000; i++) {
+            try {
+                auto size = ((i * 7 + id) % 16 + 1) << 6;
+                auto addr = pool->alloc(size);
+
+                if (pool->size(addr) != size) {
+                    failed = true;
+                }
+
+                claim(addr, size, id);
+                addrs.emplace_back(addr, size);
+            }
+            catch (std::bad_alloc &)
+            { }
+
+            if (addrs.size() > 16 || (i % 3 == 0 && !addrs.empty())) {
+                auto entry = addrs.front();
+                addrs.erase(addrs.begin());
+
+                release(entry.first, entry.second);
+                pool->free(entry.first);
+            }
+        }
+
+        for (const auto &entry : addrs) {
+            release(entry.first, entry.second);
+            pool->free(entry.first);
+        }
+    };
+
+    for (auto id = 1ULL; id <= num_threads; id++) {
+        threads.emplace_back(stress, id);
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    CHECK_FALSE(failed);
+    CHECK(pool->stats().used == 0);
+    CHECK(pool->alloc(0x100000) == 0x100000ULL);
+}
+
+// The following compares growing a buffer one block at a time (the way a
+// std::string or std::vector grows) using realloc semantics with, and
+// without resizing in place. It is hidden as timing results depend on the
+// machine; run it with "[benchmark]".
+
+TEST_CASE("mem_pool_bitmap: growing realloc throughput", "[.][benchmark]")
+{
+    using bench_pool_type = mem_pool_bitmap<0x100000, 6>;
+    constexpr const auto max_size = 0x10000ULL;
+
+    auto owner = std::make_unique<std::array<uint8_t, 0x100000>>();
+    auto pool = std::make_unique<bench_pool_type>(reinterpret_cast<uintptr_t>(owner->data()));
+
+    auto grow = [&](bool in_place) {
+        auto start = std::chrono::high_resolution_clock::now();
+        auto addr = pool->alloc(64);
+        auto copied = 0ULL;
+
+        for (auto size = 128ULL; size <= max_size; size += 64) {
+            if (in_place && pool->resize(addr, size)) {
+                continue;
+            }
+
+            auto old_size = pool->size(addr);
+            auto new_addr = pool->alloc(size);
+
+            std::memcpy(reinterpret_cast<void *>(new_addr), reinterpret_cast<void *>(addr), old_size);
+            pool->free(addr);
+
+            copied += old_size;
+            addr = new_addr;
+        }
+
+        pool->free(addr);
+
+        auto stop = std::chrono::high_resolution_clock::now();
+        return std::make_pair(std::chrono::duration<double>(stop - start).count(), copied);
+    };
+
+    auto copy = grow(false);
+    auto in_place = grow(true);
+
+    CHECK(in_place.second < copy.second);
+
+    WARN("alloc / copy: " << copy.first << "s, " << copy.second << " bytes copied");
+    WARN("resize: " << in_place.first << "s, " << in_place.second << " bytes copied");
+}
@@ -0,0 +1,340 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#define TESTING_MEM_POOL
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <bfgsl.h>
+#include <memory_manager/mem_pool_buddy.h>
+
+using pool_type = mem_pool_buddy<0x10000, 12>;
+using odd_pool_type = mem_pool_buddy<0x7000, 12>;
+
+TEST_CASE("mem_pool_buddy: invalid pool")
+{
+    CHECK_THROWS(pool_type{0});
+    CHECK_THROWS(pool_type{0x1001});
+}
+
+TEST_CASE("mem_pool_buddy: free invalid address")
+{
+    pool_type pool{0x10000};
+
+    CHECK_NOTHROW(pool.free(0));
+    CHECK_NOTHROW(pool.free(0xFFFFFFFFFFFFFFFF));
+    CHECK_NOTHROW(pool.free(0x10000));
+}
+
+TEST_CASE("mem_pool_buddy: free twice")
+{
+    pool_type pool{0x10000};
+
+    auto addr = pool.alloc(0x1000);
+    CHECK_NOTHROW(pool.free(addr));
+    CHECK_NOTHROW(pool.free(addr));
+
+    CHECK(pool.alloc(0x10000) == 0x10000);
+}
+
+TEST_CASE("mem_pool_buddy: alloc invalid size")
+{
+    pool_type pool{0x10000};
+
+    CHECK_THROWS(pool.alloc(0));
+    CHECK_THROWS(pool.alloc(0x10001));
+    CHECK_THROWS(pool.alloc(0xFFFFFFFFFFFFFFFF));
+}
+
+TEST_CASE("mem_pool_buddy: alloc is naturally aligned")
+{
+    pool_type pool{0x10000};
+
+    CHECK(pool.alloc(0x1000) == 0x10000);
+    CHECK(pool.alloc(0x2000) == 0x12000);
+    CHECK(pool.alloc(0x4000) == 0x14000);
+    CHECK(pool.alloc(0x8000) == 0x18000);
+    CHECK(pool.alloc(0x1000) == 0x11000);
+}
+
+TEST_CASE("mem_pool_buddy: alloc rounds up to order")
+{
+    pool_type pool{0x10000};
+
+    auto addr = pool.alloc(0x3000);
+    CHECK(addr == 0x10000);
+    CHECK(pool.size(addr) == 0x4000);
+    CHECK(pool.alloc(0x1000) == 0x14000);
+}
+
+TEST_CASE("mem_pool_buddy: alloc all of memory")
+{
+    pool_type pool{0x10000};
+    std::vector<pool_type::integer_pointer> addrs;
+
+    for (auto i = 0; i < 16; i++) {
+        addrs.push_back(pool.alloc(0x1000));
+    }
+
+    CHECK_THROWS(pool.alloc(0x1000));
+
+    for (const auto &addr : addrs) {
+        pool.free(addr);
+    }
+
+    CHECK(pool.alloc(0x10000) == 0x10000);
+    CHECK_THROWS(pool.alloc(0x1000));
+}
+
+TEST_CASE("mem_pool_buddy: free coalesces")
+{
+    pool_type pool{0x10000};
+    std::vector<pool_type::integer_pointer> addrs;
+
+    for (auto i = 0; i < 16; i++) {
+        addrs.push_back(pool.alloc(0x1000));
+    }
+
+    for (auto i = 0U; i < addrs.size(); i += 2) {
+        pool.free(addrs.at(i));
+    }
+
+    CHECK_THROWS(pool.alloc(0x2000));
+
+    pool.free(addrs.at(5));
+    CHECK(pool.alloc(0x2000) == addrs.at(4));
+
+    pool.free(addrs.at(4));
+    CHECK(pool.alloc(0x2000) == addrs.at(4));
+}
+
+TEST_CASE("mem_pool_buddy: unaligned pool")
+{
+    odd_pool_type pool{0x3000};
+
+    // The pool covers 0x3000 - 0xA000, which is seeded as 0x3000 (4k),
+    // 0x4000 (16k) and 0x8000 (8k).
+
+    CHECK(pool.alloc(0x4000) == 0x4000);
+    CHECK(pool.alloc(0x2000) == 0x8000);
+    CHECK(pool.alloc(0x1000) == 0x3000);
+    CHECK_THROWS(pool.alloc(0x1000));
+
+    pool.free(0x3000);
+    pool.free(0x4000);
+    pool.free(0x8000);
+
+    CHECK_THROWS(pool.alloc(0x8000));
+    CHECK(pool.alloc(0x4000) == 0x4000);
+}
+
+TEST_CASE("mem_pool_buddy: size")
+{
+    pool_type pool{0x10000};
+
+    CHECK(pool.size(0) == 0);
+    CHECK(pool.size(0x10000) == 0);
+
+    auto addr = pool.alloc(0x1001);
+    CHECK(pool.size(addr) == 0x2000);
+    CHECK(pool.size(addr + 0x1000) == 0);
+
+    pool.free(addr);
+    CHECK(pool.size(addr) == 0);
+}
+
+TEST_CASE("mem_pool_buddy: contains")
+{
+    pool_type pool{0x10000};
+
+    CHECK(pool.contains(0x10000));
+    CHECK(pool.contains(0x1FFFF));
+
+    CHECK_FALSE(pool.contains(0));
+    CHECK_FALSE(pool.contains(0xFFFF));
+    CHECK_FALSE(pool.contains(0x20000));
+}
+
+TEST_CASE("mem_pool_buddy: clear")
+{
+    pool_type pool{0x10000};
+
+    pool.alloc(0x4000);
+    pool.clear();
+
+    CHECK(pool.alloc(0x10000) == 0x10000);
+}
+
+TEST_CASE("mem_pool_buddy: stats")
+{
+    pool_type pool{0x10000};
+
+    auto addr1 = pool.alloc(0x3000);
+    auto addr2 = pool.alloc(0x1000);
+
+    CHECK_THROWS(pool.alloc(0x10000));
+
+    auto stats = pool.stats();
+    CHECK(stats.total_size == 0x10000);
+    CHECK(stats.used == 0x5000);
+    CHECK(stats.peak == 0x5000);
+    CHECK(stats.largest_free == 0x8000);
+    CHECK(stats.allocs == 2);
+    CHECK(stats.failures == 1);
+    CHECK(stats.fragmentation() == 28);
+
+    pool.free(addr1);
+    pool.free(addr2);
+
+    stats = pool.stats();
+    CHECK(stats.used == 0);
+    CHECK(stats.frees == 2);
+    CHECK(stats.largest_free == 0x10000);
+    CHECK(stats.fragmentation() == 0);
+}
+
+TEST_CASE("mem_pool_buddy: resize")
+{
+    pool_type pool{0x10000};
+
+    CHECK_FALSE(pool.resize(0, 0x1000));
+    CHECK_FALSE(pool.resize(0x10000, 0x1000));
+
+    auto addr1 = pool.alloc(0x1000);
+    auto addr2 = pool.alloc(0x1000);
+
+    CHECK_FALSE(pool.resize(addr1, 0));
+    CHECK_FALSE(pool.resize(addr1, 0x10001));
+
+    // addr2 is the upper half of its buddy pair, so it cannot grow, and
+    // addr1 cannot grow into addr2
+
+    CHECK_FALSE(pool.resize(addr2, 0x2000));
+    CHECK_FALSE(pool.resize(addr1, 0x2000));
+
+    pool.free(addr2);
+
+    CHECK(pool.resize(addr1, 0x8000));
+    CHECK(pool.size(addr1) == 0x8000);
+    CHECK(pool.alloc(0x8000) == 0x18000);
+    CHECK_FALSE(pool.resize(addr1, 0x10000));
+
+    CHECK(pool.resize(addr1, 0x1000));
+    CHECK(pool.size(addr1) == 0x1000);
+    CHECK(pool.alloc(0x4000) == 0x14000);
+    CHECK(pool.alloc(0x2000) == 0x12000);
+    CHECK(pool.alloc(0x1000) == 0x11000);
+    CHECK_THROWS(pool.alloc(0x1000));
+}
+
+// -----------------------------------------------------------------------------
+// Concurrency
+// -----------------------------------------------------------------------------
+
+// Each thread claims every block of an allocation before using it, so two
+// threads being handed overlapping memory is detected as a failed claim.
+
+TEST_CASE("mem_pool_buddy: concurrent alloc / free / size")
+{
+    using stress_pool_type = mem_pool_buddy<0x100000, 12>;
+
+    constexpr const auto num_threads = 8ULL;
+    constexpr const auto num_blocks = 0x100000ULL >> 12;
+
+    auto pool = std::make_unique<stress_pool_type>(0x100000ULL);
+    std::vector<std::atomic<uint64_t>> owners(num_blocks);
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+
+    for (auto &owner : owners) {
+        owner = 0;
+    }
+
+    auto claim = [&](uintptr_t addr, size_t size, uint64_t id) {
+        auto start = (addr - 0x100000ULL) >> 12;
+
+        for (auto i = start; i < start + (size >> 12); i++) {
+            uint64_t expected = 0;
+            if (!owners.at(i).compare_exchange_strong(expected, id)) {
+                failed = true;
+            }
+        }
+    };
+
+    auto release = [&](uintptr_t addr, size_t size) {
+        auto start = (addr - 0x100000ULL) >> 12;
+
+        for (auto i = start; i < start + (size >> 12); i++) {
+            owners.at(i) = 0;
+        }
+    };
+
+    auto stress = [&](uint64_t id) {
+        std::vector<std::pair<uintptr_t, size_t>> addrs;
+
+        for (auto i = 0ULL; i < 10000; i++) {
+            try {
+                auto size = 0x1000ULL << ((i + id) % 4);
+                auto addr = pool->alloc(size);
+
+                if (pool->size(addr) != size) {
+                    failed = true;
+                }
+
+                claim(addr, size, id);
+                addrs.emplace_back(addr, size);
+            }
+            catch (std::bad_alloc &)
+            { }
+
+            if (addrs.size() > 16 || (i % 3 == 0 && !addrs.empty())) {
+                auto entry = addrs.front();
+                addrs.erase(addrs.begin());
+
+                release(entry.first, entry.second);
+                pool->free(entry.first);
+            }
+        }
+
+        for (const auto &entry : addrs) {
+            release(entry.first, entry.second);
+            pool->free(entry.first);
+        }
+    };
+
+    for (auto id = 1ULL; id <= num_threads; id++) {
+        threads.emplace_back(stress, id);
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    CHECK_FALSE(failed);
+    CHECK(pool->stats().used == 0);
+    CHECK(pool->alloc(0x100000) == 0x100000ULL);
+}
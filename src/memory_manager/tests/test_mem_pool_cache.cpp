@@ -0,0 +1,487 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#define TESTING_MEM_POOL
+
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <bfgsl.h>
+#include <memory_manager/mem_pool_bitmap.h>
+#include <memory_manager/mem_pool_cache.h>
+
+constexpr const auto pool_size = 0x40000ULL;
+constexpr const auto pool_shift = 6ULL;
+constexpr const auto num_cpus = 4ULL;
+
+using pool_type = mem_pool_bitmap<pool_size, pool_shift>;
+using cache_type = mem_pool_cache<pool_type, pool_size, pool_shift, num_cpus>;
+
+alignas(0x1000) uint8_t g_pool_owner[pool_size] = {};
+
+struct cache_test
+{
+    cache_test() :
+        pool(reinterpret_cast<uintptr_t>(g_pool_owner)),
+        cache(pool, reinterpret_cast<uintptr_t>(g_pool_owner))
+    { }
+
+    pool_type pool;
+    cache_type cache;
+};
+
+// Counts the calls the cache makes into the memory pool. alloc_n takes the
+// pool's lock once per call, and alloc once per object.
+
+struct counting_pool_type : public pool_type
+{
+    using pool_type::pool_type;
+
+    integer_pointer
+    alloc(size_type size)
+    { num_alloc++; return pool_type::alloc(size); }
+
+    size_type
+    alloc_n(size_type size, integer_pointer *out, size_type n)
+    { num_alloc_n++; return pool_type::alloc_n(size, out, n); }
+
+    void
+    free(integer_pointer addr) noexcept
+    { num_free++; pool_type::free(addr); }
+
+    void
+    free_n(const integer_pointer *addrs, size_type n) noexcept
+    { num_free_n++; pool_type::free_n(addrs, n); }
+
+    uint64_t num_alloc{0};
+    uint64_t num_alloc_n{0};
+    uint64_t num_free{0};
+    uint64_t num_free_n{0};
+};
+
+using counting_cache_type = mem_pool_cache<counting_pool_type, pool_size, pool_shift, num_cpus>;
+
+struct counting_cache_test
+{
+    counting_cache_test() :
+        pool(reinterpret_cast<uintptr_t>(g_pool_owner)),
+        cache(pool, reinterpret_cast<uintptr_t>(g_pool_owner))
+    { }
+
+    counting_pool_type pool;
+    counting_cache_type cache;
+};
+
+TEST_CASE("mem_pool_cache: cacheable")
+{
+    CHECK_FALSE(cache_type::cacheable(0));
+    CHECK(cache_type::cacheable(1));
+    CHECK(cache_type::cacheable(2048));
+    CHECK_FALSE(cache_type::cacheable(2049));
+}
+
+TEST_CASE("mem_pool_cache: class size")
+{
+    CHECK(cache_type::class_size(0) == 0);
+    CHECK(cache_type::class_size(1) == 64);
+    CHECK(cache_type::class_size(16) == 64);
+    CHECK(cache_type::class_size(64) == 64);
+    CHECK(cache_type::class_size(65) == 128);
+    CHECK(cache_type::class_size(1025) == 2048);
+    CHECK(cache_type::class_size(2048) == 2048);
+    CHECK(cache_type::class_size(2049) == 0);
+}
+
+TEST_CASE("mem_pool_cache: alloc invalid")
+{
+    auto test = std::make_unique<cache_test>();
+
+    CHECK(test->cache.alloc(0, 0) == 0);
+    CHECK(test->cache.alloc(2049, 0) == 0);
+    CHECK(test->cache.alloc(64, num_cpus) == 0);
+}
+
+TEST_CASE("mem_pool_cache: free invalid")
+{
+    auto test = std::make_unique<cache_test>();
+
+    CHECK_FALSE(test->cache.free(0, 0));
+    CHECK_FALSE(test->cache.free(0xFFFFFFFFFFFFFFFF, 0));
+
+    auto addr = test->pool.alloc(64);
+    CHECK_FALSE(test->cache.free(addr, 0));
+}
+
+TEST_CASE("mem_pool_cache: alloc refills from pool")
+{
+    auto test = std::make_unique<cache_test>();
+
+    auto addr = test->cache.alloc(100, 0);
+    CHECK(test->pool.contains(addr));
+    CHECK(test->pool.size(addr) == 128);
+
+    // The refill took a batch from the pool, so the pool's next block is
+    // past the batch.
+
+    auto base = reinterpret_cast<uintptr_t>(g_pool_owner);
+    CHECK(test->pool.alloc(64) == base + (mem_pool_cache_batch_size * 128));
+}
+
+TEST_CASE("mem_pool_cache: refill and drain take one batch per pool call")
+{
+    auto test = std::make_unique<counting_cache_test>();
+    std::vector<uintptr_t> addrs;
+
+    for (auto i = 0ULL; i < mem_pool_cache_batch_size; i++) {
+        addrs.push_back(test->cache.alloc(64, 0));
+    }
+
+    CHECK(test->pool.num_alloc_n == 1);
+    CHECK(test->pool.num_alloc == 0);
+
+    addrs.push_back(test->cache.alloc(64, 0));
+    CHECK(test->pool.num_alloc_n == 2);
+
+    while (addrs.size() <= mem_pool_cache_magazine_size) {
+        addrs.push_back(test->cache.alloc(64, 0));
+    }
+
+    CHECK(test->pool.num_alloc_n == 3);
+    CHECK(test->pool.num_alloc == 0);
+
+    for (const auto &addr : addrs) {
+        CHECK(test->cache.free(addr, 0));
+    }
+
+    // The magazine overflowed once, which drained half of it. The rest of
+    // the memory the refills took is still cached.
+
+    CHECK(test->pool.num_free_n == 1);
+    CHECK(test->pool.stats().used == ((mem_pool_cache_batch_size * 3) - (mem_pool_cache_magazine_size / 2)) * 64);
+
+    test->cache.flush(0);
+
+    CHECK(test->pool.num_free_n == 2);
+    CHECK(test->pool.num_free == 0);
+    CHECK(test->pool.stats().used == 0);
+}
+
+TEST_CASE("mem_pool_cache: free reuses memory")
+{
+    auto test = std::make_unique<cache_test>();
+
+    auto addr = test->cache.alloc(64, 0);
+    CHECK(test->cache.free(addr, 0));
+    CHECK(test->cache.alloc(64, 0) == addr);
+}
+
+TEST_CASE("mem_pool_cache: size classes do not mix")
+{
+    auto test = std::make_unique<cache_test>();
+
+    auto addr1 = test->cache.alloc(64, 0);
+    CHECK(test->cache.free(addr1, 0));
+
+    auto addr2 = test->cache.alloc(256, 0);
+    CHECK(addr2 != addr1);
+    CHECK(test->pool.size(addr2) == 256);
+}
+
+TEST_CASE("mem_pool_cache: remote free")
+{
+    auto test = std::make_unique<cache_test>();
+
+    auto addr = test->cache.alloc(64, 0);
+    CHECK(test->cache.free(addr, 1));
+
+    // CPU 1 never gets the memory, it is returned to CPU 0
+
+    CHECK(test->cache.alloc(64, 1) != addr);
+
+    std::set<uintptr_t> addrs;
+    for (auto i = 0ULL; i < mem_pool_cache_batch_size * 2; i++) {
+        addrs.insert(test->cache.alloc(64, 0));
+    }
+
+    CHECK(addrs.count(addr) == 1);
+}
+
+TEST_CASE("mem_pool_cache: reclaim")
+{
+    auto test = std::make_unique<cache_test>();
+
+    auto addr = test->cache.alloc(64, 0);
+    CHECK(test->cache.free(addr, 1));
+    CHECK(test->cache.owns(addr));
+
+    test->cache.reclaim();
+
+    CHECK_FALSE(test->cache.owns(addr));
+    CHECK(test->pool.size(addr) == 0);
+}
+
+TEST_CASE("mem_pool_cache: out of memory reclaims remote frees")
+{
+    auto test = std::make_unique<cache_test>();
+
+    auto addr1 = test->pool.alloc(pool_size - 128);
+    auto addr2 = test->cache.alloc(64, 0);
+    auto addr3 = test->cache.alloc(64, 0);
+
+    CHECK(test->cache.alloc(64, 0) == 0);
+
+    // CPU 0 never allocates the size class again, so the memory CPU 1
+    // frees to it is only returned to the pool by the reclaim.
+
+    CHECK(test->cache.free(addr2, 1));
+    CHECK(test->cache.free(addr3, 1));
+    CHECK(test->cache.alloc(128, 1) != 0);
+
+    test->pool.free(addr1);
+}
+
+TEST_CASE("mem_pool_cache: drain to pool")
+{
+    auto test = std::make_unique<cache_test>();
+    std::vector<uintptr_t> addrs;
+
+    for (auto i = 0ULL; i < mem_pool_cache_magazine_size * 4; i++) {
+        addrs.push_back(test->cache.alloc(64, 0));
+    }
+
+    for (const auto &addr : addrs) {
+        CHECK(test->cache.free(addr, 0));
+    }
+
+    test->cache.flush(0);
+
+    for (const auto &addr : addrs) {
+        CHECK(test->pool.size(addr) == 0);
+    }
+
+    CHECK(test->pool.alloc(pool_size) == reinterpret_cast<uintptr_t>(g_pool_owner));
+}
+
+TEST_CASE("mem_pool_cache: flush invalid cpu")
+{
+    auto test = std::make_unique<cache_test>();
+    CHECK_NOTHROW(test->cache.flush(num_cpus));
+}
+
+TEST_CASE("mem_pool_cache: out of memory")
+{
+    auto test = std::make_unique<cache_test>();
+
+    auto addr = test->pool.alloc(pool_size - 64);
+    CHECK(test->cache.alloc(64, 0) != 0);
+    CHECK(test->cache.alloc(64, 0) == 0);
+
+    test->pool.free(addr);
+}
+
+TEST_CASE("mem_pool_cache: concurrent alloc / free")
+{
+    auto test = std::make_unique<cache_test>();
+
+    std::mutex mutex;
+    std::atomic<bool> corrupt{false};
+    std::vector<uintptr_t> shared;
+    std::vector<std::thread> threads;
+
+    auto func = [&](uint64_t cpuid) {
+        for (auto round = 0; round < 100; round++) {
+            std::vector<uintptr_t> addrs;
+
+            for (auto i = 0; i < 50; i++) {
+                auto addr = test->cache.alloc(64 << (i % 6), cpuid);
+                if (addr == 0) {
+                    corrupt = true;
+                    return;
+                }
+
+                *reinterpret_cast<uint64_t *>(addr) = cpuid;
+                addrs.push_back(addr);
+            }
+
+            for (const auto &addr : addrs) {
+                if (*reinterpret_cast<uint64_t *>(addr) != cpuid) {
+                    corrupt = true;
+                }
+            }
+
+            // Half of the memory is freed locally, the other half is handed
+            // to whichever CPU gets to it first, which results in remote
+            // frees.
+
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (auto i = 0U; i < addrs.size(); i++) {
+                if (i % 2 == 0) {
+                    test->cache.free(addrs.at(i), cpuid);
+                }
+                else {
+                    shared.push_back(addrs.at(i));
+                }
+            }
+
+            while (shared.size() > 25) {
+                test->cache.free(shared.back(), cpuid);
+                shared.pop_back();
+            }
+        }
+    };
+
+    for (auto cpuid = 0ULL; cpuid < num_cpus; cpuid++) {
+        threads.emplace_back(func, cpuid);
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    CHECK_FALSE(corrupt);
+
+    for (const auto &addr : shared) {
+        test->cache.free(addr, 0);
+    }
+
+    for (auto cpuid = 0ULL; cpuid < num_cpus; cpuid++) {
+        test->cache.flush(cpuid);
+    }
+
+    CHECK(test->pool.alloc(pool_size) == reinterpret_cast<uintptr_t>(g_pool_owner));
+}
+
+TEST_CASE("mem_pool_cache: owns")
+{
+    auto test = std::make_unique<cache_test>();
+
+    CHECK_FALSE(test->cache.owns(0));
+
+    auto addr1 = test->cache.alloc(64, 0);
+    auto addr2 = test->pool.alloc(64);
+
+    CHECK(test->cache.owns(addr1));
+    CHECK_FALSE(test->cache.owns(addr2));
+
+    test->cache.free(addr1, 0);
+    test->cache.flush(0);
+
+    CHECK_FALSE(test->cache.owns(addr1));
+}
+
+// The following measures alloc / free throughput with 1 to num_cpus
+// threads, using the cache and using the pool directly, and reports each
+// throughput relative to a single thread (i.e. linear scaling is Nx with N
+// threads, provided there are N hardware threads to run them). With 8
+// objects per round, the cache is served from the magazines. With 128, each
+// round also refills and drains the magazines, so every thread keeps going
+// back to the pool in batches. Run it with "[benchmark]".
+
+template<typename F>
+static double
+measure(uint64_t num_threads, F func)
+{
+    std::vector<std::thread> threads;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (auto cpuid = 0ULL; cpuid < num_threads; cpuid++) {
+        threads.emplace_back(func, cpuid);
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(stop - start).count();
+}
+
+template<uint64_t batch>
+static void
+measure_scaling()
+{
+    constexpr const auto iterations = 1000000ULL;
+
+    auto cache_base = 0.0;
+    auto pool_base = 0.0;
+
+    for (auto num_threads = 1ULL; num_threads <= num_cpus; num_threads <<= 1) {
+        auto test = std::make_unique<cache_test>();
+
+        auto &&cache = measure(num_threads, [&](uint64_t cpuid) {
+            std::array<uintptr_t, batch> addrs{};
+
+            for (auto i = 0ULL; i < iterations; i += batch) {
+                for (auto &addr : addrs) {
+                    addr = test->cache.alloc(64, cpuid);
+                }
+
+                for (const auto &addr : addrs) {
+                    test->cache.free(addr, cpuid);
+                }
+            }
+        });
+
+        auto &&pool = measure(num_threads, [&](uint64_t cpuid) {
+            std::array<uintptr_t, batch> addrs{};
+            (void) cpuid;
+
+            for (auto i = 0ULL; i < iterations; i += batch) {
+                for (auto &addr : addrs) {
+                    addr = test->pool.alloc(64);
+                }
+
+                for (const auto &addr : addrs) {
+                    test->pool.free(addr);
+                }
+            }
+        });
+
+        auto &&ops = static_cast<double>(num_threads * iterations * 2);
+        auto &&cache_mops = ops / cache / 1000000;
+        auto &&pool_mops = ops / pool / 1000000;
+
+        if (num_threads == 1) {
+            cache_base = cache_mops;
+            pool_base = pool_mops;
+        }
+
+        WARN(batch << " objects, " << num_threads << " threads, cache: " << cache_mops << " Mops/s (" <<
+             cache_mops / cache_base << "x), pool: " << pool_mops << " Mops/s (" << pool_mops / pool_base << "x)");
+    }
+}
+
+TEST_CASE("mem_pool_cache: scaling", "[.][benchmark]")
+{
+    WARN("hardware threads: " << std::thread::hardware_concurrency());
+
+    measure_scaling<8>();
+    measure_scaling<mem_pool_cache_magazine_size * 4>();
+}
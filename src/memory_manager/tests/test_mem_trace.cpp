@@ -0,0 +1,61 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include <memory>
+
+#include <memory_manager/mem_trace.h>
+
+static mem_trace_event
+make_event(uint64_t addr)
+{ return {addr, 1, addr, 0x10, 0x1234, mem_trace_op_alloc, mem_trace_pool_heap}; }
+
+TEST_CASE("mem_trace: record")
+{
+    auto ring = std::make_unique<mem_trace_ring>();
+
+    mem_trace_record(*ring, make_event(0x1000));
+    mem_trace_record(*ring, make_event(0x2000));
+
+    CHECK(ring->epos == 2);
+    CHECK(ring->events[0].addr == 0x1000);
+    CHECK(ring->events[1].addr == 0x2000);
+    CHECK(ring->events[1].cpuid == 1);
+    CHECK(ring->events[1].caller == 0x1234);
+    CHECK(ring->events[1].op == mem_trace_op_alloc);
+    CHECK(ring->events[1].pool == mem_trace_pool_heap);
+}
+
+TEST_CASE("mem_trace: record wraps")
+{
+    auto ring = std::make_unique<mem_trace_ring>();
+
+    for (auto i = 0ULL; i < MEM_TRACE_SIZE + 2; i++) {
+        mem_trace_record(*ring, make_event(i));
+    }
+
+    CHECK(ring->epos == MEM_TRACE_SIZE + 2);
+    CHECK(ring->events[0].addr == MEM_TRACE_SIZE);
+    CHECK(ring->events[1].addr == MEM_TRACE_SIZE + 1);
+    CHECK(ring->events[2].addr == 2);
+}
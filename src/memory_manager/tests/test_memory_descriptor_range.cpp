@@ -0,0 +1,84 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include <array>
+#include <vector>
+
+#include <bfgsl.h>
+#include <memory_manager/memory_descriptor_range.h>
+
+TEST_CASE("memory_descriptor_range: add page to empty list")
+{
+    memory_descriptor_range_list list;
+
+    add_page_to_range_list(list, 0x54321000, 0x12345000, MEMORY_TYPE_R);
+
+    REQUIRE(list.size() == 1);
+    CHECK(list.at(0).phys == 0x54321000);
+    CHECK(list.at(0).virt == 0x12345000);
+    CHECK(list.at(0).pages == 1);
+    CHECK(list.at(0).type == MEMORY_TYPE_R);
+}
+
+TEST_CASE("memory_descriptor_range: add contiguous pages")
+{
+    memory_descriptor_range_list list;
+
+    add_page_to_range_list(list, 0x54321000, 0x12345000, MEMORY_TYPE_R);
+    add_page_to_range_list(list, 0x54322000, 0x12346000, MEMORY_TYPE_R);
+    add_page_to_range_list(list, 0x54323000, 0x12347000, MEMORY_TYPE_R);
+
+    REQUIRE(list.size() == 1);
+    CHECK(list.at(0).pages == 3);
+}
+
+TEST_CASE("memory_descriptor_range: add pages to buffer")
+{
+    std::array<memory_descriptor_range, 2> buffer{};
+    auto num = 0L;
+
+    CHECK(add_page_to_range_buffer(buffer, num, 0x54321000, 0x12345000, MEMORY_TYPE_R));
+    CHECK(add_page_to_range_buffer(buffer, num, 0x54322000, 0x12346000, MEMORY_TYPE_R));
+    CHECK(add_page_to_range_buffer(buffer, num, 0, 0x12347000, 0));
+    CHECK(add_page_to_range_buffer(buffer, num, 0, 0x12348000, 0));
+    CHECK_FALSE(add_page_to_range_buffer(buffer, num, 0x54329000, 0x12349000, MEMORY_TYPE_R));
+
+    REQUIRE(num == 2);
+    CHECK(buffer.at(0).pages == 2);
+    CHECK(buffer.at(1).virt == 0x12347000);
+    CHECK(buffer.at(1).pages == 2);
+    CHECK(buffer.at(1).type == 0);
+}
+
+TEST_CASE("memory_descriptor_range: add discontiguous pages")
+{
+    memory_descriptor_range_list list;
+
+    add_page_to_range_list(list, 0x54321000, 0x12345000, MEMORY_TYPE_R);
+    add_page_to_range_list(list, 0x54323000, 0x12346000, MEMORY_TYPE_R);
+    add_page_to_range_list(list, 0x54324000, 0x12348000, MEMORY_TYPE_R);
+    add_page_to_range_list(list, 0x54325000, 0x12349000, MEMORY_TYPE_W);
+
+    CHECK(list.size() == 4);
+}
@@ -22,9 +22,658 @@
 #define CATCH_CONFIG_MAIN
 #include <catch/catch.hpp>
 
-TEST_CASE("test name goes here")
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include <bfgsl.h>
+#include <bfmemory.h>
+#include <bfexception.h>
+
+#include <memory_manager/memory_manager_x64.h>
+
+constexpr const auto test_attr = MEMORY_TYPE_R | MEMORY_TYPE_W | MEMORY_TYPE_E;
+
+extern uint8_t g_page_pool_owner[MAX_PAGE_POOL];
+extern uint8_t g_page_table_pool_owner[MAX_PAGE_TABLE_POOL];
+
+static std::vector<memory_descriptor>
+make_mdl(uint64_t virt, uint64_t phys, uint64_t num)
+{
+    std::vector<memory_descriptor> mdl;
+
+    for (auto i = 0ULL; i < num; i++) {
+        mdl.push_back({phys + (i << 12), virt + (i << 12), test_attr});
+    }
+
+    return mdl;
+}
+
+static void
+remove_mdl(const std::vector<memory_descriptor> &mdl)
+{
+    for (const auto &md : mdl) {
+        g_mm->remove_md(md.virt);
+    }
+}
+
+TEST_CASE("memory_manager_x64: zeroed page reserve is not filled by alloc_zeroed")
+{
+    CHECK(g_mm->stats().zeroed_pages == 0);
+
+    auto ptr = g_mm->alloc_zeroed(0x1000);
+    CHECK(g_mm->stats().zeroed_pages == 0);
+    CHECK(g_mm->stats().zeroed_hits == 0);
+    CHECK(g_mm->stats().zeroed_misses == 1);
+
+    g_mm->free(ptr);
+}
+
+TEST_CASE("memory_manager_x64: add_md")
+{
+    CHECK_THROWS(g_mm->add_md(0x12345000, 0x54321000, 0));
+    CHECK_THROWS(g_mm->add_md(0x12345000, 0x54321123, test_attr));
+    CHECK_THROWS(g_mm->add_md(0x12345123, 0x54321000, test_attr));
+    CHECK(g_mm->descriptors().empty());
+
+    g_mm->add_md(0x12345000, 0x54321000, test_attr);
+
+    CHECK(g_mm->virtint_to_physint(0x12345ABC) == 0x54321ABC);
+    CHECK(g_mm->physint_to_virtint(0x54321ABC) == 0x12345ABC);
+    CHECK(g_mm->virtint_to_attrint(0x12345ABC) == test_attr);
+    CHECK_THROWS(g_mm->virtint_to_physint(0x54321000));
+    CHECK_THROWS(g_mm->physint_to_virtint(0x12345000));
+
+    g_mm->remove_md(0x12345000);
+    CHECK(g_mm->descriptors().empty());
+    CHECK_THROWS(g_mm->virtint_to_physint(0x12345000));
+}
+
+TEST_CASE("memory_manager_x64: add_md high virt")
+{
+    g_mm->add_md(0xFFFF800012345000, 0x54321000, test_attr);
+
+    CHECK(g_mm->virtint_to_physint(0xFFFF800012345ABC) == 0x54321ABC);
+    CHECK(g_mm->physint_to_virtint(0x54321ABC) == 0xFFFF800012345ABC);
+
+    auto mdl = g_mm->descriptors();
+    REQUIRE(mdl.size() == 1);
+    CHECK(mdl.at(0).virt == 0xFFFF800012345000);
+
+    g_mm->remove_md(0xFFFF800012345000);
+    CHECK(g_mm->descriptors().empty());
+}
+
+TEST_CASE("memory_manager_x64: add_mdl")
+{
+    auto mdl = make_mdl(0x12345000, 0x54321000, 0x100);
+
+    CHECK_THROWS(g_mm->add_mdl(nullptr, 1));
+    CHECK_THROWS(g_mm->add_mdl(mdl.data(), 0));
+
+    g_mm->add_mdl(mdl.data(), mdl.size());
+
+    REQUIRE(g_mm->descriptors().size() == 1);
+    CHECK(g_mm->descriptors().at(0).pages == mdl.size());
+    CHECK(g_mm->virtint_to_physint(0x12345ABC) == 0x54321ABC);
+    CHECK(g_mm->virtint_to_physint(0x12444ABC) == 0x54420ABC);
+    CHECK(g_mm->physint_to_virtint(0x54420ABC) == 0x12444ABC);
+    CHECK(g_mm->virtint_to_attrint(0x12444ABC) == test_attr);
+
+    remove_mdl(mdl);
+    CHECK(g_mm->descriptors().empty());
+}
+
+TEST_CASE("memory_manager_x64: add_mdl invalid descriptor adds nothing")
+{
+    auto mdl = make_mdl(0x12345000, 0x54321000, 0x100);
+
+    mdl.at(0x80).type = 0;
+    CHECK_THROWS(g_mm->add_mdl(mdl.data(), mdl.size()));
+    CHECK(g_mm->descriptors().empty());
+
+    mdl.at(0x80).type = test_attr;
+    mdl.at(0xFF).phys |= 0x10;
+    CHECK_THROWS(g_mm->add_mdl(mdl.data(), mdl.size()));
+    CHECK(g_mm->descriptors().empty());
+
+    mdl.at(0xFF).phys = 0xFFFFFFFFFFFFF000;
+    CHECK_THROWS(g_mm->add_mdl(mdl.data(), mdl.size()));
+    CHECK(g_mm->descriptors().empty());
+}
+
+TEST_CASE("memory_manager_x64: add_md_range")
+{
+    CHECK_THROWS(g_mm->add_md_range(0x12345000, 0x54321000, 0, test_attr));
+    CHECK_THROWS(g_mm->add_md_range(0x12345000, 0x54321000, 0x10, 0));
+    CHECK_THROWS(g_mm->add_md_range(0x12345000, 0x54321010, 0x10, test_attr));
+    CHECK_THROWS(g_mm->add_md_range(0x12345000, 0xFFFFFFFFFFFF0000, 0x100, test_attr));
+    CHECK(g_mm->descriptors().empty());
+
+    g_mm->add_md_range(0x12345000, 0x54321000, 0x10, test_attr);
+
+    CHECK(g_mm->virtint_to_physint(0x12345ABC) == 0x54321ABC);
+    CHECK(g_mm->virtint_to_physint(0x12354ABC) == 0x54330ABC);
+    CHECK(g_mm->physint_to_virtint(0x54330ABC) == 0x12354ABC);
+    CHECK_THROWS(g_mm->virtint_to_physint(0x12355000));
+
+    auto mdl = g_mm->descriptors();
+    REQUIRE(mdl.size() == 1);
+    CHECK(mdl.at(0).virt == 0x12345000);
+    CHECK(mdl.at(0).phys == 0x54321000);
+    CHECK(mdl.at(0).pages == 0x10);
+    CHECK(mdl.at(0).type == test_attr);
+
+    remove_mdl(make_mdl(0x12345000, 0x54321000, 0x10));
+    CHECK(g_mm->descriptors().empty());
+}
+
+TEST_CASE("memory_manager_x64: add_mdl_range")
+{
+    std::array<memory_descriptor_range, 2> mdl = {{
+        {0x54321000, 0x12345000, 0x10, test_attr},
+        {0x64321000, 0x22345000, 0x10, 0}
+    }};
+
+    CHECK_THROWS(g_mm->add_mdl_range(nullptr, 1));
+    CHECK_THROWS(g_mm->add_mdl_range(mdl.data(), 0));
+    CHECK_THROWS(g_mm->add_mdl_range(mdl.data(), mdl.size()));
+    CHECK(g_mm->descriptors().empty());
+
+    mdl.at(1).type = test_attr;
+    g_mm->add_mdl_range(mdl.data(), mdl.size());
+
+    CHECK(g_mm->virtint_to_physint(0x12345ABC) == 0x54321ABC);
+    CHECK(g_mm->virtint_to_physint(0x22354ABC) == 0x64330ABC);
+    CHECK(g_mm->descriptors().size() == 2);
+
+    remove_mdl(make_mdl(0x12345000, 0x54321000, 0x10));
+    remove_mdl(make_mdl(0x22345000, 0x64321000, 0x10));
+    CHECK(g_mm->descriptors().empty());
+}
+
+TEST_CASE("memory_manager_x64: remove_md_range")
+{
+    g_mm->add_md_range(0x12345000, 0x54321000, 0x10, test_attr);
+
+    g_mm->remove_md_range(0, 0x10);
+    g_mm->remove_md_range(0x12345001, 0x10);
+    CHECK(g_mm->descriptors().size() == 1);
+
+    g_mm->remove_md_range(0x12346000, 0x8);
+
+    CHECK(g_mm->virtint_to_physint(0x12345ABC) == 0x54321ABC);
+    CHECK_THROWS(g_mm->virtint_to_physint(0x12346000));
+    CHECK_THROWS(g_mm->physint_to_virtint(0x54329000));
+    CHECK(g_mm->virtint_to_physint(0x1234E000) == 0x5432A000);
+
+    g_mm->remove_md_range(0x12345000, 0x10);
+    CHECK(g_mm->descriptors().empty());
+}
+
+TEST_CASE("memory_manager_x64: scattered phys pages")
+{
+    // The driver backs the VMM with pages that it allocates one at a time,
+    // so pages that are next to each other in the VMM are usually far
+    // apart physically. Indexing them should not cost more than a few
+    // words per page.
+
+    std::vector<memory_descriptor> mdl;
+
+    for (auto i = 0ULL; i < 0x1000; i++) {
+        mdl.push_back({0x100000000 + (i * 0x201000), 0x12345000 + (i << 12), test_attr});
+    }
+
+    auto before = g_mm->stats().phys_index_bytes;
+    g_mm->add_mdl(mdl.data(), mdl.size());
+
+    CHECK(g_mm->stats().phys_index_bytes - before <= mdl.size() * 64);
+
+    for (const auto &md : mdl) {
+        CHECK(g_mm->physint_to_virtint(md.phys + 0xABC) == md.virt + 0xABC);
+    }
+
+    remove_mdl(mdl);
+    CHECK(g_mm->descriptors().empty());
+    CHECK_THROWS(g_mm->physint_to_virtint(mdl.at(0).phys));
+}
+
+TEST_CASE("memory_manager_x64: descriptors are coalesced")
+{
+    auto mdl = make_mdl(0x12345000, 0x54321000, 0x10);
+
+    mdl.at(4).phys = 0x60000000;
+    mdl.at(8).type = MEMORY_TYPE_R;
+
+    g_mm->add_mdl(mdl.data(), mdl.size());
+
+    auto ranges = g_mm->descriptors();
+    REQUIRE(ranges.size() == 5);
+    CHECK(ranges.at(0).pages == 4);
+    CHECK(ranges.at(1).phys == 0x60000000);
+    CHECK(ranges.at(1).pages == 1);
+    CHECK(ranges.at(2).virt == 0x1234A000);
+    CHECK(ranges.at(2).pages == 3);
+    CHECK(ranges.at(3).type == MEMORY_TYPE_R);
+    CHECK(ranges.at(3).pages == 1);
+    CHECK(ranges.at(4).pages == 7);
+
+    remove_mdl(mdl);
+    CHECK(g_mm->descriptors().empty());
+}
+
+TEST_CASE("memory_manager_x64: descriptors are read in chunks")
+{
+    auto mdl = make_mdl(0x12345000, 0x54321000, 0x10);
+
+    mdl.at(4).phys = 0x60000000;
+    mdl.at(8).type = MEMORY_TYPE_R;
+
+    g_mm->add_mdl(mdl.data(), mdl.size());
+
+    std::array<memory_descriptor_range, 2> chunk{};
+    memory_manager_x64::memory_descriptor_list ranges;
+    memory_manager_x64::descriptor_cursor_type cursor;
+
+    CHECK_THROWS(g_mm->descriptors(nullptr, chunk.size(), cursor));
+    CHECK_THROWS(g_mm->descriptors(chunk.data(), 0, cursor));
+
+    while (!cursor.done) {
+        auto num = g_mm->descriptors(chunk.data(), chunk.size(), cursor);
+        ranges.insert(ranges.end(), chunk.begin(), chunk.begin() + static_cast<std::ptrdiff_t>(num));
+    }
+
+    auto expected = g_mm->descriptors();
+    REQUIRE(ranges.size() == expected.size());
+
+    for (auto i = 0ULL; i < ranges.size(); i++) {
+        CHECK(ranges.at(i).virt == expected.at(i).virt);
+        CHECK(ranges.at(i).phys == expected.at(i).phys);
+        CHECK(ranges.at(i).pages == expected.at(i).pages);
+        CHECK(ranges.at(i).type == expected.at(i).type);
+    }
+
+    CHECK(g_mm->descriptors(chunk.data(), chunk.size(), cursor) == 0);
+
+    remove_mdl(mdl);
+}
+
+TEST_CASE("memory_manager_x64: descriptors changed since a generation")
+{
+    auto mdl = make_mdl(0x12345000, 0x54321000, 0x10);
+    g_mm->add_mdl(mdl.data(), mdl.size());
+
+    auto gen = g_mm->generation();
+    std::array<memory_descriptor_range, 8> chunk{};
+
+    memory_manager_x64::descriptor_cursor_type cursor;
+    cursor.since = gen;
+
+    CHECK(g_mm->descriptors(chunk.data(), chunk.size(), cursor) == 0);
+    CHECK(cursor.done);
+
+    g_mm->remove_md(0x12348000);
+    g_mm->add_md(0x40000000, 0x70000000, test_attr);
+    CHECK(g_mm->generation() == gen + 2);
+
+    cursor = {};
+    cursor.since = gen;
+
+    std::vector<memory_descriptor_range> ranges;
+
+    while (!cursor.done) {
+        auto num = g_mm->descriptors(chunk.data(), chunk.size(), cursor);
+        ranges.insert(ranges.end(), chunk.begin(), chunk.begin() + static_cast<std::ptrdiff_t>(num));
+    }
+
+    auto removed = std::find_if(ranges.begin(), ranges.end(), [](const auto & md) {
+        return md.type == 0 && md.virt <= 0x12348000 && 0x12348000 < md.virt + (md.pages << 12);
+    });
+
+    auto added = std::find_if(ranges.begin(), ranges.end(), [](const auto & md) {
+        return md.type == test_attr && md.virt == 0x40000000 && md.phys == 0x70000000;
+    });
+
+    CHECK(removed != ranges.end());
+    CHECK(added != ranges.end());
+
+    auto pages = 0ULL;
+    for (const auto &md : ranges) {
+        pages += md.pages;
+    }
+
+    CHECK(pages == 2 * 512);
+
+    g_mm->remove_md(0x40000000);
+    remove_mdl(mdl);
+}
+
+static bool
+is_zero(void *ptr, size_t size)
+{
+    auto bytes = static_cast<uint8_t *>(ptr);
+    return std::all_of(bytes, bytes + size, [](auto byte) { return byte == 0; });
+}
+
+TEST_CASE("memory_manager_x64: physint_to_page_table")
+{
+    auto pool = reinterpret_cast<uintptr_t>(g_page_pool_owner);
+    auto arena = reinterpret_cast<uintptr_t>(g_page_table_pool_owner);
+    auto arena_pages = MAX_PAGE_TABLE_POOL >> x64::page_shift;
+
+    CHECK(g_mm->alloc_page_table() == nullptr);
+
+    g_mm->add_md_range(pool, pool + 0x100000000, MAX_PAGE_POOL >> x64::page_shift, test_attr);
+    g_mm->add_md_range(arena, arena + 0x100000000, arena_pages, test_attr);
+
+    // Once the arena is empty, page tables come from the page pool, which
+    // must be indexed the same way.
+
+    std::vector<uint8_t *> tables;
+
+    for (auto i = 0ULL; i <= arena_pages; i++) {
+        tables.push_back(static_cast<uint8_t *>(g_mm->alloc_page_table()));
+        REQUIRE(tables.back() != nullptr);
+    }
+
+    for (auto table : tables) {
+        auto phys = g_mm->virtptr_to_physint(table);
+        CHECK(g_mm->physint_to_page_table(phys + 0x10) == table + 0x10);
+    }
+
+    auto phys = g_mm->virtptr_to_physint(tables.back());
+
+    g_mm->add_md(0x12345000, phys, test_attr);
+    g_mm->remove_md(0x12345000);
+
+    CHECK_THROWS(g_mm->physint_to_virtint(phys));
+    CHECK(g_mm->physint_to_page_table(phys) == tables.back());
+
+    for (auto table : tables) {
+        g_mm->free_page_table(table);
+    }
+
+    CHECK_THROWS(g_mm->physint_to_page_table(phys));
+
+    g_mm->remove_md_range(pool, MAX_PAGE_POOL >> x64::page_shift);
+    g_mm->remove_md_range(arena, arena_pages);
+    g_mm->refill_zeroed_pages();
+}
+
+TEST_CASE("memory_manager_x64: zeroed page reserve is filled")
+{
+    CHECK(g_mm->stats().zeroed_pages == MAX_ZEROED_PAGES);
+
+    auto ptr = g_mm->alloc_zeroed(0x1000);
+    CHECK(g_mm->stats().zeroed_pages == MAX_ZEROED_PAGES - 1);
+
+    g_mm->maintain();
+    CHECK(g_mm->stats().zeroed_pages == MAX_ZEROED_PAGES - 1);
+
+    g_mm->refill_zeroed_pages();
+    CHECK(g_mm->stats().zeroed_pages == MAX_ZEROED_PAGES);
+
+    g_mm->free(ptr);
+}
+
+TEST_CASE("memory_manager_x64: maintain tops up the zeroed page reserve")
+{
+    constexpr const auto page_size = 0x1000ULL;
+    constexpr const auto low = MAX_ZEROED_PAGES / 2;
+
+    std::vector<void *> ptrs;
+    auto stats = g_mm->stats();
+
+    while (ptrs.size() < MAX_ZEROED_PAGES - low + 1) {
+        ptrs.push_back(g_mm->alloc_zeroed(page_size));
+    }
+
+    CHECK(g_mm->stats().zeroed_pages == low - 1);
+
+    g_mm->maintain();
+    CHECK(g_mm->stats().zeroed_pages == low - 1 + ZEROED_PAGES_REFILL_BATCH);
+
+    // Calling maintain() as often as the reserve is drawn from keeps every
+    // allocation a hit, long after the initial MAX_ZEROED_PAGES are used
+
+    while (ptrs.size() < MAX_ZEROED_PAGES * 2) {
+        ptrs.push_back(g_mm->alloc_zeroed(page_size));
+        CHECK(is_zero(ptrs.back(), page_size));
+
+        if (ptrs.size() % ZEROED_PAGES_REFILL_BATCH == 0) {
+            g_mm->maintain();
+        }
+    }
+
+    CHECK(g_mm->stats().zeroed_hits == stats.zeroed_hits + MAX_ZEROED_PAGES * 2);
+    CHECK(g_mm->stats().zeroed_misses == stats.zeroed_misses);
+    CHECK(g_mm->stats().zeroed_pages >= low - ZEROED_PAGES_REFILL_BATCH);
+
+    for (auto ptr : ptrs) {
+        std::memset(ptr, 0xFF, page_size);
+        g_mm->free(ptr);
+    }
+
+    g_mm->refill_zeroed_pages();
+    CHECK(g_mm->stats().zeroed_pages == MAX_ZEROED_PAGES);
+}
+
+TEST_CASE("memory_manager_x64: alloc_zeroed")
+{
+    constexpr const auto page_size = 0x1000ULL;
+
+    g_mm->set_zeroed_pages_target(2);
+    g_mm->refill_zeroed_pages();
+
+    auto stats = g_mm->stats();
+    CHECK(stats.zeroed_pages == 2);
+
+    auto ptr1 = g_mm->alloc_zeroed(page_size);
+    auto ptr2 = g_mm->alloc_zeroed(page_size);
+    auto ptr3 = g_mm->alloc_zeroed(page_size);
+    auto ptr4 = g_mm->alloc_zeroed(100);
+
+    CHECK(is_zero(ptr1, page_size));
+    CHECK(is_zero(ptr2, page_size));
+    CHECK(is_zero(ptr3, page_size));
+    CHECK(is_zero(ptr4, 100));
+
+    CHECK(g_mm->stats().zeroed_hits == stats.zeroed_hits + 2);
+    CHECK(g_mm->stats().zeroed_misses == stats.zeroed_misses + 1);
+    CHECK(g_mm->stats().zeroed_pages == 0);
+
+    std::memset(ptr1, 0xFF, page_size);
+    std::memset(ptr4, 0xFF, 100);
+
+    g_mm->free(ptr1);
+    g_mm->free(ptr2);
+    g_mm->free(ptr3);
+    g_mm->free(ptr4);
+
+    g_mm->refill_zeroed_pages();
+    CHECK(g_mm->stats().zeroed_pages == 2);
+
+    ptr1 = g_mm->alloc_zeroed(page_size);
+    CHECK(is_zero(ptr1, page_size));
+    g_mm->free(ptr1);
+
+    g_mm->set_zeroed_pages_target(0);
+    g_mm->refill_zeroed_pages();
+    CHECK(g_mm->stats().zeroed_pages == 0);
+}
+
+TEST_CASE("memory_manager_x64: stats counts allocs and frees")
+{
+    auto stats = g_mm->stats();
+
+    auto ptr1 = g_mm->alloc(64);
+    auto ptr2 = g_mm->alloc(0x1000);
+
+    g_mm->free(ptr1);
+    g_mm->free(ptr2);
+
+    auto after = g_mm->stats();
+
+    CHECK(after.allocs == stats.allocs + 2);
+    CHECK(after.frees == stats.frees + 2);
+    CHECK(after.histogram.at(6) == stats.histogram.at(6) + 1);
+    CHECK(after.histogram.at(12) == stats.histogram.at(12) + 1);
+}
+
+TEST_CASE("memory_manager_x64: alloc_aligned")
+{
+    constexpr const auto page_size = 0x1000ULL;
+
+    CHECK(g_mm->alloc_aligned(0, 64) == nullptr);
+    CHECK(g_mm->alloc_aligned(512, 0) == nullptr);
+    CHECK(g_mm->alloc_aligned(512, 96) == nullptr);
+    CHECK(g_mm->alloc_aligned(512, page_size << 1) == nullptr);
+
+    for (auto alignment = 64ULL; alignment <= page_size; alignment <<= 1) {
+        auto ptr = g_mm->alloc_aligned(512, alignment);
+
+        CHECK(ptr != nullptr);
+        CHECK((reinterpret_cast<uintptr_t>(ptr) & (alignment - 1)) == 0);
+        CHECK(g_mm->size(ptr) < page_size);
+
+        g_mm->free(ptr);
+    }
+
+    auto ptr = g_mm->alloc_aligned(page_size, page_size);
+    CHECK((reinterpret_cast<uintptr_t>(ptr) & (page_size - 1)) == 0);
+    g_mm->free(ptr);
+}
+
+TEST_CASE("memory_manager_x64: add_pool_segments")
+{
+    constexpr const auto page_size = 0x1000ULL;
+    constexpr const auto donation_size = (pool_segment_footprint * 2) + page_size;
+
+    // Donated memory is never returned, so the donation has to outlive the
+    // memory manager. The first segment is aligned to its size so that it
+    // can be allocated as a single block.
+
+    static auto donation = std::make_unique<uint8_t[]>(donation_size + MAX_POOL_SEGMENT_SIZE);
+
+    auto addr = reinterpret_cast<uintptr_t>(donation.get()) + pool_segment_header_size;
+    auto virt = ((addr + MAX_POOL_SEGMENT_SIZE - 1) & ~(MAX_POOL_SEGMENT_SIZE - 1)) - pool_segment_header_size;
+
+    CHECK_THROWS(g_mm->add_pool_segments(virt + 1, donation_size));
+    CHECK_THROWS(g_mm->add_pool_segments(virt, pool_segment_footprint - 1));
+
+    auto num = g_mm->stats().num_segments;
+    CHECK(g_mm->free_pool_segments() == MAX_POOL_SEGMENTS - num);
+
+    CHECK(g_mm->add_pool_segments(virt, donation_size) == 2);
+    CHECK(g_mm->stats().num_segments == num + 2);
+    CHECK(g_mm->free_pool_segments() == MAX_POOL_SEGMENTS - num - 2);
+
+    auto seg1 = virt + pool_segment_header_size;
+    auto seg2 = seg1 + pool_segment_footprint;
+
+    // Requests that are too large for the heap and page pools are served by
+    // the first segment that can fit them.
+
+    auto ptr1 = g_mm->alloc(MAX_POOL_SEGMENT_SIZE);
+    auto ptr2 = g_mm->alloc(MAX_PAGE_POOL + page_size);
+    auto ptr3 = g_mm->alloc(MAX_HEAP_POOL + 100);
+
+    CHECK(reinterpret_cast<uintptr_t>(ptr1) == seg1);
+    CHECK(reinterpret_cast<uintptr_t>(ptr2) >= seg2);
+    CHECK(reinterpret_cast<uintptr_t>(ptr3) >= seg2);
+    CHECK(g_mm->alloc(MAX_POOL_SEGMENT_SIZE) == nullptr);
+    CHECK(g_mm->alloc(MAX_POOL_SEGMENT_SIZE + page_size) == nullptr);
+
+    CHECK(g_mm->size(ptr1) == MAX_POOL_SEGMENT_SIZE);
+    CHECK(g_mm->size(ptr3) >= MAX_HEAP_POOL + 100);
+
+    auto used = g_mm->stats().segments.used;
+    auto used2 = g_mm->size(ptr2) + g_mm->size(ptr3);
+
+    CHECK(g_mm->segment_stats(num).used == MAX_POOL_SEGMENT_SIZE);
+    CHECK(g_mm->segment_stats(num + 1).used == used2);
+    CHECK(g_mm->segment_stats(MAX_POOL_SEGMENTS).total_size == 0);
+
+    g_mm->free(ptr1);
+    g_mm->free(ptr2);
+    g_mm->free(ptr3);
+
+    CHECK(g_mm->segment_stats(num).used == 0);
+    CHECK(g_mm->segment_stats(num + 1).used == 0);
+    CHECK(g_mm->stats().segments.used == used - MAX_POOL_SEGMENT_SIZE - used2);
+}
+
+TEST_CASE("memory_manager_x64: get_mem_trace")
+{
+    mem_trace_ring *ring = nullptr;
+
+    CHECK(get_mem_trace(0, nullptr) == GET_MEM_TRACE_FAILURE);
+    CHECK(get_mem_trace(MEM_TRACE_MAX_CPUS, &ring) == GET_MEM_TRACE_FAILURE);
+
+#ifdef MEMORY_MANAGER_TRACE
+    CHECK(get_mem_trace(0, &ring) == GET_MEM_TRACE_SUCCESS);
+    REQUIRE(ring != nullptr);
+
+    auto epos = ring->epos;
+    auto ptr = g_mm->alloc(64);
+    g_mm->free(ptr);
+
+    REQUIRE(ring->epos == epos + 2);
+
+    auto &&alloc = ring->events[epos & (MEM_TRACE_SIZE - 1)];
+    auto &&free = ring->events[(epos + 1) & (MEM_TRACE_SIZE - 1)];
+
+    CHECK(alloc.op == mem_trace_op_alloc);
+    CHECK(alloc.addr == reinterpret_cast<uintptr_t>(ptr));
+    CHECK(alloc.caller != 0);
+    CHECK(free.op == mem_trace_op_free);
+    CHECK(free.addr == reinterpret_cast<uintptr_t>(ptr));
+    CHECK(free.caller != 0);
+#else
+    CHECK(get_mem_trace(0, &ring) == GET_MEM_TRACE_FAILURE);
+    CHECK(ring == nullptr);
+#endif
+}
+
+// The following compares loading a VMM image one BF_REQUEST_ADD_MDL request
+// per page with loading it using a single batched request. bfmain is mocked
+// out by calling into the memory manager the same way the request handlers
+// do. It is hidden as timing results depend on the machine; run it with
+// "[benchmark]".
+
+TEST_CASE("memory_manager_x64: add_mdl throughput", "[.][benchmark]")
 {
-    CHECK(true);
+    auto mdl = make_mdl(0x100000000, 0x200000000, 0x10000);
+
+    auto load = [&](auto func) {
+        auto start = std::chrono::high_resolution_clock::now();
+        func();
+        auto stop = std::chrono::high_resolution_clock::now();
+
+        CHECK(g_mm->descriptors().at(0).pages == mdl.size());
+        remove_mdl(mdl);
+
+        return std::chrono::duration<double>(stop - start).count();
+    };
+
+    auto single = load([&] {
+        for (auto &md : mdl) {
+            guard_exceptions(MEMORY_MANAGER_FAILURE, [&] {
+                g_mm->add_md(md.virt, md.phys, md.type);
+            });
+        }
+    });
+
+    auto batched = load([&] {
+        guard_exceptions(MEMORY_MANAGER_FAILURE, [&] {
+            g_mm->add_mdl(mdl.data(), mdl.size());
+        });
+    });
+
+    WARN("add_md: " << single << "s for " << mdl.size() << " pages");
+    WARN("add_mdl: " << batched << "s for " << mdl.size() << " pages");
 }
 
 // #include <bfgsl.h>
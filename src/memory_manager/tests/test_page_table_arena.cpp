@@ -0,0 +1,108 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#define TESTING_MEM_POOL
+
+#include <bfgsl.h>
+#include <memory_manager/page_table_arena.h>
+
+using arena_type = page_table_arena<0x4000>;
+
+alignas(0x1000) static uint8_t g_buf[0x4000] = {};
+
+static auto
+buf_addr()
+{ return reinterpret_cast<uintptr_t>(g_buf); }
+
+TEST_CASE("page_table_arena: invalid address")
+{
+    CHECK_THROWS(arena_type{0});
+    CHECK_THROWS(arena_type{buf_addr() + 8});
+    CHECK_NOTHROW(arena_type{buf_addr()});
+}
+
+TEST_CASE("page_table_arena: alloc until full")
+{
+    arena_type arena{buf_addr()};
+
+    CHECK(arena.alloc() == buf_addr() + 0x0000);
+    CHECK(arena.alloc() == buf_addr() + 0x1000);
+    CHECK(arena.alloc() == buf_addr() + 0x2000);
+    CHECK(arena.alloc() == buf_addr() + 0x3000);
+    CHECK(arena.alloc() == 0);
+
+    auto &&stats = arena.stats();
+    CHECK(stats.used == 0x4000);
+    CHECK(stats.allocs == 4);
+    CHECK(stats.failures == 1);
+    CHECK(stats.largest_free == 0);
+
+    for (auto i = 0ULL; i < 4; i++) {
+        arena.free(buf_addr() + (i * 0x1000));
+    }
+}
+
+TEST_CASE("page_table_arena: free recycles zeroed pages")
+{
+    arena_type arena{buf_addr()};
+
+    auto addr1 = arena.alloc();
+    auto addr2 = arena.alloc();
+
+    auto view = reinterpret_cast<uint64_t *>(addr1);
+    view[0] = 0xDEADBEEF;
+    view[511] = 0xDEADBEEF;
+
+    arena.free(addr2);
+    arena.free(addr1);
+
+    CHECK(arena.alloc() == addr1);
+    CHECK(view[0] == 0);
+    CHECK(view[511] == 0);
+    CHECK(arena.alloc() == addr2);
+    CHECK(*reinterpret_cast<uint64_t *>(addr2) == 0);
+    CHECK(arena.alloc() == buf_addr() + 0x2000);
+
+    CHECK(arena.stats().used == 0x3000);
+
+    arena.free(addr1);
+    arena.free(addr2);
+    arena.free(buf_addr() + 0x2000);
+
+    CHECK(arena.stats().used == 0);
+}
+
+TEST_CASE("page_table_arena: contains")
+{
+    arena_type arena{buf_addr()};
+
+    CHECK(arena.contains(buf_addr()));
+    CHECK(arena.contains(buf_addr() + 0x3FFF));
+    CHECK_FALSE(arena.contains(buf_addr() + 0x4000));
+    CHECK_FALSE(arena.contains(buf_addr() - 1));
+
+    CHECK_NOTHROW(arena.free(0));
+    CHECK_NOTHROW(arena.free(buf_addr() + 0x4000));
+    CHECK(arena.stats().frees == 0);
+}
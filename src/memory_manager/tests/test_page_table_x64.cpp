@@ -22,9 +22,265 @@
 #define CATCH_CONFIG_MAIN
 #include <catch/catch.hpp>
 
-TEST_CASE("test name goes here")
+#include <array>
+
+#include <bfgsl.h>
+#include <bfmemory.h>
+
+#include <memory_manager/page_table_x64.h>
+#include <memory_manager/memory_manager_x64.h>
+
+#include <test/memory_manager_utils.h>
+
+constexpr const auto virt = 0x0000100000000000UL;
+
+static void
+set_4k(page_table_entry_x64 &&entry)
+{ entry.set_present(true); }
+
+static void
+set_large(page_table_entry_x64 &&entry)
+{ entry.set_present(true); entry.set_ps(true); }
+
+TEST_CASE("page_table_x64: add / remove 4k")
+{
+    arena_mdl mdl;
+    auto scr3 = 0x0UL;
+    auto pml4 = std::make_unique<page_table_x64>(&scr3);
+
+    CHECK(scr3 != 0);
+    CHECK(pml4->global_size() == 0);
+    CHECK(pml4->global_capacity() == 512 * 1);
+
+    set_4k(pml4->add_page_4k(virt));
+    CHECK(pml4->global_size() == 4);
+    CHECK(pml4->global_capacity() == 512 * 4);
+
+    set_4k(pml4->add_page_4k(virt + 0x1000));
+    CHECK(pml4->global_size() == 5);
+    CHECK(pml4->global_capacity() == 512 * 4);
+
+    set_4k(pml4->add_page_4k(virt + 0x200000));
+    CHECK(pml4->global_size() == 7);
+    CHECK(pml4->global_capacity() == 512 * 5);
+
+    CHECK(pml4->remove_page(virt) == 0x1000);
+    CHECK(pml4->remove_page(virt) == 0);
+    CHECK(pml4->global_size() == 6);
+
+    CHECK(pml4->remove_page(virt + 0x1000) == 0x1000);
+    CHECK(pml4->global_size() == 4);
+    CHECK(pml4->global_capacity() == 512 * 4);
+
+    CHECK(pml4->remove_page(virt + 0x200000) == 0x1000);
+    CHECK(pml4->global_size() == 0);
+    CHECK(pml4->global_capacity() == 512 * 1);
+}
+
+TEST_CASE("page_table_x64: add / remove large pages")
+{
+    arena_mdl mdl;
+    auto scr3 = 0x0UL;
+    auto pml4 = std::make_unique<page_table_x64>(&scr3);
+
+    set_large(pml4->add_page_1g(virt));
+    CHECK(pml4->global_size() == 2);
+    CHECK(pml4->global_capacity() == 512 * 2);
+
+    set_large(pml4->add_page_2m(virt + 0x40000000));
+    CHECK(pml4->global_size() == 4);
+    CHECK(pml4->global_capacity() == 512 * 3);
+
+    CHECK(pml4->remove_page(virt + 0x100) == 0x40000000);
+    CHECK(pml4->remove_page(virt + 0x40000000) == 0x200000);
+    CHECK(pml4->global_size() == 0);
+    CHECK(pml4->global_capacity() == 512 * 1);
+}
+
+TEST_CASE("page_table_x64: swap page sizes")
+{
+    arena_mdl mdl;
+    auto scr3 = 0x0UL;
+    auto pml4 = std::make_unique<page_table_x64>(&scr3);
+
+    set_4k(pml4->add_page_4k(virt));
+    set_4k(pml4->add_page_4k(virt + 0x1000));
+    CHECK(pml4->global_capacity() == 512 * 4);
+
+    set_large(pml4->add_page_2m(virt));
+    CHECK(pml4->global_size() == 3);
+    CHECK(pml4->global_capacity() == 512 * 3);
+    CHECK(pml4->virt_to_pte(virt + 0x1000).ps());
+
+    set_4k(pml4->add_page_4k(virt));
+    CHECK(pml4->global_size() == 4);
+    CHECK(pml4->global_capacity() == 512 * 4);
+    CHECK_FALSE(pml4->virt_to_pte(virt).ps());
+
+    CHECK(pml4->remove_page(virt) == 0x1000);
+    CHECK(pml4->global_size() == 0);
+}
+
+TEST_CASE("page_table_x64: virt_to_pte")
+{
+    arena_mdl mdl;
+    auto scr3 = 0x0UL;
+    auto pml4 = std::make_unique<page_table_x64>(&scr3);
+
+    auto &&entry = pml4->add_page_4k(virt);
+    entry.set_present(true);
+    entry.set_phys_addr(0x12345000);
+
+    CHECK(pml4->virt_to_pte(virt).phys_addr() == 0x12345000);
+    CHECK(pml4->virt_to_pte(virt + 0x1000).phys_addr() == 0);
+    CHECK_THROWS(pml4->virt_to_pte(virt + 0x40000000));
+
+    pml4->remove_page(virt);
+    CHECK_THROWS(pml4->virt_to_pte(virt));
+}
+
+TEST_CASE("page_table_x64: pt_to_mdl")
+{
+    arena_mdl mdl;
+    auto scr3 = 0x0UL;
+    auto pml4 = std::make_unique<page_table_x64>(&scr3);
+
+    auto pages = [&] {
+        auto num = 0ULL;
+
+        for (const auto &md : pml4->pt_to_mdl()) {
+            num += md.pages;
+        }
+
+        return num;
+    };
+
+    CHECK(pages() == 1);
+    set_large(pml4->add_page_1g(0x1000));
+    CHECK(pages() == 2);
+    set_large(pml4->add_page_2m(0x1000));
+    CHECK(pages() == 3);
+    set_4k(pml4->add_page_4k(0x1000));
+    CHECK(pages() == 4);
+
+    pml4->remove_page(0x1000);
+    CHECK(pages() == 1);
+}
+
+TEST_CASE("page_table_x64: pt_to_mdl in chunks")
+{
+    arena_mdl mdl;
+    auto scr3 = 0x0UL;
+    auto pml4 = std::make_unique<page_table_x64>(&scr3);
+
+    // Page tables are added in the reverse order that they are read, so
+    // that they are not coalesced into a single range.
+
+    for (auto i = 4ULL; i > 0; i--) {
+        set_4k(pml4->add_page_4k(i << 30));
+    }
+
+    auto expected = pml4->pt_to_mdl();
+    REQUIRE(expected.size() > 1);
+
+    std::array<memory_descriptor_range, 1> chunk{};
+    page_table_x64::memory_descriptor_list ranges;
+    page_table_x64::cursor_type cursor;
+
+    CHECK_THROWS(pml4->pt_to_mdl(nullptr, chunk.size(), cursor));
+    CHECK_THROWS(pml4->pt_to_mdl(chunk.data(), 0, cursor));
+
+    while (!cursor.done) {
+        REQUIRE(pml4->pt_to_mdl(chunk.data(), chunk.size(), cursor) == 1);
+        ranges.push_back(chunk.at(0));
+    }
+
+    CHECK(pml4->pt_to_mdl(chunk.data(), chunk.size(), cursor) == 0);
+    REQUIRE(ranges.size() == expected.size());
+
+    for (auto i = 0ULL; i < ranges.size(); i++) {
+        CHECK(ranges.at(i).virt == expected.at(i).virt);
+        CHECK(ranges.at(i).phys == expected.at(i).phys);
+        CHECK(ranges.at(i).pages == expected.at(i).pages);
+    }
+
+    for (auto i = 4ULL; i > 0; i--) {
+        pml4->remove_page(i << 30);
+    }
+}
+
+TEST_CASE("page_table_x64: generation")
+{
+    arena_mdl mdl;
+    auto scr3 = 0x0UL;
+    auto pml4 = std::make_unique<page_table_x64>(&scr3);
+
+    auto gen = pml4->generation();
+
+    set_4k(pml4->add_page_4k(virt));
+    CHECK(pml4->generation() == gen + 3);
+
+    set_4k(pml4->add_page_4k(virt + 0x1000));
+    CHECK(pml4->generation() == gen + 3);
+
+    pml4->remove_page(virt + 0x1000);
+    CHECK(pml4->generation() == gen + 3);
+
+    pml4->remove_page(virt);
+    CHECK(pml4->generation() == gen + 6);
+
+    set_large(pml4->add_page_2m(virt));
+    set_4k(pml4->add_page_4k(virt + 0x200000));
+    gen = pml4->generation();
+
+    set_large(pml4->add_page_1g(virt));
+    CHECK(pml4->generation() == gen + 1);
+}
+
+TEST_CASE("page_table_x64: page tables come from the arena")
+{
+    arena_mdl mdl;
+
+    auto before = g_mm->stats().page_table.used;
+
+    {
+        auto scr3 = 0x0UL;
+        auto pml4 = std::make_unique<page_table_x64>(&scr3);
+
+        set_4k(pml4->add_page_4k(virt));
+        CHECK(g_mm->stats().page_table.used == before + (4 * x64::page_size));
+    }
+
+    CHECK(g_mm->stats().page_table.used == before);
+}
+
+// The following reports how much memory the page tables need to map 1g of
+// memory using 2m pages, and 64m of memory using 4k pages (scaled to 1g). It
+// is hidden as it only reports; run it with "[benchmark]".
+
+TEST_CASE("page_table_x64: memory per mapped gigabyte", "[.][benchmark]")
 {
-    CHECK(true);
+    arena_mdl mdl;
+
+    auto report = [](auto size, auto page_size, const char *name) {
+        auto scr3 = 0x0UL;
+        auto pml4 = std::make_unique<page_table_x64>(&scr3);
+
+        for (auto addr = virt; addr < virt + size; addr += page_size) {
+            if (page_size == x64::page_size) {
+                set_4k(pml4->add_page_4k(addr));
+            }
+            else {
+                set_large(pml4->add_page_2m(addr));
+            }
+        }
+
+        auto bytes = pml4->global_capacity() * sizeof(uintptr_t) * (0x40000000 / size);
+        WARN(name << ": " << pml4->global_size() << " entries, " << bytes << " bytes per mapped gigabyte");
+    };
+
+    report(0x40000000ULL, 0x200000ULL, "2m pages");
+    report(0x4000000ULL, 0x1000ULL, "4k pages");
 }
 
 // #include <bfgsl.h>
@@ -0,0 +1,267 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <bfgsl.h>
+#include <memory_manager/radix_tree.h>
+
+using tree_type = radix_tree<36>;
+
+TEST_CASE("radix_tree: get empty")
+{
+    tree_type tree;
+
+    CHECK(tree.get(0) == 0);
+    CHECK(tree.get(0x123456789) == 0);
+    CHECK(tree.get(0xFFFFFFFFF) == 0);
+}
+
+TEST_CASE("radix_tree: get invalid key")
+{
+    tree_type tree;
+
+    CHECK(tree.get(0x1000000000) == 0);
+    CHECK(tree.get(0xFFFFFFFFFFFFFFFF) == 0);
+}
+
+TEST_CASE("radix_tree: set invalid")
+{
+    tree_type tree;
+
+    CHECK_THROWS(tree.set(0x1000000000, 1));
+    CHECK_THROWS(tree.set(1, 0));
+}
+
+TEST_CASE("radix_tree: set / get")
+{
+    tree_type tree;
+
+    tree.set(0, 10);
+    tree.set(1, 11);
+    tree.set(0x200, 12);
+    tree.set(0xFFFFFFFFF, 13);
+
+    CHECK(tree.get(0) == 10);
+    CHECK(tree.get(1) == 11);
+    CHECK(tree.get(2) == 0);
+    CHECK(tree.get(0x200) == 12);
+    CHECK(tree.get(0xFFFFFFFFF) == 13);
+    CHECK(tree.get(0xFFFFFFFFE) == 0);
+
+    tree.set(1, 14);
+    CHECK(tree.get(1) == 14);
+}
+
+TEST_CASE("radix_tree: erase")
+{
+    tree_type tree;
+
+    CHECK(tree.erase(1) == 0);
+    CHECK(tree.erase(0x1000000000) == 0);
+
+    tree.set(1, 11);
+    tree.set(2, 12);
+
+    CHECK(tree.erase(1) == 11);
+    CHECK(tree.get(1) == 0);
+    CHECK(tree.get(2) == 12);
+    CHECK(tree.erase(1) == 0);
+}
+
+TEST_CASE("radix_tree: reserve")
+{
+    tree_type tree;
+    auto count = 0ULL;
+
+    CHECK_THROWS(tree.reserve(0x1000000000));
+
+    tree.set(1, 11);
+    tree.reserve(1);
+    tree.reserve(0x123456789);
+
+    CHECK(tree.get(1) == 11);
+    CHECK(tree.get(0x123456789) == 0);
+    CHECK(tree.generation() == 1);
+
+    tree.for_each([&](auto, auto) { count++; });
+    CHECK(count == 1);
+
+    tree.set(0x123456789, 12);
+    CHECK(tree.get(0x123456789) == 12);
+}
+
+TEST_CASE("radix_tree: for each")
+{
+    tree_type tree;
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+
+    tree.set(0xFFFFFFFFF, 13);
+    tree.set(0x200, 12);
+    tree.set(1, 11);
+    tree.erase(0x200);
+
+    tree.for_each([&](auto key, auto val) {
+        entries.push_back({key, val});
+    });
+
+    REQUIRE(entries.size() == 2);
+    CHECK(entries.at(0).first == 1);
+    CHECK(entries.at(0).second == 11);
+    CHECK(entries.at(1).first == 0xFFFFFFFFF);
+    CHECK(entries.at(1).second == 13);
+}
+
+TEST_CASE("radix_tree: generation")
+{
+    tree_type tree;
+    CHECK(tree.generation() == 0);
+
+    tree.set(1, 11);
+    CHECK(tree.generation() == 1);
+
+    tree.set(1, 12);
+    CHECK(tree.generation() == 2);
+
+    tree.erase(2);
+    CHECK(tree.generation() == 2);
+
+    tree.erase(1);
+    CHECK(tree.generation() == 3);
+}
+
+TEST_CASE("radix_tree: for each changed")
+{
+    tree_type tree;
+    std::vector<std::pair<uint64_t, uint64_t>> entries;
+
+    auto &&present = [&](auto key, auto val) {
+        if (val != 0) {
+            entries.push_back({key, val});
+        }
+        return true;
+    };
+
+    tree.set(1, 11);
+    tree.set(0x200, 12);
+    tree.set(0xFFFFFFFFF, 13);
+
+    CHECK(tree.for_each_changed(0, 0, present));
+    CHECK(entries.size() == 3);
+
+    entries.clear();
+    CHECK(tree.for_each_changed(2, 0, present));
+    REQUIRE(entries.size() == 2);
+    CHECK(entries.at(0).first == 0x200);
+
+    entries.clear();
+    CHECK(tree.for_each_changed(0x1000000000, 0, present));
+    CHECK(entries.empty());
+
+    auto &&gen = tree.generation();
+    tree.erase(0x200);
+    tree.set(0x201, 14);
+
+    auto erased = 0ULL;
+    auto visited = 0ULL;
+
+    CHECK(tree.for_each_changed(0, gen, [&](auto key, auto val) {
+        erased += (key == 0x200 && val == 0) ? 1 : 0;
+        visited++;
+        return true;
+    }));
+
+    CHECK(erased == 1);
+    CHECK(visited == radix_tree_level_size);
+
+    entries.clear();
+    CHECK(tree.for_each_changed(0, tree.generation(), present));
+    CHECK(entries.empty());
+
+    entries.clear();
+    CHECK_FALSE(tree.for_each_changed(0, 0, [&](auto key, auto val) {
+        if (val != 0) {
+            entries.push_back({key, val});
+        }
+        return entries.empty();
+    }));
+
+    REQUIRE(entries.size() == 1);
+    CHECK(entries.at(0).first == 1);
+}
+
+TEST_CASE("radix_tree: root level only")
+{
+    radix_tree<10> tree;
+
+    tree.set(0x3FF, 1);
+    CHECK(tree.get(0x3FF) == 1);
+    CHECK(tree.get(0x1FF) == 0);
+    CHECK(tree.get(0x400) == 0);
+}
+
+TEST_CASE("radix_tree: lock free readers")
+{
+    tree_type tree;
+    std::atomic<bool> done{false};
+    std::atomic<bool> corrupt{false};
+
+    tree.set(0, 1);
+
+    auto reader = [&] {
+        while (!done) {
+            for (auto key = 0ULL; key < 0x10000; key += 0x101) {
+                auto val = tree.get(key);
+
+                if (val != 0 && val != key + 1) {
+                    corrupt = true;
+                }
+            }
+
+            if (tree.get(0) != 1) {
+                corrupt = true;
+            }
+        }
+    };
+
+    std::thread t1(reader);
+    std::thread t2(reader);
+
+    for (auto key = 1ULL; key < 0x10000; key++) {
+        tree.set(key, key + 1);
+    }
+
+    for (auto key = 1ULL; key < 0x10000; key += 2) {
+        tree.erase(key);
+    }
+
+    done = true;
+
+    t1.join();
+    t2.join();
+
+    CHECK_FALSE(corrupt);
+}
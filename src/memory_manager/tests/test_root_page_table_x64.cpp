@@ -21,10 +21,619 @@
 
 #define CATCH_CONFIG_MAIN
 #include <catch/catch.hpp>
+#include <hippomocks.h>
 
-TEST_CASE("test name goes here")
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <bfgsl.h>
+#include <bfmemory.h>
+
+#include <memory_manager/memory_manager_x64.h>
+#include <memory_manager/root_page_table_x64.h>
+
+#include <test/memory_manager_utils.h>
+
+#include <intrinsics/x86/intel/cpuid_intel_x64.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace x64;
+
+// A root page table reads CPUID when it is created, to see if the CPU
+// supports 1g pages, so every test says whether it does (before creating
+// the root page table) instead of depending on the CPU that runs the tests.
+
+struct cpuid_1g
+{
+    cpuid_1g(bool supported = true)
+    {
+        auto &&mask = supported ? intel_x64::cpuid::ext_feature_info::edx::pages_avail::mask : 0;
+        mocks.OnCallFunc(_cpuid_edx).Return(gsl::narrow_cast<uint32_t>(mask));
+    }
+
+    MockRepository mocks;
+};
+
+static auto
+num_tables(const root_page_table_x64 &rpt)
+{
+    auto num = 0ULL;
+
+    for (const auto &md : rpt.pt_to_mdl()) {
+        num += md.pages;
+    }
+
+    return num;
+}
+
+TEST_CASE("root_page_table_x64: map_range picks the largest page size")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    auto virt = 0x3FDFF000UL;
+    auto size = 0x1000UL + 0x200000UL + 0x40000000UL + 0x200000UL + 0x1000UL;
+
+    rpt.map_range(virt, virt, size, memory_attr::rw_wb);
+
+    CHECK(rpt.mapped_pages(page_table::pdpt::size_bytes) == 1);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 2);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 2);
+
+    CHECK_FALSE(rpt.virt_to_pte(0x3FDFF000).ps());
+    CHECK(rpt.virt_to_pte(0x3FE00000).ps());
+    CHECK(rpt.virt_to_pte(0x40000000).ps());
+    CHECK(rpt.virt_to_pte(0x80000000).ps());
+    CHECK_FALSE(rpt.virt_to_pte(0x80200000).ps());
+
+    CHECK(rpt.virt_to_pte(0x3FDFF000).phys_addr() == 0x3FDFF000);
+    CHECK(rpt.virt_to_pte(0x3FE00000).phys_addr() == 0x3FE00000);
+    CHECK(rpt.virt_to_pte(0x40000000).phys_addr() == 0x40000000);
+    CHECK(rpt.virt_to_pte(0x80000000).phys_addr() == 0x80000000);
+    CHECK(rpt.virt_to_pte(0x80200000).phys_addr() == 0x80200000);
+    CHECK(rpt.virt_to_pte(0x80201000).phys_addr() == 0);
+
+    rpt.unmap_range(virt, size);
+
+    CHECK(rpt.mapped_pages(page_table::pdpt::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 0);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: map_range without 1g pages")
+{
+    cpuid_1g cpu{false};
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.map_range(0x40000000, 0x40000000, 0x40000000, memory_attr::rw_wb);
+
+    CHECK(rpt.mapped_pages(page_table::pdpt::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 512);
+    CHECK(rpt.virt_to_pte(0x40000000).ps());
+    CHECK(rpt.virt_to_pte(0x7FE00000).phys_addr() == 0x7FE00000);
+
+    rpt.unmap_range(0x40000000, 0x40000000);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: map_range uses the alignment of phys")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.map_range(0x200000, 0x201000, 0x200000, memory_attr::rw_wb);
+
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 512);
+    CHECK(rpt.virt_to_pte(0x3FF000).phys_addr() == 0x400000);
+
+    rpt.unmap_range(0x200000, 0x200000);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 0);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: map_range matches map_4k")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.map_4k(0x1000, 0x5000, memory_attr::re_wt);
+    rpt.map_range(0x2000, 0x5000, 0x1000, memory_attr::re_wt);
+
+    auto &&entry1 = rpt.virt_to_pte(0x1000);
+    auto &&entry2 = rpt.virt_to_pte(0x2000);
+
+    CHECK(entry1.phys_addr() == entry2.phys_addr());
+    CHECK(entry1.present() == entry2.present());
+    CHECK(entry1.rw() == entry2.rw());
+    CHECK(entry1.nx() == entry2.nx());
+    CHECK(entry1.pat_index_4k() == entry2.pat_index_4k());
+
+    rpt.unmap(0x1000);
+    rpt.unmap_range(0x2000, 0x1000);
+}
+
+TEST_CASE("root_page_table_x64: map_range replaces existing page tables")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.map_4k(0x200000, 0x200000, memory_attr::rw_wb);
+    CHECK(num_tables(rpt) == 4);
+
+    rpt.map_range(0x200000, 0x200000, 0x200000, memory_attr::rw_wb);
+    CHECK(num_tables(rpt) == 3);
+    CHECK(rpt.virt_to_pte(0x200000).ps());
+
+    rpt.unmap_range(0x200000, 0x200000);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: descriptors for a page table do not move it")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.map_4k(0x200000, 0x200000, memory_attr::rw_wb);
+    REQUIRE(num_tables(rpt) == 4);
+
+    // A guest can ask the VMM to map any physical page, including one of
+    // the VMM's own page tables, which adds (and then removes) another
+    // descriptor for it. The page tables must still be found afterwards.
+
+    auto window = 0x0000700000000000UL;
+
+    for (const auto &md : rpt.pt_to_mdl()) {
+        for (auto i = 0ULL; i < md.pages; i++) {
+            g_mm->add_md(window, md.phys + (i << page_shift), MEMORY_TYPE_R | MEMORY_TYPE_W);
+            g_mm->remove_md(window);
+        }
+    }
+
+    CHECK(rpt.virt_to_pte(0x200000).phys_addr() == 0x200000);
+
+    rpt.unmap(0x200000);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: map_range invalid")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    CHECK_THROWS(rpt.map_range(0x1001, 0x1000, 0x1000, memory_attr::rw_wb));
+    CHECK_THROWS(rpt.map_range(0x1000, 0x1001, 0x1000, memory_attr::rw_wb));
+    CHECK_THROWS(rpt.map_range(0x1000, 0x1000, 0x1001, memory_attr::rw_wb));
+    CHECK_THROWS(rpt.map_range(0x1000, 0x1000, 0x1000, memory_attr::invalid));
+
+    CHECK_NOTHROW(rpt.map_range(0x1000, 0x1000, 0, memory_attr::rw_wb));
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: identity maps keep their page size")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.setup_identity_map_4k(0x0, 0x200000);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 512);
+
+    rpt.unmap_identity_map_4k(0x0, 0x200000);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 0);
+
+    rpt.setup_identity_map_2m(0x0, 0x40000000);
+    CHECK(rpt.mapped_pages(page_table::pdpt::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 512);
+
+    rpt.unmap_identity_map_2m(0x0, 0x40000000);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: map_range promotes full page tables")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.enable_promotion();
+
+    for (auto virt = 0x200000UL; virt < 0x400000UL; virt += page_table::pt::size_bytes) {
+        rpt.map_range(virt, virt + 0x40000000, page_table::pt::size_bytes, memory_attr::rw_wb);
+    }
+
+    CHECK(rpt.promotions() == 1);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 1);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 0);
+    CHECK(rpt.virt_to_pte(0x200000).ps());
+    CHECK(rpt.virt_to_pte(0x200000).phys_addr() == 0x40200000);
+    CHECK(num_tables(rpt) == 3);
+
+    for (auto virt = 0x400000UL; virt < 0x40000000UL; virt += page_table::pd::size_bytes) {
+        rpt.map_range(virt, virt + 0x40000000, page_table::pd::size_bytes, memory_attr::rw_wb);
+    }
+
+    rpt.map_range(0, 0x40000000, page_table::pd::size_bytes, memory_attr::rw_wb);
+
+    CHECK(rpt.promotions() == 2);
+    CHECK(rpt.mapped_pages(page_table::pdpt::size_bytes) == 1);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(rpt.virt_to_pte(0).phys_addr() == 0x40000000);
+    CHECK(num_tables(rpt) == 2);
+
+    rpt.unmap_range(0, 0x40000000);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: promotion is disabled by default")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    for (auto virt = 0x200000UL; virt < 0x400000UL; virt += page_table::pt::size_bytes) {
+        rpt.map_range(virt, virt, page_table::pt::size_bytes, memory_attr::rw_wb);
+    }
+
+    CHECK(rpt.promotions() == 0);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 512);
+
+    rpt.map_range(0x400000, 0x400000, page_table::pd::size_bytes, memory_attr::rw_wb);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 1);
+
+    rpt.unmap_range(0x200000, 0x400000);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: unmap splits promoted pages")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.enable_promotion();
+
+    for (auto virt = 0x200000UL; virt < 0x400000UL; virt += page_table::pt::size_bytes) {
+        rpt.map_range(virt, virt, page_table::pt::size_bytes, memory_attr::rw_wb);
+    }
+
+    CHECK(rpt.promotions() == 1);
+    rpt.unmap(0x201000);
+
+    CHECK(rpt.splits() == 1);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 511);
+    CHECK(rpt.virt_to_pte(0x201000).phys_addr() == 0);
+    CHECK(rpt.virt_to_pte(0x202000).phys_addr() == 0x202000);
+
+    rpt.map_range(0x201000, 0x201000, page_table::pt::size_bytes, memory_attr::rw_wb);
+    CHECK(rpt.promotions() == 2);
+
+    rpt.map_2m(0x400000, 0x400000, memory_attr::rw_wb);
+    rpt.unmap(0x401000);
+    CHECK(rpt.splits() == 1);
+
+    rpt.unmap_range(0x200000, 0x200000);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: map_range only promotes matching pages")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.enable_promotion();
+
+    rpt.map_range(0x200000, 0x200000, 0x1FF000, memory_attr::rw_wb);
+    rpt.map_range(0x3FF000, 0x3FF000, 0x1000, memory_attr::re_wb);
+
+    rpt.map_range(0x400000, 0x400000, 0x1FF000, memory_attr::rw_wb);
+    rpt.map_range(0x5FF000, 0x7FF000, 0x1000, memory_attr::rw_wb);
+
+    rpt.map_4k(0x600000, 0x600000, memory_attr::rw_wb);
+    rpt.map_range(0x601000, 0x601000, 0x1FF000, memory_attr::rw_wb);
+
+    CHECK(rpt.promotions() == 1);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 1);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 1024);
+
+    rpt.unmap_range(0x200000, 0x600000);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: unmap_range splits large pages")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.enable_promotion();
+
+    rpt.map_range(0x200000, 0x800000, 0x200000, memory_attr::re_wp);
+    rpt.unmap_range(0x201000, 0x1000);
+
+    CHECK(rpt.splits() == 1);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 511);
+    CHECK(rpt.virt_to_pte(0x201000).phys_addr() == 0);
+
+    auto &&entry = rpt.virt_to_pte(0x3FF000);
+
+    CHECK_FALSE(entry.rw());
+    CHECK(entry.phys_addr() == 0x9FF000);
+    CHECK(entry.pat_index_4k() == pat::write_protected_index);
+
+    rpt.map_range(0x201000, 0x801000, 0x1000, memory_attr::re_wp);
+
+    CHECK(rpt.promotions() == 1);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 1);
+    CHECK(rpt.virt_to_pte(0x200000).pat_index_large() == pat::write_protected_index);
+
+    rpt.map_range(0x40000000, 0x40000000, 0x40000000, memory_attr::rw_wb);
+    rpt.unmap_range(0x40201000, 0x1000);
+
+    CHECK(rpt.splits() == 3);
+    CHECK(rpt.mapped_pages(page_table::pdpt::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 512);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 511);
+    CHECK(rpt.virt_to_pte(0x7FE00000).phys_addr() == 0x7FE00000);
+    CHECK(rpt.virt_to_pte(0x40202000).phys_addr() == 0x40202000);
+
+    rpt.unmap_range(0x200000, 0x200000);
+    rpt.unmap_range(0x40000000, 0x40000000);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: map_range over a page table uncounts its pages")
 {
-    CHECK(true);
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.map_range(0x200000, 0x200000, 0x1000, memory_attr::rw_wb);
+    rpt.map_range(0x201000, 0x900000, 0x1000, memory_attr::rw_wb);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 2);
+
+    rpt.map_range(0x200000, 0x600000, 0x200000, memory_attr::rw_wb);
+
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 1);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 0);
+
+    rpt.unmap_range(0x200000, 0x200000);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(num_tables(rpt) == 1);
+}
+
+TEST_CASE("root_page_table_x64: unmap of a large page removes its descriptors")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{true};
+
+    rpt.map_2m(0x40000000, 0x600000, memory_attr::rw_wb);
+    CHECK(g_mm->virtint_to_physint(0x40000000) == 0x600000);
+
+    rpt.unmap(0x40001000);
+
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK_THROWS(g_mm->virtint_to_physint(0x40000000));
+    CHECK_THROWS(g_mm->virtint_to_physint(0x401FF000));
+    CHECK_THROWS(g_mm->physint_to_virtint(0x600000));
+}
+
+TEST_CASE("root_page_table_x64: map_range splits large pages")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.map_range(0x200000, 0x200000, 0x200000, memory_attr::rw_wb);
+    rpt.map_range(0x201000, 0x900000, 0x1000, memory_attr::rw_wb);
+
+    CHECK(rpt.splits() == 1);
+    CHECK(rpt.promotions() == 0);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 512);
+    CHECK(rpt.virt_to_pte(0x200000).phys_addr() == 0x200000);
+    CHECK(rpt.virt_to_pte(0x201000).phys_addr() == 0x900000);
+    CHECK(rpt.virt_to_pte(0x202000).phys_addr() == 0x202000);
+
+    rpt.unmap_range(0x200000, 0x200000);
+    CHECK(num_tables(rpt) == 1);
+}
+
+// Each thread maps and unmaps its own 2m of memory, but every thread shares
+// the same PDPT and PD, so the threads race to add and remove them. The
+// VMM's page tables are used, so the descriptors are updated as well.
+
+TEST_CASE("root_page_table_x64: concurrent map / unmap")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{true};
+
+    constexpr const auto num_threads = 8UL;
+    constexpr const auto num_loops = 200UL;
+
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+
+    for (auto t = 0UL; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            auto virt = 0x40000000UL + (t * page_table::pd::size_bytes);
+
+            for (auto i = 0UL; i < num_loops; i++) {
+                try {
+                    if (t % 2 == 0) {
+                        rpt.map_range(virt, virt + 0x1000, 0x10000, memory_attr::rw_wb);
+
+                        if (rpt.virt_to_pte(virt + 0xF000).phys_addr() != virt + 0x10000) {
+                            failed = true;
+                        }
+
+                        if (g_mm->virtint_to_physint(virt + 0xF000) != virt + 0x10000) {
+                            failed = true;
+                        }
+
+                        rpt.unmap_range(virt, 0x10000);
+                    }
+                    else {
+                        rpt.map_2m(virt, virt, memory_attr::rw_wb);
+
+                        if (!rpt.virt_to_pte(virt).ps()) {
+                            failed = true;
+                        }
+
+                        if (g_mm->virtint_to_physint(virt + 0x1FF000) != virt + 0x1FF000) {
+                            failed = true;
+                        }
+
+                        rpt.unmap(virt);
+                    }
+                }
+                catch (...) {
+                    failed = true;
+                }
+            }
+        });
+    }
+
+    for (auto &&thread : threads) {
+        thread.join();
+    }
+
+    CHECK_FALSE(failed);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 0);
+    CHECK(num_tables(rpt) == 1);
+
+    for (auto t = 0UL; t < num_threads; t++) {
+        CHECK_THROWS(g_mm->virtint_to_physint(0x40000000UL + (t * page_table::pd::size_bytes)));
+    }
+}
+
+// Each thread fills its own 2m of memory one page at a time (which promotes
+// it to a 2m page), and then unmaps it one page at a time (which splits it
+// up again), while the other threads do the same in the same PD.
+
+TEST_CASE("root_page_table_x64: concurrent promote / split")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    rpt.enable_promotion();
+
+    constexpr const auto num_threads = 4UL;
+    constexpr const auto num_loops = 10UL;
+    constexpr const auto num_pages = 512UL;
+
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+
+    for (auto t = 0UL; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            auto virt = 0x40000000UL + (t * page_table::pd::size_bytes);
+
+            for (auto i = 0UL; i < num_loops; i++) {
+                try {
+                    for (auto p = 0UL; p < num_pages; p++) {
+                        auto addr = virt + (p << page_shift);
+                        rpt.map_range(addr, addr, page_table::pt::size_bytes, memory_attr::rw_wb);
+                    }
+
+                    for (auto p = 0UL; p < num_pages; p++) {
+                        auto addr = virt + (p << page_shift);
+
+                        if (rpt.virt_to_pte(addr).phys_addr() != addr) {
+                            failed = true;
+                        }
+
+                        rpt.unmap_range(addr, page_table::pt::size_bytes);
+                    }
+                }
+                catch (...) {
+                    failed = true;
+                }
+            }
+        });
+    }
+
+    for (auto &&thread : threads) {
+        thread.join();
+    }
+
+    CHECK_FALSE(failed);
+    CHECK(rpt.promotions() == num_threads * num_loops);
+    CHECK(rpt.splits() == num_threads * num_loops);
+    CHECK(rpt.mapped_pages(page_table::pd::size_bytes) == 0);
+    CHECK(rpt.mapped_pages(page_table::pt::size_bytes) == 0);
+    CHECK(num_tables(rpt) == 1);
+}
+
+// The following compares map_range with mapping each page individually. 4k
+// pages are only benchmarked on 64m as 1g of 4k pages needs more page tables
+// than the test's page table arena holds.
+
+TEST_CASE("root_page_table_x64: map_range benchmark", "[.][benchmark]")
+{
+    cpuid_1g cpu;
+    arena_mdl mdl;
+    root_page_table_x64 rpt{false};
+
+    constexpr const auto size_1g = 0x40000000UL;
+    constexpr const auto size_64m = 0x4000000UL;
+
+    auto &&loop_2m = time_it([&] {
+        for (auto virt = 0UL; virt < size_1g; virt += page_table::pd::size_bytes) {
+            rpt.map_2m(virt, virt, memory_attr::rw_wb);
+        }
+    });
+    rpt.unmap_range(0, size_1g);
+
+    auto &&range_2m = time_it([&] {
+        rpt.map_range(0, page_table::pd::size_bytes, size_1g, memory_attr::rw_wb);
+    });
+    rpt.unmap_range(0, size_1g);
+
+    auto &&range_1g = time_it([&] {
+        rpt.map_range(0, 0, size_1g, memory_attr::rw_wb);
+    });
+    rpt.unmap_range(0, size_1g);
+
+    auto &&loop_4k = time_it([&] {
+        for (auto virt = 0UL; virt < size_64m; virt += page_table::pt::size_bytes) {
+            rpt.map_4k(virt, virt, memory_attr::rw_wb);
+        }
+    });
+    rpt.unmap_range(0, size_64m);
+
+    auto &&range_4k = time_it([&] {
+        rpt.map_range(0, page_table::pt::size_bytes, size_64m, memory_attr::rw_wb);
+    });
+    rpt.unmap_range(0, size_64m);
+
+    WARN("1g identity map, map_2m per page: " << loop_2m << "us");
+    WARN("1g identity map, map_range (2m pages): " << range_2m << "us");
+    WARN("1g identity map, map_range (1g page): " << range_1g << "us");
+    WARN("64m identity map, map_4k per page: " << loop_4k << "us");
+    WARN("64m identity map, map_range (4k pages): " << range_4k << "us");
+
+    CHECK(num_tables(rpt) == 1);
 }
 
 // #include <test.h>
@@ -773,3 +1382,5 @@ TEST_CASE("test name goes here")
 
 //     this->expect_no_exception([&] { root_cr3.pt_to_mdl(); });
 // }
+
+#endif
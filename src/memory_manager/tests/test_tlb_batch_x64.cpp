@@ -0,0 +1,330 @@
+//
+// Bareflank Hypervisor
+//
+// Copyright (C) 2015 Assured Information Security, Inc.
+// Author: Rian Quinn        <quinnr@ainfosec.com>
+// Author: Brendan Kerrigan  <kerriganb@ainfosec.com>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+
+#define CATCH_CONFIG_MAIN
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <vector>
+#include <algorithm>
+
+#include <memory_manager/map_ptr_x64.h>
+#include <memory_manager/tlb_batch_x64.h>
+#include <memory_manager/memory_manager_x64.h>
+#include <memory_manager/root_page_table_x64.h>
+
+#include <test/memory_manager_utils.h>
+
+#include <intrinsics/x86/common_x64.h>
+#include <intrinsics/x86/intel/crs_intel_x64.h>
+
+#ifdef _HIPPOMOCKS__ENABLE_CFUNC_MOCKING_SUPPORT
+
+using namespace x64;
+
+static std::vector<uintptr_t> g_invlpg;
+static std::vector<uintptr_t> g_invpcid;
+static auto g_cr3_writes = 0UL;
+static auto g_cr3 = 0x1000UL;
+
+static void
+test_invlpg(const void *virt) noexcept
+{ g_invlpg.push_back(reinterpret_cast<uintptr_t>(virt)); }
+
+static void
+test_invpcid(uint64_t type, const void *descriptor) noexcept
+{
+    auto &&desc = static_cast<const uint64_t *>(descriptor);
+    g_invpcid.push_back(type == 0 ? desc[1] : ~0ULL);
+}
+
+static uint64_t
+test_read_cr3() noexcept
+{ return g_cr3; }
+
+static void
+test_write_cr3(uint64_t val) noexcept
+{ (void) val; g_cr3_writes++; }
+
+static void
+setup_intrinsics(MockRepository &mocks)
+{
+    mocks.OnCallFunc(_invlpg).Do(test_invlpg);
+    mocks.OnCallFunc(_invpcid).Do(test_invpcid);
+    mocks.OnCallFunc(_read_cr3).Do(test_read_cr3);
+    mocks.OnCallFunc(_write_cr3).Do(test_write_cr3);
+    mocks.OnCallFunc(_cpuid_edx).Return(0U);
+
+    g_invlpg.clear();
+    g_invpcid.clear();
+    g_cr3_writes = 0;
+    g_cr3 = 0x1000;
+}
+
+static auto
+mem_map_used()
+{ return g_mm->stats().mem_map.used; }
+
+TEST_CASE("tlb_batch_x64: invalidate")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    tlb_batch_x64 batch;
+
+    batch.invalidate(0x10000, 0);
+    CHECK(g_invlpg.empty());
+
+    batch.invalidate(0x10010, 0x2000);
+    CHECK(g_invlpg == std::vector<uintptr_t>({0x10000, 0x11000, 0x12000}));
+    CHECK(batch.issued() == 3);
+    CHECK(batch.saved() == 0);
+
+    g_invlpg.clear();
+    batch.invalidate(0x10000, (TLB_BATCH_FLUSH_THRESHOLD + 1) * page_size);
+    CHECK(g_invlpg.empty());
+    CHECK(g_cr3_writes == 1);
+    CHECK(batch.issued() == 4);
+    CHECK(batch.saved() == TLB_BATCH_FLUSH_THRESHOLD);
+}
+
+TEST_CASE("tlb_batch_x64: release is deferred until flush")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    tlb_batch_x64 batch;
+    auto &&used = mem_map_used();
+
+    auto &&virt1 = reinterpret_cast<uintptr_t>(g_mm->alloc_map(page_size));
+    auto &&virt2 = reinterpret_cast<uintptr_t>(g_mm->alloc_map(page_size * 2));
+
+    batch.release(virt1, page_size);
+    batch.release(virt2, page_size * 2);
+
+    CHECK(batch.num_pending() == 2);
+    CHECK(mem_map_used() == used + page_size * 3);
+    CHECK(g_invlpg.empty());
+
+    batch.flush();
+
+    CHECK(batch.num_pending() == 0);
+    CHECK(mem_map_used() == used);
+    CHECK(g_invlpg == std::vector<uintptr_t>({virt1, virt2, virt2 + page_size}));
+    CHECK(g_cr3_writes == 0);
+    CHECK(batch.issued() == 3);
+
+    batch.flush();
+    CHECK(batch.issued() == 3);
+}
+
+TEST_CASE("tlb_batch_x64: large releases reload cr3")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    tlb_batch_x64 batch;
+    auto &&used = mem_map_used();
+
+    for (auto i = 0; i < TLB_BATCH_MAX_RELEASES; i++) {
+        batch.release(reinterpret_cast<uintptr_t>(g_mm->alloc_map(page_size * 4)), page_size * 4);
+    }
+
+    CHECK(batch.num_pending() == TLB_BATCH_MAX_RELEASES);
+
+    batch.release(reinterpret_cast<uintptr_t>(g_mm->alloc_map(page_size)), page_size);
+
+    CHECK(batch.num_pending() == 1);
+    CHECK(g_invlpg.empty());
+    CHECK(g_cr3_writes == 1);
+    CHECK(batch.issued() == 1);
+    CHECK(batch.saved() == TLB_BATCH_MAX_RELEASES * 4 - 1);
+
+    batch.invalidate(0x10000, (TLB_BATCH_FLUSH_THRESHOLD + 1) * page_size);
+
+    CHECK(batch.num_pending() == 0);
+    CHECK(g_cr3_writes == 2);
+    CHECK(mem_map_used() == used);
+}
+
+TEST_CASE("tlb_batch_x64: totals")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    size_t issued1;
+    size_t saved1;
+    tlb_batch_totals(issued1, saved1);
+
+    tlb_batch_cpu()->invalidate(0x10000, 0x1000);
+    tlb_batch_cpu()->invalidate(0x10000, (TLB_BATCH_FLUSH_THRESHOLD + 1) * page_size);
+
+    size_t issued2;
+    size_t saved2;
+    tlb_batch_totals(issued2, saved2);
+
+    CHECK(issued2 == issued1 + 2);
+    CHECK(saved2 == saved1 + TLB_BATCH_FLUSH_THRESHOLD);
+}
+
+TEST_CASE("tlb_batch_x64: pcid")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    tlb_batch_x64 batch;
+    tlb_batch_x64::set_pcid(1, 0x2001);
+    CHECK(tlb_batch_x64::pcid() == 1);
+
+    // The VMM's CR3 is not loaded (e.g. the VMM has not been launched yet),
+    // so the PCID is not used
+
+    batch.invalidate(0x10000, 0x1000);
+    CHECK(g_invlpg.size() == 1);
+    CHECK(g_invpcid.empty());
+
+    g_invlpg.clear();
+    g_cr3 = 0x2001;
+
+    batch.invalidate(0x10000, 0x2000);
+    CHECK(g_invlpg.empty());
+    CHECK(g_invpcid == std::vector<uintptr_t>({0x10000, 0x11000}));
+
+    g_invpcid.clear();
+    batch.invalidate(0x10000, (TLB_BATCH_FLUSH_THRESHOLD + 1) * page_size);
+    CHECK(g_invpcid == std::vector<uintptr_t>({~0ULL}));
+    CHECK(g_cr3_writes == 0);
+
+    tlb_batch_x64::set_pcid(0);
+    CHECK(tlb_batch_x64::pcid() == 0);
+
+    batch.invalidate(0x10000, 0x1000);
+    CHECK(g_invlpg.size() == 1);
+}
+
+// The following runs the part of a VMCALL_DATA exit that maps the guest's
+// buffers (an input and an output buffer, mapped, released and flushed
+// once per exit) with and without a PCID, and reports the time taken and
+// the VMM's invalidations per exit. The intrinsics are mocked, so this
+// measures the VMM's own overhead, and not the cost of any TLB misses.
+//
+// The PCID does not change the number of invalidations. It changes how
+// they are done: INVPCID instead of INVLPG, and once the released buffers
+// are larger than TLB_BATCH_FLUSH_THRESHOLD pages, a single-context INVPCID
+// instead of a CR3 reload, which leaves the entries of other PCIDs alone.
+// The guest is not given a VPID, so every VM entry and exit still flushes
+// the whole TLB, with or without a PCID. It is hidden as it only reports;
+// run it with "[benchmark]".
+
+struct exit_path_result
+{
+    size_t invlpg;
+    size_t invpcid_address;
+    size_t invpcid_context;
+    size_t cr3_reloads;
+    size_t issued;
+};
+
+static exit_path_result
+exit_path(const char *name, size_t num_exits, size_t buffer_size)
+{
+    constexpr const auto phys = 0x0000222200000000UL;
+
+    g_invlpg.clear();
+    g_invpcid.clear();
+    g_cr3_writes = 0;
+
+    auto &&batch = tlb_batch_cpu();
+    auto &&issued = batch->issued();
+
+    auto &&us = time_it([&]
+    {
+        for (auto i = 0UL; i < num_exits; i++) {
+            {
+                auto &&imap = bfn::make_unique_map_x64<char>({{phys, buffer_size}});
+                auto &&omap = bfn::make_unique_map_x64<char>({{phys + buffer_size, buffer_size}});
+
+                bfignored(imap);
+                bfignored(omap);
+            }
+
+            batch->flush();
+        }
+    });
+
+    auto &&context = gsl::narrow_cast<size_t>(std::count(g_invpcid.begin(), g_invpcid.end(), ~0ULL));
+
+    exit_path_result result{
+        g_invlpg.size() / num_exits,
+        (g_invpcid.size() - context) / num_exits,
+        context / num_exits,
+        g_cr3_writes / num_exits,
+        (batch->issued() - issued) / num_exits
+    };
+
+    WARN(name << ", " << (buffer_size >> page_shift) << " page buffers: "
+         << us << "us for " << num_exits << " exits, per exit: "
+         << result.issued << " invalidations ("
+         << result.invlpg << " invlpg, "
+         << result.invpcid_address << " invpcid address, "
+         << result.invpcid_context << " invpcid single context, "
+         << result.cr3_reloads << " cr3 reloads)");
+
+    return result;
+}
+
+TEST_CASE("tlb_batch_x64: exit path benchmark", "[.][benchmark]")
+{
+    MockRepository mocks;
+    setup_intrinsics(mocks);
+
+    arena_mdl mdl;
+
+    constexpr const auto num_exits = 10000UL;
+    constexpr const auto small = page_size * 4;
+    constexpr const auto large = page_size * TLB_BATCH_FLUSH_THRESHOLD;
+
+    auto &&no_pcid_small = exit_path("without pcid", num_exits, small);
+    auto &&no_pcid_large = exit_path("without pcid", num_exits, large);
+
+    g_cr3 = 0x1001;
+    tlb_batch_x64::set_pcid(1, g_cr3);
+
+    auto &&pcid_small = exit_path("with pcid", num_exits, small);
+    auto &&pcid_large = exit_path("with pcid", num_exits, large);
+
+    tlb_batch_x64::set_pcid(0);
+
+    CHECK(no_pcid_small.invlpg == 16);
+    CHECK(no_pcid_small.issued == 16);
+    CHECK(pcid_small.invpcid_address == 16);
+    CHECK(pcid_small.invlpg == 0);
+    CHECK(pcid_small.issued == 16);
+
+    CHECK(no_pcid_large.cr3_reloads == 1);
+    CHECK(no_pcid_large.invpcid_context == 0);
+    CHECK(pcid_large.cr3_reloads == 0);
+    CHECK(pcid_large.invpcid_context == 1);
+    CHECK(pcid_large.issued == no_pcid_large.issued);
+}
+
+#endif
@@ -19,9 +19,12 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
 
+#include <bfgsl.h>
+
 #include <vmcs/vmcs_intel_x64_vmm_state.h>
 
 #include <memory_manager/pat_x64.h>
+#include <memory_manager/tlb_batch_x64.h>
 #include <memory_manager/root_page_table_x64.h>
 
 using namespace x64;
@@ -33,8 +36,10 @@ idt_x64 g_idt{256};
 
 static auto gdt_setup = false;
 
-vmcs_intel_x64_vmm_state::vmcs_intel_x64_vmm_state()
+vmcs_intel_x64_vmm_state::vmcs_intel_x64_vmm_state(intel_x64::cr3::value_type pcid)
 {
+    expects(pcid < 0x1000);
+
     if (!gdt_setup) {
         g_gdt.set_access_rights(1, access_rights::ring0_cs_descriptor);
         g_gdt.set_access_rights(2, access_rights::ring0_ss_descriptor);
@@ -105,6 +110,19 @@ vmcs_intel_x64_vmm_state::vmcs_intel_x64_vmm_state()
         m_cr4 |= cr4::smap_enable_bit::mask;
     }
 
+    // Tagging the VMM's CR3 with a PCID lets the VMM invalidate only its
+    // own TLB entries (see tlb_batch_x64). This is opt-in (see VMM_PCID),
+    // as the VMM's entries only survive an exit once VPIDs are used.
+
+    if (pcid != 0 &&
+        intel_x64::cpuid::feature_information::ecx::pcid::is_enabled() &&
+        intel_x64::cpuid::extended_feature_flags::subleaf0::ebx::invpcid::is_enabled()) {
+        m_cr3 |= pcid;
+        m_cr4 |= cr4::pcid_enable_bit::mask;
+
+        tlb_batch_x64::set_pcid(pcid, m_cr3);
+    }
+
     m_rflags = 0;
 
     m_ia32_pat_msr = x64::pat::pat_value;
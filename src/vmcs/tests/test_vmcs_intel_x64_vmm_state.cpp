@@ -30,6 +30,7 @@
 #include <intrinsics/x86/intel_x64.h>
 
 #include <memory_manager/pat_x64.h>
+#include <memory_manager/tlb_batch_x64.h>
 #include <memory_manager/root_page_table_x64.h>
 
 #include <test/vmcs_utils.h>
@@ -162,6 +163,76 @@ TEST_CASE("vmcs: vmm_state_control_registers")
     CHECK(state.cr4() == test_cr4);
 }
 
+TEST_CASE("vmcs: vmm_state_control_registers_pcid")
+{
+    MockRepository mocks;
+    setup_vmm_state(mocks);
+
+    g_ebx[intel_x64::cpuid::extended_feature_flags::addr] = 0x00100480UL;
+    g_ecx[intel_x64::cpuid::feature_information::addr] = 0x4020000UL;
+
+    vmcs_intel_x64_vmm_state state{1};
+
+    CHECK(state.cr3() == (test_cr3 | 1));
+    CHECK(state.cr4() == (test_cr4 | intel_x64::cr4::pcid_enable_bit::mask));
+    CHECK(tlb_batch_x64::pcid() == 1);
+
+    tlb_batch_x64::set_pcid(0);
+}
+
+TEST_CASE("vmcs: vmm_state_control_registers_pcid_not_supported")
+{
+    MockRepository mocks;
+    setup_vmm_state(mocks);
+
+    g_ebx[intel_x64::cpuid::extended_feature_flags::addr] = 0x00100480UL;
+    g_ecx[intel_x64::cpuid::feature_information::addr] = 0x4000000UL;
+
+    vmcs_intel_x64_vmm_state state{1};
+
+    CHECK(state.cr3() == test_cr3);
+    CHECK(state.cr4() == test_cr4);
+    CHECK(tlb_batch_x64::pcid() == 0);
+}
+
+TEST_CASE("vmcs: vmm_state_control_registers_invpcid_not_supported")
+{
+    MockRepository mocks;
+    setup_vmm_state(mocks);
+
+    g_ebx[intel_x64::cpuid::extended_feature_flags::addr] = 0x00100080UL;
+    g_ecx[intel_x64::cpuid::feature_information::addr] = 0x4020000UL;
+
+    vmcs_intel_x64_vmm_state state{1};
+
+    CHECK(state.cr3() == test_cr3);
+    CHECK(state.cr4() == test_cr4);
+    CHECK(tlb_batch_x64::pcid() == 0);
+}
+
+TEST_CASE("vmcs: vmm_state_control_registers_pcid_disabled")
+{
+    MockRepository mocks;
+    setup_vmm_state(mocks);
+
+    g_ebx[intel_x64::cpuid::extended_feature_flags::addr] = 0x00100480UL;
+    g_ecx[intel_x64::cpuid::feature_information::addr] = 0x4020000UL;
+
+    vmcs_intel_x64_vmm_state state{0};
+
+    CHECK(state.cr3() == test_cr3);
+    CHECK(state.cr4() == test_cr4);
+    CHECK(tlb_batch_x64::pcid() == 0);
+}
+
+TEST_CASE("vmcs: vmm_state_control_registers_pcid_invalid")
+{
+    MockRepository mocks;
+    setup_vmm_state(mocks);
+
+    CHECK_THROWS(vmcs_intel_x64_vmm_state{0x1000});
+}
+
 TEST_CASE("vmcs: vmm_state_rflags")
 {
     MockRepository mocks;